@@ -23,6 +23,31 @@ in vec2 TexCoord;
 
 uniform sampler2D screenTexture;
 
+// When set, the texture contains linear HDR colors that need
+// to be tonemapped here. Otherwise this was done on the CPU.
+uniform bool  gpuTonemap;
+uniform int   tonemap; // 0 = none, 1 = reinhard, 2 = aces
+uniform float exposure;
+uniform bool  srgb;
+
+vec3 apply_tonemap(vec3 c) {
+    if (tonemap == 1)
+        return c / (1.0 + c);
+    if (tonemap == 2)
+        return clamp((c * (2.51 * c + 0.03)) / (c * (2.43 * c + 0.59) + 0.14), 0.0, 1.0);
+    return clamp(c, 0.0, 1.0);
+}
+
+vec3 encode_srgb(vec3 c) {
+    return mix(c * 12.92, 1.055 * pow(c, vec3(1.0 / 2.4)) - 0.055, step(0.0031308, c));
+}
+
 void main() {
-    FragColor = texture(screenTexture, TexCoord);
+    vec3 color = texture(screenTexture, TexCoord).rgb;
+    if (gpuTonemap) {
+        color = apply_tonemap(color * exposure);
+        if (srgb)
+            color = encode_srgb(color);
+    }
+    FragColor = vec4(color, 1.0);
 }
\ No newline at end of file
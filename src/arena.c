@@ -0,0 +1,81 @@
+/*
+Copyright 2024 Francesco Cozzuto
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+associated documentation files (the “Software”), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial
+portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "arena.h"
+
+struct ArenaBlock {
+	ArenaBlock *prev;
+	size_t      used;
+	size_t      size;
+	_Alignas(max_align_t) char data[];
+};
+
+void init_arena(Arena *arena)
+{
+	arena->head = NULL;
+}
+
+void free_arena(Arena *arena)
+{
+	ArenaBlock *block = arena->head;
+	while (block) {
+		ArenaBlock *prev = block->prev;
+		free(block);
+		block = prev;
+	}
+	arena->head = NULL;
+}
+
+void *arena_alloc(Arena *arena, size_t size, size_t align)
+{
+	ArenaBlock *block = arena->head;
+	if (block) {
+		uintptr_t base  = (uintptr_t) block->data;
+		uintptr_t start = (base + block->used + align - 1) & ~(uintptr_t) (align - 1);
+		if (start + size <= base + block->size) {
+			block->used = start + size - base;
+			return (void*) start;
+		}
+	}
+
+	// Blocks are aligned for any type, so the allocation
+	// can start at the beginning of the new block
+	size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+	ArenaBlock *new_block = malloc(sizeof(ArenaBlock) + block_size);
+	if (!new_block) {
+		printf("OUT OF MEMORY\n");
+		abort();
+	}
+	new_block->size = block_size;
+	new_block->used = size;
+
+	// Oversized allocations go behind the current block so
+	// that its free space can still be used
+	if (block && size > ARENA_BLOCK_SIZE) {
+		new_block->prev = block->prev;
+		block->prev = new_block;
+	} else {
+		new_block->prev = block;
+		arena->head = new_block;
+	}
+	return new_block->data;
+}
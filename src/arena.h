@@ -0,0 +1,47 @@
+/*
+Copyright 2024 Francesco Cozzuto
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+associated documentation files (the “Software”), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial
+portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef ARENA_INCLUDED
+#define ARENA_INCLUDED
+
+#include <stddef.h>
+
+// Default size of the blocks of memory arenas allocate from
+#define ARENA_BLOCK_SIZE (1 << 20)
+
+typedef struct ArenaBlock ArenaBlock;
+
+// Allocator for memory that is freed all at once. Allocations are
+// carved out of blocks that are never moved, so pointers stay valid
+// until the arena is freed. Bigger allocations get a block of their own.
+typedef struct {
+	ArenaBlock *head;
+} Arena;
+
+void  init_arena(Arena *arena);
+void  free_arena(Arena *arena);
+
+// Returns "size" bytes aligned to "align" (a power of two no
+// bigger than the alignment of max_align_t).
+// Aborts if the system is out of memory.
+void *arena_alloc(Arena *arena, size_t size, size_t align);
+
+#define arena_alloc_array(arena, type, count) \
+	((type*) arena_alloc((arena), sizeof(type) * (count), _Alignof(type)))
+
+#endif
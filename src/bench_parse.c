@@ -0,0 +1,227 @@
+/*
+Copyright 2024 Francesco Cozzuto
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+associated documentation files (the “Software”), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial
+portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// Measures how fast scenes are parsed. It generates a large random
+// scene in memory (256 MB by default, or the number of megabytes
+// given as first argument) and parses it a few times, printing the
+// best throughput on one thread and on the number of threads given
+// as second argument (4 by default). It also builds the tree over the
+// objects with both methods and prints the time per million objects.
+// Build it with "make bench_parse".
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include "scene.h"
+
+#define NUM_RUNS 3
+
+typedef struct {
+	char  *data;
+	size_t size;
+	size_t capacity;
+} Buffer;
+
+static void append(Buffer *buffer, const char *fmt, ...)
+{
+	for (;;) {
+		va_list args;
+		va_start(args, fmt);
+		int n = vsnprintf(buffer->data + buffer->size, buffer->capacity - buffer->size, fmt, args);
+		va_end(args);
+
+		if (n >= 0 && (size_t) n < buffer->capacity - buffer->size) {
+			buffer->size += n;
+			return;
+		}
+
+		buffer->capacity *= 2;
+		buffer->data = realloc(buffer->data, buffer->capacity);
+		if (buffer->data == NULL) {
+			printf("OUT OF MEMORY\n");
+			abort();
+		}
+	}
+}
+
+static float random_range(float min, float max)
+{
+	return min + (max - min) * (rand() / (float) RAND_MAX);
+}
+
+// Numbers are written in all the forms the parser accepts
+static void append_number(Buffer *buffer, float value)
+{
+	switch (rand() % 4) {
+		case 0: append(buffer, "%.0f", value); break;
+		case 1: append(buffer, "%.3f", value); break;
+		case 2: append(buffer, "%.7g", value); break;
+		case 3: append(buffer, "%.4e", value); break;
+	}
+}
+
+static void append_vector(Buffer *buffer, float min, float max)
+{
+	append(buffer, "{");
+	append_number(buffer, random_range(min, max));
+	append(buffer, " ");
+	append_number(buffer, random_range(min, max));
+	append(buffer, " ");
+	append_number(buffer, random_range(min, max));
+	append(buffer, "}");
+}
+
+static void generate_scene(Buffer *buffer, size_t size)
+{
+	srand(1);
+	while (buffer->size < size) {
+		if (rand() % 2) {
+			append(buffer, "sphere\n\tcenter         ");
+			append_vector(buffer, -100, 100);
+			append(buffer, "\n\tradius         ");
+			append_number(buffer, random_range(0.1, 2));
+		} else {
+			append(buffer, "cube\n\torigin         ");
+			append_vector(buffer, -100, 100);
+			append(buffer, "\n\tsize           ");
+			append_vector(buffer, 0.1, 2);
+		}
+		append(buffer, "\n\talbedo         ");
+		append_vector(buffer, 0, 1);
+		append(buffer, "\n\troughness      ");
+		append_number(buffer, random_range(0, 1));
+		append(buffer, "\n\tmetallic       ");
+		append_number(buffer, random_range(0, 1));
+		append(buffer, "\n\treflectance    ");
+		append_number(buffer, random_range(0, 1));
+		append(buffer, "\n\n");
+	}
+}
+
+// Parses the scene a few times and keeps the best times
+static int run(Buffer *buffer, Pool *pool, double *best_parse, double *best_build)
+{
+	int num_objects = 0;
+	for (int i = 0; i < NUM_RUNS; i++) {
+		SceneLoadStats stats;
+		Scene *scene = parse_scene_string(buffer->data, buffer->size, pool, &stats);
+		if (scene == NULL) {
+			fprintf(stderr, "Error: The generated scene is invalid\n");
+			exit(-1);
+		}
+		num_objects = scene->num_objects;
+		free_scene(scene);
+
+		double parse = stats.parse_ns / 1e9;
+		double build = stats.build_ns / 1e9;
+		if (i == 0 || parse < *best_parse) *best_parse = parse;
+		if (i == 0 || build < *best_build) *best_build = build;
+	}
+	return num_objects;
+}
+
+// Builds the tree a few times and keeps the best time per
+// million boxes. Returns the cost of the tree (see "bvh_cost").
+static float run_build(const AABB *boxes, int count, BVHBuildMethod method, Pool *pool, double *best)
+{
+	float cost = 0;
+	for (int i = 0; i < NUM_RUNS; i++) {
+		uint64_t start = get_relative_time_ns();
+		BVH bvh;
+		if (!build_bvh(&bvh, boxes, count, method, pool)) {
+			printf("OUT OF MEMORY\n");
+			abort();
+		}
+		double time = (get_relative_time_ns() - start) / 1e6 / (count / 1e6);
+		if (i == 0 || time < *best) *best = time;
+		cost = bvh_cost(&bvh);
+		free_bvh(&bvh);
+	}
+	return cost;
+}
+
+int main(int argc, char **argv)
+{
+	size_t megabytes = 256;
+	int    num_threads = 4;
+	if (argc > 1)
+		megabytes = atoi(argv[1]);
+	if (argc > 2)
+		num_threads = atoi(argv[2]);
+	if (megabytes == 0 || num_threads < 1) {
+		fprintf(stderr, "Usage: %s [megabytes] [threads]\n", argv[0]);
+		return -1;
+	}
+	if (num_threads > MAX_POOL_THREADS + 1)
+		num_threads = MAX_POOL_THREADS + 1;
+
+	Buffer buffer = { .capacity = 1 << 20 };
+	buffer.data = malloc(buffer.capacity);
+	if (buffer.data == NULL) {
+		printf("OUT OF MEMORY\n");
+		abort();
+	}
+	generate_scene(&buffer, megabytes << 20);
+
+	// The calling thread takes part in the parsing
+	Pool pool;
+	init_pool(&pool, num_threads - 1);
+
+	double serial_parse, serial_build;
+	double parallel_parse, parallel_build;
+	int num_objects = run(&buffer, NULL, &serial_parse, &serial_build);
+	run(&buffer, &pool, &parallel_parse, &parallel_build);
+
+	double size_mb = buffer.size / (1024.0 * 1024.0);
+	double millions = num_objects / 1e6;
+	printf("%.1f MB, %d objects\n", size_mb, num_objects);
+	printf("1 thread:   parse %.1f ms (%.1f MB/s), build %.1f ms (%.1f ms per million objects)\n",
+		serial_parse * 1e3, size_mb / serial_parse, serial_build * 1e3, serial_build * 1e3 / millions);
+	printf("%d threads: parse %.1f ms (%.1f MB/s, %.1fx), build %.1f ms (%.1f ms per million objects)\n", num_threads,
+		parallel_parse * 1e3, size_mb / parallel_parse, serial_parse / parallel_parse, parallel_build * 1e3, parallel_build * 1e3 / millions);
+
+	// The tree alone, built with each method
+	Scene *scene = parse_scene_string(buffer.data, buffer.size, &pool, NULL);
+	AABB *boxes = malloc(sizeof(AABB) * (scene->num_objects + 1));
+	if (boxes == NULL) {
+		printf("OUT OF MEMORY\n");
+		abort();
+	}
+	for (int i = 0; i < scene->num_objects; i++)
+		boxes[i] = bounds_of(scene->objects[i]);
+
+	const char *names[] = { [BVH_BUILD_SAH] = "sah ", [BVH_BUILD_MORTON] = "lbvh" };
+	float sah_cost = 0;
+	for (int method = BVH_BUILD_SAH; method <= BVH_BUILD_MORTON; method++) {
+		double serial, parallel;
+		float cost = run_build(boxes, scene->num_objects, method, NULL, &serial);
+		run_build(boxes, scene->num_objects, method, &pool, &parallel);
+		if (method == BVH_BUILD_SAH)
+			sah_cost = cost;
+		printf("%s tree: %.1f ms per million objects on 1 thread, %.1f ms on %d threads (%.1fx), cost %.2fx\n",
+			names[method], serial, parallel, num_threads, serial / parallel, cost / sah_cost);
+	}
+	free(boxes);
+	free_scene(scene);
+
+	free_pool(&pool);
+	free(buffer.data);
+	return 0;
+}
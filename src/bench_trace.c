@@ -0,0 +1,266 @@
+/*
+Copyright 2024 Francesco Cozzuto
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+associated documentation files (the “Software”), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial
+portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// Measures how fast incoherent rays traverse the acceleration structure
+// of a large scene with full and with compressed nodes. It generates a
+// random scene with the number of objects given as first argument (in
+// millions, 2 by default) and traces the same rays through both trees
+// on the number of threads given as second argument (4 by default),
+// printing the best throughput of a few runs. Before that it checks
+// that axis-aligned rays along the edges of a cube mesh don't slip
+// through it. Build it with "make bench_trace".
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "scene.h"
+
+#define NUM_RUNS 3
+#define NUM_RAYS (1 << 18)
+#define RAYS_PER_TASK 1024
+
+static float random_range(float min, float max)
+{
+	return min + (max - min) * (rand() / (float) RAND_MAX);
+}
+
+static char *generate_scene(int num_objects, size_t *len)
+{
+	size_t cap = (size_t) num_objects * 96 + 1;
+	char *src = malloc(cap);
+	if (src == NULL) {
+		printf("OUT OF MEMORY\n");
+		abort();
+	}
+
+	srand(1);
+	size_t n = 0;
+	for (int i = 0; i < num_objects; i++) {
+		float x = random_range(-100, 100);
+		float y = random_range(-100, 100);
+		float z = random_range(-100, 100);
+		if (rand() % 2)
+			n += snprintf(src + n, cap - n, "sphere center {%.2f %.2f %.2f} radius %.2f\n", x, y, z, random_range(0.05, 0.5));
+		else
+			n += snprintf(src + n, cap - n, "cube origin {%.2f %.2f %.2f} size {%.2f %.2f %.2f}\n", x, y, z,
+				random_range(0.05, 0.5), random_range(0.05, 0.5), random_range(0.05, 0.5));
+	}
+	*len = n;
+	return src;
+}
+
+// Writes a unit cube as an OBJ file and as a big-endian PLY file
+static bool write_cube_meshes(const char *obj, const char *ply)
+{
+	FILE *stream = fopen(obj, "w");
+	if (stream == NULL)
+		return false;
+	fputs("v 0 0 0\nv 1 0 0\nv 1 1 0\nv 0 1 0\nv 0 0 1\nv 1 0 1\nv 1 1 1\nv 0 1 1\n"
+		"f 1 2 3 4\nf 5 8 7 6\nf 1 5 6 2\nf 4 3 7 8\nf 1 4 8 5\nf 2 6 7 3\n", stream);
+	fclose(stream);
+
+	stream = fopen(ply, "wb");
+	if (stream == NULL)
+		return false;
+	fputs("ply\nformat binary_big_endian 1.0\n"
+		"element vertex 8\nproperty float x\nproperty float y\nproperty float z\n"
+		"element face 6\nproperty list uchar int vertex_indices\nend_header\n", stream);
+	for (int i = 0; i < 8; i++)
+		for (int k = 0; k < 3; k++) {
+			unsigned char bytes[4] = { (i >> k) & 1 ? 0x3F : 0, (i >> k) & 1 ? 0x80 : 0, 0, 0 }; // 1.0f or 0.0f
+			fwrite(bytes, 1, 4, stream);
+		}
+	static const unsigned char faces[6][4] = {
+		{0, 2, 3, 1}, {4, 5, 7, 6}, {0, 1, 5, 4}, {2, 6, 7, 3}, {0, 4, 6, 2}, {1, 3, 7, 5},
+	};
+	for (int i = 0; i < 6; i++) {
+		fputc(4, stream);
+		for (int k = 0; k < 4; k++) {
+			unsigned char bytes[4] = { 0, 0, 0, faces[i][k] };
+			fwrite(bytes, 1, 4, stream);
+		}
+	}
+	fclose(stream);
+	return true;
+}
+
+// Traces a 21x21 grid of rays along each axis, in both directions,
+// at the unit cube of the scene, including the rays that run along its
+// faces, and returns how many of them miss it or hit it at the wrong
+// distance.
+static int count_cube_misses(const Scene *scene)
+{
+	int misses = 0;
+	for (int axis = 0; axis < 3; axis++)
+		for (int sign = -1; sign <= 1; sign += 2)
+			for (int i = 0; i <= 20; i++)
+				for (int j = 0; j <= 20; j++) {
+					float origin[3], direction[3] = {0, 0, 0};
+					origin[axis] = sign > 0 ? -1 : 2;
+					origin[(axis + 1) % 3] = i / 20.0f;
+					origin[(axis + 2) % 3] = j / 20.0f;
+					direction[axis] = sign;
+					Ray ray = {
+						{ origin[0], origin[1], origin[2] },
+						{ direction[0], direction[1], direction[2] },
+					};
+					HitInfo hit = trace_ray(ray, scene);
+					if (hit.object < 0 || hit.distance != 1)
+						misses++;
+				}
+	return misses;
+}
+
+// Returns the number of rays slipping through the cube mesh,
+// or -1 if it couldn't be loaded
+static int check_watertight(void)
+{
+	const char *obj = "bench_trace_cube.obj";
+	const char *ply = "bench_trace_cube.ply";
+	if (!write_cube_meshes(obj, ply)) {
+		fprintf(stderr, "Error: Couldn't write the test meshes\n");
+		return -1;
+	}
+
+	int misses = 0;
+	const char *files[] = { obj, ply };
+	for (int i = 0; i < 2 && misses >= 0; i++) {
+		char src[64];
+		int len = snprintf(src, sizeof(src), "mesh file %s\n", files[i]);
+		Scene *scene = parse_scene_string(src, len, NULL, NULL);
+		if (scene == NULL) {
+			misses = -1;
+			break;
+		}
+		misses += count_cube_misses(scene);
+		if (compress_scene_bvhs(scene) > 0)
+			misses += count_cube_misses(scene);
+		free_scene(scene);
+	}
+
+	remove(obj);
+	remove(ply);
+	return misses;
+}
+
+typedef struct {
+	const Scene *scene;
+	const Ray   *rays;
+	int         *hits;
+} TraceJob;
+
+static void trace_rays(void *data, int begin, int end)
+{
+	TraceJob *job = data;
+	for (int i = begin * RAYS_PER_TASK; i < end * RAYS_PER_TASK; i++)
+		job->hits[i] = trace_ray(job->rays[i], job->scene).object;
+}
+
+// Traces the rays a few times and returns the best time in seconds
+static double run(Pool *pool, TraceJob *job)
+{
+	double best = 0;
+	for (int i = 0; i < NUM_RUNS; i++) {
+		uint64_t start = get_relative_time_ns();
+		parallel_for(pool, NUM_RAYS / RAYS_PER_TASK, 1, trace_rays, job);
+		double time = (get_relative_time_ns() - start) / 1e9;
+		if (i == 0 || time < best)
+			best = time;
+	}
+	return best;
+}
+
+int main(int argc, char **argv)
+{
+	float millions = 2;
+	int   num_threads = 4;
+	if (argc > 1)
+		millions = atof(argv[1]);
+	if (argc > 2)
+		num_threads = atoi(argv[2]);
+	if (millions <= 0 || num_threads < 1) {
+		fprintf(stderr, "Usage: %s [millions of objects] [threads]\n", argv[0]);
+		return -1;
+	}
+	if (num_threads > MAX_POOL_THREADS + 1)
+		num_threads = MAX_POOL_THREADS + 1;
+
+	int leaks = check_watertight();
+	if (leaks < 0)
+		return -1;
+	if (leaks > 0)
+		printf("Warning: %d rays slipped through the cube mesh\n", leaks);
+
+	Pool pool;
+	init_pool(&pool, num_threads - 1);
+
+	size_t len;
+	char *src = generate_scene(millions * 1e6, &len);
+	Scene *scene = parse_scene_string(src, len, &pool, NULL);
+	free(src);
+	if (scene == NULL) {
+		fprintf(stderr, "Error: The generated scene is invalid\n");
+		return -1;
+	}
+
+	// Rays start anywhere in the scene and go in any direction,
+	// so consecutive rays visit unrelated parts of the tree
+	Ray *rays = malloc(sizeof(Ray) * NUM_RAYS);
+	int *full_hits = malloc(sizeof(int) * NUM_RAYS);
+	int *compressed_hits = malloc(sizeof(int) * NUM_RAYS);
+	if (!rays || !full_hits || !compressed_hits) {
+		printf("OUT OF MEMORY\n");
+		abort();
+	}
+	for (int i = 0; i < NUM_RAYS; i++) {
+		rays[i].origin    = (Vector3) { random_range(-100, 100), random_range(-100, 100), random_range(-100, 100) };
+		rays[i].direction = (Vector3) { random_range(-1, 1), random_range(-1, 1), random_range(-1, 1) };
+	}
+
+	TraceJob job = { scene, rays, full_hits };
+	double full_time = run(&pool, &job);
+
+	size_t full_size = sizeof(BVHNode) * scene->bvh.num_nodes;
+	size_t compressed_size = compress_scene_bvhs(scene);
+	if (compressed_size == 0) {
+		fprintf(stderr, "Error: The tree couldn't be compressed\n");
+		return -1;
+	}
+	job.hits = compressed_hits;
+	double compressed_time = run(&pool, &job);
+
+	// Looser boxes only cost extra visits, the hits must be the same
+	int mismatches = 0;
+	for (int i = 0; i < NUM_RAYS; i++)
+		if (full_hits[i] != compressed_hits[i])
+			mismatches++;
+
+	printf("%d objects, %d nodes, %d rays on %d threads\n", scene->num_objects, scene->bvh.num_nodes, NUM_RAYS, num_threads);
+	printf("full nodes:       %7.1f MB, %.3f Mrays/s\n", full_size / 1e6, NUM_RAYS / full_time / 1e6);
+	printf("compressed nodes: %7.1f MB, %.3f Mrays/s (%.2fx)\n", compressed_size / 1e6, NUM_RAYS / compressed_time / 1e6, full_time / compressed_time);
+	if (mismatches > 0)
+		printf("Warning: %d rays hit different objects\n", mismatches);
+
+	free(rays);
+	free(full_hits);
+	free(compressed_hits);
+	free_scene(scene);
+	free_pool(&pool);
+	return mismatches > 0 || leaks > 0;
+}
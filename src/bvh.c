@@ -0,0 +1,1159 @@
+/*
+Copyright 2024 Francesco Cozzuto
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+associated documentation files (the “Software”), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial
+portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "bvh.h"
+
+// Leaves are allowed to hold at most this many primitives
+#define MAX_LEAF_SIZE 4
+
+AABB empty_aabb(void)
+{
+	return (AABB) {
+		.min = { FLT_MAX,  FLT_MAX,  FLT_MAX},
+		.max = {-FLT_MAX, -FLT_MAX, -FLT_MAX},
+	};
+}
+
+AABB union_aabb(AABB a, AABB b)
+{
+	return (AABB) {
+		.min = { bvh_min(a.min.x, b.min.x), bvh_min(a.min.y, b.min.y), bvh_min(a.min.z, b.min.z) },
+		.max = { bvh_max(a.max.x, b.max.x), bvh_max(a.max.y, b.max.y), bvh_max(a.max.z, b.max.z) },
+	};
+}
+
+AABB grow_aabb(AABB a, Vector3 p)
+{
+	return union_aabb(a, (AABB) {p, p});
+}
+
+static Vector3 centroid_of(AABB box)
+{
+	return (Vector3) {
+		(box.min.x + box.max.x) * 0.5f,
+		(box.min.y + box.max.y) * 0.5f,
+		(box.min.z + box.max.z) * 0.5f,
+	};
+}
+
+static float axis_of(Vector3 v, int axis)
+{
+	switch (axis) {
+		case 0: return v.x;
+		case 1: return v.y;
+	}
+	return v.z;
+}
+
+// Leaves are forced at this depth, which leaves room for the
+// levels "merge_bvhs" adds on top of the tree
+#define MAX_BUILD_DEPTH (BVH_MAX_DEPTH - BVH_MERGE_LEVELS - 1)
+
+// Number of bins per axis the surface area heuristic evaluates
+// (small nodes use fewer)
+#define NUM_BINS 16
+
+// Passes over the primitives of large nodes are split in parts
+// processed by the threads of the pool. Parts have at least
+// MIN_PART_SIZE primitives.
+#define MIN_PART_SIZE 4096
+#define MAX_PARTS     64
+
+// Nodes are split by the calling thread until there are about
+// TASKS_PER_THREAD subtrees for each thread, then the threads build
+// those on their own. Subtrees smaller than MIN_TASK_SIZE aren't
+// worth a task.
+#define TASKS_PER_THREAD 8
+#define MIN_TASK_SIZE    1024
+
+// Morton codes have 10 bits per axis and are sorted 10 bits at a time
+#define MORTON_CELLS 1024
+#define RADIX_BITS   10
+#define RADIX_SIZE   (1 << RADIX_BITS)
+
+// Primitive placed in the tree by the surface area heuristic. The
+// boxes are moved along with the indices so that they are read in
+// order by the passes over the primitives.
+typedef struct {
+	AABB box;
+	int  index;
+} BuildPrim;
+
+typedef struct {
+	AABB box;       // Bounds of the primitives
+	AABB centroids; // Bounds of their centroids
+	int  count;
+} Bin;
+
+typedef struct {
+	Bin bins[3][NUM_BINS];
+} Bins;
+
+// Where a node is split by the surface area heuristic. Primitives
+// whose centroids fall in the bins before "bin" along "axis" go to
+// the left child. The axis is -1 if the centroids couldn't be told
+// apart and the primitives were split in half.
+typedef struct {
+	int axis;
+	int bin;
+	int num_bins;
+	Bin left;
+	Bin right;
+} Split;
+
+// Subtree built by a single thread. Its nodes are stored from
+// "nodes + 2 * first" of the builder, with the indices of the
+// inner nodes relative to there, until they are moved to the tree.
+typedef struct {
+	int first;
+	int depth;
+	Bin bounds;    // Only the count is known with Morton codes
+	int num_nodes;
+	int offset;    // Position of its root in the tree
+} BuildTask;
+
+// Node split by the calling thread, above the tasks
+typedef struct {
+	AABB box;
+	int  left;  // -1 if the node is a task
+	int  right; // Index of the task if the node is one
+} TopNode;
+
+typedef struct {
+	int count;
+	int task;
+} TaskOrder;
+
+typedef struct {
+	BVH           *bvh;
+	const AABB    *boxes;
+	BVHBuildMethod method;
+	Pool          *pool;
+
+	// Primitives of the surface area heuristic, copied
+	// to "prims" once the tree is built
+	BuildPrim *refs;
+	BuildPrim *temp_refs; // Room to partition them
+
+	uint32_t *codes;      // Morton codes of the primitives in "prims"
+	int      *temp;       // Room to sort them
+	uint32_t *temp_codes;
+
+	// Nodes with more primitives than this are split by the calling thread
+	int task_size;
+
+	BuildTask *tasks;
+	int        num_tasks;
+	int        max_tasks;
+	TaskOrder *order;   // Tasks from the largest
+
+	TopNode *top;
+	int      num_top;
+	int      max_top;
+
+	BVHNode *nodes; // Where the tasks build their subtrees
+
+	// Results of the passes over the parts of a node
+	Bins *part_bins;
+	int  *part_digits; // RADIX_SIZE per part
+	Bin   part_bounds[MAX_PARTS];
+	int   part_left[MAX_PARTS];
+	int   part_right[MAX_PARTS];
+} Builder;
+
+static Bin empty_bin(void)
+{
+	return (Bin) { empty_aabb(), empty_aabb(), 0 };
+}
+
+static void add_to_bin(Bin *bin, AABB box, Vector3 centroid)
+{
+	bin->box       = union_aabb(bin->box, box);
+	bin->centroids = grow_aabb(bin->centroids, centroid);
+	bin->count++;
+}
+
+static void merge_bins(Bin *dst, Bin src)
+{
+	dst->box       = union_aabb(dst->box, src.box);
+	dst->centroids = union_aabb(dst->centroids, src.centroids);
+	dst->count    += src.count;
+}
+
+// Cells per unit when dividing "bounds" in "cells" cells along each
+// axis. Axes where the bounds are flat (or overflow) get a scale of
+// 0 and only use the first cell.
+static Vector3 cell_scale(AABB bounds, int cells)
+{
+	Vector3 extent = combine(bounds.max, bounds.min, 1, -1);
+	return (Vector3) {
+		extent.x > 0 ? cells / extent.x : 0,
+		extent.y > 0 ? cells / extent.y : 0,
+		extent.z > 0 ? cells / extent.z : 0,
+	};
+}
+
+static int cell_index(float value, float min, float scale, int cells)
+{
+	float f = (value - min) * scale;
+	return f > 0 ? (int) bvh_min(f, cells - 1) : 0;
+}
+
+// Half of the surface area. Doubles don't overflow for huge boxes.
+static double half_area(AABB box)
+{
+	double dx = (double) box.max.x - box.min.x;
+	double dy = (double) box.max.y - box.min.y;
+	double dz = (double) box.max.z - box.min.z;
+	return dx * dy + dy * dz + dz * dx;
+}
+
+static Bin bound_prims(const Builder *b, int begin, int end)
+{
+	Bin bounds = empty_bin();
+	for (int i = begin; i < end; i++)
+		add_to_bin(&bounds, b->refs[i].box, centroid_of(b->refs[i].box));
+	return bounds;
+}
+
+static void bin_prims(const Builder *b, int begin, int end, AABB centroids, int num_bins, Bins *bins)
+{
+	for (int k = 0; k < 3; k++)
+		for (int i = 0; i < num_bins; i++)
+			bins->bins[k][i] = empty_bin();
+
+	Vector3 scale = cell_scale(centroids, num_bins);
+	for (int i = begin; i < end; i++) {
+		AABB box = b->refs[i].box;
+		Vector3 c = centroid_of(box);
+		add_to_bin(&bins->bins[0][cell_index(c.x, centroids.min.x, scale.x, num_bins)], box, c);
+		add_to_bin(&bins->bins[1][cell_index(c.y, centroids.min.y, scale.y, num_bins)], box, c);
+		add_to_bin(&bins->bins[2][cell_index(c.z, centroids.min.z, scale.z, num_bins)], box, c);
+	}
+}
+
+// Picks the boundary between bins that minimizes the surface area
+// of the children weighted by their number of primitives
+static Split find_split(const Bins *bins, int num_bins)
+{
+	Split split = { .axis = -1, .num_bins = num_bins };
+	double best = INFINITY;
+	for (int axis = 0; axis < 3; axis++) {
+		const Bin *row = bins->bins[axis];
+
+		// Only the boxes and counts are needed to compare the splits
+		double right_cost[NUM_BINS];
+		int    right_count[NUM_BINS];
+		AABB   right_box   = empty_aabb();
+		int    num_right   = 0;
+		for (int i = num_bins - 1; i > 0; i--) {
+			if (row[i].count > 0) {
+				right_box  = union_aabb(right_box, row[i].box);
+				num_right += row[i].count;
+			}
+			right_cost[i]  = num_right > 0 ? half_area(right_box) * num_right : 0;
+			right_count[i] = num_right;
+		}
+
+		AABB left_box = empty_aabb();
+		int  num_left = 0;
+		for (int i = 1; i < num_bins; i++) {
+			if (row[i-1].count > 0) {
+				left_box  = union_aabb(left_box, row[i-1].box);
+				num_left += row[i-1].count;
+			}
+			if (num_left == 0 || right_count[i] == 0)
+				continue;
+			double cost = half_area(left_box) * num_left + right_cost[i];
+			if (cost < best) {
+				best = cost;
+				split.axis = axis;
+				split.bin  = i;
+			}
+		}
+	}
+
+	if (split.axis >= 0) {
+		split.left  = empty_bin();
+		split.right = empty_bin();
+		for (int i = 0; i < num_bins; i++)
+			merge_bins(i < split.bin ? &split.left : &split.right, bins->bins[split.axis][i]);
+	}
+	return split;
+}
+
+// Bins of the split axis start at "min" and there are "scale" per unit
+static bool goes_left(AABB box, Split split, float min, float scale)
+{
+	float value = axis_of(centroid_of(box), split.axis);
+	return cell_index(value, min, scale, split.num_bins) < split.bin;
+}
+
+// Used when the centroids are all in the same spot
+static Split split_in_half(const Builder *b, int first, int count)
+{
+	Split split = { .axis = -1 };
+	split.left  = bound_prims(b, first, first + count / 2);
+	split.right = bound_prims(b, first + count / 2, first + count);
+	return split;
+}
+
+// Bins the primitives of a node and moves those going to
+// the left child before the others
+static Split choose_split(Builder *b, int first, Bin bounds)
+{
+	// Small nodes don't need as many bins
+	int num_bins = bounds.count < 2 * NUM_BINS ? bounds.count / 2 + 1 : NUM_BINS;
+
+	Bins bins;
+	bin_prims(b, first, first + bounds.count, bounds.centroids, num_bins, &bins);
+	Split split = find_split(&bins, num_bins);
+	if (split.axis < 0)
+		return split_in_half(b, first, bounds.count);
+
+	BuildPrim *refs = b->refs;
+	float min   = axis_of(bounds.centroids.min, split.axis);
+	float scale = axis_of(cell_scale(bounds.centroids, num_bins), split.axis);
+	int i = first;
+	int j = first + bounds.count - 1;
+	while (i <= j) {
+		if (goes_left(refs[i].box, split, min, scale))
+			i++;
+		else {
+			BuildPrim tmp = refs[i];
+			refs[i] = refs[j];
+			refs[j] = tmp;
+			j--;
+		}
+	}
+	assert(i - first == split.left.count);
+	return split;
+}
+
+// Builds the subtree of the primitives refs[first] to
+// refs[first+bounds.count-1] in "nodes" and returns the
+// index of its root
+static int build_sah_node(Builder *b, BVHNode *nodes, int *num_nodes, int first, int depth, Bin bounds)
+{
+	int node_index = (*num_nodes)++;
+	nodes[node_index].box = bounds.box;
+
+	if (bounds.count <= MAX_LEAF_SIZE || depth == MAX_BUILD_DEPTH) {
+		nodes[node_index].index = first;
+		nodes[node_index].count = bounds.count;
+		return node_index;
+	}
+
+	Split split = choose_split(b, first, bounds);
+	nodes[node_index].count = 0;
+	build_sah_node(b, nodes, num_nodes, first, depth + 1, split.left);
+	nodes[node_index].index = build_sah_node(b, nodes, num_nodes, first + split.left.count, depth + 1, split.right);
+	return node_index;
+}
+
+// Number of primitives going to the left child: those before the
+// highest bit that differs between the codes changes, or half of
+// them if the codes are all the same
+static int morton_split(const Builder *b, int first, int count)
+{
+	uint32_t lo = b->codes[first];
+	uint32_t hi = b->codes[first + count - 1];
+	if (lo == hi)
+		return count / 2;
+
+	uint32_t bit = lo ^ hi;
+	bit |= bit >> 1;
+	bit |= bit >> 2;
+	bit |= bit >> 4;
+	bit |= bit >> 8;
+	bit |= bit >> 16;
+	bit ^= bit >> 1;
+
+	// The codes are sorted, so the ones with the bit set come last
+	int i = first;
+	int j = first + count - 1;
+	while (i < j) {
+		int mid = i + (j - i) / 2;
+		if (b->codes[mid] & bit)
+			j = mid;
+		else
+			i = mid + 1;
+	}
+	return i - first;
+}
+
+// Same as "build_sah_node" for primitives sorted by Morton code. The
+// boxes are computed on the way back up.
+static int build_morton_node(Builder *b, BVHNode *nodes, int *num_nodes, int first, int count, int depth)
+{
+	int node_index = (*num_nodes)++;
+
+	if (count <= MAX_LEAF_SIZE || depth == MAX_BUILD_DEPTH) {
+		AABB box = empty_aabb();
+		for (int i = first; i < first + count; i++)
+			box = union_aabb(box, b->boxes[b->bvh->prims[i]]);
+		nodes[node_index] = (BVHNode) { box, first, count };
+		return node_index;
+	}
+
+	int left_count = morton_split(b, first, count);
+	int left  = build_morton_node(b, nodes, num_nodes, first, left_count, depth + 1);
+	int right = build_morton_node(b, nodes, num_nodes, first + left_count, count - left_count, depth + 1);
+	nodes[node_index] = (BVHNode) { union_aabb(nodes[left].box, nodes[right].box), right, 0 };
+	return node_index;
+}
+
+// Pass over the primitives prims[first] to prims[first+count-1],
+// split in "num_parts" parts processed in parallel
+typedef struct {
+	Builder *b;
+	int      first;
+	int      count;
+	int      num_parts;
+	AABB     centroids; // Bounds the bins or cells divide
+	Split    split;
+	int      shift;     // Of the digit sorted by the radix pass
+} PartPass;
+
+static PartPass make_pass(Builder *b, int first, int count)
+{
+	int num_parts = 1;
+	if (b->pool) {
+		num_parts = count / MIN_PART_SIZE;
+		if (num_parts > MAX_PARTS) num_parts = MAX_PARTS;
+		if (num_parts < 1) num_parts = 1;
+	}
+	return (PartPass) { .b = b, .first = first, .count = count, .num_parts = num_parts };
+}
+
+static void run_pass(PartPass *pass, ParallelForFunc func)
+{
+	if (pass->num_parts > 1)
+		parallel_for(pass->b->pool, pass->num_parts, 1, func, pass);
+	else
+		func(pass, 0, 1);
+}
+
+static void part_range(const PartPass *pass, int part, int *begin, int *end)
+{
+	*begin = pass->first + (int) ((int64_t) pass->count * part / pass->num_parts);
+	*end   = pass->first + (int) ((int64_t) pass->count * (part + 1) / pass->num_parts);
+}
+
+// Initializes the primitives and computes their bounds
+static void prepare_parts(void *data, int begin, int end)
+{
+	PartPass *pass = data;
+	Builder  *b = pass->b;
+	for (int part = begin; part < end; part++) {
+		int first, last;
+		part_range(pass, part, &first, &last);
+
+		Bin bounds = empty_bin();
+		for (int i = first; i < last; i++) {
+			AABB box = b->boxes[i];
+			if (b->refs)
+				b->refs[i] = (BuildPrim) { box, i };
+			else
+				b->bvh->prims[i] = i;
+			add_to_bin(&bounds, box, centroid_of(box));
+		}
+		b->part_bounds[part] = bounds;
+	}
+}
+
+static void bin_parts(void *data, int begin, int end)
+{
+	PartPass *pass = data;
+	for (int part = begin; part < end; part++) {
+		int first, last;
+		part_range(pass, part, &first, &last);
+		bin_prims(pass->b, first, last, pass->centroids, NUM_BINS, &pass->b->part_bins[part]);
+	}
+}
+
+// Copies the primitives of each part to the ranges of
+// the children reserved for it in "temp"
+static void scatter_parts(void *data, int begin, int end)
+{
+	PartPass *pass = data;
+	Builder  *b = pass->b;
+	float min   = axis_of(pass->centroids.min, pass->split.axis);
+	float scale = axis_of(cell_scale(pass->centroids, pass->split.num_bins), pass->split.axis);
+	for (int part = begin; part < end; part++) {
+		int first, last;
+		part_range(pass, part, &first, &last);
+
+		int left  = b->part_left[part];
+		int right = b->part_right[part];
+		for (int i = first; i < last; i++) {
+			BuildPrim ref = b->refs[i];
+			if (goes_left(ref.box, pass->split, min, scale))
+				b->temp_refs[left++] = ref;
+			else
+				b->temp_refs[right++] = ref;
+		}
+	}
+}
+
+static void copy_parts(void *data, int begin, int end)
+{
+	PartPass *pass = data;
+	Builder  *b = pass->b;
+	for (int part = begin; part < end; part++) {
+		int first, last;
+		part_range(pass, part, &first, &last);
+		memcpy(b->refs + first, b->temp_refs + first, sizeof(BuildPrim) * (last - first));
+	}
+}
+
+static void index_parts(void *data, int begin, int end)
+{
+	PartPass *pass = data;
+	Builder  *b = pass->b;
+	for (int part = begin; part < end; part++) {
+		int first, last;
+		part_range(pass, part, &first, &last);
+		for (int i = first; i < last; i++)
+			b->bvh->prims[i] = b->refs[i].index;
+	}
+}
+
+// Same as "choose_split" with the passes over the primitives
+// shared by the threads of the pool
+static Split choose_split_parallel(Builder *b, int first, Bin bounds)
+{
+	PartPass pass = make_pass(b, first, bounds.count);
+	pass.centroids = bounds.centroids;
+	run_pass(&pass, bin_parts);
+
+	Bins bins = b->part_bins[0];
+	for (int part = 1; part < pass.num_parts; part++)
+		for (int k = 0; k < 3; k++)
+			for (int i = 0; i < NUM_BINS; i++)
+				merge_bins(&bins.bins[k][i], b->part_bins[part].bins[k][i]);
+
+	Split split = find_split(&bins, NUM_BINS);
+	if (split.axis < 0)
+		return split_in_half(b, first, bounds.count);
+
+	// Each part knows from its bins how many of its
+	// primitives go left, so they can be moved at once
+	int left  = first;
+	int right = first + split.left.count;
+	for (int part = 0; part < pass.num_parts; part++) {
+		int part_first, part_last;
+		part_range(&pass, part, &part_first, &part_last);
+
+		int left_count = 0;
+		for (int i = 0; i < split.bin; i++)
+			left_count += b->part_bins[part].bins[split.axis][i].count;
+
+		b->part_left[part]  = left;
+		b->part_right[part] = right;
+		left  += left_count;
+		right += part_last - part_first - left_count;
+	}
+
+	pass.split = split;
+	run_pass(&pass, scatter_parts);
+	run_pass(&pass, copy_parts);
+	return split;
+}
+
+// Spreads the 10 lowest bits so that there are two zeros between them
+static uint32_t spread_bits(uint32_t x)
+{
+	x = (x | (x << 16)) & 0x030000FF;
+	x = (x | (x <<  8)) & 0x0300F00F;
+	x = (x | (x <<  4)) & 0x030C30C3;
+	x = (x | (x <<  2)) & 0x09249249;
+	return x;
+}
+
+static void code_parts(void *data, int begin, int end)
+{
+	PartPass *pass = data;
+	Builder  *b = pass->b;
+	AABB bounds = pass->centroids;
+	Vector3 scale = cell_scale(bounds, MORTON_CELLS);
+	for (int part = begin; part < end; part++) {
+		int first, last;
+		part_range(pass, part, &first, &last);
+		for (int i = first; i < last; i++) {
+			Vector3 c = centroid_of(b->boxes[b->bvh->prims[i]]);
+			uint32_t x = cell_index(c.x, bounds.min.x, scale.x, MORTON_CELLS);
+			uint32_t y = cell_index(c.y, bounds.min.y, scale.y, MORTON_CELLS);
+			uint32_t z = cell_index(c.z, bounds.min.z, scale.z, MORTON_CELLS);
+			b->codes[i] = (spread_bits(x) << 2) | (spread_bits(y) << 1) | spread_bits(z);
+		}
+	}
+}
+
+static void count_digits(void *data, int begin, int end)
+{
+	PartPass *pass = data;
+	Builder  *b = pass->b;
+	for (int part = begin; part < end; part++) {
+		int first, last;
+		part_range(pass, part, &first, &last);
+
+		int *digits = b->part_digits + part * RADIX_SIZE;
+		memset(digits, 0, sizeof(int) * RADIX_SIZE);
+		for (int i = first; i < last; i++)
+			digits[(b->codes[i] >> pass->shift) & (RADIX_SIZE - 1)]++;
+	}
+}
+
+// Parts are moved in order, so the sort is stable
+static void scatter_digits(void *data, int begin, int end)
+{
+	PartPass *pass = data;
+	Builder  *b = pass->b;
+	for (int part = begin; part < end; part++) {
+		int first, last;
+		part_range(pass, part, &first, &last);
+
+		int *positions = b->part_digits + part * RADIX_SIZE;
+		for (int i = first; i < last; i++) {
+			int j = positions[(b->codes[i] >> pass->shift) & (RADIX_SIZE - 1)]++;
+			b->temp[j] = b->bvh->prims[i];
+			b->temp_codes[j] = b->codes[i];
+		}
+	}
+}
+
+// Sorts the primitives by Morton code, RADIX_BITS bits at a time
+static void sort_by_code(Builder *b, int count)
+{
+	PartPass pass = make_pass(b, 0, count);
+	for (pass.shift = 0; pass.shift < 30; pass.shift += RADIX_BITS) {
+		run_pass(&pass, count_digits);
+
+		// Counts become the position of the first
+		// primitive of each part with that digit
+		int position = 0;
+		for (int digit = 0; digit < RADIX_SIZE; digit++)
+			for (int part = 0; part < pass.num_parts; part++) {
+				int *n = &b->part_digits[part * RADIX_SIZE + digit];
+				int tmp = *n;
+				*n = position;
+				position += tmp;
+			}
+
+		run_pass(&pass, scatter_digits);
+
+		int *prims = b->bvh->prims;
+		b->bvh->prims = b->temp;
+		b->temp = prims;
+
+		uint32_t *codes = b->codes;
+		b->codes = b->temp_codes;
+		b->temp_codes = codes;
+	}
+}
+
+static int add_top_node(Builder *b)
+{
+	if (b->num_top == b->max_top) {
+		int max_top = 2 * b->max_top + 16;
+		TopNode *top = realloc(b->top, sizeof(TopNode) * max_top);
+		if (top == NULL)
+			return -1;
+		b->top = top;
+		b->max_top = max_top;
+	}
+	return b->num_top++;
+}
+
+static int add_task(Builder *b)
+{
+	if (b->num_tasks == b->max_tasks) {
+		int max_tasks = 2 * b->max_tasks + 16;
+		BuildTask *tasks = realloc(b->tasks, sizeof(BuildTask) * max_tasks);
+		if (tasks == NULL)
+			return -1;
+		b->tasks = tasks;
+		b->max_tasks = max_tasks;
+	}
+	return b->num_tasks++;
+}
+
+// Splits the nodes with more than "task_size" primitives on the
+// calling thread and turns the others in tasks. Returns the index
+// of the top node or -1 if there's no memory.
+static int split_top(Builder *b, int first, int depth, Bin bounds)
+{
+	int top = add_top_node(b);
+	if (top < 0)
+		return -1;
+
+	if (bounds.count <= b->task_size || depth == MAX_BUILD_DEPTH) {
+		int task = add_task(b);
+		if (task < 0)
+			return -1;
+		b->tasks[task] = (BuildTask) { .first = first, .depth = depth, .bounds = bounds };
+		b->top[top].left  = -1;
+		b->top[top].right = task;
+		return top;
+	}
+
+	Bin left  = empty_bin();
+	Bin right = empty_bin();
+	if (b->method == BVH_BUILD_SAH) {
+		Split split = choose_split_parallel(b, first, bounds);
+		left  = split.left;
+		right = split.right;
+	} else {
+		left.count  = morton_split(b, first, bounds.count);
+		right.count = bounds.count - left.count;
+	}
+
+	int left_top = split_top(b, first, depth + 1, left);
+	if (left_top < 0)
+		return -1;
+	int right_top = split_top(b, first + left.count, depth + 1, right);
+	if (right_top < 0)
+		return -1;
+	b->top[top].left  = left_top;
+	b->top[top].right = right_top;
+	return top;
+}
+
+static void build_task(Builder *b, BuildTask *task)
+{
+	BVHNode *nodes = b->nodes + 2 * task->first;
+	task->num_nodes = 0;
+	if (b->method == BVH_BUILD_SAH)
+		build_sah_node(b, nodes, &task->num_nodes, task->first, task->depth, task->bounds);
+	else
+		build_morton_node(b, nodes, &task->num_nodes, task->first, task->bounds.count, task->depth);
+}
+
+static void build_tasks(void *data, int begin, int end)
+{
+	Builder *b = data;
+	for (int i = begin; i < end; i++)
+		build_task(b, &b->tasks[b->order[i].task]);
+}
+
+// Gives the top nodes and the subtrees of the tasks their place
+// in the tree, in depth-first order. Returns the index of the node.
+static int place_top_node(Builder *b, int top)
+{
+	BVH *bvh = b->bvh;
+	int left  = b->top[top].left;
+	int right = b->top[top].right;
+
+	if (left < 0) {
+		BuildTask *task = &b->tasks[right];
+		task->offset = bvh->num_nodes;
+		bvh->num_nodes += task->num_nodes;
+		b->top[top].box = b->nodes[2 * task->first].box;
+		return task->offset;
+	}
+
+	int node_index = bvh->num_nodes++;
+	place_top_node(b, left);
+	int right_index = place_top_node(b, right);
+	b->top[top].box = union_aabb(b->top[left].box, b->top[right].box);
+	bvh->nodes[node_index] = (BVHNode) { b->top[top].box, right_index, 0 };
+	return node_index;
+}
+
+static void move_tasks(void *data, int begin, int end)
+{
+	Builder *b = data;
+	for (int i = begin; i < end; i++) {
+		const BuildTask *task = &b->tasks[i];
+		const BVHNode *src = b->nodes + 2 * task->first;
+		BVHNode *dst = b->bvh->nodes + task->offset;
+		for (int j = 0; j < task->num_nodes; j++) {
+			BVHNode node = src[j];
+			if (node.count == 0)
+				node.index += task->offset;
+			dst[j] = node;
+		}
+	}
+}
+
+static int compare_tasks(const void *a, const void *b)
+{
+	return ((const TaskOrder *) b)->count - ((const TaskOrder *) a)->count;
+}
+
+static void for_each_task(Builder *b, ParallelForFunc func)
+{
+	if (b->pool)
+		parallel_for(b->pool, b->num_tasks, 1, func, b);
+	else
+		func(b, 0, b->num_tasks);
+}
+
+static bool run_builder(Builder *b, int count)
+{
+	if (b->pool) {
+		int num_threads = count_pool_threads(b->pool);
+		b->task_size = count / (num_threads * TASKS_PER_THREAD);
+		if (b->task_size < MIN_TASK_SIZE)
+			b->task_size = MIN_TASK_SIZE;
+	} else
+		b->task_size = count;
+
+	// Primitives are only partitioned out of place by
+	// the calling thread
+	if (b->method == BVH_BUILD_SAH) {
+		b->refs = malloc(sizeof(BuildPrim) * count);
+		if (b->refs == NULL)
+			return false;
+		if (count > b->task_size) {
+			b->temp_refs = malloc(sizeof(BuildPrim) * count);
+			b->part_bins = malloc(sizeof(Bins) * MAX_PARTS);
+			if (!b->temp_refs || !b->part_bins)
+				return false;
+		}
+	}
+	if (b->method == BVH_BUILD_MORTON) {
+		b->temp = malloc(sizeof(int) * count);
+		b->codes = malloc(sizeof(uint32_t) * count);
+		b->temp_codes = malloc(sizeof(uint32_t) * count);
+		b->part_digits = malloc(sizeof(int) * RADIX_SIZE * (b->pool ? MAX_PARTS : 1));
+		if (!b->temp || !b->codes || !b->temp_codes || !b->part_digits)
+			return false;
+	}
+
+	PartPass pass = make_pass(b, 0, count);
+	run_pass(&pass, prepare_parts);
+	Bin bounds = empty_bin();
+	for (int part = 0; part < pass.num_parts; part++)
+		merge_bins(&bounds, b->part_bounds[part]);
+
+	if (b->method == BVH_BUILD_MORTON) {
+		pass.centroids = bounds.centroids;
+		run_pass(&pass, code_parts);
+		sort_by_code(b, count);
+	}
+
+	int root = split_top(b, 0, 0, bounds);
+	if (root < 0)
+		return false;
+
+	if (b->num_tasks == 1) {
+		// A single subtree is the whole tree
+		b->nodes = b->bvh->nodes;
+		build_task(b, &b->tasks[0]);
+		b->bvh->num_nodes = b->tasks[0].num_nodes;
+	} else {
+		b->nodes = malloc(sizeof(BVHNode) * 2 * count);
+		b->order = malloc(sizeof(TaskOrder) * b->num_tasks);
+		if (!b->nodes || !b->order)
+			return false;
+
+		// Large tasks go first so that the threads
+		// don't wait for one of them at the end
+		for (int i = 0; i < b->num_tasks; i++)
+			b->order[i] = (TaskOrder) { b->tasks[i].bounds.count, i };
+		qsort(b->order, b->num_tasks, sizeof(TaskOrder), compare_tasks);
+
+		for_each_task(b, build_tasks);
+		place_top_node(b, root);
+		for_each_task(b, move_tasks);
+	}
+
+	if (b->method == BVH_BUILD_SAH)
+		run_pass(&pass, index_parts);
+	return true;
+}
+
+bool build_bvh(BVH *bvh, const AABB *boxes, int count, BVHBuildMethod method, Pool *pool)
+{
+	bvh->num_nodes = 0;
+	bvh->num_prims = count;
+	bvh->prims = malloc(sizeof(int) * (count > 0 ? count : 1));
+	bvh->nodes = malloc(sizeof(BVHNode) * (count > 0 ? 2 * count - 1 : 1));
+	if (!bvh->prims || !bvh->nodes) {
+		free(bvh->prims);
+		free(bvh->nodes);
+		return false;
+	}
+
+	// An empty BVH has no nodes at all
+	if (count == 0)
+		return true;
+
+	if (pool && count_pool_threads(pool) == 1)
+		pool = NULL;
+
+	Builder b = { .bvh = bvh, .boxes = boxes, .method = method, .pool = pool };
+	bool ok = run_builder(&b, count);
+
+	free(b.refs);
+	free(b.temp_refs);
+	free(b.codes);
+	free(b.temp);
+	free(b.temp_codes);
+	free(b.tasks);
+	free(b.order);
+	free(b.top);
+	free(b.part_bins);
+	free(b.part_digits);
+	if (b.nodes != bvh->nodes)
+		free(b.nodes);
+
+	if (!ok) {
+		free(bvh->prims);
+		free(bvh->nodes);
+		return false;
+	}
+	assert(bvh->num_nodes <= 2 * count - 1);
+	return true;
+}
+
+typedef struct {
+	BVH        *bvh;
+	const BVH  *parts;
+	const int  *first;
+	const AABB *boxes;  // Bounds of the parts
+	int        *order;  // Indices of the parts being split
+} Merger;
+
+// Copies a part at the end of the merged tree
+static void copy_part(Merger *m, int part)
+{
+	BVH *bvh = m->bvh;
+	const BVH *src = &m->parts[part];
+
+	int node_base = bvh->num_nodes;
+	int prim_base = bvh->num_prims;
+	for (int i = 0; i < src->num_nodes; i++) {
+		BVHNode node = src->nodes[i];
+		node.index += node.count ? prim_base : node_base;
+		bvh->nodes[node_base + i] = node;
+	}
+	for (int i = 0; i < src->num_prims; i++)
+		bvh->prims[prim_base + i] = m->first[part] + src->prims[i];
+	bvh->num_nodes += src->num_nodes;
+	bvh->num_prims += src->num_prims;
+}
+
+static float centroid_axis(AABB box, int axis)
+{
+	return axis_of(centroid_of(box), axis);
+}
+
+// Builds the nodes above the parts order[first] to order[first+count-1]
+// by splitting them in halves along the axis with the largest spread
+// of centroids, so that at most BVH_MERGE_LEVELS levels are added.
+static int merge_node(Merger *m, int first, int count)
+{
+	BVH *bvh = m->bvh;
+
+	if (count == 1) {
+		int node_index = bvh->num_nodes;
+		copy_part(m, m->order[first]);
+		return node_index;
+	}
+
+	int node_index = bvh->num_nodes++;
+	BVHNode *node = &bvh->nodes[node_index];
+
+	AABB box = empty_aabb();
+	AABB centroid_box = empty_aabb();
+	for (int i = first; i < first + count; i++) {
+		box = union_aabb(box, m->boxes[m->order[i]]);
+		centroid_box = grow_aabb(centroid_box, centroid_of(m->boxes[m->order[i]]));
+	}
+	node->box = box;
+	node->count = 0;
+
+	Vector3 extent = combine(centroid_box.max, centroid_box.min, 1, -1);
+	int axis = 0;
+	if (extent.y > axis_of(extent, axis)) axis = 1;
+	if (extent.z > axis_of(extent, axis)) axis = 2;
+
+	// There are only a few parts, so insertion sort is fine
+	for (int i = first + 1; i < first + count; i++) {
+		int part = m->order[i];
+		int j = i;
+		while (j > first && centroid_axis(m->boxes[m->order[j-1]], axis) > centroid_axis(m->boxes[part], axis)) {
+			m->order[j] = m->order[j-1];
+			j--;
+		}
+		m->order[j] = part;
+	}
+
+	int left_count = count / 2;
+	merge_node(m, first, left_count);
+	int right = merge_node(m, first + left_count, count - left_count);
+	bvh->nodes[node_index].index = right;
+	return node_index;
+}
+
+bool merge_bvhs(BVH *bvh, const BVH *parts, const int *first, int count)
+{
+	assert(count <= BVH_MAX_MERGE);
+
+	// Empty parts have no root to link
+	AABB boxes[BVH_MAX_MERGE];
+	int  order[BVH_MAX_MERGE];
+	int  num_nonempty = 0;
+	int  num_nodes = 0;
+	int  num_prims = 0;
+	for (int i = 0; i < count; i++) {
+		num_nodes += parts[i].num_nodes;
+		num_prims += parts[i].num_prims;
+		if (parts[i].num_nodes > 0) {
+			boxes[i] = parts[i].nodes[0].box;
+			order[num_nonempty++] = i;
+		}
+	}
+	num_nodes += num_nonempty > 0 ? num_nonempty - 1 : 0;
+
+	bvh->num_nodes = 0;
+	bvh->num_prims = 0;
+	bvh->prims = malloc(sizeof(int)     * (num_prims > 0 ? num_prims : 1));
+	bvh->nodes = malloc(sizeof(BVHNode) * (num_nodes > 0 ? num_nodes : 1));
+	if (!bvh->prims || !bvh->nodes) {
+		free(bvh->prims);
+		free(bvh->nodes);
+		return false;
+	}
+
+	if (num_nonempty == 0)
+		return true;
+
+	Merger m = { bvh, parts, first, boxes, order };
+	merge_node(&m, 0, num_nonempty);
+	assert(bvh->num_nodes == num_nodes);
+	assert(bvh->num_prims == num_prims);
+	return true;
+}
+
+void refit_bvh(BVH *bvh, const AABB *boxes)
+{
+	// Children always come after their parent
+	for (int i = bvh->num_nodes - 1; i >= 0; i--) {
+		BVHNode *node = &bvh->nodes[i];
+		AABB box = empty_aabb();
+		if (node->count == 0)
+			box = union_aabb(bvh->nodes[i+1].box, bvh->nodes[node->index].box);
+		else
+			for (int j = node->index; j < node->index + node->count; j++)
+				box = union_aabb(box, boxes[bvh->prims[j]]);
+		node->box = box;
+	}
+}
+
+static float surface_area(AABB box)
+{
+	Vector3 d = combine(box.max, box.min, 1, -1);
+	return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+float bvh_cost(const BVH *bvh)
+{
+	float cost = 0;
+	for (int i = 0; i < bvh->num_nodes; i++)
+		cost += surface_area(bvh->nodes[i].box);
+	return cost;
+}
+
+void free_bvh(BVH *bvh)
+{
+	free(bvh->nodes);
+	free(bvh->prims);
+}
+
+// Finds the smallest box that can be encoded relative to "parent" and
+// contains "box", using the same arithmetic as "decode_box"
+static bool encode_box(AABB parent, AABB box, CompressedNode *node)
+{
+	float lo[3]   = { box.min.x, box.min.y, box.min.z };
+	float hi[3]   = { box.max.x, box.max.y, box.max.z };
+	float pmin[3] = { parent.min.x, parent.min.y, parent.min.z };
+	float pmax[3] = { parent.max.x, parent.max.y, parent.max.z };
+
+	for (int k = 0; k < 3; k++) {
+		float step = (pmax[k] - pmin[k]) * (1.0f / 255);
+		if (!(lo[k] <= hi[k]) || !isfinite(step))
+			return false;
+
+		int qmin = 0;
+		int qmax = 255;
+		if (step > 0) {
+			qmin = (int) fminf(fmaxf(floorf((lo[k] - pmin[k]) / step), 0), 255);
+			qmax = 255 - (int) fminf(fmaxf(floorf((pmax[k] - hi[k]) / step), 0), 255);
+		}
+
+		// The estimates can be off by one because of rounding
+		while (qmin > 0 && pmin[k] + qmin * step > lo[k])
+			qmin--;
+		while (qmax < 255 && pmax[k] - (255 - qmax) * step < hi[k])
+			qmax++;
+		node->min[k] = qmin;
+		node->max[k] = qmax;
+	}
+
+	AABB decoded = decode_box(parent, node);
+	return decoded.min.x <= box.min.x && decoded.min.y <= box.min.y && decoded.min.z <= box.min.z
+	    && decoded.max.x >= box.max.x && decoded.max.y >= box.max.y && decoded.max.z >= box.max.z;
+}
+
+// Compresses the subtree of node "i", whose own entry was already
+// written, given its decoded box. Returns the index following the
+// last node of the subtree.
+static int compress_node(const BVH *bvh, CompressedNode *nodes, int i, AABB box)
+{
+	const BVHNode *node = &bvh->nodes[i];
+	nodes[i].index = node->index;
+	nodes[i].count = node->count;
+	if (node->count > UINT16_MAX)
+		return -1;
+	if (node->count > 0)
+		return i + 1;
+
+	int left  = i + 1;
+	int right = node->index;
+	if (!encode_box(box, bvh->nodes[left].box,  &nodes[left]) ||
+		!encode_box(box, bvh->nodes[right].box, &nodes[right]))
+		return -1;
+	if (compress_node(bvh, nodes, left, decode_box(box, &nodes[left])) < 0)
+		return -1;
+	return compress_node(bvh, nodes, right, decode_box(box, &nodes[right]));
+}
+
+bool compress_bvh(const BVH *bvh, CompressedNode *nodes)
+{
+	// Roots are decoded relative to their own box, which
+	// the traversal reads from the full tree
+	int i = 0;
+	while (i < bvh->num_nodes) {
+		AABB box = bvh->nodes[i].box;
+		if (!encode_box(box, box, &nodes[i]))
+			return false;
+		i = compress_node(bvh, nodes, i, box);
+		if (i < 0)
+			return false;
+	}
+	return true;
+}
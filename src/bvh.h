@@ -0,0 +1,190 @@
+/*
+Copyright 2024 Francesco Cozzuto
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+associated documentation files (the “Software”), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial
+portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef BVH_INCLUDED
+#define BVH_INCLUDED
+
+#include <stdint.h>
+#include "vector.h"
+#include "pool.h"
+
+typedef struct {
+	Vector3 min;
+	Vector3 max;
+} AABB;
+
+// The root is the first node (there are no nodes if the BVH
+// is empty). Nodes are stored in depth-first order, so the left child of an
+// inner node always follows it. Inner nodes have a count of 0 and
+// "index" is the position of their right child. Leaves reference
+// "count" primitives starting from position "index" of the "prims"
+// array of the BVH.
+typedef struct {
+	AABB box;
+	int  index;
+	int  count;
+} BVHNode;
+
+typedef struct {
+	BVHNode *nodes;
+	int      num_nodes;
+	int     *prims;
+	int      num_prims;
+} BVH;
+
+// Node of a compressed copy of a tree, with the same index as the node
+// it was made from. Its box is stored in 8 bits per coordinate as a
+// fraction of the box of its parent, rounded outwards, so the box of a
+// node is only known after decoding those of its ancestors. Nodes take
+// 12 bytes instead of 32, which lets more of a large tree stay cached.
+typedef struct {
+	uint8_t  min[3];
+	uint8_t  max[3];
+	uint16_t count;
+	int32_t  index;
+} CompressedNode;
+
+typedef struct {
+	CompressedNode *nodes; // NULL if the tree isn't compressed
+	int             num_nodes;
+} CompressedBVH;
+
+// Maximum depth of the trees produced by "build_bvh" and "merge_bvhs".
+// Traversal code can use it to size its stack.
+#define BVH_MAX_DEPTH 64
+
+// Maximum number of trees "merge_bvhs" can combine and the number
+// of levels it adds on top of them. Trees built by "build_bvh"
+// leave room for those levels.
+#define BVH_MAX_MERGE 16
+#define BVH_MERGE_LEVELS 4
+
+AABB empty_aabb(void);
+AABB union_aabb(AABB a, AABB b);
+AABB grow_aabb(AABB a, Vector3 p);
+
+// How "build_bvh" chooses where to split the nodes
+typedef enum {
+	// Binned surface area heuristic. The trees are the fastest to
+	// traverse.
+	BVH_BUILD_SAH,
+	// Primitives sorted along a Morton curve and split where their
+	// codes differ (LBVH). Several times faster to build, for trees
+	// rebuilt often, but slower to traverse.
+	BVH_BUILD_MORTON,
+} BVHBuildMethod;
+
+// Builds the tree over "count" primitives. With a pool, the top of the
+// tree is split by the calling thread with the threads of the pool
+// binning and partitioning the large nodes, then the subtrees below it
+// are built by all threads at once. "pool" can be NULL to only use the
+// calling thread, and must be when called from a loop of the pool.
+bool build_bvh(BVH *bvh, const AABB *boxes, int count, BVHBuildMethod method, Pool *pool);
+
+// Combines "count" trees built separately over consecutive ranges of
+// primitives into a single one. The primitive indices of parts[i] are
+// relative to first[i]. The parts are copied as they are, only the
+// few nodes above them are built.
+bool merge_bvhs(BVH *bvh, const BVH *parts, const int *first, int count);
+void free_bvh(BVH *bvh);
+
+// Fills "nodes" (one per node of the tree) with the compressed copy of
+// the tree, or of each tree if it contains many stored one after the
+// other. Returns false if it can't be represented, in which case the
+// full tree should be used: boxes must be finite and not empty and
+// leaves can't hold more than 65535 primitives.
+bool  compress_bvh(const BVH *bvh, CompressedNode *nodes);
+
+// Recomputes the boxes of the nodes after the primitives moved,
+// keeping the structure of the tree
+void  refit_bvh(BVH *bvh, const AABB *boxes);
+
+// Sum of the surface areas of the nodes, which is proportional to the
+// expected cost of traversing the tree. A refitted tree costing much
+// more than the tree did before should be rebuilt.
+float bvh_cost(const BVH *bvh);
+
+// Box of a compressed node given the box of its parent. Both ends of
+// the parent box are reproduced exactly, so a box can always be found
+// that contains the original one.
+static inline AABB decode_box(AABB parent, const CompressedNode *node)
+{
+	Vector3 step = {
+		(parent.max.x - parent.min.x) * (1.0f / 255),
+		(parent.max.y - parent.min.y) * (1.0f / 255),
+		(parent.max.z - parent.min.z) * (1.0f / 255),
+	};
+	return (AABB) {
+		.min = {
+			parent.min.x + node->min[0] * step.x,
+			parent.min.y + node->min[1] * step.y,
+			parent.min.z + node->min[2] * step.z,
+		},
+		.max = {
+			parent.max.x - (255 - node->max[0]) * step.x,
+			parent.max.y - (255 - node->max[1]) * step.y,
+			parent.max.z - (255 - node->max[2]) * step.z,
+		},
+	};
+}
+
+// 1 + 2 * gamma(3), the relative error of the slab distances
+#define BVH_SLAB_EPSILON 1.0000004f
+
+// The slab test runs once per visited node, so it's defined here
+// to let the traversal code inline it. If either operand is NaN,
+// these return the second one.
+static inline float bvh_min(float x, float y) { return x < y ? x : y; }
+static inline float bvh_max(float x, float y) { return x > y ? x : y; }
+
+// Distances at which the ray enters and leaves the slab between "lo"
+// and "hi". A ray parallel to the slab that starts on one of its planes
+// gets 0 * inf = NaN: it lies on the surface of the box, so both
+// distances are NaN and the slab test ignores them.
+static inline void intersect_slab(float lo, float hi, float origin, float inv_dir, float *enter, float *leave)
+{
+	float t0 = (lo - origin) * inv_dir;
+	float t1 = (hi - origin) * inv_dir;
+	*enter = t0 != t0 ? t0 : bvh_min(t0, t1);
+	*leave = t0 != t0 ? t0 : bvh_max(t0, t1);
+}
+
+// Returns the distance at which the ray enters the box (0 if the
+// origin is inside it) if that happens before "max_t"
+static inline bool intersect_aabb(Vector3 origin, Vector3 inv_dir, AABB box, float max_t, float *t)
+{
+	float enter_x, leave_x, enter_y, leave_y, enter_z, leave_z;
+	intersect_slab(box.min.x, box.max.x, origin.x, inv_dir.x, &enter_x, &leave_x);
+	intersect_slab(box.min.y, box.max.y, origin.y, inv_dir.y, &enter_y, &leave_y);
+	intersect_slab(box.min.z, box.max.z, origin.z, inv_dir.z, &enter_z, &leave_z);
+
+	// The slab distances go first so that NaNs are dropped
+	float tnear = bvh_max(enter_z, bvh_max(enter_y, bvh_max(enter_x, 0)));
+	float tfar  = bvh_min(leave_z, bvh_min(leave_y, bvh_min(leave_x, max_t)));
+
+	// The distances are rounded, so rays grazing a box could miss it by
+	// an ulp and skip the triangles they hit on its surface. Growing the
+	// exit distance by the bound on the error keeps meshes watertight.
+	if (tnear > tfar * BVH_SLAB_EPSILON)
+		return false;
+
+	if (t) *t = tnear;
+	return true;
+}
+
+#endif
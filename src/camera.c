@@ -92,34 +92,78 @@ Matrix4 camera_pov(void)
 	return lookat_matrix(camera_pos, combine(camera_pos, camera_front, 1, 1), camera_up);
 }
 
-Ray ray_through_screen_at(float px, float py, float aspect_ratio)
+CameraSnapshot take_camera_snapshot(int frame_w, int frame_h)
 {
-	assert(!isnan(aspect_ratio));
+	assert(frame_w > 1 && frame_h > 1);
 
-	Vector3 w = normalize(scalev(camera_front, -1));
-	Vector3 u = normalize(cross(camera_up, w));
-	Vector3 v = cross(w, u);
+	CameraSnapshot cam;
+	cam.generation = 0;
+	cam.frame_w = frame_w;
+	cam.frame_h = frame_h;
+	cam.pos = camera_pos;
 
-	assert(!isnanv(w));
-	assert(!isnanv(u));
-	assert(!isnanv(v));
+	cam.w = normalize(scalev(camera_front, -1));
+	cam.u = normalize(cross(camera_up, cam.w));
+	cam.v = cross(cam.w, cam.u);
 
-	float screen_h = 2 * tan(fov / 2);
-	float screen_w = aspect_ratio * screen_h;
-	assert(!isnan(screen_h));
-	assert(!isnan(screen_w));
+	assert(!isnanv(cam.w));
+	assert(!isnanv(cam.u));
+	assert(!isnanv(cam.v));
 
-	Vector3 horizontal = scalev(u, screen_w);
-	Vector3 vertical   = scalev(v, screen_h);
+	float aspect_ratio = (float) frame_w / frame_h;
+	cam.screen_h = 2 * tan(fov / 2);
+	cam.screen_w = aspect_ratio * cam.screen_h;
+	assert(!isnan(cam.screen_h));
+	assert(!isnan(cam.screen_w));
 
-	assert(!isnanv(horizontal));
-	assert(!isnanv(vertical));
+	cam.horizontal = scalev(cam.u, cam.screen_w);
+	cam.vertical   = scalev(cam.v, cam.screen_h);
 
-	Vector3 lower_left_corner = combine4(camera_pos, horizontal, vertical, w, 1, -0.5, -0.5, -1);
-	assert(!isnanv(lower_left_corner));
+	cam.lower_left_corner = combine4(cam.pos, cam.horizontal, cam.vertical, cam.w, 1, -0.5, -0.5, -1);
+	assert(!isnanv(cam.lower_left_corner));
 
-	Vector3 dir = combine4(lower_left_corner, horizontal, vertical, camera_pos, 1, px, py, -1);
-	assert(!isnanv(dir));
+	// The screen is mirrored on both axis: pixel (0, 0) is the
+	// upper right corner of the screen plane.
+	cam.pixel00_dir = combine4(cam.lower_left_corner, cam.horizontal, cam.vertical, cam.pos, 1, 1, 1, -1);
+	cam.pixel_dx = scalev(cam.horizontal, -1.0f / (frame_w - 1));
+	cam.pixel_dy = scalev(cam.vertical,   -1.0f / (frame_h - 1));
 
-	return (Ray) {.origin=camera_pos, .direction=dir};
+	return cam;
+}
+
+// Direction (not normalized) of the primary ray through
+// the pixel (x, y) of the frame
+Vector3 snapshot_ray_dir(const CameraSnapshot *cam, float x, float y)
+{
+	return combine(combine(cam->pixel00_dir, cam->pixel_dx, 1, x), cam->pixel_dy, 1, y);
+}
+
+// Inverse of "snapshot_ray_dir". Finds the pixel coordinates of the
+// ray leaving the camera along "dir" (which doesn't need to be
+// normalized). Returns false if the direction points behind the
+// camera.
+bool snapshot_project(const CameraSnapshot *cam, Vector3 dir, float *x, float *y)
+{
+	// Rays through the screen have a component of -1 along w,
+	// so the direction needs to be rescaled to match that.
+	float depth = -dotv(dir, cam->w);
+	if (depth <= 0)
+		return false;
+
+	float px = dotv(dir, cam->u) / (depth * cam->screen_w) + 0.5f;
+	float py = dotv(dir, cam->v) / (depth * cam->screen_h) + 0.5f;
+	*x = (1 - px) * (cam->frame_w - 1);
+	*y = (1 - py) * (cam->frame_h - 1);
+	return true;
+}
+
+// Position, relative to "origin", of the point seen through the pixel
+// (x, y) at distance "depth" from the camera. Points at infinite depth
+// (the sky) only depend on the viewing direction.
+Vector3 snapshot_point(const CameraSnapshot *cam, float x, float y, float depth, Vector3 origin)
+{
+	Vector3 dir = normalize(snapshot_ray_dir(cam, x, y));
+	if (isinf(depth))
+		return dir;
+	return combine(combine(cam->pos, dir, 1, depth), origin, 1, -1);
 }
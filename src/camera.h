@@ -16,14 +16,54 @@ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMA
 WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
 SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 */
+#include <stdint.h>
 #include "vector.h"
 
 typedef enum {
     UP, DOWN, LEFT, RIGHT,
 } Direction;
 
+// Immutable copy of the camera published to the workers. Everything
+// needed to generate primary rays for a frame of the given size is
+// precomputed, so the ray through pixel (x, y) is simply
+//
+//     pixel00_dir + x * pixel_dx + y * pixel_dy
+//
+typedef struct {
+
+	// Value of the accumulation generation counter this
+	// snapshot was published with
+	uint32_t generation;
+
+	int frame_w;
+	int frame_h;
+
+	Vector3 pos;
+
+	// Orthonormal basis of the camera (w points backwards)
+	Vector3 u;
+	Vector3 v;
+	Vector3 w;
+
+	// Size of the screen at distance 1 from the camera
+	float screen_w;
+	float screen_h;
+
+	Vector3 horizontal;
+	Vector3 vertical;
+	Vector3 lower_left_corner;
+
+	Vector3 pixel00_dir;
+	Vector3 pixel_dx;
+	Vector3 pixel_dy;
+} CameraSnapshot;
+
 Matrix4 camera_pov(void);
 void    move_camera(Direction dir, float speed);
 void    rotate_camera(double mouse_x, double mouse_y);
 Vector3 get_camera_pos(void);
-Ray     ray_through_screen_at(float u, float v, float aspect_ratio);
\ No newline at end of file
+
+CameraSnapshot take_camera_snapshot(int frame_w, int frame_h);
+Vector3        snapshot_ray_dir(const CameraSnapshot *cam, float x, float y);
+bool           snapshot_project(const CameraSnapshot *cam, Vector3 dir, float *x, float *y);
+Vector3        snapshot_point(const CameraSnapshot *cam, float x, float y, float depth, Vector3 origin);
\ No newline at end of file
@@ -0,0 +1,128 @@
+/*
+Copyright 2024 Francesco Cozzuto
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+associated documentation files (the “Software”), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial
+portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// Checks the math used to reproject the accumulation buffer when the
+// camera moves. It traces the primary rays of a small frame, moves the
+// camera without rotating it and verifies that the depth of every
+// pixel brings it back to the point that was hit, as seen from the
+// new position, that the new camera measures the same distances and
+// that the sky stays in place. It exits with an error if any pixel is
+// off. Build it with "make check_reproject".
+
+#include <stdio.h>
+#include <math.h>
+#include "scene.h"
+#include "camera.h"
+
+#define FRAME_W 64
+#define FRAME_H 48
+
+// Relative error allowed between distances
+#define TOLERANCE 1e-4f
+
+static bool close_to(Vector3 a, Vector3 b, float scale)
+{
+	return norm_of(combine(a, b, 1, -1)) <= TOLERANCE * scale;
+}
+
+static Ray primary_ray(const CameraSnapshot *cam, float x, float y)
+{
+	return (Ray) { cam->pos, snapshot_ray_dir(cam, x, y) };
+}
+
+int main(void)
+{
+	static const char src[] =
+		"sphere center {0 0 0} radius 1.5\n"
+		"sphere center {-2 0.5 1} radius 0.75\n"
+		"cube origin {0.5 -1 -3} size {1 2 1}\n";
+	Scene *scene = parse_scene_string(src, sizeof(src) - 1, NULL, NULL);
+	if (scene == NULL) {
+		fprintf(stderr, "Error: The test scene is invalid\n");
+		return -1;
+	}
+
+	CameraSnapshot old_camera = take_camera_snapshot(FRAME_W, FRAME_H);
+	move_camera(RIGHT, 0.7f);
+	move_camera(UP, 0.4f);
+	CameraSnapshot new_camera = take_camera_snapshot(FRAME_W, FRAME_H);
+
+	int hits = 0;
+	int errors = 0;
+	for (int j = 0; j < FRAME_H; j++)
+		for (int i = 0; i < FRAME_W; i++) {
+
+			Ray ray = primary_ray(&old_camera, i, j);
+			HitInfo hit = trace_ray(ray, scene);
+			float depth = hit_depth(ray, hit);
+
+			Vector3 offset = snapshot_point(&old_camera, i, j, depth, new_camera.pos);
+
+			if (hit.object == -1) {
+				// Translating the camera doesn't move the sky
+				float x, y;
+				if (!snapshot_project(&new_camera, offset, &x, &y) || absf(x - i) > 1e-3f || absf(y - j) > 1e-3f) {
+					fprintf(stderr, "Error: The sky at pixel (%d, %d) moved\n", i, j);
+					errors++;
+				}
+				continue;
+			}
+			hits++;
+
+			float old_distance = norm_of(combine(hit.point, old_camera.pos, 1, -1));
+			if (absf(depth - old_distance) > TOLERANCE * old_distance) {
+				fprintf(stderr, "Error: Pixel (%d, %d) has depth %f but the hit is %f away\n", i, j, depth, old_distance);
+				errors++;
+				continue;
+			}
+
+			Vector3 expected = combine(hit.point, new_camera.pos, 1, -1);
+			if (!close_to(offset, expected, old_distance)) {
+				fprintf(stderr, "Error: Pixel (%d, %d) was reprojected to {%f %f %f} instead of {%f %f %f}\n",
+					i, j, offset.x, offset.y, offset.z, expected.x, expected.y, expected.z);
+				errors++;
+				continue;
+			}
+
+			// When the point is still visible, the new camera must
+			// measure the distance the reprojection predicts
+			float x, y;
+			if (!snapshot_project(&new_camera, offset, &x, &y))
+				continue;
+			Ray new_ray = primary_ray(&new_camera, x, y);
+			HitInfo new_hit = trace_ray(new_ray, scene);
+			if (new_hit.object != hit.object || !close_to(new_hit.point, hit.point, 10 * old_distance))
+				continue;
+			float new_depth = hit_depth(new_ray, new_hit);
+			if (absf(new_depth - norm_of(offset)) > 10 * TOLERANCE * new_depth) {
+				fprintf(stderr, "Error: Pixel (%d, %d) is seen at depth %f from the new position instead of %f\n",
+					i, j, new_depth, norm_of(offset));
+				errors++;
+			}
+		}
+
+	free_scene(scene);
+
+	if (hits == 0) {
+		fprintf(stderr, "Error: No ray hit the test scene\n");
+		return -1;
+	}
+	printf("%d pixels reprojected, %d errors\n", FRAME_W * FRAME_H, errors);
+	return errors > 0;
+}
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdint.h>
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 
@@ -16,11 +17,32 @@ static unsigned int vbo;
 static int screen_w;
 static int screen_h;
 
+// Frames are uploaded through a ring of pixel buffer objects. The
+// CPU writes a frame in one buffer while the GPU copies the previous
+// ones into the texture. A fence for each buffer tells when the
+// GPU is done reading from it.
+#define NUM_UPLOAD_BUFFERS 3
+static unsigned int upload_buffers[NUM_UPLOAD_BUFFERS];
+static GLsync       upload_fences[NUM_UPLOAD_BUFFERS];
+static int          upload_index = 0;
+
+// Size of the frame texture and upload buffers
+static int texture_w = 0;
+static int texture_h = 0;
+
+static DisplaySettings display;
+
 #define MAX_EVENTS 512
 int event_queue[MAX_EVENTS];
 int event_queue_head = 0;
 int event_queue_size = 0;
 
+// Latest cursor position reported by GLFW and whether it
+// changed since the last call to "poll_input"
+static bool   cursor_moved = false;
+static double cursor_x;
+static double cursor_y;
+
 void load_cubemap(Cubemap *c, const char *files[6])
 {
 	for (int i = 0; i < 6; i++) {
@@ -228,7 +250,7 @@ static void push_event(int event)
 	event_queue_size++;
 }
 
-int pop_event(double *mouse_x, double *mouse_y)
+int pop_event(void)
 {
 	if (glfwWindowShouldClose(window))
 		return EVENT_CLOSE;
@@ -239,12 +261,24 @@ int pop_event(double *mouse_x, double *mouse_y)
 	int event = event_queue[event_queue_head];
 	event_queue_head = (event_queue_head + 1) % MAX_EVENTS;
 	event_queue_size--;
-
-	if (event == EVENT_MOVE_MOUSE)
-		glfwGetCursorPos(window, mouse_x, mouse_y);
 	return event;
 }
 
+void poll_input(InputState *input)
+{
+	input->mouse_moved = cursor_moved;
+	input->mouse_x = cursor_x;
+	input->mouse_y = cursor_y;
+	cursor_moved = false;
+
+	input->forward = 0;
+	input->right   = 0;
+	if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS) input->forward++;
+	if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS) input->forward--;
+	if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS) input->right++;
+	if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS) input->right--;
+}
+
 static void error_callback(int error, const char* description)
 {
     fprintf(stderr, "Error: %s\n", description);
@@ -265,7 +299,11 @@ static void key_callback(GLFWwindow* window, int key, int scancode, int action,
 
 static void cursor_callback(GLFWwindow *window, double x, double y)
 {
-	push_event(EVENT_MOVE_MOUSE);
+	// This may be called many times per frame. Only the
+	// last position matters.
+	cursor_moved = true;
+	cursor_x = x;
+	cursor_y = y;
 }
 
 static void framebuffer_size_callback(GLFWwindow* window, int w, int h)
@@ -304,7 +342,9 @@ void startup_window_and_opengl_context_or_exit(int window_w, int window_h, const
 		exit(-1);
 	}
 
-	glfwSwapInterval(1);
+	// The main loop paces itself. Waiting for vsync in the swap
+	// would add up to a refresh interval of input latency.
+	glfwSwapInterval(0);
 
 	glfwGetWindowSize(window, &screen_w, &screen_h);
 
@@ -342,18 +382,16 @@ void startup_window_and_opengl_context_or_exit(int window_w, int window_h, const
 		glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)(2 * sizeof(float)));
 	}
 
-	glGenTextures(1, &frame_texture);
-	glBindTexture(GL_TEXTURE_2D, frame_texture);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glGenBuffers(NUM_UPLOAD_BUFFERS, upload_buffers);
 }
 
 void cleanup_window_and_opengl_context(void)
 {
+	for (int i = 0; i < NUM_UPLOAD_BUFFERS; i++)
+		if (upload_fences[i])
+			glDeleteSync(upload_fences[i]);
+	glDeleteBuffers(NUM_UPLOAD_BUFFERS, upload_buffers);
+	glDeleteTextures(1, &frame_texture);
 	glfwDestroyWindow(window);
 	glfwTerminate();
 }
@@ -368,11 +406,127 @@ int get_screen_h(void)
 	return screen_h;
 }
 
-void move_frame_to_the_gpu(int w, int h, Vector3 *data)
+static int pixel_type(void)
+{
+	return display.format == DISPLAY_RGBA8 ? GL_UNSIGNED_BYTE : GL_HALF_FLOAT;
+}
+
+void set_display_settings(const DisplaySettings *settings)
+{
+	display = *settings;
+
+	glUseProgram(screen_program);
+	set_uniform_i(screen_program, "gpuTonemap", display.gpu_tonemap);
+	set_uniform_i(screen_program, "tonemap",    display.tonemap);
+	set_uniform_f(screen_program, "exposure",   display.exposure);
+	set_uniform_i(screen_program, "srgb",       display.srgb);
+	glUseProgram(0);
+
+	// Force the texture to be recreated with the new format
+	texture_w = 0;
+	texture_h = 0;
+}
+
+static void wait_upload_fence(int i)
+{
+	if (upload_fences[i]) {
+		glClientWaitSync(upload_fences[i], GL_SYNC_FLUSH_COMMANDS_BIT, UINT64_MAX);
+		glDeleteSync(upload_fences[i]);
+		upload_fences[i] = 0;
+	}
+}
+
+// Allocates the frame texture and the upload buffers for
+// frames of the given size. The texture storage is immutable,
+// so it's recreated when the size changes.
+static void resize_frame_texture(int w, int h)
+{
+	if (w == texture_w && h == texture_h)
+		return;
+
+	glDeleteTextures(1, &frame_texture);
+	glGenTextures(1, &frame_texture);
+	glBindTexture(GL_TEXTURE_2D, frame_texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	int internal_format = display.format == DISPLAY_RGBA8 ? GL_RGBA8 : GL_RGBA16F;
+	if (GLAD_GL_VERSION_4_2)
+		glTexStorage2D(GL_TEXTURE_2D, 1, internal_format, w, h);
+	else
+		glTexImage2D(GL_TEXTURE_2D, 0, internal_format, w, h, 0, GL_RGBA, pixel_type(), NULL);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	for (int i = 0; i < NUM_UPLOAD_BUFFERS; i++) {
+		wait_upload_fence(i);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload_buffers[i]);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, display_pixel_size(display.format) * w * h, NULL, GL_STREAM_DRAW);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	texture_w = w;
+	texture_h = h;
+}
+
+void *begin_frame_upload(int w, int h)
 {
+	resize_frame_texture(w, h);
+
+	// The buffer was last used NUM_UPLOAD_BUFFERS frames ago, so
+	// this usually doesn't need to wait. Since the fence guarantees
+	// the GPU isn't reading from it, the buffer can be mapped without
+	// synchronizing with the driver.
+	wait_upload_fence(upload_index);
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload_buffers[upload_index]);
+	void *data = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, display_pixel_size(display.format) * w * h,
+		GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_FLUSH_EXPLICIT_BIT);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	if (data == NULL)
+		fprintf(stderr, "Couldn't map the frame upload buffer\n");
+	return data;
+}
+
+void end_frame_upload(const FrameRect *rects, int num_rects)
+{
+	int pixel_size = display_pixel_size(display.format);
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload_buffers[upload_index]);
+
+	// Only the ranges of the buffer spanned by the regions were written
+	for (int i = 0; i < num_rects; i++) {
+		FrameRect r = rects[i];
+		glFlushMappedBufferRange(GL_PIXEL_UNPACK_BUFFER,
+			(r.y * texture_w + r.x) * pixel_size,
+			((r.h - 1) * texture_w + r.w) * pixel_size);
+	}
+	glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+	if (num_rects == 0) {
+		// Nothing to upload. The buffer can be reused right away.
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		return;
+	}
+
+	// With a pixel buffer bound the data pointer is an offset in
+	// the buffer and the copy is performed asynchronously by the GPU.
+	// The buffer holds whole rows of the frame, so each region is
+	// copied from its position in the frame.
 	glBindTexture(GL_TEXTURE_2D, frame_texture);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, w, h, 0, GL_RGB, GL_FLOAT, data);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, texture_w);
+	for (int i = 0; i < num_rects; i++) {
+		FrameRect r = rects[i];
+		glTexSubImage2D(GL_TEXTURE_2D, 0, r.x, r.y, r.w, r.h, GL_RGBA, pixel_type(),
+			(void*) (intptr_t) ((r.y * texture_w + r.x) * pixel_size));
+	}
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
 	glBindTexture(GL_TEXTURE_2D, 0);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	upload_fences[upload_index] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	upload_index = (upload_index + 1) % NUM_UPLOAD_BUFFERS;
 }
 
 void draw_frame(void)
@@ -389,9 +543,4 @@ void draw_frame(void)
 
 	glfwSwapBuffers(window);
 	glfwPollEvents();
-
-	if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS) { push_event(EVENT_PRESS_W); }
-	if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS) { push_event(EVENT_PRESS_A); }
-	if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS) { push_event(EVENT_PRESS_S); }
-	if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS) { push_event(EVENT_PRESS_D); }
 }
\ No newline at end of file
@@ -1,4 +1,8 @@
+#ifndef GPU_AND_WINDOWING_INCLUDED
+#define GPU_AND_WINDOWING_INCLUDED
+
 #include <stdint.h>
+#include <stdbool.h>
 #include "vector.h"
 
 typedef struct {
@@ -15,25 +19,58 @@ typedef enum {
 	CF_BOTTOM,
 } CubeFace;
 
+typedef enum {
+	TONEMAP_NONE,     // Values above 1 are clamped
+	TONEMAP_REINHARD,
+	TONEMAP_ACES,
+} Tonemap;
+
+// Format of the pixels sent to the GPU
+typedef enum {
+	DISPLAY_RGBA8,
+	DISPLAY_RGBA16F,
+} DisplayFormat;
+
+// How the averaged (linear and HDR) pixels of the accumulation
+// buffer are turned into displayable colors
+typedef struct {
+	float         exposure;
+	Tonemap       tonemap;
+	bool          srgb;
+	DisplayFormat format;
+
+	// If set, the pixels are uploaded as they are and exposure,
+	// tonemapping and sRGB encoding are applied by the fragment
+	// shader. Requires the RGBA16F format.
+	bool gpu_tonemap;
+} DisplaySettings;
+
+// Discrete events that need to be handled one by one. Continuous
+// input (mouse motion and held keys) isn't queued but merged into
+// an InputState once per frame.
 enum {
 	EVENT_EMPTY = 0,
 	EVENT_CLOSE,
 	EVENT_PRESS_SPACE,
 	EVENT_PRESS_ESC,
-	EVENT_PRESS_W,
-	EVENT_PRESS_A,
-	EVENT_PRESS_S,
-	EVENT_PRESS_D,
-	EVENT_AGAIN_SPACE,
-	EVENT_AGAIN_ESC,
-	EVENT_AGAIN_W,
-	EVENT_AGAIN_A,
-	EVENT_AGAIN_S,
-	EVENT_AGAIN_D,
-	EVENT_MOVE_MOUSE,
 };
 
-int pop_event(double *mouse_x, double *mouse_y);
+typedef struct {
+
+	// Set if the cursor moved since the last poll. The
+	// position is the latest one reported by the system.
+	bool   mouse_moved;
+	double mouse_x;
+	double mouse_y;
+
+	// +1 or -1 while the keys that move the camera along
+	// each direction are held (W/S and D/A), 0 otherwise
+	int forward;
+	int right;
+} InputState;
+
+int  pop_event(void);
+void poll_input(InputState *input);
 
 void startup_window_and_opengl_context_or_exit(int window_w, int window_h, const char *title);
 void cleanup_window_and_opengl_context(void);
@@ -41,9 +78,32 @@ void cleanup_window_and_opengl_context(void);
 int get_screen_w(void);
 int get_screen_h(void);
 
-void move_frame_to_the_gpu(int w, int h, Vector3 *data);
+// Must be called before uploading frames
+void set_display_settings(const DisplaySettings *settings);
+
+static inline int display_pixel_size(DisplayFormat format)
+{
+	return format == DISPLAY_RGBA8 ? 4 : 8;
+}
+
+typedef struct {
+	int x, y;
+	int w, h;
+} FrameRect;
+
+// Uploading a frame is split in two parts. The first returns
+// the memory where the w by h pixels of the frame need to be
+// written (NULL on failure) in the display format and the second
+// sends them to the GPU without waiting for the transfer to complete.
+// Only the given regions are uploaded and need to be written. The
+// rest of the texture keeps the contents of previous frames.
+void *begin_frame_upload(int w, int h);
+void  end_frame_upload(const FrameRect *rects, int num_rects);
 void draw_frame(void);
 
 void    load_cubemap(Cubemap *c, const char *files[6]);
 void    free_cubemap(Cubemap *c);
 Vector3 sample_cubemap(Cubemap *c, Vector3 dir);
+
+
+#endif
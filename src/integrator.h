@@ -0,0 +1,51 @@
+/*
+Copyright 2024 Francesco Cozzuto
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+associated documentation files (the “Software”), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial
+portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef INTEGRATOR_INCLUDED
+#define INTEGRATOR_INCLUDED
+
+#include <math.h>
+#include "vector.h"
+
+// Parameters of the path tracing estimator. They are shared by the
+// per-pixel integrator in main.c and the wavefront one so that both
+// converge to the same image.
+
+// Maximum number of bounces of a path
+#define MAX_BOUNCES 10
+
+// Number of rays traced towards the light source at each bounce
+#define LIGHT_SAMPLES 3
+
+// How much noise is added to the direction of the light samples.
+// The more noise the softer the shadows.
+#define LIGHT_SAMPLE_SPREAD 0.5f
+
+// Fraction of the path contribution that goes to the light samples
+#define LIGHT_SAMPLE_WEIGHT 0.05f
+
+// Secondary rays leave from slightly above the surface they
+// bounced off of to avoid hitting it again
+#define RAY_OFFSET 0.001f
+
+static inline Vector3 fresnel_schlick(float u, Vector3 f0)
+{
+	return combine(f0, combine(vec_from_scalar(1.0), f0, 1, -1), 1, pow(1.0 - u, 5.0));
+}
+
+#endif
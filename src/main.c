@@ -34,59 +34,240 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "camera.h"
 #include "scene.h"
 #include "gpu_and_windowing.h"
-
-typedef struct {
-	int column_i;
-} WorkerConfig;
+#include "integrator.h"
+#include "wavefront.h"
+#include "resolve.h"
+#include "pool.h"
+#include "scheduler.h"
 
 /////////////////////////////////////////////////////////////////////////////
 /// GLOBAL VARIABLES                                                      ///
 /////////////////////////////////////////////////////////////////////////////
 
-#define MAX_COLUMNS 32
+#define MAX_WORKERS 32
+
+// Maximum weight the history of a pixel can carry over a camera
+// move. Reprojected samples only approximate what the new view
+// would see, so they shouldn't outweigh fresh samples for long.
+#define MAX_HISTORY_WEIGHT 8
+
+// Relative difference between the expected and the stored depth
+// of a reprojected sample above which the sample is considered
+// disoccluded and is thrown away.
+#define DISOCCLUSION_TOLERANCE 0.05f
+
+// Minimum number of paths evaluated together by the wavefront
+// integrator. Bigger batches sort better but take longer to
+// notice that the frame was invalidated.
+#define WAVEFRONT_BATCH 4096
+
+// Coarsest resolution the frame time controller can pick and
+// how quickly its estimate of the cost of a pixel adapts.
+#define MAX_SCALE 16
+#define PIXEL_COST_SMOOTHING 0.25
+
+// Parameters of the joint bilateral upsampling of low resolution
+// passes. Depths are compared relative to the depth of the pixel
+// and the cosine between normals is raised to 2^SHARPNESS.
+#define UPSAMPLE_DEPTH_SIGMA 0.05f
+#define UPSAMPLE_NORMAL_SHARPNESS 3
+#define UPSAMPLE_MIN_WEIGHT 1e-4f
+
+// Minimum time between the snapshots of a scene read from a stream,
+// and how many times the cost of the last snapshot they are apart
+#define STREAM_PUBLISH_INTERVAL_NS 100000000
+#define STREAM_PUBLISH_COST_RATIO 4
+
+// Weight of the pixels skipped by an interleaved pass, which are
+// guessed from their neighbours. It's low enough that the history
+// of the accumulation buffer wins where there is one.
+#define INTERLEAVE_FILL_WEIGHT (1.0f / 64)
+
+// Patterns of pixels evaluated by interleaved passes
+typedef enum {
+	INTERLEAVE_NONE,
+	INTERLEAVE_CHECKER, // Two phases, alternate pixels of a checkerboard
+	INTERLEAVE_2X2,     // Four phases, one pixel of each 2x2 block
+} Interleave;
 
 // Parameters. These are set at startup and are
 // considered constant after that.
-int num_columns;
+int num_workers;
 int init_scale;
+bool use_wavefront;
+DisplaySettings display;
+int display_fps;
+float target_ms;
+Interleave interleave;
+bool foveate;
+float focus_x;
+float focus_y;
+TileOrder tile_order;
+bool show_stats;
+bool use_scene_cache;
+bool use_compressed_bvh;
+BVHBuildMethod reload_method;
+
+// The scene and background being rendered. The scene is never
+// modified once loaded. A scene read from a stream is instead
+// replaced by a bigger one every time more objects arrive, which
+// resets the frame like a camera change. Workers copy the pointer
+// along with the camera snapshot.
+const Scene *frame_scene;
+Cubemap      skybox;
+
+// Scenes that were replaced but may still be used by workers. They are
+// freed once every worker has refreshed its camera snapshot after the
+// generation they were replaced at. "worker_generations" holds the
+// generation of the snapshot cached by each worker, which stores it
+// after reading the snapshot. The retired scenes are guarded by the
+// frame lock.
+typedef struct {
+	const Scene *scene;
+	uint32_t     generation;
+} RetiredScene;
 
-// The scene and background being rendered.
-Scene   scene;
-Cubemap skybox;
+#define MAX_RETIRED_SCENES 64
+
+RetiredScene retired_scenes[MAX_RETIRED_SCENES];
+int          num_retired_scenes;
+_Atomic uint32_t worker_generations[MAX_WORKERS];
+
+// Reads the scene when it comes from a stream
+os_thread    loader;
+bool         loader_stopped;
 
 // Any time the accumulation buffer is reset or
 // resized, this is incremented.
 _Atomic uint32_t accum_generation = 0;
 
 // This is the "accumulation buffer". Workers evaluate
-// pixel colors in parallel and sum their results in here.
+// pixel colors in parallel and their results are summed in here.
 // When the main thread needs to draw a new frame it takes
 // these values and divides them by the frame count, averaging
-// the results of multiple frames.
+// the results of multiple frames. The accumulation, weight and
+// depth buffers belong to the main thread, which merges in them
+// what the workers published since the last frame.
 Vector3 *accum = NULL;
 
-// This is the "frame buffer". It's only accessed by the
-// main buffer to store the averaged values of the accumulation
-// buffer before sending them to the GPU.
-Vector3 *frame = NULL;
+// Per-pixel weight of the values stored in the accumulation
+// buffer. Lower resolution samples weigh less (half resolution
+// weighs 0.25) and reprojected samples carry the weight they had
+// in the previous view.
+float *accum_weights = NULL;
+
+// Distance from the camera of the first thing hit by the ray
+// of each pixel (INFINITY for the sky, negative if unknown).
+// It's used to reproject the accumulation buffer when the camera
+// moves.
+float *depth = NULL;
+
+// Accumulation, weight and depth buffers of the previous view.
+// They are swapped with the current ones when reprojecting.
+Vector3 *history_accum = NULL;
+float   *history_weights = NULL;
+float   *history_depth = NULL;
+
+// Depths of the previous view splatted into the new one when
+// reprojecting. Each pixel packs the sum of the weights of the
+// depths of the nearest surface that landed on it and the sum of
+// the weighted depths, so that rows can be splatted in parallel.
+// It's zero between reprojections.
+_Atomic uint64_t *splat_depth = NULL;
+
+// Sums of the samples of a frame that weren't merged in the
+// accumulation buffer yet. The depth is negative where there are
+// none.
+typedef struct {
+	Vector3 *accum;
+	float   *weights;
+	float   *depth;
+} SampleBuffer;
+
+// Workers add their samples to "published" while holding the frame
+// lock. The main thread swaps it with the empty "merging" buffer
+// and merges the samples outside of the lock, so workers never wait
+// for a frame to be resolved. "accum_cleared" tells the main thread
+// that the frame was reset since it last took the samples. Only the
+// main thread touches "merging".
+SampleBuffer published;
+SampleBuffer merging;
+bool         accum_cleared;
+
+// Camera the workers are rendering from. It's replaced (never
+// modified) every time the generation counter is incremented, so
+// the contents of the accumulation buffer always correspond to it.
+// It's guarded by the frame lock.
+CameraSnapshot camera;
+
+// Copies of the camera snapshots and the scene they were published
+// with, indexed by generation, that workers read without the lock.
+// A slot is written before the generation counter is incremented,
+// and is only written again after the counter moved on, so a copy
+// made while the counter didn't change is consistent.
+typedef struct {
+	CameraSnapshot camera;
+	const Scene   *scene;
+} PublishedSnapshot;
+
+#define SNAPSHOT_SLOTS 8
+
+PublishedSnapshot snapshots[SNAPSHOT_SLOTS];
 
-// Size of the accumulation and frame buffers
+// Size of the accumulation buffers. They are only changed
+// by the main thread.
 int frame_w = 0;
 int frame_h = 0;
 
+// The frame is divided in square tiles of this size. A tile is
+// dirty when its pixels in the accumulation buffer changed since
+// they were last resolved and sent to the GPU.
+#define TILE_SIZE 32
+
+// One flag per tile (row major). The tiles marked by the workers
+// are guarded by the frame lock and are moved to "tiles_to_resolve",
+// which only the main thread uses, when it takes their samples.
+bool *dirty_tiles = NULL;
+bool *tiles_to_resolve = NULL;
+int   tiles_x = 0;
+int   tiles_y = 0;
+
+// Regions of the frame resolved by "update_frame" that need to
+// be uploaded. There is at most one per tile.
+FrameRect *dirty_rects = NULL;
+
+// Runs the parallel loops of the main thread on the workers, which
+// join them between their own jobs. It has no threads of its own so
+// that the cores aren't oversubscribed.
+Pool pool;
+
 // This guards the critical section around the accumulation buffer.
 os_mutex_t frame_mutex;
 
-// One condition variable per column. Any time new information
-// is added to the accumulation buffer the condition of the
-// associated column is signaled
-os_condvar_t accum_conds[MAX_COLUMNS];
+// Hands out the tiles of the frame to the workers. It's reset
+// every time the camera snapshot is published.
+TileScheduler scheduler;
+
+// Statistics printed with --stats. The cache counters and samples are
+// summed by the workers and reset when printed. The time the frame was
+// reset and the number of tiles that haven't completed their first pass
+// since then are guarded by the frame lock.
+_Atomic uint64_t stat_cache_misses;
+_Atomic uint64_t stat_cache_references;
+_Atomic uint64_t stat_samples;
+uint64_t frame_reset_time;
+int      preview_tiles_left;
+
+// Samples of a pass over a tile, one for each "scale" by "scale"
+// block of pixels. Each one is evaluated at the first pixel of its
+// block and stores the depth and normal of the first hit, which
+// guide the reconstruction of the full resolution tile.
+typedef struct {
+	Vector3 color [RENDER_TILE_SIZE * RENDER_TILE_SIZE];
+	float   depth [RENDER_TILE_SIZE * RENDER_TILE_SIZE];
+	Vector3 normal[RENDER_TILE_SIZE * RENDER_TILE_SIZE];
+} TileSamples;
 
-// Counters that indicate how much information each column
-// is storing. An integer value of N means N full frames have 
-// been accumulated. Lower resolution frames contribute lower
-// values (half resolution weighs 0.25).
-float accum_counts[MAX_COLUMNS];
 
 /////////////////////////////////////////////////////////////////////////////
 /// FUNCTION PROTOTYPES                                                   ///
@@ -97,53 +278,492 @@ void    stop_workers(void);
 
 bool    quitting(void);
 void    screenshot(void);
-void    parse_arguments_or_exit(int argc, char **argv, int *num_columns, int *init_scale, char **scene_file);
+void    parse_arguments_or_exit(int argc, char **argv, int *num_workers, int *init_scale, bool *use_wavefront, DisplaySettings *display, int *display_fps, float *target_ms, Interleave *interleave, bool *foveate, float *focus_x, float *focus_y, TileOrder *tile_order, bool *show_stats, bool *use_scene_cache, bool *use_compressed_bvh, BVHBuildMethod *reload_method, char **scene_file);
 
-Vector3 pixel(float x, float y, float aspect_ratio);
+Vector3 pixel(Ray in_ray, HitInfo hit, float *depth, const Scene *scene);
 void    update_frame(void);
-float   render_column(Vector3 *data, int scale, int column_w, int column_i, int frame_w, int frame_h, uint64_t cached_generation);
+void    render_tile(TileSamples *samples, int scale, Tile tile, const CameraSnapshot *cam, const Scene *scene, Wavefront *wavefront, Interleave pattern, int phase);
+void    reconstruct_tile(const TileSamples *samples, Vector3 *data, float *data_depth, Vector3 *data_normal, int scale, Tile tile, const CameraSnapshot *cam, const Scene *scene);
 void    invalidate_accumulation(void);
+void    reproject_accumulation(void);
+void    publish_camera(void);
+void    mark_tiles_dirty(int x, int y, int w, int h);
+void    replace_scene(const Scene *scene);
+void    reload_scene(char *file);
+void    free_retired_scenes(bool all);
 
 os_threadreturn worker(void *arg);
+os_threadreturn load_scene_stream(void *arg);
 
 /////////////////////////////////////////////////////////////////////////////
 /// IMPLEMENTATION                                                        ///
 /////////////////////////////////////////////////////////////////////////////
 
+// Area of the frame covered by the tile (i, j)
+static FrameRect tile_rect(int i, int j)
+{
+	FrameRect rect;
+	rect.x = i * TILE_SIZE;
+	rect.y = j * TILE_SIZE;
+	rect.w = TILE_SIZE;
+	rect.h = TILE_SIZE;
+	if (rect.w > frame_w - rect.x) rect.w = frame_w - rect.x;
+	if (rect.h > frame_h - rect.y) rect.h = frame_h - rect.y;
+	return rect;
+}
+
+// Removes the samples of a tile from the buffer
+static void clear_tile_samples(SampleBuffer *buffer, int i, int j)
+{
+	FrameRect rect = tile_rect(i, j);
+	for (int y = rect.y; y < rect.y + rect.h; y++) {
+		int offset = y * frame_w + rect.x;
+		memset(buffer->accum + offset, 0, sizeof(Vector3) * rect.w);
+		memset(buffer->weights + offset, 0, sizeof(float) * rect.w);
+		for (int x = 0; x < rect.w; x++)
+			buffer->depth[offset + x] = -1;
+	}
+}
+
+// Must be executed while holding the frame lock. Only the samples
+// published since the main thread last took them are dropped here
+// (they can only be in dirty tiles). The main thread clears the
+// accumulation buffer when it takes the next ones.
+static void clear_accumulation(void)
+{
+	for (int j = 0; j < tiles_y; j++)
+		for (int i = 0; i < tiles_x; i++)
+			if (dirty_tiles[j * tiles_x + i])
+				clear_tile_samples(&published, i, j);
+	accum_cleared = true;
+	mark_tiles_dirty(0, 0, frame_w, frame_h);
+	publish_camera();
+}
+
+// Takes the samples published by the workers, leaving them the empty
+// buffer, and moves the dirty tiles to the ones the main thread needs
+// to resolve. Returns whether the frame was reset since the samples
+// were last taken. Must be called by the main thread while holding
+// the frame lock, and followed by "merge_samples".
+static bool take_published_samples(void)
+{
+	SampleBuffer tmp = published;
+	published = merging;
+	merging = tmp;
+
+	for (int i = 0; i < tiles_x * tiles_y; i++) {
+		tiles_to_resolve[i] |= dirty_tiles[i];
+		dirty_tiles[i] = false;
+	}
+
+	bool cleared = accum_cleared;
+	accum_cleared = false;
+	return cleared;
+}
+
+// Merges the samples of the rows of tiles in [begin, end) in the
+// accumulation buffer and empties them
+static void merge_tile_rows(void *data, int begin, int end)
+{
+	(void) data;
+	for (int j = begin; j < end; j++)
+		for (int i = 0; i < tiles_x; i++) {
+
+			if (!tiles_to_resolve[j * tiles_x + i])
+				continue;
+
+			FrameRect rect = tile_rect(i, j);
+			for (int y = rect.y; y < rect.y + rect.h; y++)
+				for (int x = rect.x; x < rect.x + rect.w; x++) {
+					int index = y * frame_w + x;
+					accum[index] = combine(accum[index], merging.accum[index], 1, 1);
+					accum_weights[index] += merging.weights[index];
+					if (merging.depth[index] >= 0)
+						depth[index] = merging.depth[index];
+				}
+			clear_tile_samples(&merging, i, j);
+		}
+}
+
+// Adds the samples taken by "take_published_samples" to the
+// accumulation buffer, which is cleared first if the frame was
+// reset. Only called by the main thread, without the lock.
+static void merge_samples(bool cleared)
+{
+	if (cleared) {
+		memset(accum, 0, sizeof(Vector3) * frame_w * frame_h);
+		memset(accum_weights, 0, sizeof(float) * frame_w * frame_h);
+		for (int i = 0; i < frame_w * frame_h; i++)
+			depth[i] = -1;
+	}
+	parallel_for(&pool, tiles_y, 1, merge_tile_rows, NULL);
+}
+
 // Resets the current frame and accumulation buffers and tells
 // every worker to drop what they are doing and start again.
 void invalidate_accumulation(void)
 {
 	os_mutex_lock(&frame_mutex);
-	for (int i = 0; i < num_columns; i++)
-		accum_counts[i] = 0;
-	atomic_fetch_add(&accum_generation, 1);
-	memset(accum, 0, sizeof(Vector3) * frame_w * frame_h);
-	memset(frame, 0, sizeof(Vector3) * frame_w * frame_h);
+	clear_accumulation();
 	os_mutex_unlock(&frame_mutex);
 }
 
-Vector3 fresnel_schlick(float u, Vector3 f0)
+// Frees the retired scenes no worker can be using anymore, or all
+// of them when the workers are stopped. Must be called while holding
+// the frame lock.
+void free_retired_scenes(bool all)
 {
-	return combine(f0, combine(vec_from_scalar(1.0), f0, 1, -1), 1, pow(1.0 - u, 5.0));
+	int kept = 0;
+	for (int i = 0; i < num_retired_scenes; i++) {
+		bool in_use = false;
+		for (int k = 0; k < num_workers && !all; k++)
+			if ((int32_t) (worker_generations[k] - retired_scenes[i].generation) < 0)
+				in_use = true;
+		if (in_use)
+			retired_scenes[kept++] = retired_scenes[i];
+		else
+			free_scene(retired_scenes[i].scene);
+	}
+	num_retired_scenes = kept;
 }
 
-Vector3 pixel(float x, float y, float aspect_ratio)
+// Makes the workers render a new scene. The frame is reset since
+// anything may have changed. Must be called while holding the frame
+// lock.
+void replace_scene(const Scene *scene)
 {
-	assert(!isnan(aspect_ratio));
+	// Workers that are slow to pick up the new snapshot
+	// keep old scenes alive, so wait for them if needed
+	free_retired_scenes(false);
+	while (num_retired_scenes == MAX_RETIRED_SCENES) {
+		os_mutex_unlock(&frame_mutex);
+		sleep_ms(1);
+		os_mutex_lock(&frame_mutex);
+		free_retired_scenes(false);
+	}
 
-	Ray in_ray = ray_through_screen_at(x, y, aspect_ratio);
-	assert(!isnanv(in_ray.direction));
+	const Scene *old = frame_scene;
+	frame_scene = scene;
 
-	// Find a light source. This is kind of lazy as we should
-	// sample every light source in the scene.
-	int light_index = -1;
-	for (int i = 0; i < scene.num_objects; i++) {
-		if (scene.objects[i].material.emission_power > 0) {
-			light_index = i;
+	// Before the first frame there is nothing to reset
+	if (accum)
+		clear_accumulation();
+	retired_scenes[num_retired_scenes++] = (RetiredScene) { old, camera.generation };
+}
+
+// Called when the scene file was modified. The frame is only reset
+// if the objects actually changed. Only the main thread replaces
+// scenes that don't come from a stream, so the current one can be
+// read without the lock.
+void reload_scene(char *file)
+{
+	uint64_t start = get_relative_time_ns();
+
+	SceneChange change;
+	Scene *scene = reload_scene_file(frame_scene, file, &pool, reload_method, &change);
+	if (scene == NULL)
+		return;
+	if (use_compressed_bvh)
+		compress_scene_bvhs(scene);
+
+	os_mutex_lock(&frame_mutex);
+	replace_scene(scene);
+	os_mutex_unlock(&frame_mutex);
+
+	const char *what = "rebuilt";
+	if (change == SCENE_MATERIALS_CHANGED) what = "materials changed";
+	if (change == SCENE_REFITTED)          what = "refitted";
+	fprintf(stderr, "Scene reloaded (%d objects, %d instances, %s, %.1f ms)\n", scene->num_objects, scene->num_instances, what,
+		(get_relative_time_ns() - start) / 1e6);
+}
+
+// Reads the scene stream, publishing what was read so far every time
+// more objects are complete. Building the scene costs more as it
+// grows, so snapshots are taken less often for bigger scenes to keep
+// that cost a fraction of the time spent reading.
+os_threadreturn load_scene_stream(void *arg)
+{
+	SceneStream *stream = arg;
+
+	uint64_t last_publish = get_relative_time_ns();
+	uint64_t publish_cost = 0;
+	int      published_objects = 0;
+	for (;;) {
+
+		bool more = read_scene_stream(stream);
+		if (stream->num_objects == published_objects) {
+			if (more)
+				continue;
 			break;
 		}
+
+		uint64_t now = get_relative_time_ns();
+		uint64_t interval = STREAM_PUBLISH_COST_RATIO * publish_cost;
+		if (interval < STREAM_PUBLISH_INTERVAL_NS)
+			interval = STREAM_PUBLISH_INTERVAL_NS;
+		if (more && now - last_publish < interval)
+			continue;
+
+		Scene *scene = snapshot_scene_stream(stream);
+		if (scene == NULL)
+			break;
+		if (use_compressed_bvh)
+			compress_scene_bvhs(scene);
+		last_publish = get_relative_time_ns();
+		publish_cost = last_publish - now;
+		published_objects = scene->num_objects;
+
+		os_mutex_lock(&frame_mutex);
+		if (loader_stopped) {
+			os_mutex_unlock(&frame_mutex);
+			free_scene(scene);
+			break;
+		}
+		replace_scene(scene);
+		os_mutex_unlock(&frame_mutex);
+
+		if (!more)
+			break;
+	}
+
+	if (!stream->failed)
+		fprintf(stderr, "Scene stream ended (%d objects)\n", stream->num_objects);
+	close_scene_stream(stream);
+	return 0;
+}
+
+// Must be executed while holding the frame lock
+void mark_tiles_dirty(int x, int y, int w, int h)
+{
+	int tx0 = x / TILE_SIZE;
+	int ty0 = y / TILE_SIZE;
+	int tx1 = (x + w + TILE_SIZE - 1) / TILE_SIZE;
+	int ty1 = (y + h + TILE_SIZE - 1) / TILE_SIZE;
+	for (int j = ty0; j < ty1; j++)
+		for (int i = tx0; i < tx1; i++)
+			dirty_tiles[j * tiles_x + i] = true;
+}
+
+// Replaces the camera snapshot used by the workers and tells them
+// to drop what they are doing. Must be called while holding the
+// frame lock.
+void publish_camera(void)
+{
+	camera = take_camera_snapshot(frame_w, frame_h);
+	camera.generation = atomic_load(&accum_generation) + 1;
+	snapshots[camera.generation % SNAPSHOT_SLOTS] = (PublishedSnapshot) { camera, frame_scene };
+	atomic_store(&accum_generation, camera.generation);
+	reset_scheduler(&scheduler, frame_w, frame_h, camera.generation);
+	frame_reset_time = get_relative_time_ns();
+	preview_tiles_left = scheduler.num_tiles;
+}
+
+// Buffers and views between which the accumulation buffer is
+// reprojected
+typedef struct {
+	CameraSnapshot old_camera;
+	CameraSnapshot new_camera;
+	const Vector3 *old_accum;
+	const float   *old_weights;
+	const float   *old_depth;
+	Vector3       *new_accum;
+	float         *new_weights;
+	float         *new_depth;
+} Reprojection;
+
+static uint64_t pack_splat(float weight, float weighted_depth)
+{
+	uint32_t a, b;
+	memcpy(&a, &weight, sizeof(a));
+	memcpy(&b, &weighted_depth, sizeof(b));
+	return (uint64_t) a << 32 | b;
+}
+
+static void unpack_splat(uint64_t packed, float *weight, float *weighted_depth)
+{
+	uint32_t a = packed >> 32;
+	uint32_t b = packed;
+	memcpy(weight, &a, sizeof(a));
+	memcpy(weighted_depth, &b, sizeof(b));
+}
+
+// Adds a depth with the given weight to a pixel of the splatted
+// depths. Depths of a surface nearer than the one already there
+// replace it, the ones of a surface further away are discarded.
+static void splat(int index, float w, float t)
+{
+	_Atomic uint64_t *pixel = &splat_depth[index];
+	uint64_t old = atomic_load_explicit(pixel, memory_order_relaxed);
+	for (;;) {
+		float sum_w, sum_wt;
+		unpack_splat(old, &sum_w, &sum_wt);
+
+		uint64_t packed;
+		if (sum_w == 0 || t < sum_wt / sum_w * (1 - DISOCCLUSION_TOLERANCE))
+			packed = pack_splat(w, w * t);
+		else if (t <= sum_wt / sum_w * (1 + DISOCCLUSION_TOLERANCE))
+			packed = pack_splat(sum_w + w, sum_wt + w * t);
+		else
+			return;
+
+		if (atomic_compare_exchange_weak_explicit(pixel, &old, packed, memory_order_relaxed, memory_order_relaxed))
+			return;
 	}
+}
+
+// Forward pass over the rows in [begin, end) of the old view: splat
+// the old depths over the 2x2 pixels around where they land in the
+// new view, with bilinear weights, to avoid cracks when surfaces get
+// closer to the camera.
+static void splat_rows(void *data, int begin, int end)
+{
+	const Reprojection *r = data;
+	for (int j = begin; j < end; j++)
+		for (int i = 0; i < frame_w; i++) {
+
+			int old_index = j * frame_w + i;
+			float t = r->old_depth[old_index];
+			if (r->old_weights[old_index] == 0 || t < 0)
+				continue;
+
+			Vector3 offset = snapshot_point(&r->old_camera, i, j, t, r->new_camera.pos);
+
+			float px, py;
+			if (!snapshot_project(&r->new_camera, offset, &px, &py))
+				continue;
+			if (px <= -1 || px >= frame_w || py <= -1 || py >= frame_h)
+				continue;
+
+			float new_t = isinf(t) ? t : norm_of(offset);
+			float x0 = floorf(px);
+			float y0 = floorf(py);
+			float tx = px - x0;
+			float ty = py - y0;
+			float bilinear[4] = {
+				(1 - tx) * (1 - ty),
+				tx * (1 - ty),
+				(1 - tx) * ty,
+				tx * ty,
+			};
+			for (int g = 0; g < 2; g++)
+				for (int k = 0; k < 2; k++) {
+					int x = x0 + k;
+					int y = y0 + g;
+					float w = bilinear[g * 2 + k];
+					if (x < 0 || x >= frame_w || y < 0 || y >= frame_h || w == 0)
+						continue;
+					splat(y * frame_w + x, w, new_t);
+				}
+		}
+}
+
+// Backward pass over the rows in [begin, end) of the new view: fetch
+// the history of each new pixel at the depth splatted on it. The
+// splatted depths are cleared for the next reprojection.
+static void gather_rows(void *data, int begin, int end)
+{
+	const Reprojection *r = data;
+	for (int j = begin; j < end; j++)
+		for (int i = 0; i < frame_w; i++) {
+
+			int new_index = j * frame_w + i;
+			r->new_accum[new_index] = (Vector3) {0, 0, 0};
+			r->new_weights[new_index] = 0;
+			r->new_depth[new_index] = -1;
+
+			float sum_w, sum_wt;
+			unpack_splat(atomic_exchange_explicit(&splat_depth[new_index], 0, memory_order_relaxed), &sum_w, &sum_wt);
+			if (sum_w == 0)
+				continue;
+			float t = sum_wt / sum_w;
+
+			Vector3 offset = snapshot_point(&r->new_camera, i, j, t, r->old_camera.pos);
+
+			float px, py;
+			if (!snapshot_project(&r->old_camera, offset, &px, &py))
+				continue;
+
+			int x = floorf(px + 0.5f);
+			int y = floorf(py + 0.5f);
+			if (x < 0 || x >= frame_w || y < 0 || y >= frame_h)
+				continue;
+
+			int old_index = y * frame_w + x;
+			float old_t = r->old_depth[old_index];
+			float old_w = r->old_weights[old_index];
+			if (old_w == 0 || old_t < 0)
+				continue;
+
+			bool rejected;
+			if (isinf(t))
+				rejected = !isinf(old_t);
+			else {
+				float expected_t = norm_of(offset);
+				rejected = isinf(old_t) || absf(old_t - expected_t) > DISOCCLUSION_TOLERANCE * expected_t;
+			}
+			if (rejected)
+				continue;
+
+			float w = minf(old_w, MAX_HISTORY_WEIGHT);
+			r->new_accum[new_index] = scalev(r->old_accum[old_index], w / old_w);
+			r->new_weights[new_index] = w;
+			r->new_depth[new_index] = t;
+		}
+}
+
+// Called when the camera moves. Instead of throwing away everything
+// that was accumulated, move the samples of the previous view to
+// where they are seen from the new camera position.
+//
+// This is done in two steps. First the depth of each old pixel is
+// splatted into the new view, which gives us an estimate of the depth
+// buffer of the new view. Then each new pixel is projected back into
+// the old view using that depth. If the depth stored in the old view
+// doesn't match, the surface wasn't visible before (it was disoccluded)
+// and the sample is rejected. Both passes run on the threads of the
+// pool and write the new view in the history buffers, which are then
+// swapped with the current ones.
+void reproject_accumulation(void)
+{
+	Reprojection r;
+
+	os_mutex_lock(&frame_mutex);
+	bool cleared = take_published_samples();
+	r.old_camera = camera;
+	publish_camera();
+	r.new_camera = camera;
+	mark_tiles_dirty(0, 0, frame_w, frame_h);
+	os_mutex_unlock(&frame_mutex);
+
+	// The samples of the old view that weren't merged yet are
+	// reprojected with the others. The accumulation buffer belongs
+	// to this thread, so the workers can start publishing samples
+	// of the new view meanwhile.
+	merge_samples(cleared);
+
+	r.old_accum   = accum;
+	r.old_weights = accum_weights;
+	r.old_depth   = depth;
+	r.new_accum   = history_accum;
+	r.new_weights = history_weights;
+	r.new_depth   = history_depth;
+	parallel_for(&pool, frame_h, 1, splat_rows, &r);
+	parallel_for(&pool, frame_h, 1, gather_rows, &r);
+
+	Vector3 *tmp0 = accum;         accum         = history_accum;   history_accum   = tmp0;
+	float   *tmp1 = accum_weights; accum_weights = history_weights; history_weights = tmp1;
+	float   *tmp2 = depth;         depth         = history_depth;   history_depth   = tmp2;
+}
+
+// Evaluates the color seen by a primary ray. The first hit of the
+// ray is computed by the caller, which may trace primary rays in
+// packets.
+Vector3 pixel(Ray in_ray, HitInfo hit, float *depth, const Scene *scene)
+{
+	assert(!isnanv(in_ray.direction));
+
+	// Find a light source
+	int light_index = find_light_source(scene);
 
 	// Keep track of how much of the light ray has been
 	// absorbed while bouncing around
@@ -152,13 +772,13 @@ Vector3 pixel(float x, float y, float aspect_ratio)
 	// Keep track of the final luminosity
 	Vector3 result = {0, 0, 0};
 
-	// Maximum number of bounces of the ray
-	int bounces = 10;
-
-	for (int i = 0; i < bounces; i++) {
+	for (int i = 0; i < MAX_BOUNCES; i++) {
 
 		// Find the next collision
-		HitInfo hit = trace_ray(in_ray, &scene);
+		if (i == 0)
+			*depth = hit_depth(in_ray, hit);
+		else
+			hit = trace_ray(in_ray, scene);
 		if (hit.object == -1) {
 			// The ray flew straight out of the scene!
 			//
@@ -181,25 +801,23 @@ Vector3 pixel(float x, float y, float aspect_ratio)
 		if (light_index != -1) {
 
 			// Direction from the current collusion point to the light source
-			Vector3 dir_to_light_source = combine(origin_of(scene.objects[light_index]), hit.point, 1, -1);
+			Vector3 dir_to_light_source = combine(origin_of(scene->objects[light_index]), hit.point, 1, -1);
 
 			// Now trace multiple rays to the light sources with some noise in
 			// the direction. The more rays we evaluate the softer the shadows.
-			float spread = 0.5;
-			int max_samples = 3;
 			int num_samples = 0;
-			for (int k = 0; k < max_samples; k++) {
+			for (int k = 0; k < LIGHT_SAMPLES; k++) {
 
 				Vector3 rand_dir = random_direction();
 				if (dotv(rand_dir, hit.normal) <= 0)
 					continue;
 
-				Vector3 sample_dir = normalize(combine(rand_dir, dir_to_light_source, spread, 1));
-				Ray     sample_ray = { combine(hit.point, sample_dir, 1, 0.001), sample_dir };
+				Vector3 sample_dir = normalize(combine(rand_dir, dir_to_light_source, LIGHT_SAMPLE_SPREAD, 1));
+				Ray     sample_ray = { combine(hit.point, sample_dir, 1, RAY_OFFSET), sample_dir };
 
-				HitInfo hit2 = trace_ray(sample_ray, &scene);
+				HitInfo hit2 = trace_ray(sample_ray, scene);
 				if (hit2.object != -1) {
-					Material material = scene.objects[hit2.object].material;
+					Material material = scene->objects[hit2.object].material;
 					sampled_light_color = combine(sampled_light_color, material.emission_color, 1, material.emission_power);
 				}
 
@@ -209,7 +827,7 @@ Vector3 pixel(float x, float y, float aspect_ratio)
 				sampled_light_color = scalev(sampled_light_color, 1.0f / num_samples);
 		}
 
-		Material material = scene.objects[hit.object].material;
+		Material material = scene->objects[hit.object].material;
 
 		Vector3 v = scalev(in_ray.direction, -1);
 		Vector3 n = hit.normal;
@@ -247,170 +865,637 @@ Vector3 pixel(float x, float y, float aspect_ratio)
 			out_dir = rand_dir;
 			contrib = mulv(contrib, scalev(material.albedo, (1 - material.metallic)));
 		}
-		Ray out_ray = { combine(hit.point, out_dir, 1, 0.001), out_dir };
+		Ray out_ray = { combine(hit.point, out_dir, 1, RAY_OFFSET), out_dir };
 
 		// Now we can add the light sampling contribution
 		//
 		// In a way what we did with light sampling is split our ray into two,
 		// one going towards the light and the other bouncing as usual. Therefore
 		// we need to reduce the contribution of the "main" ray.
-		float light_sample_weight = 0.05;
 		if (!iszerov(sampled_light_color)) {
-			result = combine(result, mulv(sampled_light_color, contrib), 1, light_sample_weight);
-			contrib = scalev(contrib, 1 - light_sample_weight);
+			result = combine(result, mulv(sampled_light_color, contrib), 1, LIGHT_SAMPLE_WEIGHT);
+			contrib = scalev(contrib, 1 - LIGHT_SAMPLE_WEIGHT);
 		}
 
 		in_ray = out_ray;
 	}
 
-	// Saturate the result so it's a valid color
-	result.x = clamp(result.x, 0, 1);
-	result.y = clamp(result.y, 0, 1);
-	result.z = clamp(result.z, 0, 1);
-
+	// The result is not clamped. Colors are accumulated in HDR
+	// and only tonemapped when the frame is displayed.
 	return result;
 }
 
-float render_column(Vector3 *data, int scale, int column_w, int column_i, int frame_w, int frame_h, uint64_t cached_generation)
-{
-	// Since we're rendering at lower resolution, the weight of the
-	// pixels we produce is also reduced.
-	float scale2inv = 1.0f / (scale * scale);
-
-	int column_x = column_w * column_i;
-	float aspect_ratio = (float) frame_w / frame_h;
-
-	// Just lower resolution version of each variable 
-	int lowres_frame_w = frame_w / scale;
-	int lowres_frame_h = frame_h / scale;
-	int lowres_column_w = column_w / scale + 1;
-	int lowres_column_x = column_x / scale;
-
-	// Iterate over each low resolution pixel
-	for (int j = 0; j < lowres_frame_h; j++) {
-		for (int i = 0; i < lowres_column_w; i++) {
-
-			float u = (float) (lowres_column_x + i) / (lowres_frame_w - 1);
-			float v = (float) j  / (lowres_frame_h - 1);
-			u = 1 - u;
-			v = 1 - v;
-
-			// Now copy the value of the single low resolution
-			// pixel into a square of high resolution pixels
-			int tile_w = scale;
-			int tile_h = scale;
-			if (tile_w > column_w - i * scale)
-				tile_w = column_w - i * scale;
-			Vector3 color = pixel(u, v, aspect_ratio);
-			for (int g = 0; g < tile_h; g++)
-				for (int t = 0; t < tile_w; t++) {
-					int pixel_index = (j * scale + g) * column_w + (i * scale + t);
-					assert(pixel_index >= 0 && pixel_index < column_w * frame_h);
-					data[pixel_index] = scalev(color, 1);
+// Evaluates the paths queued in the wavefront and stores their colors.
+// The depth and normal of each sample were stored when the path was queued.
+static void flush_wavefront(Wavefront *wavefront, TileSamples *samples, const Scene *scene)
+{
+	wavefront_run(wavefront, scene, &skybox);
+	for (int i = 0; i < wavefront->num_results; i++)
+		samples->color[wavefront->tags[i]] = wavefront->results[i];
+}
+
+static int count_interleave_phases(Interleave pattern)
+{
+	switch (pattern) {
+		case INTERLEAVE_NONE   : return 1;
+		case INTERLEAVE_CHECKER: return 2;
+		case INTERLEAVE_2X2    : return 4;
+	}
+	return 1;
+}
+
+// Whether a pixel is evaluated by the given phase of an interleaved
+// pass. The first two phases of the 2x2 pattern are diagonal so that
+// they form a checkerboard together.
+static bool in_interleave_phase(int x, int y, Interleave pattern, int phase)
+{
+	static const int order_2x2[4] = {0, 3, 1, 2};
+	switch (pattern) {
+		case INTERLEAVE_NONE   : return true;
+		case INTERLEAVE_CHECKER: return (x + y) % 2 == phase;
+		case INTERLEAVE_2X2    : return (x % 2) + 2 * (y % 2) == order_2x2[phase];
+	}
+	return true;
+}
+
+// With an interleaved pattern only the pixels of its "phase" are
+// evaluated, but the primary rays of all pixels are traced so that
+// their depth and normal are known. Interleaving is only supported
+// at full resolution.
+void render_tile(TileSamples *samples, int scale, Tile tile, const CameraSnapshot *cam, const Scene *scene, Wavefront *wavefront, Interleave pattern, int phase)
+{
+	assert(pattern == INTERLEAVE_NONE || scale == 1);
+
+	// Distance between the rays of adjacent low resolution pixels
+	Vector3 ray_step = scalev(cam->pixel_dx, scale);
+
+	// Just lower resolution version of each variable. Partial
+	// blocks at the borders are rounded up so that every high
+	// resolution pixel is covered.
+	int lowres_tile_h = (tile.h + scale - 1) / scale;
+	int lowres_tile_w = (tile.w + scale - 1) / scale;
+
+	// Iterate over each low resolution pixel. They are evaluated
+	// at the position of the first high resolution pixel they cover.
+	// Primary rays of square groups of low resolution pixels are
+	// traced together as a packet.
+	for (int j = 0; j < lowres_tile_h; j += PACKET_W) {
+		for (int i = 0; i < lowres_tile_w; i += PACKET_W) {
+
+			int packet_w = PACKET_W;
+			int packet_h = PACKET_W;
+			if (packet_w > lowres_tile_w - i) packet_w = lowres_tile_w - i;
+			if (packet_h > lowres_tile_h - j) packet_h = lowres_tile_h - j;
+
+			RayPacket packet;
+			packet.count  = packet_w * packet_h;
+			packet.origin = cam->pos;
+			for (int g = 0; g < packet_h; g++) {
+				Vector3 row_dir = snapshot_ray_dir(cam, tile.x + i * scale, tile.y + (j + g) * scale);
+				for (int k = 0; k < packet_w; k++)
+					packet.dirs[g * packet_w + k] = combine(row_dir, ray_step, 1, k);
+			}
+
+			Vector3 corners[4] = {
+				packet.dirs[0],
+				packet.dirs[packet_w-1],
+				packet.dirs[packet.count-1],
+				packet.dirs[packet.count-packet_w],
+			};
+			setup_packet_frustum(&packet, corners);
+
+			HitInfo hits[MAX_PACKET_SIZE];
+			trace_packet(&packet, scene, hits);
+
+			for (int g = 0; g < packet_h; g++)
+				for (int k = 0; k < packet_w; k++) {
+
+					int sample_index = (j + g) * lowres_tile_w + (i + k);
+
+					Ray     ray = { cam->pos, packet.dirs[g * packet_w + k] };
+					HitInfo hit = hits[g * packet_w + k];
+
+					samples->normal[sample_index] = hit.object == -1 ? (Vector3) {0, 0, 0} : hit.normal;
+
+					if (!in_interleave_phase(tile.x + i + k, tile.y + j + g, pattern, phase)) {
+						samples->depth[sample_index] = hit_depth(ray, hit);
+						continue;
+					}
+
+					if (wavefront) {
+						// Only the depth is known for now. The path is
+						// evaluated with the rest of the batch.
+						samples->depth[sample_index] = hit_depth(ray, hit);
+						wavefront_push(wavefront, ray, hit, sample_index);
+						continue;
+					}
+
+					samples->color[sample_index] = pixel(ray, hit, &samples->depth[sample_index], scene);
 				}
 		}
-		// We are done calculating a row of pixels!
-		
+		// We are done calculating a row of packets!
+
 		// If the frame has been invalidated we need to
 		// exit and try again as soon as possible
-		if (cached_generation != atomic_load(&accum_generation))
+		if (cam->generation != atomic_load(&accum_generation)) {
+			if (wavefront)
+				wavefront_discard(wavefront);
 			break;
+		}
+
+		if (wavefront && (wavefront->num_paths >= WAVEFRONT_BATCH || j + PACKET_W >= lowres_tile_h))
+			flush_wavefront(wavefront, samples, scene);
 	}
+}
+
+// Traces the primary rays of every pixel of the tile to find
+// the depth and normal of the first hit, which are cheap compared
+// to evaluating the whole path.
+static void trace_guide(float *data_depth, Vector3 *data_normal, Tile tile, const CameraSnapshot *cam, const Scene *scene)
+{
+	for (int j = 0; j < tile.h; j += PACKET_W) {
+		for (int i = 0; i < tile.w; i += PACKET_W) {
+
+			int packet_w = PACKET_W;
+			int packet_h = PACKET_W;
+			if (packet_w > tile.w - i) packet_w = tile.w - i;
+			if (packet_h > tile.h - j) packet_h = tile.h - j;
+
+			RayPacket packet;
+			packet.count  = packet_w * packet_h;
+			packet.origin = cam->pos;
+			for (int g = 0; g < packet_h; g++) {
+				Vector3 row_dir = snapshot_ray_dir(cam, tile.x + i, tile.y + j + g);
+				for (int k = 0; k < packet_w; k++)
+					packet.dirs[g * packet_w + k] = combine(row_dir, cam->pixel_dx, 1, k);
+			}
 
-	// Return the weight of the current column
-	return scale2inv;
+			Vector3 corners[4] = {
+				packet.dirs[0],
+				packet.dirs[packet_w-1],
+				packet.dirs[packet.count-1],
+				packet.dirs[packet.count-packet_w],
+			};
+			setup_packet_frustum(&packet, corners);
+
+			HitInfo hits[MAX_PACKET_SIZE];
+			trace_packet(&packet, scene, hits);
+
+			for (int g = 0; g < packet_h; g++)
+				for (int k = 0; k < packet_w; k++) {
+					Ray     ray = { cam->pos, packet.dirs[g * packet_w + k] };
+					HitInfo hit = hits[g * packet_w + k];
+					int pixel_index = (j + g) * tile.w + (i + k);
+					data_depth[pixel_index]  = hit_depth(ray, hit);
+					data_normal[pixel_index] = hit.object == -1 ? (Vector3) {0, 0, 0} : hit.normal;
+				}
+		}
+
+		if (cam->generation != atomic_load(&accum_generation))
+			break;
+	}
 }
 
-os_threadreturn worker(void *arg)
+// How much a sample contributes to a pixel based on how similar
+// their first hits are. Samples across depth discontinuities or on
+// surfaces facing another way get little to no weight.
+static float guide_weight(float pixel_depth, Vector3 pixel_normal, float sample_depth, Vector3 sample_normal)
+{
+	// Both rays missed the scene
+	if (isinf(pixel_depth) || isinf(sample_depth))
+		return isinf(pixel_depth) && isinf(sample_depth) ? 1 : 0;
+
+	float relative = (pixel_depth - sample_depth) / (UPSAMPLE_DEPTH_SIGMA * pixel_depth);
+	float depth_weight = expf(-0.5f * relative * relative);
+
+	float normal_weight = dotv(pixel_normal, sample_normal);
+	if (normal_weight <= 0)
+		return 0;
+	for (int i = 0; i < UPSAMPLE_NORMAL_SHARPNESS; i++)
+		normal_weight *= normal_weight;
+
+	return depth_weight * normal_weight;
+}
+
+// Reconstructs the full resolution tile from the samples of a pass
+// with joint bilateral upsampling. Each pixel interpolates the four
+// samples around it, weighted by how close they are and by how well
+// their depth and normal match the ones of the pixel. The pixel depth
+// and normal must have been traced already.
+static void upsample_tile(const TileSamples *samples, Vector3 *data, const float *data_depth, const Vector3 *data_normal, int scale, Tile tile)
+{
+	int lowres_tile_h = (tile.h + scale - 1) / scale;
+	int lowres_tile_w = (tile.w + scale - 1) / scale;
+
+	for (int y = 0; y < tile.h; y++) {
+
+		int   lowres_y0 = y / scale;
+		int   lowres_y1 = lowres_y0 + 1 < lowres_tile_h ? lowres_y0 + 1 : lowres_y0;
+		float ty = (float) (y - lowres_y0 * scale) / scale;
+
+		for (int x = 0; x < tile.w; x++) {
+
+			int   lowres_x0 = x / scale;
+			int   lowres_x1 = lowres_x0 + 1 < lowres_tile_w ? lowres_x0 + 1 : lowres_x0;
+			float tx = (float) (x - lowres_x0 * scale) / scale;
+
+			int pixel_index = y * tile.w + x;
+
+			int indices[4] = {
+				lowres_y0 * lowres_tile_w + lowres_x0,
+				lowres_y0 * lowres_tile_w + lowres_x1,
+				lowres_y1 * lowres_tile_w + lowres_x0,
+				lowres_y1 * lowres_tile_w + lowres_x1,
+			};
+			float bilinear[4] = {
+				(1 - tx) * (1 - ty),
+				tx * (1 - ty),
+				(1 - tx) * ty,
+				tx * ty,
+			};
+
+			Vector3 color = {0, 0, 0};
+			float total = 0;
+			int   best = 0;
+			float best_weight = -1;
+			for (int k = 0; k < 4; k++) {
+				float w = guide_weight(data_depth[pixel_index], data_normal[pixel_index],
+					samples->depth[indices[k]], samples->normal[indices[k]]);
+				if (w > best_weight) {
+					best = k;
+					best_weight = w;
+				}
+				w *= bilinear[k];
+				color = combine(color, samples->color[indices[k]], 1, w);
+				total += w;
+			}
+
+			// None of the surrounding samples hit the surface the
+			// pixel sees, so the most similar one is used as is.
+			if (total < UPSAMPLE_MIN_WEIGHT)
+				data[pixel_index] = samples->color[indices[best]];
+			else
+				data[pixel_index] = scalev(color, 1 / total);
+		}
+	}
+}
+
+// Produces the full resolution tile and its depth from the samples
+// of a pass. At full resolution the samples are just copied.
+void reconstruct_tile(const TileSamples *samples, Vector3 *data, float *data_depth, Vector3 *data_normal, int scale, Tile tile, const CameraSnapshot *cam, const Scene *scene)
+{
+	if (scale == 1) {
+		memcpy(data, samples->color, sizeof(Vector3) * tile.w * tile.h);
+		memcpy(data_depth, samples->depth, sizeof(float) * tile.w * tile.h);
+		return;
+	}
+
+	trace_guide(data_depth, data_normal, tile, cam, scene);
+	if (cam->generation != atomic_load(&accum_generation))
+		return;
+
+	upsample_tile(samples, data, data_depth, data_normal, scale, tile);
+}
+
+// Guesses the color of the pixels skipped by an interleaved pass
+// from the evaluated pixels around them that see the same surface.
+// Every 3x3 window contains evaluated pixels for both patterns.
+static void fill_interleaved(const TileSamples *samples, Vector3 *data, Tile tile, Interleave pattern, int phase)
 {
-	// How many information is contained in the column buffer
-	float column_data_weight = 0;
+	for (int y = 0; y < tile.h; y++)
+		for (int x = 0; x < tile.w; x++) {
+
+			if (in_interleave_phase(tile.x + x, tile.y + y, pattern, phase))
+				continue;
+
+			int pixel_index = y * tile.w + x;
+
+			Vector3 color = {0, 0, 0};
+			float total = 0;
+			int   best = -1;
+			float best_weight = -1;
+			for (int dy = -1; dy <= 1; dy++)
+				for (int dx = -1; dx <= 1; dx++) {
+					int nx = x + dx;
+					int ny = y + dy;
+					if (nx < 0 || nx >= tile.w || ny < 0 || ny >= tile.h)
+						continue;
+					if (!in_interleave_phase(tile.x + nx, tile.y + ny, pattern, phase))
+						continue;
+					int neighbour_index = ny * tile.w + nx;
+					float w = guide_weight(samples->depth[pixel_index], samples->normal[pixel_index],
+						samples->depth[neighbour_index], samples->normal[neighbour_index]);
+					if (w > best_weight) {
+						best = neighbour_index;
+						best_weight = w;
+					}
+					color = combine(color, samples->color[neighbour_index], 1, w);
+					total += w;
+				}
+
+			if (total < UPSAMPLE_MIN_WEIGHT)
+				data[pixel_index] = best < 0 ? (Vector3) {0, 0, 0} : samples->color[best];
+			else
+				data[pixel_index] = scalev(color, 1 / total);
+		}
+}
+
+// Estimate of how long a worker takes to evaluate a low resolution
+// pixel and to reconstruct a full resolution one from them, used to
+// pick the resolution of its passes.
+typedef struct {
+	double ns_per_sample; // Zero until a pass was measured
+	double ns_per_pixel;  // Zero until a low resolution pass was measured
+} ScaleController;
+
+static int count_lowres_pixels(int scale, int w, int h)
+{
+	return ((w + scale - 1) / scale) * ((h + scale - 1) / scale);
+}
+
+static void smooth_cost(double *cost, double sample)
+{
+	if (*cost == 0)
+		*cost = sample;
+	else
+		*cost += PIXEL_COST_SMOOTHING * (sample - *cost);
+}
+
+static void measure_pass(ScaleController *controller, uint64_t render_ns, uint64_t reconstruct_ns, int scale, Tile tile)
+{
+	int num_samples = count_lowres_pixels(scale, tile.w, tile.h);
+	if (num_samples == 0)
+		return;
+	smooth_cost(&controller->ns_per_sample, (double) render_ns / num_samples);
+	if (scale > 1)
+		smooth_cost(&controller->ns_per_pixel, (double) reconstruct_ns / (tile.w * tile.h));
+}
+
+// Returns the finest scale at which a pass over the frame is expected
+// to take less than "target_ms". The frame is shared by all workers.
+// Any integer scale is allowed, not only powers of two.
+static int choose_scale(const ScaleController *controller, int frame_w, int frame_h)
+{
+	if (controller->ns_per_sample == 0)
+		return init_scale;
+	double budget_ns = target_ms * 1000000.0 * num_workers;
+	for (int scale = 1; scale < MAX_SCALE; scale++) {
+		double estimate = controller->ns_per_sample * count_lowres_pixels(scale, frame_w, frame_h);
+		if (scale > 1)
+			estimate += controller->ns_per_pixel * frame_w * frame_h;
+		if (estimate <= budget_ns)
+			return scale;
+	}
+	return MAX_SCALE;
+}
+
+// Samples of a tile that weren't published yet, with their weights.
+// Workers don't wait for the frame lock to publish their results. If
+// the main thread is holding it, results are kept here and published
+// after a later pass.
+typedef struct {
+	Tile     tile;
+	uint32_t generation;
+	int      pass;
+	Vector3  accum  [RENDER_TILE_SIZE * RENDER_TILE_SIZE];
+	float    weights[RENDER_TILE_SIZE * RENDER_TILE_SIZE];
+	float    depth  [RENDER_TILE_SIZE * RENDER_TILE_SIZE];
+} PendingTile;
+
+// When this many tiles are waiting to be published and the lock
+// is still taken, the worker drops the newest one instead of
+// waiting. Later passes over the tile make up for it.
+#define MAX_PENDING_TILES 4
+
+// Adds the pending tiles of the current frame to the published
+// samples. Must be called while holding the frame lock.
+static void publish_tiles(PendingTile *pending, int num_pending)
+{
+	for (int p = 0; p < num_pending; p++) {
+
+		// The frame was reset or resized while the tile was waiting
+		if (pending[p].generation != atomic_load(&accum_generation))
+			continue;
+
+		Tile tile = pending[p].tile;
+		for (int j = 0; j < tile.h; j++)
+			for (int i = 0; i < tile.w; i++) {
+				int src_index = j * tile.w + i;
+				int dst_index = (tile.y + j) * frame_w + (tile.x + i);
+				assert(dst_index >= 0 && dst_index < frame_w * frame_h);
+				published.accum[dst_index] = combine(published.accum[dst_index], pending[p].accum[src_index], 1, 1);
+				published.weights[dst_index] += pending[p].weights[src_index];
+				published.depth[dst_index] = pending[p].depth[src_index];
+			}
+		mark_tiles_dirty(tile.x, tile.y, tile.w, tile.h);
 
-	// The actual pixels
-	Vector3 *column_data = NULL;
+		if (pending[p].pass == 0) {
+			preview_tiles_left--;
+			if (preview_tiles_left == 0 && show_stats)
+				fprintf(stderr, "First complete preview after %.1f ms\n",
+					(get_relative_time_ns() - frame_reset_time) / 1000000.0);
+		}
+	}
+}
 
-	// The screen is divided in "num_columns" columns
-	int column_i = (int) arg;
-	int column_w;
+// Copies the snapshot published with the given generation. Returns
+// false if the frame was reset since then.
+static bool read_snapshot(uint32_t generation, CameraSnapshot *cam, const Scene **scene)
+{
+	if (atomic_load(&accum_generation) != generation)
+		return false;
 
-	// Workers need to know the frame size while evaluating pixel
-	// values. Since the frame size may change at any time, threads
-	// cache their value.
-	int cached_frame_w;
-	int cached_frame_h;
+	const PublishedSnapshot *slot = &snapshots[generation % SNAPSHOT_SLOTS];
+	CameraSnapshot slot_camera = slot->camera;
+	const Scene   *slot_scene  = slot->scene;
 
-	// Generation counter of the frame buffer when the worker
-	// started producing a new frame. If the camera moves in the
-	// or something else causing the frame buffer to be reset, this
-	// will let the worker know the information needs to be thrown
-	// away. 
-	uint64_t cached_generation;
+	// The slot may have been rewritten while it was copied
+	atomic_thread_fence(memory_order_acquire);
+	if (atomic_load(&accum_generation) != generation)
+		return false;
+
+	*cam = slot_camera;
+	*scene = slot_scene;
+	return true;
+}
+
+os_threadreturn worker(void *arg)
+{
+	int index = (intptr_t) arg;
+
+	// Samples of the latest pass over a tile
+	TileSamples *samples = malloc(sizeof(TileSamples));
+
+	// Pixels of the latest pass over a tile, reconstructed from
+	// the samples, and the depth and normal of their first hit
+	Vector3 *tile_data   = malloc(sizeof(Vector3) * RENDER_TILE_SIZE * RENDER_TILE_SIZE);
+	float   *tile_depth  = malloc(sizeof(float)   * RENDER_TILE_SIZE * RENDER_TILE_SIZE);
+	Vector3 *tile_normal = malloc(sizeof(Vector3) * RENDER_TILE_SIZE * RENDER_TILE_SIZE);
+
+	PendingTile *pending = malloc(sizeof(PendingTile) * MAX_PENDING_TILES);
+	int num_pending = 0;
+
+	if (!samples || !tile_data || !tile_depth || !tile_normal || !pending) abort();
+
+	// Cache behaviour of the passes, with --stats. Only
+	// the first worker to fail warns about it.
+	static _Atomic bool counters_warning;
+	os_cache_counters counters = {-1, -1};
+	if (show_stats && !os_cache_counters_open(&counters) && !atomic_exchange(&counters_warning, true))
+		fprintf(stderr, "Warning: Cache counters are not available\n");
+
+	// Workers need to know the camera and frame size while evaluating
+	// pixel values. Since they may change at any time, threads cache
+	// the snapshot published by the main thread. Its generation counter
+	// lets the worker know if the camera moved or something else caused
+	// the frame buffer to be reset, in which case the information it
+	// is holding needs to be thrown away. The snapshot is refreshed
+	// without the lock when the generation changes. The scene is
+	// refreshed with it.
+	CameraSnapshot cached_camera;
+	const Scene   *cached_scene = NULL;
+	bool have_camera = false;
+
+	// Path queues of the wavefront integrator, if enabled. They
+	// are kept across passes so they're only allocated once.
+	Wavefront wavefront_storage;
+	Wavefront *wavefront = NULL;
+	if (use_wavefront) {
+		init_wavefront(&wavefront_storage);
+		wavefront = &wavefront_storage;
+	}
 
-	// This value determines the resolution at which pixels are
+	// The scale determines the resolution at which pixels are
 	// evaluated. For scale=1 the image is full size. For scale=2
-	// the image size is halved (along both axis). When a worker
-	// evaluates a frame it starts at the lowest resolution "init_scale"
-	// and after each succesfull paint it doubles the resolution
-	int scale = init_scale;
+	// the image size is halved (along both axis). The first pass over
+	// a tile is evaluated at the lowest resolution "init_scale" and
+	// each following one doubles the resolution. With a "target_ms"
+	// budget the starting resolution is instead the finest one the
+	// workers can evaluate in time, and refinement skips ahead to any
+	// resolution that fits the budget.
+	ScaleController controller = {0};
+
+	// With an "interleave" pattern the frame is always evaluated at
+	// full resolution. After the camera moves, the first passes over
+	// a tile only evaluate the pixels of one phase of the pattern,
+	// which changes every pass and every frame so that the skipped
+	// pixels are evaluated next.
+	int num_phases = count_interleave_phases(interleave);
 
-	os_mutex_lock(&frame_mutex);
 	while (!quitting()) {
 
-		// Cache data and check if we need to resize the column buffer
-		bool resize = false;
-		if (column_data == NULL || cached_generation != atomic_load(&accum_generation))
-			resize = true;
-		column_w = frame_w / num_columns;
-		cached_frame_w = frame_w;
-		cached_frame_h = frame_h;
-		cached_generation = atomic_load(&accum_generation);
-		os_mutex_unlock(&frame_mutex);
+		// The main thread waits for its loops, so joining
+		// them comes before starting the next tile
+		help_parallel_for(&pool);
+
+		int start_scale = init_scale;
+		int fitting_scale = MAX_SCALE;
+		if (interleave != INTERLEAVE_NONE) {
+			start_scale = 1;
+			fitting_scale = 1;
+		} else if (target_ms > 0 && have_camera) {
+			start_scale = choose_scale(&controller, cached_camera.frame_w, cached_camera.frame_h);
+			fitting_scale = start_scale;
+		}
 
-		// We need to resize
-		if (resize) {
-			free(column_data);
-			column_data = malloc(sizeof(Vector3) * column_w * cached_frame_h);
-			if (!column_data) abort();
+		TileJob job;
+		if (!next_tile(&scheduler, start_scale, fitting_scale, &job)) {
+			// The frame is empty
+			sleep_ms(1);
+			continue;
 		}
 
-		// Trace rays for each pixel in the column
-		column_data_weight += render_column(column_data, scale, column_w, column_i, cached_frame_w, cached_frame_h, cached_generation);
+		if (!have_camera || cached_camera.generation != job.generation) {
 
-		// Now we try publishing the changes
-		os_mutex_lock(&frame_mutex);
+			// The frame was reset after the tile was handed out
+			if (!read_snapshot(job.generation, &cached_camera, &cached_scene))
+				continue;
+			atomic_store(&worker_generations[index], job.generation);
+			have_camera = true;
+		}
 
-		if (cached_generation == atomic_load(&accum_generation)) {
-			// Frame didn't change its size while we were evaluating the column
-
-			// This loop basically copies the pixel colors from the column buffer to
-			// the frame buffer.
-			for (int j = 0; j < frame_h; j++)
-				for (int i = 0; i < column_w; i++) {	
-					int column_x = column_w * column_i;
-					int src_index = j * column_w + i;
-					int dst_index = j * frame_w + (i + column_x);
-					assert(src_index >= 0 && src_index < column_w * cached_frame_h);
-					assert(dst_index >= 0 && dst_index < cached_frame_w * cached_frame_h);
-					accum[dst_index] = combine(accum[dst_index], column_data[src_index], 1, 1.0f / (scale * scale));
-				}
-			accum_counts[column_i] += column_data_weight;
+		Interleave pattern = INTERLEAVE_NONE;
+		int phase = 0;
+		if (job.pass < num_phases) {
+			pattern = interleave;
+			phase = (job.generation + job.pass) % num_phases;
+		}
 
-			// Let the main thread know there are new pixels
-			os_condvar_signal(&accum_conds[column_i]);
+		uint64_t misses_before, references_before;
+		os_cache_counters_read(&counters, &misses_before, &references_before);
 
-			// We painted succesfully so we can render at double the resolution next time
-			if (scale > 1)
-				scale >>= 1;
+		// Trace rays for each pixel in the tile
+		uint64_t pass_start = get_relative_time_ns();
+		render_tile(samples, job.scale, job.tile, &cached_camera, cached_scene, wavefront, pattern, phase);
+		uint64_t render_end = get_relative_time_ns();
 
+		// Fill in the pixels between the samples
+		if (cached_camera.generation == atomic_load(&accum_generation))
+			reconstruct_tile(samples, tile_data, tile_depth, tile_normal, job.scale, job.tile, &cached_camera, cached_scene);
+
+		if (show_stats) {
+			uint64_t misses_after, references_after;
+			os_cache_counters_read(&counters, &misses_after, &references_after);
+			atomic_fetch_add(&stat_cache_misses, misses_after - misses_before);
+			atomic_fetch_add(&stat_cache_references, references_after - references_before);
+			atomic_fetch_add(&stat_samples, count_lowres_pixels(job.scale, job.tile.w, job.tile.h));
+		}
+
+		// The pass was interrupted
+		if (cached_camera.generation != atomic_load(&accum_generation))
+			continue;
+
+		if (pattern == INTERLEAVE_NONE)
+			measure_pass(&controller, render_end - pass_start, get_relative_time_ns() - render_end, job.scale, job.tile);
+
+		PendingTile *result = &pending[num_pending++];
+		result->tile = job.tile;
+		result->generation = job.generation;
+		result->pass = job.pass;
+		memcpy(result->depth, tile_depth, sizeof(float) * job.tile.w * job.tile.h);
+
+		// Since we're rendering at lower resolution, the weight of the
+		// pixels we produce is also reduced.
+		float weight = 1.0f / (job.scale * job.scale);
+		if (pattern == INTERLEAVE_NONE) {
+			for (int i = 0; i < job.tile.w * job.tile.h; i++) {
+				result->accum[i] = scalev(tile_data[i], weight);
+				result->weights[i] = weight;
+			}
 		} else {
-			// Data was invalidated. We need to go back and render at low res
-			scale = init_scale;
+			// Skipped pixels are only guesses. Where the accumulation
+			// buffer has history for them, it is what shows.
+			fill_interleaved(samples, tile_data, job.tile, pattern, phase);
+			for (int j = 0; j < job.tile.h; j++)
+				for (int i = 0; i < job.tile.w; i++) {
+					int index = j * job.tile.w + i;
+					float w = in_interleave_phase(job.tile.x + i, job.tile.y + j, pattern, phase) ? weight : INTERLEAVE_FILL_WEIGHT;
+					result->accum[index] = scalev(tile_data[index], w);
+					result->weights[index] = w;
+				}
+		}
+
+		// Now we try publishing the changes
+		if (!os_mutex_trylock(&frame_mutex)) {
+			if (num_pending == MAX_PENDING_TILES)
+				num_pending--;
+			continue;
 		}
 
-		// Either way we need to reset the column data now
-		column_data_weight = 0;
+		publish_tiles(pending, num_pending);
+		num_pending = 0;
+
+		os_mutex_unlock(&frame_mutex);
 	}
-	os_mutex_unlock(&frame_mutex);
+	free(samples);
+	free(tile_data);
+	free(tile_depth);
+	free(tile_normal);
+	free(pending);
+	os_cache_counters_close(&counters);
+	if (wavefront)
+		free_wavefront(wavefront);
+	return 0;
 }
 
 void realloc_frame_buffer(void)
@@ -418,28 +1503,58 @@ void realloc_frame_buffer(void)
 	frame_w = get_screen_w();
 	frame_h = get_screen_h();
 
-	if (frame) free(frame);
-	if (accum) free(accum);
-
-	frame = malloc(sizeof(Vector3) * frame_w * frame_h);
-	if (!frame) {
+	free(accum);
+	free(accum_weights);
+	free(depth);
+	free(history_accum);
+	free(history_weights);
+	free(history_depth);
+	free(splat_depth);
+	free(published.accum);
+	free(published.weights);
+	free(published.depth);
+	free(merging.accum);
+	free(merging.weights);
+	free(merging.depth);
+	free(dirty_tiles);
+	free(tiles_to_resolve);
+	free(dirty_rects);
+
+	tiles_x = (frame_w + TILE_SIZE - 1) / TILE_SIZE;
+	tiles_y = (frame_h + TILE_SIZE - 1) / TILE_SIZE;
+
+	accum           = malloc(sizeof(Vector3) * frame_w * frame_h);
+	accum_weights   = malloc(sizeof(float)   * frame_w * frame_h);
+	depth           = malloc(sizeof(float)   * frame_w * frame_h);
+	history_accum   = malloc(sizeof(Vector3) * frame_w * frame_h);
+	history_weights = malloc(sizeof(float)   * frame_w * frame_h);
+	history_depth   = malloc(sizeof(float)   * frame_w * frame_h);
+	splat_depth     = malloc(sizeof(uint64_t) * frame_w * frame_h);
+	published.accum   = malloc(sizeof(Vector3) * frame_w * frame_h);
+	published.weights = malloc(sizeof(float)   * frame_w * frame_h);
+	published.depth   = malloc(sizeof(float)   * frame_w * frame_h);
+	merging.accum     = malloc(sizeof(Vector3) * frame_w * frame_h);
+	merging.weights   = malloc(sizeof(float)   * frame_w * frame_h);
+	merging.depth     = malloc(sizeof(float)   * frame_w * frame_h);
+	dirty_tiles      = malloc(sizeof(bool)      * tiles_x * tiles_y);
+	tiles_to_resolve = malloc(sizeof(bool)      * tiles_x * tiles_y);
+	dirty_rects      = malloc(sizeof(FrameRect) * tiles_x * tiles_y);
+	if (!accum || !accum_weights || !depth || !history_accum || !history_weights || !history_depth || !splat_depth
+		|| !published.accum || !published.weights || !published.depth || !merging.accum || !merging.weights || !merging.depth
+		|| !dirty_tiles || !tiles_to_resolve || !dirty_rects) {
 		printf("OUT OF MEMORY\n");
 		abort();
 	}
 
-	accum = malloc(sizeof(Vector3) * frame_w * frame_h);
-	if (!accum) {
-		printf("OUT OF MEMORY\n");
-		abort();
-	}
-
-	for (int i = 0; i < num_columns; i++)
-		accum_counts[i] = 0;
-		
-	memset(accum, 0, sizeof(Vector3) * frame_w * frame_h);
-	memset(frame, 0, sizeof(Vector3) * frame_w * frame_h);
-
-	atomic_fetch_add(&accum_generation, 1);
+	// Every tile is dirty so that both sample buffers are cleared.
+	// The accumulation buffer is cleared when the samples are taken.
+	memset(splat_depth, 0, sizeof(uint64_t) * frame_w * frame_h);
+	memset(tiles_to_resolve, 0, sizeof(bool) * tiles_x * tiles_y);
+	mark_tiles_dirty(0, 0, frame_w, frame_h);
+	for (int j = 0; j < tiles_y; j++)
+		for (int i = 0; i < tiles_x; i++)
+			clear_tile_samples(&merging, i, j);
+	clear_accumulation();
 }
 
 bool frame_buffer_size_doesnt_match_window(void)
@@ -447,38 +1562,90 @@ bool frame_buffer_size_doesnt_match_window(void)
 	return frame_w != get_screen_w() || frame_h != get_screen_h();
 }
 
+// Resolves the dirty rectangles in [begin, end) into the upload buffer
+static void resolve_rects(void *data, int begin, int end)
+{
+	uint8_t *pixels = data;
+	int pixel_size = display_pixel_size(display.format);
+	for (int i = begin; i < end; i++) {
+		FrameRect rect = dirty_rects[i];
+		for (int y = rect.y; y < rect.y + rect.h; y++) {
+			int offset = y * frame_w + rect.x;
+			resolve_pixels(&display, accum + offset, accum_weights + offset, rect.w, pixels + offset * pixel_size);
+		}
+	}
+}
+
 void update_frame(void)
 {
+	// The lock is only held to take the samples published by the
+	// workers. They are merged and resolved without it, so workers
+	// never wait for a frame to be displayed.
 	os_mutex_lock(&frame_mutex);
-
 	if (frame_buffer_size_doesnt_match_window())
 		realloc_frame_buffer();
+	bool cleared = take_published_samples();
+	os_mutex_unlock(&frame_mutex);
 
-	int column_w = frame_w / num_columns;
-
-	// Wait for the workers to produce a frame
-	// (each worker produces a column)
-	for (int i = 0; i < num_columns; i++) {
-		while (accum_counts[i] < 0.0001)
-			os_condvar_wait(&accum_conds[i], &frame_mutex, -1);
-	}
-
-	// Copy pixels from the accumulation buffer to the frame buffer
-	for (int j = 0; j < frame_h; j++)
-		for (int i = 0; i < frame_w; i++) {
+	merge_samples(cleared);
+
+	// Mapping the upload buffer may need to wait for the GPU. The
+	// frame size can be read without the lock since this thread
+	// is the only one changing it.
+	void *pixels = begin_frame_upload(frame_w, frame_h);
+	if (pixels == NULL)
+		return;
+
+	// The frame shows whatever the workers accumulated so far. There
+	// is no waiting for them to complete a pass.
+	//
+	// Horizontal runs of dirty tiles are resolved and uploaded as
+	// a single rectangle.
+	int num_rects = 0;
+	for (int j = 0; j < tiles_y; j++) {
+		int i = 0;
+		while (i < tiles_x) {
+
+			if (!tiles_to_resolve[j * tiles_x + i]) {
+				i++;
+				continue;
+			}
 
-			float u = (float) i / (frame_w - 1);
-			float v = (float) j / (frame_h - 1);
-			u = 1 - u;
-			v = 1 - v;
+			int run_start = i;
+			while (i < tiles_x && tiles_to_resolve[j * tiles_x + i]) {
+				tiles_to_resolve[j * tiles_x + i] = false;
+				i++;
+			}
 
-			int pixel_index = j * frame_w + i;
-			frame[pixel_index] = scalev(accum[pixel_index], 1.0f / accum_counts[i / column_w]);
+			FrameRect rect;
+			rect.x = run_start * TILE_SIZE;
+			rect.y = j * TILE_SIZE;
+			rect.w = i * TILE_SIZE - rect.x;
+			rect.h = TILE_SIZE;
+			if (rect.w > frame_w - rect.x) rect.w = frame_w - rect.x;
+			if (rect.h > frame_h - rect.y) rect.h = frame_h - rect.y;
+			dirty_rects[num_rects++] = rect;
 		}
+	}
 
-	move_frame_to_the_gpu(frame_w, frame_h, frame);
+	// Write the averaged pixels directly in the upload buffer. The
+	// rectangles are resolved in parallel by the threads of the pool.
+	parallel_for(&pool, num_rects, 1, resolve_rects, pixels);
 
-	os_mutex_unlock(&frame_mutex);
+	end_frame_upload(dirty_rects, num_rects);
+}
+
+// Prints the statistics collected since the last call
+static void print_stats(void)
+{
+	uint64_t misses     = atomic_exchange(&stat_cache_misses, 0);
+	uint64_t references = atomic_exchange(&stat_cache_references, 0);
+	uint64_t samples    = atomic_exchange(&stat_samples, 0);
+	if (references > 0)
+		fprintf(stderr, "%llu samples, %.2f%% cache miss rate, %.1f misses per sample\n",
+			(unsigned long long) samples, 100.0 * misses / references, samples > 0 ? (double) misses / samples : 0);
+	else
+		fprintf(stderr, "%llu samples\n", (unsigned long long) samples);
 }
 
 int main(int argc, char **argv)
@@ -486,16 +1653,39 @@ int main(int argc, char **argv)
 	fprintf(stderr, "Started\n");
 
 	char *scene_file;
-	parse_arguments_or_exit(argc, argv, &num_columns, &init_scale, &scene_file);
+	parse_arguments_or_exit(argc, argv, &num_workers, &init_scale, &use_wavefront, &display, &display_fps, &target_ms, &interleave, &foveate, &focus_x, &focus_y, &tile_order, &show_stats, &use_scene_cache, &use_compressed_bvh, &reload_method, &scene_file);
 
 	fprintf(stderr, "Parsed arguments\n");
 
-	if (!parse_scene_file(scene_file, &scene)) {
-		fprintf(stderr, "Couldn't parse scene\n");
-		return -1;
-	}
+	// The workers aren't running yet, so the first scene is loaded
+	// by threads of its own. The main thread takes part too.
+	Pool load_pool;
+	init_pool(&load_pool, num_workers - 1);
+
+	// Scenes read from a stream are rendered while they arrive,
+	// starting from an empty one
+	SceneStream stream;
+	bool streaming = os_is_stream(scene_file);
+	if (streaming) {
+		if (!open_scene_stream(&stream, scene_file))
+			return -1;
+		frame_scene = parse_scene_string("", 0, NULL, NULL);
+		fprintf(stderr, "Streaming scene\n");
+	} else {
+		uint64_t load_start = get_relative_time_ns();
+		Scene *scene = load_scene_file(scene_file, use_scene_cache, &load_pool);
+		if (!scene) {
+			fprintf(stderr, "Couldn't parse scene\n");
+			return -1;
+		}
+		if (use_compressed_bvh)
+			compress_scene_bvhs(scene);
+		frame_scene = scene;
 
-	fprintf(stderr, "Scene parsed\n");
+		fprintf(stderr, "Scene loaded (%d objects, %d instances, %d meshes, %.1f ms)\n", frame_scene->num_objects,
+			frame_scene->num_instances, frame_scene->num_meshes, (get_relative_time_ns() - load_start) / 1e6);
+	}
+	free_pool(&load_pool);
 
 	const char *faces[] = {
 		[CF_RIGHT]  = "assets/skybox/right.jpg",
@@ -510,83 +1700,144 @@ int main(int argc, char **argv)
 	fprintf(stderr, "Cubemap loaded\n");
 
 	startup_window_and_opengl_context_or_exit(2 * 640, 2 * 480, "Ray Tracing");
+	set_display_settings(&display);
+	init_resolve();
 
 	fprintf(stderr, "Started windows and opengl context\n");
 
+	// The scheduler is reset along with the frame, which happens
+	// the first time it's updated
+	init_scheduler(&scheduler, tile_order, foveate, focus_x, focus_y);
+	init_helped_pool(&pool, num_workers);
 	start_workers();
 
 	fprintf(stderr, "Workers started\n");
 
+	if (streaming)
+		os_thread_create(&loader, &stream, load_scene_stream);
+
+	// Edits to the scene file are applied while rendering
+	os_file_watch watch;
+	bool watching = !streaming && os_file_watch_open(&watch, scene_file);
+	if (!streaming && !watching)
+		fprintf(stderr, "Warning: Changes to the scene file won't be reloaded\n");
+
+	// Frames are presented at a fixed rate (instead of following
+	// vsync or the progress of the workers) so input is handled
+	// with the same latency whatever the cost of rendering.
+	uint64_t frame_period_ns = 1000000000 / display_fps;
+	uint64_t last_stats = get_relative_time_ns();
+
 	for (bool exit = false; !exit; ) {
 
+		uint64_t frame_start = get_relative_time_ns();
+
 		for (;;) {
 
-			double mouse_x;
-			double mouse_y;
-			int event = pop_event(&mouse_x, &mouse_y);
+			int event = pop_event();
 			if (event == EVENT_EMPTY) break;
 
-			float speed = 0.5;
 			switch (event) {
 				case EVENT_CLOSE:
 				case EVENT_PRESS_ESC:
-				fprintf(stderr, "Exiting\n");
 				exit = true;
 				break;
 
-				case EVENT_PRESS_W:
-				case EVENT_AGAIN_W:
-				move_camera(UP, speed);
-				invalidate_accumulation();
+				case EVENT_PRESS_SPACE:
+				screenshot();
 				break;
+			}
 
-				case EVENT_PRESS_A:
-				case EVENT_AGAIN_A:
-				move_camera(LEFT, speed);
-				invalidate_accumulation();
+			if (exit) {
+				fprintf(stderr, "Exiting\n");
 				break;
+			}
+		}
 
-				case EVENT_PRESS_S:
-				case EVENT_AGAIN_S:
-				move_camera(DOWN, speed);
-				invalidate_accumulation();
-				break;
+		// All mouse motion and held keys since the last frame are
+		// merged into a single camera update, so the accumulation
+		// buffer is reprojected at most once per frame.
+		InputState input;
+		poll_input(&input);
+
+		float speed = 0.5;
+		bool camera_moved = false;
+		if (input.mouse_moved) {
+			rotate_camera(input.mouse_x, input.mouse_y);
+			camera_moved = true;
+		}
+		if (input.forward != 0) {
+			move_camera(input.forward > 0 ? UP : DOWN, speed);
+			camera_moved = true;
+		}
+		if (input.right != 0) {
+			move_camera(input.right > 0 ? RIGHT : LEFT, speed);
+			camera_moved = true;
+		}
+		if (camera_moved)
+			reproject_accumulation();
 
-				case EVENT_PRESS_D:
-				case EVENT_AGAIN_D:
-				move_camera(RIGHT, speed);
-				invalidate_accumulation();
-				break;
+		if (watching && os_file_watch_changed(&watch))
+			reload_scene(scene_file);
 
-				case EVENT_MOVE_MOUSE:
-				rotate_camera(mouse_x, mouse_y);
-				invalidate_accumulation();
-				break;
+		update_frame();
+		draw_frame();
 
-				case EVENT_PRESS_SPACE:
-				screenshot();
-				break;
-			}
+		if (show_stats && get_relative_time_ns() - last_stats >= 1000000000) {
+			print_stats();
+			last_stats = get_relative_time_ns();
 		}
 
-		update_frame();
-		draw_frame();
+		uint64_t elapsed = get_relative_time_ns() - frame_start;
+		if (elapsed < frame_period_ns)
+			sleep_ms((frame_period_ns - elapsed) / 1000000.0f);
 	}
 
 	// Tell workers to stop evaluating frames
 	invalidate_accumulation();
 
+	if (watching)
+		os_file_watch_close(&watch);
+
 	stop_workers();
+
+	// The loader may be waiting for the stream forever, so it's
+	// not joined. It drops any scene it builds from now on.
+	os_mutex_lock(&frame_mutex);
+	loader_stopped = true;
+	free_retired_scenes(true);
+	free_scene(frame_scene);
+	os_mutex_unlock(&frame_mutex);
+
+	free_pool(&pool);
+	free_scheduler(&scheduler);
 	free_cubemap(&skybox);
 	cleanup_window_and_opengl_context();
 	return 0;
 }
 
-void parse_arguments_or_exit(int argc, char **argv, int *num_columns, int *init_scale, char **scene_file)
+void parse_arguments_or_exit(int argc, char **argv, int *num_workers, int *init_scale, bool *use_wavefront, DisplaySettings *display, int *display_fps, float *target_ms, Interleave *interleave, bool *foveate, float *focus_x, float *focus_y, TileOrder *tile_order, bool *show_stats, bool *use_scene_cache, bool *use_compressed_bvh, BVHBuildMethod *reload_method, char **scene_file)
 {
 	*scene_file = NULL;
-	*num_columns = -1;
+	*num_workers = -1;
 	*init_scale = 8;
+	*use_wavefront = false;
+	*display_fps = 60;
+	*target_ms = 0;
+	*interleave = INTERLEAVE_NONE;
+	*foveate = false;
+	*focus_x = 0.5f;
+	*focus_y = 0.5f;
+	*show_stats = false;
+	*use_scene_cache = true;
+	*use_compressed_bvh = false;
+	*reload_method = BVH_BUILD_SAH;
+	int order = -1;
+	display->exposure = 1;
+	display->tonemap = TONEMAP_NONE;
+	display->srgb = false;
+	display->format = DISPLAY_RGBA8;
+	display->gpu_tonemap = false;
 	for (int i = 1; i < argc; i++) {
 		if (!strcmp(argv[i], "--init-scale")) {
 			i++;
@@ -605,8 +1856,8 @@ void parse_arguments_or_exit(int argc, char **argv, int *num_columns, int *init_
 				fprintf(stderr, "Error: --threads option is missing the count\n");
 				exit(-1);
 			}
-			*num_columns = atoi(argv[i]);
-			if (*num_columns == 0) {
+			*num_workers = atoi(argv[i]);
+			if (*num_workers == 0) {
 				fprintf(stderr, "Error: Invalid count for --threads\n");
 				exit(-1);
 			}
@@ -617,6 +1868,139 @@ void parse_arguments_or_exit(int argc, char **argv, int *num_columns, int *init_
 				exit(-1);
 			}
 			*scene_file = argv[i];
+		} else if (!strcmp(argv[i], "--wavefront")) {
+			*use_wavefront = true;
+		} else if (!strcmp(argv[i], "--exposure")) {
+			i++;
+			if (i == argc) {
+				fprintf(stderr, "Error: --exposure option is missing the value\n");
+				exit(-1);
+			}
+			display->exposure = atof(argv[i]);
+			if (display->exposure <= 0) {
+				fprintf(stderr, "Error: Invalid value for --exposure. It must be a positive number\n");
+				exit(-1);
+			}
+		} else if (!strcmp(argv[i], "--tonemap")) {
+			i++;
+			if (i == argc) {
+				fprintf(stderr, "Error: --tonemap option is missing the operator\n");
+				exit(-1);
+			}
+			if (!strcmp(argv[i], "none"))
+				display->tonemap = TONEMAP_NONE;
+			else if (!strcmp(argv[i], "reinhard"))
+				display->tonemap = TONEMAP_REINHARD;
+			else if (!strcmp(argv[i], "aces"))
+				display->tonemap = TONEMAP_ACES;
+			else {
+				fprintf(stderr, "Error: Invalid value for --tonemap. It must be one of none, reinhard or aces\n");
+				exit(-1);
+			}
+		} else if (!strcmp(argv[i], "--srgb")) {
+			display->srgb = true;
+		} else if (!strcmp(argv[i], "--display-format")) {
+			i++;
+			if (i == argc) {
+				fprintf(stderr, "Error: --display-format option is missing the format\n");
+				exit(-1);
+			}
+			if (!strcmp(argv[i], "rgba8"))
+				display->format = DISPLAY_RGBA8;
+			else if (!strcmp(argv[i], "rgba16f"))
+				display->format = DISPLAY_RGBA16F;
+			else {
+				fprintf(stderr, "Error: Invalid value for --display-format. It must be rgba8 or rgba16f\n");
+				exit(-1);
+			}
+		} else if (!strcmp(argv[i], "--fps")) {
+			i++;
+			if (i == argc) {
+				fprintf(stderr, "Error: --fps option is missing the rate\n");
+				exit(-1);
+			}
+			*display_fps = atoi(argv[i]);
+			if (*display_fps <= 0) {
+				fprintf(stderr, "Error: Invalid value for --fps\n");
+				exit(-1);
+			}
+		} else if (!strcmp(argv[i], "--target-ms")) {
+			i++;
+			if (i == argc) {
+				fprintf(stderr, "Error: --target-ms option is missing the duration\n");
+				exit(-1);
+			}
+			*target_ms = atof(argv[i]);
+			if (*target_ms <= 0) {
+				fprintf(stderr, "Error: Invalid value for --target-ms. It must be a positive number\n");
+				exit(-1);
+			}
+		} else if (!strcmp(argv[i], "--interleave")) {
+			i++;
+			if (i == argc) {
+				fprintf(stderr, "Error: --interleave option is missing the pattern\n");
+				exit(-1);
+			}
+			if (!strcmp(argv[i], "checker"))
+				*interleave = INTERLEAVE_CHECKER;
+			else if (!strcmp(argv[i], "2x2"))
+				*interleave = INTERLEAVE_2X2;
+			else {
+				fprintf(stderr, "Error: Invalid value for --interleave. It must be checker or 2x2\n");
+				exit(-1);
+			}
+		} else if (!strcmp(argv[i], "--foveate")) {
+			*foveate = true;
+		} else if (!strcmp(argv[i], "--focus")) {
+			i++;
+			if (i == argc) {
+				fprintf(stderr, "Error: --focus option is missing the point\n");
+				exit(-1);
+			}
+			if (sscanf(argv[i], "%f,%f", focus_x, focus_y) != 2
+				|| *focus_x < 0 || *focus_x > 1 || *focus_y < 0 || *focus_y > 1) {
+				fprintf(stderr, "Error: Invalid value for --focus. It must be <x>,<y> with coordinates between 0 and 1\n");
+				exit(-1);
+			}
+			*foveate = true;
+		} else if (!strcmp(argv[i], "--tile-order")) {
+			i++;
+			if (i == argc) {
+				fprintf(stderr, "Error: --tile-order option is missing the order\n");
+				exit(-1);
+			}
+			if (!strcmp(argv[i], "rows"))
+				order = TILE_ORDER_ROWS;
+			else if (!strcmp(argv[i], "spiral"))
+				order = TILE_ORDER_SPIRAL;
+			else if (!strcmp(argv[i], "hilbert"))
+				order = TILE_ORDER_HILBERT;
+			else {
+				fprintf(stderr, "Error: Invalid value for --tile-order. It must be rows, spiral or hilbert\n");
+				exit(-1);
+			}
+		} else if (!strcmp(argv[i], "--stats")) {
+			*show_stats = true;
+		} else if (!strcmp(argv[i], "--no-scene-cache")) {
+			*use_scene_cache = false;
+		} else if (!strcmp(argv[i], "--compress-bvh")) {
+			*use_compressed_bvh = true;
+		} else if (!strcmp(argv[i], "--reload-bvh")) {
+			i++;
+			if (i == argc) {
+				fprintf(stderr, "Error: --reload-bvh option is missing the builder\n");
+				exit(-1);
+			}
+			if (!strcmp(argv[i], "sah"))
+				*reload_method = BVH_BUILD_SAH;
+			else if (!strcmp(argv[i], "lbvh"))
+				*reload_method = BVH_BUILD_MORTON;
+			else {
+				fprintf(stderr, "Error: Invalid value for --reload-bvh. It must be sah or lbvh\n");
+				exit(-1);
+			}
+		} else if (!strcmp(argv[i], "--gpu-tonemap")) {
+			display->gpu_tonemap = true;
 		} else {
 			fprintf(stderr, "Warning: Ignoring option %s\n", argv[i]);
 		}
@@ -625,15 +2009,23 @@ void parse_arguments_or_exit(int argc, char **argv, int *num_columns, int *init_
 		fprintf(stderr, "Error: No scene specified (you should use --scene <filename>)\n");
 		exit(-1);
 	}
-	if (*num_columns < 0) {
+	if (*num_workers < 0) {
 		fprintf(stderr, "Error: Missing --threads <N> option\n");
 		exit(-1);
 	}
-	if (*num_columns > MAX_COLUMNS)
-		*num_columns = MAX_COLUMNS;
+	if (*num_workers > MAX_WORKERS)
+		*num_workers = MAX_WORKERS;
+	// Foveated rendering starts from the focus point by default
+	if (order < 0)
+		order = *foveate ? TILE_ORDER_SPIRAL : TILE_ORDER_ROWS;
+	*tile_order = order;
+	if (display->gpu_tonemap && display->format != DISPLAY_RGBA16F) {
+		// Tonemapping on the GPU needs the HDR values
+		fprintf(stderr, "Warning: --gpu-tonemap requires the rgba16f display format\n");
+		display->format = DISPLAY_RGBA16F;
+	}
 }
 
-// Must be executed while holding the frame lock
 void screenshot(void)
 {
 	// Choose a file name in the form "screenshot_X.png" where X
@@ -658,19 +2050,24 @@ void screenshot(void)
 		i++;
 	}
 
-	// Convert the frame buffer from one float per pixel to one byte.
-	uint8_t *converted = malloc(frame_w * frame_h * 3 * sizeof(uint8_t));
+	// Resolve the accumulation buffer to one byte per channel. The
+	// image is tonemapped the same way as the display, even when
+	// the display does it on the GPU.
+	DisplaySettings settings = display;
+	settings.format = DISPLAY_RGBA8;
+	settings.gpu_tonemap = false;
+
+	uint8_t *converted = malloc(frame_w * frame_h * 4 * sizeof(uint8_t));
 	if (converted == NULL) {
 		fprintf(stderr, "Couldn't take screenshot (out of memory)\n");
+		return;
 	}
-	for (int i = 0; i < frame_w * frame_h; i++) {
-		converted[i * 3 + 0] = frame[i].x * 255;
-		converted[i * 3 + 1] = frame[i].y * 255;
-		converted[i * 3 + 2] = frame[i].z * 255;
-	}
+	// The accumulation buffer belongs to the main thread,
+	// so there is no need for the lock
+	resolve_pixels(&settings, accum, accum_weights, frame_w * frame_h, converted);
 
 	stbi_flip_vertically_on_write(1);
-	int ok = stbi_write_png(file, frame_w, frame_h, 3, converted, 0);
+	int ok = stbi_write_png(file, frame_w, frame_h, 4, converted, 0);
 
 	free(converted);
 
@@ -684,8 +2081,8 @@ void screenshot(void)
 /// WORKER SYNCHRONIZATION                                                ///
 /////////////////////////////////////////////////////////////////////////////
 
-static bool workers_should_stop;
-os_thread workers[MAX_COLUMNS];
+static _Atomic bool workers_should_stop;
+os_thread workers[MAX_WORKERS];
 
 bool quitting(void)
 {
@@ -698,21 +2095,13 @@ void start_workers(void)
 
 	os_mutex_create(&frame_mutex);
 
-	for (int i = 0; i < num_columns; i++)
-		os_condvar_create(&accum_conds[i]);
-
-	for (int i = 0; i < num_columns; i++)
-		os_thread_create(&workers[i], (void*) i, worker);
+	for (int i = 0; i < num_workers; i++)
+		os_thread_create(&workers[i], (void*) (intptr_t) i, worker);
 }
 
 void stop_workers(void)
 {
-	os_mutex_lock(&frame_mutex);
 	workers_should_stop = true;
-	os_mutex_unlock(&frame_mutex);
-	for (int i = 0; i < num_columns; i++)
+	for (int i = 0; i < num_workers; i++)
 		os_thread_join(workers[i]);
-
-	for (int i = 0; i < num_columns; i++)
-		os_condvar_delete(&accum_conds[i]);
 }
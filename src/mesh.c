@@ -0,0 +1,642 @@
+/*
+Copyright 2024 Francesco Cozzuto
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+associated documentation files (the “Software”), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial
+portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "os.h"
+#include "utils.h"
+#include "mesh.h"
+
+// The arrays of the mesh grow while the file is read
+typedef struct {
+	MeshData *mesh;
+	int       max_vertices;
+	int       max_triangles;
+} MeshBuilder;
+
+static void push_vertex(MeshBuilder *b, Vector3 v)
+{
+	MeshData *mesh = b->mesh;
+	if (mesh->num_vertices == b->max_vertices) {
+		b->max_vertices = b->max_vertices ? 2 * b->max_vertices : 1024;
+		mesh->vertices = realloc(mesh->vertices, sizeof(Vector3) * b->max_vertices);
+		if (mesh->vertices == NULL) {
+			printf("OUT OF MEMORY\n");
+			abort();
+		}
+	}
+	mesh->vertices[mesh->num_vertices++] = v;
+}
+
+static void push_triangle(MeshBuilder *b, int i, int j, int k)
+{
+	MeshData *mesh = b->mesh;
+	if (mesh->num_triangles == b->max_triangles) {
+		b->max_triangles = b->max_triangles ? 2 * b->max_triangles : 1024;
+		mesh->triangles = realloc(mesh->triangles, sizeof(mesh->triangles[0]) * b->max_triangles);
+		if (mesh->triangles == NULL) {
+			printf("OUT OF MEMORY\n");
+			abort();
+		}
+	}
+	mesh->triangles[mesh->num_triangles][0] = i;
+	mesh->triangles[mesh->num_triangles][1] = j;
+	mesh->triangles[mesh->num_triangles][2] = k;
+	mesh->num_triangles++;
+}
+
+void free_mesh_data(MeshData *mesh)
+{
+	free(mesh->vertices);
+	free(mesh->triangles);
+	memset(mesh, 0, sizeof(MeshData));
+}
+
+// Spaces and tabs, but not newlines
+static const char *skip_blanks(const char *p, const char *end)
+{
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+		p++;
+	return p;
+}
+
+static const char *skip_line(const char *p, const char *end)
+{
+	const char *newline = memchr(p, '\n', end - p);
+	return newline ? newline + 1 : end;
+}
+
+// The scanning functions return the position after what they
+// read, or NULL if there isn't a number there
+
+static const char *scan_mesh_float(const char *p, const char *end, float *value)
+{
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+')) {
+		negative = *p == '-';
+		p++;
+	}
+
+	// Digits after the first 19 significant ones only
+	// change the exponent
+	uint64_t digits = 0;
+	int significant = 0;
+	int exponent = 0;
+	bool any = false;
+	while (p < end && is_digit(*p)) {
+		if (significant < 19) {
+			digits = digits * 10 + (*p - '0');
+			if (digits > 0)
+				significant++;
+		} else
+			exponent++;
+		any = true;
+		p++;
+	}
+	if (p < end && *p == '.') {
+		p++;
+		while (p < end && is_digit(*p)) {
+			if (significant < 19) {
+				digits = digits * 10 + (*p - '0');
+				if (digits > 0)
+					significant++;
+				exponent--;
+			}
+			any = true;
+			p++;
+		}
+	}
+	if (!any)
+		return NULL;
+
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		p++;
+		bool exp_negative = false;
+		if (p < end && (*p == '-' || *p == '+')) {
+			exp_negative = *p == '-';
+			p++;
+		}
+		if (p == end || !is_digit(*p))
+			return NULL;
+		int e = 0;
+		while (p < end && is_digit(*p)) {
+			if (e < 10000)
+				e = e * 10 + (*p - '0');
+			p++;
+		}
+		exponent += exp_negative ? -e : e;
+	}
+
+	*value = decimal_to_float(digits, exponent, negative);
+	return p;
+}
+
+// Fails on values that don't fit in 32 bits, since indices
+// and counts are stored as int
+static const char *scan_mesh_int(const char *p, const char *end, long long *value)
+{
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+')) {
+		negative = *p == '-';
+		p++;
+	}
+	if (p == end || !is_digit(*p))
+		return NULL;
+	long long n = 0;
+	while (p < end && is_digit(*p)) {
+		n = n * 10 + (*p - '0');
+		if (n > INT32_MAX)
+			return NULL;
+		p++;
+	}
+	*value = negative ? -n : n;
+	return p;
+}
+
+static bool check_indices(const MeshData *mesh, const char *file)
+{
+	for (int i = 0; i < mesh->num_triangles; i++)
+		for (int k = 0; k < 3; k++) {
+			int index = mesh->triangles[i][k];
+			if (index < 0 || index >= mesh->num_vertices) {
+				fprintf(stderr, "Error: Vertex index out of range in %s\n", file);
+				return false;
+			}
+		}
+	return true;
+}
+
+// Only vertex positions ("v") and faces ("f") are read, everything
+// else (normals, texture coordinates, groups, materials) is skipped.
+// Faces refer to vertices starting from 1, or counting back from the
+// last one read if negative, and can have texture and normal indices
+// after slashes.
+static bool load_obj(const char *src, size_t len, const char *file, MeshData *mesh)
+{
+	MeshBuilder b = { .mesh = mesh };
+	const char *p = src;
+	const char *end = src + len;
+	int line = 1;
+
+	for (; p < end; line++) {
+
+		p = skip_blanks(p, end);
+		if (p + 1 < end && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+
+			float c[3];
+			p += 2;
+			for (int i = 0; i < 3; i++) {
+				p = scan_mesh_float(skip_blanks(p, end), end, &c[i]);
+				if (p == NULL) {
+					fprintf(stderr, "Error: Invalid vertex in %s (line %d)\n", file, line);
+					return false;
+				}
+			}
+			push_vertex(&b, (Vector3) { c[0], c[1], c[2] });
+
+		} else if (p + 1 < end && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+
+			// Polygons are split in a fan of triangles
+			int first = -1;
+			int prev = -1;
+			int count = 0;
+			p = skip_blanks(p + 2, end);
+			while (p < end && *p != '\n') {
+				long long index;
+				p = scan_mesh_int(p, end, &index);
+				if (p == NULL || index == 0) {
+					fprintf(stderr, "Error: Invalid face in %s (line %d)\n", file, line);
+					return false;
+				}
+				while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+					p++;
+				p = skip_blanks(p, end);
+
+				int vertex = index > 0 ? index - 1 : mesh->num_vertices + index;
+				if (count == 0)
+					first = vertex;
+				else if (count >= 2)
+					push_triangle(&b, first, prev, vertex);
+				prev = vertex;
+				count++;
+			}
+			if (count < 3) {
+				fprintf(stderr, "Error: Face with less than 3 vertices in %s (line %d)\n", file, line);
+				return false;
+			}
+		}
+		p = skip_line(p, end);
+	}
+	return check_indices(mesh, file);
+}
+
+typedef enum {
+	PLY_INT8,
+	PLY_UINT8,
+	PLY_INT16,
+	PLY_UINT16,
+	PLY_INT32,
+	PLY_UINT32,
+	PLY_FLOAT32,
+	PLY_FLOAT64,
+} PlyType;
+
+typedef enum {
+	PLY_ASCII,
+	PLY_LITTLE_ENDIAN,
+	PLY_BIG_ENDIAN,
+} PlyFormat;
+
+typedef enum {
+	PLY_OTHER,
+	PLY_X,
+	PLY_Y,
+	PLY_Z,
+	PLY_INDICES,
+} PlyRole;
+
+typedef struct {
+	bool    list;
+	PlyType count_type; // Type of the length of lists
+	PlyType type;
+	PlyRole role;
+} PlyProperty;
+
+#define MAX_PLY_ELEMENTS   16
+#define MAX_PLY_PROPERTIES 32
+
+typedef struct {
+	bool        vertex;
+	bool        face;
+	long long   count;
+	PlyProperty props[MAX_PLY_PROPERTIES];
+	int         num_props;
+} PlyElement;
+
+typedef struct {
+	const char *p;
+	const char *end;
+	PlyFormat   format;
+} PlyReader;
+
+static const struct {
+	const char *name;
+	PlyType     type;
+	int         size;
+} ply_types[] = {
+	{ "char",    PLY_INT8,    1 }, { "int8",    PLY_INT8,    1 },
+	{ "uchar",   PLY_UINT8,   1 }, { "uint8",   PLY_UINT8,   1 },
+	{ "short",   PLY_INT16,   2 }, { "int16",   PLY_INT16,   2 },
+	{ "ushort",  PLY_UINT16,  2 }, { "uint16",  PLY_UINT16,  2 },
+	{ "int",     PLY_INT32,   4 }, { "int32",   PLY_INT32,   4 },
+	{ "uint",    PLY_UINT32,  4 }, { "uint32",  PLY_UINT32,  4 },
+	{ "float",   PLY_FLOAT32, 4 }, { "float32", PLY_FLOAT32, 4 },
+	{ "double",  PLY_FLOAT64, 8 }, { "float64", PLY_FLOAT64, 8 },
+};
+
+static bool parse_ply_type(const char *word, size_t len, PlyType *type)
+{
+	for (int i = 0; i < COUNTOF(ply_types); i++)
+		if (strlen(ply_types[i].name) == len && !memcmp(ply_types[i].name, word, len)) {
+			*type = ply_types[i].type;
+			return true;
+		}
+	return false;
+}
+
+static int ply_type_size(PlyType type)
+{
+	for (int i = 0; i < COUNTOF(ply_types); i++)
+		if (ply_types[i].type == type)
+			return ply_types[i].size;
+	return 0;
+}
+
+static bool read_ply_value(PlyReader *r, PlyType type, double *value)
+{
+	if (r->format == PLY_ASCII) {
+		while (r->p < r->end && is_space(*r->p))
+			r->p++;
+		if (type == PLY_FLOAT32 || type == PLY_FLOAT64) {
+			float f;
+			r->p = scan_mesh_float(r->p, r->end, &f);
+			*value = f;
+		} else {
+			long long n;
+			r->p = scan_mesh_int(r->p, r->end, &n);
+			*value = n;
+		}
+		return r->p != NULL;
+	}
+
+	int size = ply_type_size(type);
+	if (r->end - r->p < size)
+		return false;
+
+	// Values are read in the byte order of the machine
+	// (little endian) and swapped if the file is different
+	unsigned char bytes[8];
+	memcpy(bytes, r->p, size);
+	r->p += size;
+	if (r->format == PLY_BIG_ENDIAN)
+		for (int i = 0; i < size / 2; i++) {
+			unsigned char b = bytes[i];
+			bytes[i] = bytes[size - 1 - i];
+			bytes[size - 1 - i] = b;
+		}
+
+	switch (type) {
+		case PLY_INT8:    { int8_t   v; memcpy(&v, bytes, 1); *value = v; break; }
+		case PLY_UINT8:   { uint8_t  v; memcpy(&v, bytes, 1); *value = v; break; }
+		case PLY_INT16:   { int16_t  v; memcpy(&v, bytes, 2); *value = v; break; }
+		case PLY_UINT16:  { uint16_t v; memcpy(&v, bytes, 2); *value = v; break; }
+		case PLY_INT32:   { int32_t  v; memcpy(&v, bytes, 4); *value = v; break; }
+		case PLY_UINT32:  { uint32_t v; memcpy(&v, bytes, 4); *value = v; break; }
+		case PLY_FLOAT32: { float    v; memcpy(&v, bytes, 4); *value = v; break; }
+		case PLY_FLOAT64: { double   v; memcpy(&v, bytes, 8); *value = v; break; }
+	}
+	return true;
+}
+
+// Returns the next word of the header line, advancing "p"
+static const char *ply_word(const char **p, const char *end, size_t *len)
+{
+	const char *word = skip_blanks(*p, end);
+	const char *q = word;
+	while (q < end && *q != ' ' && *q != '\t' && *q != '\r' && *q != '\n')
+		q++;
+	*len = q - word;
+	*p = q;
+	return word;
+}
+
+static bool word_is(const char *word, size_t len, const char *name)
+{
+	return strlen(name) == len && !memcmp(word, name, len);
+}
+
+// The header lists the elements stored in the file, in order, with
+// the type of each of their properties. Vertices are read from the
+// "x", "y" and "z" properties of the "vertex" element and triangles
+// from the "vertex_indices" list of the "face" element. Everything
+// else is skipped.
+static bool load_ply(const char *src, size_t len, const char *file, MeshData *mesh)
+{
+	const char *p = src;
+	const char *end = src + len;
+
+	PlyElement elements[MAX_PLY_ELEMENTS];
+	int num_elements = 0;
+	PlyFormat format = PLY_ASCII;
+	bool has_format = false;
+
+	p = skip_line(p, end); // "ply"
+	for (;;) {
+		if (p == end) {
+			fprintf(stderr, "Error: Missing 'end_header' in %s\n", file);
+			return false;
+		}
+
+		size_t len;
+		const char *word = ply_word(&p, end, &len);
+
+		if (word_is(word, len, "end_header")) {
+			p = skip_line(p, end);
+			break;
+		}
+
+		if (word_is(word, len, "format")) {
+			word = ply_word(&p, end, &len);
+			if (word_is(word, len, "ascii"))
+				format = PLY_ASCII;
+			else if (word_is(word, len, "binary_little_endian"))
+				format = PLY_LITTLE_ENDIAN;
+			else if (word_is(word, len, "binary_big_endian"))
+				format = PLY_BIG_ENDIAN;
+			else {
+				fprintf(stderr, "Error: Unknown format in %s\n", file);
+				return false;
+			}
+			has_format = true;
+
+		} else if (word_is(word, len, "element")) {
+			if (num_elements == MAX_PLY_ELEMENTS) {
+				fprintf(stderr, "Error: Too many elements in %s\n", file);
+				return false;
+			}
+			PlyElement *element = &elements[num_elements++];
+			memset(element, 0, sizeof(PlyElement));
+			word = ply_word(&p, end, &len);
+			element->vertex = word_is(word, len, "vertex");
+			element->face   = word_is(word, len, "face");
+			const char *count = skip_blanks(p, end);
+			p = scan_mesh_int(count, end, &element->count);
+			if (p == NULL || element->count < 0 || element->count > INT32_MAX) {
+				fprintf(stderr, "Error: Invalid element count in %s\n", file);
+				return false;
+			}
+
+		} else if (word_is(word, len, "property")) {
+			if (num_elements == 0) {
+				fprintf(stderr, "Error: Property outside of an element in %s\n", file);
+				return false;
+			}
+			PlyElement *element = &elements[num_elements-1];
+			if (element->num_props == MAX_PLY_PROPERTIES) {
+				fprintf(stderr, "Error: Too many properties in %s\n", file);
+				return false;
+			}
+			PlyProperty *prop = &element->props[element->num_props++];
+			memset(prop, 0, sizeof(PlyProperty));
+
+			word = ply_word(&p, end, &len);
+			if (word_is(word, len, "list")) {
+				prop->list = true;
+				word = ply_word(&p, end, &len);
+				if (!parse_ply_type(word, len, &prop->count_type)) {
+					fprintf(stderr, "Error: Unknown property type in %s\n", file);
+					return false;
+				}
+				word = ply_word(&p, end, &len);
+			}
+			if (!parse_ply_type(word, len, &prop->type)) {
+				fprintf(stderr, "Error: Unknown property type in %s\n", file);
+				return false;
+			}
+
+			word = ply_word(&p, end, &len);
+			if (element->vertex && !prop->list) {
+				if (word_is(word, len, "x")) prop->role = PLY_X;
+				if (word_is(word, len, "y")) prop->role = PLY_Y;
+				if (word_is(word, len, "z")) prop->role = PLY_Z;
+			}
+			if (element->face && prop->list && (word_is(word, len, "vertex_indices") || word_is(word, len, "vertex_index")))
+				prop->role = PLY_INDICES;
+		}
+
+		// Comments and anything else are ignored
+		p = skip_line(p, end);
+	}
+	if (!has_format) {
+		fprintf(stderr, "Error: Missing format in %s\n", file);
+		return false;
+	}
+
+	MeshBuilder b = { .mesh = mesh };
+	PlyReader r = { p, end, format };
+	for (int i = 0; i < num_elements; i++) {
+		PlyElement *element = &elements[i];
+		for (long long j = 0; j < element->count; j++) {
+
+			float c[3] = {0, 0, 0};
+			int first = -1;
+			int prev = -1;
+			for (int k = 0; k < element->num_props; k++) {
+				PlyProperty *prop = &element->props[k];
+				double value;
+
+				if (!prop->list) {
+					if (!read_ply_value(&r, prop->type, &value)) {
+						fprintf(stderr, "Error: Truncated or invalid data in %s\n", file);
+						return false;
+					}
+					if (prop->role >= PLY_X && prop->role <= PLY_Z)
+						c[prop->role - PLY_X] = value;
+					continue;
+				}
+
+				double count;
+				if (!read_ply_value(&r, prop->count_type, &count) || count < 0 || count > INT32_MAX) {
+					fprintf(stderr, "Error: Truncated or invalid data in %s\n", file);
+					return false;
+				}
+				if (prop->role == PLY_INDICES && count < 3) {
+					fprintf(stderr, "Error: Face with less than 3 vertices in %s\n", file);
+					return false;
+				}
+				for (int n = 0; n < (int) count; n++) {
+					if (!read_ply_value(&r, prop->type, &value)) {
+						fprintf(stderr, "Error: Truncated or invalid data in %s\n", file);
+						return false;
+					}
+					if (prop->role != PLY_INDICES)
+						continue;
+
+					// Polygons are split in a fan of triangles
+					int vertex = value < 0 || value > INT32_MAX ? -1 : (int) value;
+					if (n == 0)
+						first = vertex;
+					else if (n >= 2)
+						push_triangle(&b, first, prev, vertex);
+					prev = vertex;
+				}
+			}
+			if (element->vertex)
+				push_vertex(&b, (Vector3) { c[0], c[1], c[2] });
+		}
+	}
+	return check_indices(mesh, file);
+}
+
+bool load_mesh(const char *file, MeshData *mesh)
+{
+	memset(mesh, 0, sizeof(MeshData));
+
+	os_file_map map;
+	if (!os_file_map_open(&map, file)) {
+		fprintf(stderr, "Error: Couldn't open mesh %s\n", file);
+		return false;
+	}
+
+	const char *src = map.data;
+	size_t len = map.size;
+
+	bool ok;
+	if (len >= 4 && !memcmp(src, "ply", 3) && (src[3] == '\n' || src[3] == '\r'))
+		ok = load_ply(src, len, file, mesh);
+	else
+		ok = load_obj(src, len, file, mesh);
+	os_file_map_close(&map);
+
+	if (ok && mesh->num_triangles == 0) {
+		fprintf(stderr, "Error: Mesh %s has no triangles\n", file);
+		ok = false;
+	}
+	if (!ok)
+		free_mesh_data(mesh);
+	return ok;
+}
+
+bool build_mesh_bvh(const MeshData *mesh, BVH *bvh, TriangleBlock **blocks_, int *num_blocks_)
+{
+	AABB *boxes = malloc(sizeof(AABB) * (mesh->num_triangles + 1));
+	if (boxes == NULL)
+		return false;
+	for (int i = 0; i < mesh->num_triangles; i++) {
+		AABB box = empty_aabb();
+		for (int k = 0; k < 3; k++)
+			box = grow_aabb(box, mesh->vertices[mesh->triangles[i][k]]);
+		boxes[i] = box;
+	}
+	bool ok = build_bvh(bvh, boxes, mesh->num_triangles, BVH_BUILD_SAH, NULL);
+	free(boxes);
+	if (!ok)
+		return false;
+
+	int num_blocks = 0;
+	for (int i = 0; i < bvh->num_nodes; i++)
+		num_blocks += (bvh->nodes[i].count + 3) / 4;
+
+	TriangleBlock *blocks = malloc(sizeof(TriangleBlock) * (num_blocks + 1));
+	if (blocks == NULL) {
+		free_bvh(bvh);
+		return false;
+	}
+
+	num_blocks = 0;
+	for (int i = 0; i < bvh->num_nodes; i++) {
+		BVHNode *node = &bvh->nodes[i];
+		if (node->count == 0)
+			continue;
+
+		int first = num_blocks;
+		num_blocks += (node->count + 3) / 4;
+		for (int j = 0; j < 4 * (num_blocks - first); j++) {
+			int *triangle = mesh->triangles[bvh->prims[node->index + (j < node->count ? j : node->count - 1)]];
+			TriangleBlock *block = &blocks[first + j / 4];
+			for (int k = 0; k < 3; k++) {
+				Vector3 v = mesh->vertices[triangle[k]];
+				block->v[k][0][j % 4] = v.x;
+				block->v[k][1][j % 4] = v.y;
+				block->v[k][2][j % 4] = v.z;
+			}
+		}
+		node->index = first;
+	}
+
+	free(bvh->prims);
+	bvh->prims = NULL;
+	bvh->num_prims = 0;
+
+	*blocks_ = blocks;
+	*num_blocks_ = num_blocks;
+	return true;
+}
@@ -0,0 +1,186 @@
+/*
+Copyright 2024 Francesco Cozzuto
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+associated documentation files (the “Software”), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial
+portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef MESH_INCLUDED
+#define MESH_INCLUDED
+
+#include <stdbool.h>
+#include <x86intrin.h>
+
+#include "vector.h"
+#include "bvh.h"
+
+// Triangles of a mesh file as indices in its vertex array
+typedef struct {
+	Vector3 *vertices;
+	int      num_vertices;
+	int    (*triangles)[3];
+	int      num_triangles;
+} MeshData;
+
+// Reads a Wavefront OBJ or PLY (ascii or binary) file. The file is
+// mapped and parsed in place. Polygons are split in triangles. Returns
+// false after printing an error if the file can't be read or is invalid.
+bool load_mesh(const char *file, MeshData *mesh);
+void free_mesh_data(MeshData *mesh);
+
+// Four triangles stored one coordinate at a time so that a ray is
+// tested against all of them with SSE. The vertices of the triangle
+// in lane "i" are (v[k][0][i], v[k][1][i], v[k][2][i]) for k = 0, 1, 2.
+typedef struct {
+	_Alignas(16) float v[3][3][4];
+} TriangleBlock;
+
+// Builds the tree over the triangles of a mesh. The triangles of every
+// leaf are packed in consecutive blocks: the "index" of leaves is their
+// first block and "count" their number of triangles. Unused lanes
+// repeat the last triangle of the leaf. The tree has no primitive array.
+bool build_mesh_bvh(const MeshData *mesh, BVH *bvh, TriangleBlock **blocks, int *num_blocks);
+
+// Ray prepared for the watertight ray/triangle test [Woop et al. 2013,
+// "Watertight Ray/Triangle Intersection"]. The axis where the direction
+// is largest becomes z and the triangles are sheared so that the ray
+// points along it. Hits on shared edges and vertices are then decided
+// the same way for all the triangles touching them, so rays never slip
+// between triangles of a closed mesh.
+typedef struct {
+	Vector3 origin;
+	int     kx, ky, kz;
+	float   sx, sy, sz;
+} TriangleRay;
+
+static inline float vector_component(Vector3 v, int k)
+{
+	return k == 0 ? v.x : (k == 1 ? v.y : v.z);
+}
+
+static inline TriangleRay prepare_triangle_ray(Vector3 origin, Vector3 dir)
+{
+	TriangleRay r;
+	float ax = dir.x < 0 ? -dir.x : dir.x;
+	float ay = dir.y < 0 ? -dir.y : dir.y;
+	float az = dir.z < 0 ? -dir.z : dir.z;
+	r.kz = ax > ay ? (ax > az ? 0 : 2) : (ay > az ? 1 : 2);
+	r.kx = (r.kz + 1) % 3;
+	r.ky = (r.kx + 1) % 3;
+
+	// Keep the winding of the triangles
+	float dz = vector_component(dir, r.kz);
+	if (dz < 0) {
+		int k = r.kx;
+		r.kx = r.ky;
+		r.ky = k;
+	}
+	r.sx = vector_component(dir, r.kx) / dz;
+	r.sy = vector_component(dir, r.ky) / dz;
+	r.sz = 1.0f / dz;
+	r.origin = origin;
+	return r;
+}
+
+// Returns the lane of the nearest of the first "count" triangles of the
+// block hit before "max_t", storing the distance in "t", or -1.
+static inline int intersect_triangle_block(const TriangleRay *r, const TriangleBlock *block, int count, float max_t, float *t)
+{
+	__m128 ox = _mm_set1_ps(vector_component(r->origin, r->kx));
+	__m128 oy = _mm_set1_ps(vector_component(r->origin, r->ky));
+	__m128 oz = _mm_set1_ps(vector_component(r->origin, r->kz));
+	__m128 sx = _mm_set1_ps(r->sx);
+	__m128 sy = _mm_set1_ps(r->sy);
+	__m128 sz = _mm_set1_ps(r->sz);
+
+	// Vertices relative to the origin, sheared and scaled
+	__m128 az = _mm_sub_ps(_mm_load_ps(block->v[0][r->kz]), oz);
+	__m128 bz = _mm_sub_ps(_mm_load_ps(block->v[1][r->kz]), oz);
+	__m128 cz = _mm_sub_ps(_mm_load_ps(block->v[2][r->kz]), oz);
+	__m128 ax = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(block->v[0][r->kx]), ox), _mm_mul_ps(sx, az));
+	__m128 ay = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(block->v[0][r->ky]), oy), _mm_mul_ps(sy, az));
+	__m128 bx = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(block->v[1][r->kx]), ox), _mm_mul_ps(sx, bz));
+	__m128 by = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(block->v[1][r->ky]), oy), _mm_mul_ps(sy, bz));
+	__m128 cx = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(block->v[2][r->kx]), ox), _mm_mul_ps(sx, cz));
+	__m128 cy = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(block->v[2][r->ky]), oy), _mm_mul_ps(sy, cz));
+
+	// Scaled barycentric coordinates
+	__m128 u = _mm_sub_ps(_mm_mul_ps(cx, by), _mm_mul_ps(cy, bx));
+	__m128 v = _mm_sub_ps(_mm_mul_ps(ax, cy), _mm_mul_ps(ay, cx));
+	__m128 w = _mm_sub_ps(_mm_mul_ps(bx, ay), _mm_mul_ps(by, ax));
+
+	// When the ray passes exactly through an edge the sign of the
+	// coordinate isn't reliable in single precision
+	__m128 zero = _mm_setzero_ps();
+	int on_edge = _mm_movemask_ps(_mm_or_ps(_mm_or_ps(_mm_cmpeq_ps(u, zero), _mm_cmpeq_ps(v, zero)), _mm_cmpeq_ps(w, zero)));
+	if (on_edge) {
+		_Alignas(16) float fu[4], fv[4], fw[4], fax[4], fay[4], fbx[4], fby[4], fcx[4], fcy[4];
+		_mm_store_ps(fu, u);   _mm_store_ps(fv, v);   _mm_store_ps(fw, w);
+		_mm_store_ps(fax, ax); _mm_store_ps(fay, ay);
+		_mm_store_ps(fbx, bx); _mm_store_ps(fby, by);
+		_mm_store_ps(fcx, cx); _mm_store_ps(fcy, cy);
+		for (int i = 0; i < 4; i++) {
+			if (!(on_edge & (1 << i)))
+				continue;
+			fu[i] = (float) ((double) fcx[i] * fby[i] - (double) fcy[i] * fbx[i]);
+			fv[i] = (float) ((double) fax[i] * fcy[i] - (double) fay[i] * fcx[i]);
+			fw[i] = (float) ((double) fbx[i] * fay[i] - (double) fby[i] * fax[i]);
+		}
+		u = _mm_load_ps(fu);
+		v = _mm_load_ps(fv);
+		w = _mm_load_ps(fw);
+	}
+
+	// The ray misses when the coordinates have different signs
+	__m128 negative = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(u, zero), _mm_cmplt_ps(v, zero)), _mm_cmplt_ps(w, zero));
+	__m128 positive = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(u, zero), _mm_cmpgt_ps(v, zero)), _mm_cmpgt_ps(w, zero));
+	__m128 det = _mm_add_ps(_mm_add_ps(u, v), w);
+	__m128 miss = _mm_or_ps(_mm_and_ps(negative, positive), _mm_cmpeq_ps(det, zero));
+
+	// The distance is T / det. Comparing T with the sign of det
+	// removed avoids the division for triangles that are missed.
+	__m128 sign_mask = _mm_set1_ps(-0.0f);
+	__m128 det_sign  = _mm_and_ps(det, sign_mask);
+	__m128 abs_det   = _mm_xor_ps(det, det_sign);
+	__m128 tt = _mm_mul_ps(sz, _mm_add_ps(_mm_add_ps(_mm_mul_ps(u, az), _mm_mul_ps(v, bz)), _mm_mul_ps(w, cz)));
+	tt = _mm_xor_ps(tt, det_sign);
+	__m128 in_range = _mm_and_ps(_mm_cmpgt_ps(tt, zero), _mm_cmplt_ps(tt, _mm_mul_ps(_mm_set1_ps(max_t), abs_det)));
+
+	int hits = _mm_movemask_ps(_mm_andnot_ps(miss, in_range)) & ((1 << count) - 1);
+	if (hits == 0)
+		return -1;
+
+	_Alignas(16) float dist[4];
+	_mm_store_ps(dist, _mm_div_ps(tt, abs_det));
+	int nearest = -1;
+	for (int i = 0; i < 4; i++)
+		if ((hits & (1 << i)) && (nearest < 0 || dist[i] < dist[nearest]))
+			nearest = i;
+	*t = dist[nearest];
+	return nearest;
+}
+
+// Geometric normal of a triangle of the block, facing the ray
+static inline Vector3 triangle_normal(const TriangleBlock *block, int lane, Vector3 dir)
+{
+	Vector3 p[3];
+	for (int k = 0; k < 3; k++)
+		p[k] = (Vector3) { block->v[k][0][lane], block->v[k][1][lane], block->v[k][2][lane] };
+	Vector3 n = normalize(cross(combine(p[1], p[0], 1, -1), combine(p[2], p[0], 1, -1)));
+	if (dotv(n, dir) > 0)
+		n = scalev(n, -1);
+	return n;
+}
+
+#endif
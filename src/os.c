@@ -34,12 +34,20 @@ For more information, please refer to <http://unlicense.org/>
 #ifdef _WIN32
 #define WIN32_MEAN_AND_LEAN
 #include <windows.h>
+#include <string.h>
 #endif
 
 #ifdef __linux__
 #include <time.h>
 #include <errno.h>
+#include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 #endif
 
 //#define SYNC_PRINT_ERRORS
@@ -96,7 +104,7 @@ uint64_t get_relative_time_ns(void)
 	{
 		struct timespec time;
 
-		if (clock_gettime(CLOCK_REALTIME, &time))
+		if (clock_gettime(CLOCK_MONOTONIC, &time))
 			abort();
 
 		uint64_t res;
@@ -167,6 +175,25 @@ void os_mutex_lock(os_mutex_t *mutex)
 
 }
 
+bool os_mutex_trylock(os_mutex_t *mutex)
+{
+
+#if defined(_WIN32)
+	return TryEnterCriticalSection(mutex);
+#elif defined(__linux__)
+	int err = pthread_mutex_trylock(mutex);
+	if (err == EBUSY)
+		return false;
+	if (err)
+		abort();
+	return true;
+#else
+	(void) mutex;
+	return true;
+#endif
+
+}
+
 void os_mutex_unlock(os_mutex_t *mutex)
 {
 
@@ -267,6 +294,20 @@ void os_condvar_signal(os_condvar_t *condvar)
 
 }
 
+void os_condvar_broadcast(os_condvar_t *condvar)
+{
+
+#if defined(_WIN32)
+	WakeAllConditionVariable(condvar);
+#elif defined(__linux__)
+	if (pthread_cond_broadcast(condvar))
+		abort();
+#else
+    (void) condvar;
+#endif
+
+}
+
 void semaphore_create(semaphore_t *sem, int count)
 {
 	sem->count = count;
@@ -416,4 +457,297 @@ uint64_t get_thread_id(void)
 	static _Thread_local uint64_t id = 0;
 	if (id == 0) id = atomic_fetch_add(&next_id, 1);
 	return id;
-}
\ No newline at end of file
+}
+
+#ifdef __linux__
+static int open_hardware_counter(uint64_t config)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.type   = PERF_TYPE_HARDWARE;
+	attr.size   = sizeof(attr);
+	attr.config = config;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv     = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+bool os_cache_counters_open(os_cache_counters *counters)
+{
+#ifdef __linux__
+	counters->misses     = open_hardware_counter(PERF_COUNT_HW_CACHE_MISSES);
+	counters->references = open_hardware_counter(PERF_COUNT_HW_CACHE_REFERENCES);
+	if (counters->misses < 0 || counters->references < 0) {
+		os_cache_counters_close(counters);
+		return false;
+	}
+	return true;
+#else
+	counters->misses     = -1;
+	counters->references = -1;
+	return false;
+#endif
+}
+
+void os_cache_counters_close(os_cache_counters *counters)
+{
+#ifdef __linux__
+	if (counters->misses >= 0)
+		close(counters->misses);
+	if (counters->references >= 0)
+		close(counters->references);
+#endif
+	counters->misses     = -1;
+	counters->references = -1;
+}
+
+void os_cache_counters_read(os_cache_counters *counters, uint64_t *misses, uint64_t *references)
+{
+	*misses = 0;
+	*references = 0;
+#ifdef __linux__
+	if (counters->misses >= 0 && read(counters->misses, misses, sizeof(uint64_t)) != sizeof(uint64_t))
+		*misses = 0;
+	if (counters->references >= 0 && read(counters->references, references, sizeof(uint64_t)) != sizeof(uint64_t))
+		*references = 0;
+#else
+	(void) counters;
+#endif
+}
+
+bool os_file_map_open(os_file_map *map, const char *file)
+{
+	map->data = NULL;
+	map->size = 0;
+#if defined(_WIN32)
+	map->mapping = NULL;
+
+	HANDLE handle = CreateFileA(file, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (handle == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(handle, &size) || size.QuadPart == 0) {
+		CloseHandle(handle);
+		return false;
+	}
+
+	// The mapping keeps the file open, so the handle isn't needed anymore
+	HANDLE mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(handle);
+	if (mapping == NULL)
+		return false;
+
+	void *data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (data == NULL) {
+		CloseHandle(mapping);
+		return false;
+	}
+	map->mapping = mapping;
+	map->data = data;
+	map->size = (size_t) size.QuadPart;
+	return true;
+#elif defined(__linux__)
+	int fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat info;
+	if (fstat(fd, &info) < 0 || info.st_size == 0) {
+		close(fd);
+		return false;
+	}
+
+	void *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return false;
+
+	map->data = data;
+	map->size = info.st_size;
+	return true;
+#else
+	(void) file;
+	return false;
+#endif
+}
+
+void os_file_map_close(os_file_map *map)
+{
+	if (map->data == NULL)
+		return;
+#if defined(_WIN32)
+	UnmapViewOfFile(map->data);
+	CloseHandle(map->mapping);
+#elif defined(__linux__)
+	munmap((void*) map->data, map->size);
+#endif
+	map->data = NULL;
+	map->size = 0;
+}
+
+bool os_file_watch_open(os_file_watch *watch, const char *file)
+{
+#if defined(_WIN32)
+	WIN32_FILE_ATTRIBUTE_DATA info;
+	if (strlen(file) >= sizeof(watch->file) || !GetFileAttributesExA(file, GetFileExInfoStandard, &info))
+		return false;
+	strcpy(watch->file, file);
+	watch->last_write = (uint64_t) info.ftLastWriteTime.dwLowDateTime | ((uint64_t) info.ftLastWriteTime.dwHighDateTime << 32);
+	return true;
+#elif defined(__linux__)
+	// The directory is watched instead of the file, since the
+	// file may be replaced by a new one. Only events after the
+	// file is complete are watched: a file that was just created
+	// may still be empty.
+	char dir[1024];
+	const char *slash = strrchr(file, '/');
+	const char *name = slash ? slash + 1 : file;
+	size_t dir_len = slash ? (size_t) (slash - file) : 1;
+	if (dir_len >= sizeof(dir) || strlen(name) >= sizeof(watch->name))
+		return false;
+	if (slash) {
+		memcpy(dir, file, dir_len);
+		if (dir_len == 0)
+			dir[dir_len++] = '/';
+	} else
+		dir[0] = '.';
+	dir[dir_len] = '\0';
+	strcpy(watch->name, name);
+
+	watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (watch->fd < 0)
+		return false;
+	if (inotify_add_watch(watch->fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		close(watch->fd);
+		return false;
+	}
+	return true;
+#else
+	(void) watch;
+	(void) file;
+	return false;
+#endif
+}
+
+void os_file_watch_close(os_file_watch *watch)
+{
+#if defined(__linux__)
+	close(watch->fd);
+#else
+	(void) watch;
+#endif
+}
+
+bool os_file_watch_changed(os_file_watch *watch)
+{
+#if defined(_WIN32)
+	// Polling is cheap enough to do every frame
+	WIN32_FILE_ATTRIBUTE_DATA info;
+	if (!GetFileAttributesExA(watch->file, GetFileExInfoStandard, &info))
+		return false;
+	uint64_t last_write = (uint64_t) info.ftLastWriteTime.dwLowDateTime | ((uint64_t) info.ftLastWriteTime.dwHighDateTime << 32);
+	if (last_write == watch->last_write)
+		return false;
+	watch->last_write = last_write;
+	return true;
+#elif defined(__linux__)
+	bool changed = false;
+	_Alignas(struct inotify_event) char buffer[4096];
+	for (;;) {
+		ssize_t num = read(watch->fd, buffer, sizeof(buffer));
+		if (num <= 0)
+			break;
+		for (ssize_t i = 0; i < num; ) {
+			struct inotify_event *event = (struct inotify_event*) (buffer + i);
+			if (event->len > 0 && !strcmp(event->name, watch->name))
+				changed = true;
+			i += sizeof(struct inotify_event) + event->len;
+		}
+	}
+	return changed;
+#else
+	(void) watch;
+	return false;
+#endif
+}
+
+bool os_is_stream(const char *file)
+{
+	if (!strcmp(file, "-"))
+		return true;
+#if defined(_WIN32)
+	return !strncmp(file, "\\\\.\\pipe\\", 9);
+#elif defined(__linux__)
+	struct stat info;
+	return !stat(file, &info) && S_ISFIFO(info.st_mode);
+#else
+	return false;
+#endif
+}
+
+bool os_stream_open(os_stream *stream, const char *file)
+{
+#if defined(_WIN32)
+	if (!strcmp(file, "-")) {
+		stream->handle = GetStdHandle(STD_INPUT_HANDLE);
+		stream->owned  = false;
+	} else {
+		stream->handle = CreateFileA(file, GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		stream->owned  = true;
+	}
+	return stream->handle != NULL && stream->handle != INVALID_HANDLE_VALUE;
+#elif defined(__linux__)
+	if (!strcmp(file, "-"))
+		stream->fd = STDIN_FILENO;
+	else
+		stream->fd = open(file, O_RDONLY);
+	return stream->fd >= 0;
+#else
+	(void) stream;
+	(void) file;
+	return false;
+#endif
+}
+
+void os_stream_close(os_stream *stream)
+{
+#if defined(_WIN32)
+	if (stream->owned)
+		CloseHandle(stream->handle);
+#elif defined(__linux__)
+	if (stream->fd != STDIN_FILENO)
+		close(stream->fd);
+#else
+	(void) stream;
+#endif
+}
+
+long os_stream_read(os_stream *stream, void *dst, size_t max)
+{
+#if defined(_WIN32)
+	DWORD num;
+	if (max > 0x40000000)
+		max = 0x40000000;
+	if (!ReadFile(stream->handle, dst, (DWORD) max, &num, NULL)) {
+		// The writer closed its end of the pipe
+		if (GetLastError() == ERROR_BROKEN_PIPE)
+			return 0;
+		return -1;
+	}
+	return num;
+#elif defined(__linux__)
+	for (;;) {
+		ssize_t num = read(stream->fd, dst, max);
+		if (num < 0 && errno == EINTR)
+			continue;
+		return num;
+	}
+#else
+	(void) stream;
+	(void) dst;
+	(void) max;
+	return -1;
+#endif
+}
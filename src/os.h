@@ -24,6 +24,10 @@ OTHER DEALINGS IN THE SOFTWARE.
 
 For more information, please refer to <http://unlicense.org/>
 */
+#ifndef OS_INCLUDED
+#define OS_INCLUDED
+
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include "profile.h"
@@ -63,12 +67,14 @@ void sleep_ms(float ms);
 void os_mutex_create(os_mutex_t *mutex);
 void os_mutex_delete(os_mutex_t *mutex);
 void os_mutex_lock  (os_mutex_t *mutex);
+bool os_mutex_trylock(os_mutex_t *mutex);
 void os_mutex_unlock(os_mutex_t *mutex);
 
 void os_condvar_create(os_condvar_t *condvar);
 void os_condvar_delete(os_condvar_t *condvar);
 bool os_condvar_wait  (os_condvar_t *condvar, os_mutex_t *mutex, int timeout_ms);
 void os_condvar_signal(os_condvar_t *condvar);
+void os_condvar_broadcast(os_condvar_t *condvar);
 
 void semaphore_create(semaphore_t *sem, int count);
 void semaphore_delete(semaphore_t *sem);
@@ -97,4 +103,73 @@ typedef void *os_threadreturn;
 uint64_t get_thread_id(void);
 
 void            os_thread_create(os_thread *thread, void *arg, os_threadreturn (*func)(void*));
-os_threadreturn os_thread_join(os_thread thread);
\ No newline at end of file
+os_threadreturn os_thread_join(os_thread thread);
+
+// Hardware counters of the cache misses and cache references of the
+// calling thread. On most CPUs these generic events count accesses to
+// the last level cache. Opening them fails where the performance
+// counters aren't accessible, for example in most virtual machines.
+typedef struct {
+	int misses;
+	int references;
+} os_cache_counters;
+
+bool os_cache_counters_open (os_cache_counters *counters);
+void os_cache_counters_close(os_cache_counters *counters);
+void os_cache_counters_read (os_cache_counters *counters, uint64_t *misses, uint64_t *references);
+
+// Read-only view of a whole file. The pages are loaded lazily and
+// shared with the page cache, so mapping a file costs the same
+// regardless of its size.
+typedef struct {
+	const void *data;
+	size_t      size;
+#ifdef _WIN32
+	void *mapping;
+#endif
+} os_file_map;
+
+bool os_file_map_open (os_file_map *map, const char *file);
+void os_file_map_close(os_file_map *map);
+
+// Notices when a file is modified, including when an editor saves it
+// by writing a new file and renaming it over the old one.
+typedef struct {
+#ifdef _WIN32
+	char     file[1024];
+	uint64_t last_write;
+#else
+	int      fd;
+	char     name[256];
+#endif
+} os_file_watch;
+
+bool os_file_watch_open (os_file_watch *watch, const char *file);
+void os_file_watch_close(os_file_watch *watch);
+
+// Returns true if the file changed since the last call. It doesn't block.
+bool os_file_watch_changed(os_file_watch *watch);
+
+// Sequential reader of the standard input ("-") or of a named pipe.
+// Reads return as soon as some data is available instead of waiting
+// for the buffer to be filled, so data can be used as it's produced.
+typedef struct {
+#ifdef _WIN32
+	void *handle;
+	bool  owned;
+#else
+	int   fd;
+#endif
+} os_stream;
+
+// Whether the file is the standard input or a named pipe
+bool os_is_stream(const char *file);
+
+bool os_stream_open (os_stream *stream, const char *file);
+void os_stream_close(os_stream *stream);
+
+// Returns the number of bytes read, 0 at the end of
+// the stream or -1 if an error occurred
+long os_stream_read(os_stream *stream, void *dst, size_t max);
+
+#endif
@@ -0,0 +1,176 @@
+/*
+Copyright 2024 Francesco Cozzuto
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+associated documentation files (the “Software”), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial
+portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "pool.h"
+
+static void run_chunks(Pool *pool)
+{
+	for (;;) {
+		int begin = atomic_fetch_add(&pool->next, pool->chunk);
+		if (begin >= pool->count)
+			break;
+		int end = begin + pool->chunk;
+		if (end > pool->count)
+			end = pool->count;
+		pool->func(pool->data, begin, end);
+	}
+}
+
+// Runs the open loop along with the other threads. Must be
+// called while holding the lock, which is released meanwhile.
+static void join_loop(Pool *pool)
+{
+	pool->active++;
+	os_mutex_unlock(&pool->mutex);
+
+	run_chunks(pool);
+
+	os_mutex_lock(&pool->mutex);
+	pool->active--;
+	if (pool->active == 0)
+		os_condvar_signal(&pool->done_cond);
+}
+
+static os_threadreturn pool_thread(void *arg)
+{
+	Pool *pool = arg;
+	uint64_t last_job = 0;
+
+	os_mutex_lock(&pool->mutex);
+	for (;;) {
+
+		while (!pool->quit && pool->job == last_job)
+			os_condvar_wait(&pool->work_cond, &pool->mutex, -1);
+		if (pool->quit)
+			break;
+		last_job = pool->job;
+
+		// The loop may have been completed by the other
+		// threads before this one woke up.
+		if (!pool->open)
+			continue;
+
+		join_loop(pool);
+	}
+	os_mutex_unlock(&pool->mutex);
+	return 0;
+}
+
+void init_pool(Pool *pool, int num_threads)
+{
+	if (num_threads > MAX_POOL_THREADS)
+		num_threads = MAX_POOL_THREADS;
+
+	pool->num_threads = num_threads;
+	pool->num_helpers = 0;
+	pool->func   = NULL;
+	pool->data   = NULL;
+	pool->count  = 0;
+	pool->chunk  = 1;
+	pool->job    = 0;
+	pool->open   = false;
+	pool->active = 0;
+	pool->quit   = false;
+	atomic_store(&pool->next, 0);
+
+	os_mutex_create(&pool->mutex);
+	os_condvar_create(&pool->work_cond);
+	os_condvar_create(&pool->done_cond);
+
+	for (int i = 0; i < num_threads; i++)
+		os_thread_create(&pool->threads[i], pool, pool_thread);
+}
+
+void init_helped_pool(Pool *pool, int num_helpers)
+{
+	init_pool(pool, 0);
+	pool->num_helpers = num_helpers;
+}
+
+int count_pool_threads(const Pool *pool)
+{
+	return pool->num_threads + pool->num_helpers + 1;
+}
+
+bool help_parallel_for(Pool *pool)
+{
+	// Helpers call this often, so the lock is only
+	// taken when there is a loop to join
+	if (!atomic_load_explicit(&pool->open, memory_order_relaxed))
+		return false;
+
+	// Loops with no chunks left to hand out are
+	// about to be closed, so they're not joined
+	os_mutex_lock(&pool->mutex);
+	bool joined = pool->open && atomic_load(&pool->next) < pool->count;
+	if (joined)
+		join_loop(pool);
+	os_mutex_unlock(&pool->mutex);
+	return joined;
+}
+
+void free_pool(Pool *pool)
+{
+	os_mutex_lock(&pool->mutex);
+	pool->quit = true;
+	os_condvar_broadcast(&pool->work_cond);
+	os_mutex_unlock(&pool->mutex);
+
+	for (int i = 0; i < pool->num_threads; i++)
+		os_thread_join(pool->threads[i]);
+
+	os_condvar_delete(&pool->work_cond);
+	os_condvar_delete(&pool->done_cond);
+	os_mutex_delete(&pool->mutex);
+}
+
+void parallel_for(Pool *pool, int count, int chunk, ParallelForFunc func, void *data)
+{
+	if (count <= 0)
+		return;
+	if (chunk < 1)
+		chunk = 1;
+
+	// Not worth waking up other threads
+	if (count_pool_threads(pool) == 1 || count <= chunk) {
+		func(data, 0, count);
+		return;
+	}
+
+	os_mutex_lock(&pool->mutex);
+	pool->func  = func;
+	pool->data  = data;
+	pool->count = count;
+	pool->chunk = chunk;
+	atomic_store(&pool->next, 0);
+	pool->open = true;
+	pool->job++;
+	os_condvar_broadcast(&pool->work_cond);
+	os_mutex_unlock(&pool->mutex);
+
+	run_chunks(pool);
+
+	// All chunks were handed out. Stop other threads from joining
+	// and wait for the ones still working on theirs.
+	os_mutex_lock(&pool->mutex);
+	pool->open = false;
+	while (pool->active > 0)
+		os_condvar_wait(&pool->done_cond, &pool->mutex, -1);
+	os_mutex_unlock(&pool->mutex);
+}
@@ -0,0 +1,78 @@
+/*
+Copyright 2024 Francesco Cozzuto
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+associated documentation files (the “Software”), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial
+portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef POOL_INCLUDED
+#define POOL_INCLUDED
+
+#include <stdatomic.h>
+#include "os.h"
+
+#define MAX_POOL_THREADS 32
+
+// Processes the indices in [begin, end)
+typedef void (*ParallelForFunc)(void *data, int begin, int end);
+
+// Pool of threads that help the calling thread run parallel loops.
+// Threads sleep when there is no loop to run. A pool can also be
+// helped by threads it doesn't own, which join the loops through
+// "help_parallel_for" between their own jobs.
+typedef struct {
+
+	os_thread threads[MAX_POOL_THREADS];
+	int       num_threads;
+	int       num_helpers;
+
+	// Guards everything below except "next"
+	os_mutex_t   mutex;
+	os_condvar_t work_cond;
+	os_condvar_t done_cond;
+
+	// Loop being executed. Threads only join it while it's
+	// open and "active" counts the ones executing it.
+	ParallelForFunc func;
+	void           *data;
+	int             count;
+	int             chunk;
+	_Atomic int     next;
+	uint64_t        job;
+	_Atomic bool    open;
+	int             active;
+	bool            quit;
+
+} Pool;
+
+void init_pool(Pool *pool, int num_threads);
+void free_pool(Pool *pool);
+
+// Initializes a pool without threads of its own that is helped by
+// "num_helpers" threads calling "help_parallel_for"
+void init_helped_pool(Pool *pool, int num_helpers);
+
+// Returns how many threads may run a loop, counting the calling one
+int count_pool_threads(const Pool *pool);
+
+// Makes the calling thread take part in the loop being executed,
+// if any. Returns false if there was none.
+bool help_parallel_for(Pool *pool);
+
+// Calls "func" over the indices in [0, count) in chunks of at most
+// "chunk" indices using the threads of the pool and the calling one.
+// Returns when all indices were processed.
+void parallel_for(Pool *pool, int count, int chunk, ParallelForFunc func, void *data);
+
+#endif
@@ -0,0 +1,329 @@
+/*
+Copyright 2024 Francesco Cozzuto
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+associated documentation files (the “Software”), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial
+portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <x86intrin.h>
+
+#include "resolve.h"
+
+// sRGB encoding is looked up in a table sampling the [0, 1]
+// range, which is precise enough for both display formats.
+#define SRGB_TABLE_SIZE 4096
+static float srgb_table[SRGB_TABLE_SIZE];
+
+// Smallest positive normal half float. Smaller values
+// are flushed to zero.
+#define HALF_MIN 6.103515625e-05f
+#define HALF_MAX 65504.0f
+#define HALF_ONE 0x3C00
+
+// Set if the CPU supports the instructions of the AVX2 kernel
+static bool use_avx2 = false;
+
+void init_resolve(void)
+{
+	use_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+
+	for (int i = 0; i < SRGB_TABLE_SIZE; i++) {
+		float c = (float) i / (SRGB_TABLE_SIZE - 1);
+		if (c <= 0.0031308f)
+			srgb_table[i] = 12.92f * c;
+		else
+			srgb_table[i] = 1.055f * powf(c, 1 / 2.4f) - 0.055f;
+	}
+}
+
+static float encode_srgb(float c)
+{
+	return srgb_table[(int) (c * (SRGB_TABLE_SIZE - 1) + 0.5f)];
+}
+
+static float tonemap_channel(Tonemap tonemap, float c)
+{
+	switch (tonemap) {
+		case TONEMAP_REINHARD:
+		return c / (1 + c);
+
+		case TONEMAP_ACES:
+		// Narkowicz's fit of the ACES filmic curve
+		return clamp((c * (2.51f * c + 0.03f)) / (c * (2.43f * c + 0.59f) + 0.14f), 0, 1);
+
+		default:
+		return clamp(c, 0, 1);
+	}
+}
+
+// Conversion of a non-negative float to half. The rounding
+// is the same of the vectorized version below.
+static uint16_t float_to_half(float f)
+{
+	if (!(f >= HALF_MIN))
+		return 0;
+	if (f > HALF_MAX)
+		f = HALF_MAX;
+
+	uint32_t bits;
+	memcpy(&bits, &f, sizeof(bits));
+	bits += 0xFFF + ((bits >> 13) & 1);
+	return (bits >> 13) - (112 << 10);
+}
+
+static void resolve_pixel(const DisplaySettings *settings, Vector3 color, float weight, void *dst)
+{
+	bool  cpu_tonemap = !settings->gpu_tonemap;
+	float scale = cpu_tonemap ? settings->exposure : 1;
+
+	float c[3] = {0, 0, 0};
+	if (weight > 0) {
+		scale /= weight;
+		c[0] = color.x * scale;
+		c[1] = color.y * scale;
+		c[2] = color.z * scale;
+	}
+
+	if (cpu_tonemap)
+		for (int k = 0; k < 3; k++) {
+			c[k] = tonemap_channel(settings->tonemap, c[k]);
+			if (settings->srgb)
+				c[k] = encode_srgb(c[k]);
+		}
+
+	if (settings->format == DISPLAY_RGBA8) {
+		uint8_t *p = dst;
+		p[0] = lrintf(c[0] * 255);
+		p[1] = lrintf(c[1] * 255);
+		p[2] = lrintf(c[2] * 255);
+		p[3] = 255;
+	} else {
+		uint16_t *p = dst;
+		p[0] = float_to_half(c[0]);
+		p[1] = float_to_half(c[1]);
+		p[2] = float_to_half(c[2]);
+		p[3] = HALF_ONE;
+	}
+}
+
+static __m128 tonemap4(Tonemap tonemap, __m128 c)
+{
+	__m128 zero = _mm_setzero_ps();
+	__m128 one  = _mm_set1_ps(1);
+	switch (tonemap) {
+		case TONEMAP_REINHARD:
+		return _mm_div_ps(c, _mm_add_ps(one, c));
+
+		case TONEMAP_ACES:
+		{
+			__m128 num = _mm_mul_ps(c, _mm_add_ps(_mm_mul_ps(c, _mm_set1_ps(2.51f)), _mm_set1_ps(0.03f)));
+			__m128 den = _mm_add_ps(_mm_mul_ps(c, _mm_add_ps(_mm_mul_ps(c, _mm_set1_ps(2.43f)), _mm_set1_ps(0.59f))), _mm_set1_ps(0.14f));
+			return _mm_min_ps(_mm_max_ps(_mm_div_ps(num, den), zero), one);
+		}
+
+		default:
+		return _mm_min_ps(_mm_max_ps(c, zero), one);
+	}
+}
+
+static __m128 encode_srgb4(__m128 c)
+{
+	float v[4];
+	_mm_storeu_ps(v, c);
+	for (int k = 0; k < 4; k++)
+		v[k] = encode_srgb(v[k]);
+	return _mm_loadu_ps(v);
+}
+
+static __m128i float_to_half4(__m128 f)
+{
+	__m128i keep = _mm_castps_si128(_mm_cmpge_ps(f, _mm_set1_ps(HALF_MIN)));
+	__m128i bits = _mm_castps_si128(_mm_min_ps(f, _mm_set1_ps(HALF_MAX)));
+	__m128i odd  = _mm_and_si128(_mm_srli_epi32(bits, 13), _mm_set1_epi32(1));
+	bits = _mm_add_epi32(bits, _mm_add_epi32(odd, _mm_set1_epi32(0xFFF)));
+	__m128i h = _mm_sub_epi32(_mm_srli_epi32(bits, 13), _mm_set1_epi32(112 << 10));
+	return _mm_and_si128(h, keep);
+}
+
+// Resolves 4 pixels at a time. Colors are loaded as 3 vectors
+// (x0 y0 z0 x1 | y1 z1 x2 y2 | z2 x3 y3 z3) and shuffled so
+// that each vector holds one channel of the 4 pixels.
+static void resolve_pixels_sse(const DisplaySettings *settings, const Vector3 *accum, const float *weights, int count, void *dst)
+{
+	bool   cpu_tonemap = !settings->gpu_tonemap;
+	__m128 exposure = _mm_set1_ps(cpu_tonemap ? settings->exposure : 1);
+
+	for (int i = 0; i < count; i += 4) {
+
+		const float *src = (const float*) (accum + i);
+		__m128 a = _mm_loadu_ps(src + 0);
+		__m128 b = _mm_loadu_ps(src + 4);
+		__m128 c = _mm_loadu_ps(src + 8);
+
+		__m128 t0 = _mm_shuffle_ps(b, c, _MM_SHUFFLE(1, 0, 0, 2)); // b2 .. .. c1
+		__m128 t1 = _mm_shuffle_ps(a, b, _MM_SHUFFLE(0, 0, 1, 1)); // a1 a1 b0 b0
+		__m128 t2 = _mm_shuffle_ps(b, c, _MM_SHUFFLE(2, 2, 3, 3)); // b3 b3 c2 c2
+		__m128 t3 = _mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 1, 2, 2)); // a2 a2 b1 b1
+		__m128 t4 = _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 3, 0, 0)); // c0 c0 c3 c3
+		__m128 r = _mm_shuffle_ps(a,  t0, _MM_SHUFFLE(3, 0, 3, 0));
+		__m128 g = _mm_shuffle_ps(t1, t2, _MM_SHUFFLE(2, 0, 2, 0));
+		__m128 l = _mm_shuffle_ps(t3, t4, _MM_SHUFFLE(2, 0, 2, 0));
+
+		// Pixels with no weight are masked to zero
+		__m128 w = _mm_loadu_ps(weights + i);
+		__m128 scale = _mm_and_ps(_mm_div_ps(exposure, w), _mm_cmpgt_ps(w, _mm_setzero_ps()));
+		r = _mm_mul_ps(r, scale);
+		g = _mm_mul_ps(g, scale);
+		l = _mm_mul_ps(l, scale);
+
+		if (cpu_tonemap) {
+			r = tonemap4(settings->tonemap, r);
+			g = tonemap4(settings->tonemap, g);
+			l = tonemap4(settings->tonemap, l);
+			if (settings->srgb) {
+				r = encode_srgb4(r);
+				g = encode_srgb4(g);
+				l = encode_srgb4(l);
+			}
+		}
+
+		if (settings->format == DISPLAY_RGBA8) {
+			__m128  k  = _mm_set1_ps(255);
+			__m128i ri = _mm_cvtps_epi32(_mm_mul_ps(r, k));
+			__m128i gi = _mm_cvtps_epi32(_mm_mul_ps(g, k));
+			__m128i bi = _mm_cvtps_epi32(_mm_mul_ps(l, k));
+			__m128i px = _mm_or_si128(_mm_or_si128(ri, _mm_slli_epi32(gi, 8)),
+			                          _mm_or_si128(_mm_slli_epi32(bi, 16), _mm_set1_epi32(0xFF000000)));
+			_mm_storeu_si128((__m128i*) ((uint8_t*) dst + 4 * i), px);
+		} else {
+			__m128i rg = _mm_or_si128(float_to_half4(r), _mm_slli_epi32(float_to_half4(g), 16));
+			__m128i ba = _mm_or_si128(float_to_half4(l), _mm_set1_epi32(HALF_ONE << 16));
+			_mm_storeu_si128((__m128i*) ((uint8_t*) dst + 8 * i + 0),  _mm_unpacklo_epi32(rg, ba));
+			_mm_storeu_si128((__m128i*) ((uint8_t*) dst + 8 * i + 16), _mm_unpackhi_epi32(rg, ba));
+		}
+	}
+}
+
+#define AVX2 __attribute__((target("avx2,fma")))
+
+AVX2 static __m256 tonemap8(Tonemap tonemap, __m256 c)
+{
+	__m256 zero = _mm256_setzero_ps();
+	__m256 one  = _mm256_set1_ps(1);
+	switch (tonemap) {
+		case TONEMAP_REINHARD:
+		return _mm256_div_ps(c, _mm256_add_ps(one, c));
+
+		case TONEMAP_ACES:
+		{
+			__m256 num = _mm256_mul_ps(c, _mm256_fmadd_ps(c, _mm256_set1_ps(2.51f), _mm256_set1_ps(0.03f)));
+			__m256 den = _mm256_fmadd_ps(c, _mm256_fmadd_ps(c, _mm256_set1_ps(2.43f), _mm256_set1_ps(0.59f)), _mm256_set1_ps(0.14f));
+			return _mm256_min_ps(_mm256_max_ps(_mm256_div_ps(num, den), zero), one);
+		}
+
+		default:
+		return _mm256_min_ps(_mm256_max_ps(c, zero), one);
+	}
+}
+
+AVX2 static __m256 encode_srgb8(__m256 c)
+{
+	__m256i index = _mm256_cvttps_epi32(_mm256_fmadd_ps(c, _mm256_set1_ps(SRGB_TABLE_SIZE - 1), _mm256_set1_ps(0.5f)));
+	return _mm256_i32gather_ps(srgb_table, index, 4);
+}
+
+AVX2 static __m256i float_to_half8(__m256 f)
+{
+	__m256i keep = _mm256_castps_si256(_mm256_cmp_ps(f, _mm256_set1_ps(HALF_MIN), _CMP_GE_OQ));
+	__m256i bits = _mm256_castps_si256(_mm256_min_ps(f, _mm256_set1_ps(HALF_MAX)));
+	__m256i odd  = _mm256_and_si256(_mm256_srli_epi32(bits, 13), _mm256_set1_epi32(1));
+	bits = _mm256_add_epi32(bits, _mm256_add_epi32(odd, _mm256_set1_epi32(0xFFF)));
+	__m256i h = _mm256_sub_epi32(_mm256_srli_epi32(bits, 13), _mm256_set1_epi32(112 << 10));
+	return _mm256_and_si256(h, keep);
+}
+
+// Same as the SSE version but 8 pixels at a time. The channels
+// are gathered directly from the array of colors.
+AVX2 static void resolve_pixels_avx2(const DisplaySettings *settings, const Vector3 *accum, const float *weights, int count, void *dst)
+{
+	bool   cpu_tonemap = !settings->gpu_tonemap;
+	__m256 exposure = _mm256_set1_ps(cpu_tonemap ? settings->exposure : 1);
+	__m256i offsets = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+
+	for (int i = 0; i < count; i += 8) {
+
+		const float *src = (const float*) (accum + i);
+		__m256 r = _mm256_i32gather_ps(src + 0, offsets, 4);
+		__m256 g = _mm256_i32gather_ps(src + 1, offsets, 4);
+		__m256 l = _mm256_i32gather_ps(src + 2, offsets, 4);
+
+		__m256 w = _mm256_loadu_ps(weights + i);
+		__m256 scale = _mm256_and_ps(_mm256_div_ps(exposure, w), _mm256_cmp_ps(w, _mm256_setzero_ps(), _CMP_GT_OQ));
+		r = _mm256_mul_ps(r, scale);
+		g = _mm256_mul_ps(g, scale);
+		l = _mm256_mul_ps(l, scale);
+
+		if (cpu_tonemap) {
+			r = tonemap8(settings->tonemap, r);
+			g = tonemap8(settings->tonemap, g);
+			l = tonemap8(settings->tonemap, l);
+			if (settings->srgb) {
+				r = encode_srgb8(r);
+				g = encode_srgb8(g);
+				l = encode_srgb8(l);
+			}
+		}
+
+		if (settings->format == DISPLAY_RGBA8) {
+			__m256  k  = _mm256_set1_ps(255);
+			__m256i ri = _mm256_cvtps_epi32(_mm256_mul_ps(r, k));
+			__m256i gi = _mm256_cvtps_epi32(_mm256_mul_ps(g, k));
+			__m256i bi = _mm256_cvtps_epi32(_mm256_mul_ps(l, k));
+			__m256i px = _mm256_or_si256(_mm256_or_si256(ri, _mm256_slli_epi32(gi, 8)),
+			                             _mm256_or_si256(_mm256_slli_epi32(bi, 16), _mm256_set1_epi32(0xFF000000)));
+			_mm256_storeu_si256((__m256i*) ((uint8_t*) dst + 4 * i), px);
+		} else {
+			// The unpack instructions work within 128 bit lanes, so
+			// the low halves hold pixels 0-1 and 4-5 and the high
+			// halves pixels 2-3 and 6-7.
+			__m256i rg = _mm256_or_si256(float_to_half8(r), _mm256_slli_epi32(float_to_half8(g), 16));
+			__m256i ba = _mm256_or_si256(float_to_half8(l), _mm256_set1_epi32(HALF_ONE << 16));
+			__m256i lo = _mm256_unpacklo_epi32(rg, ba);
+			__m256i hi = _mm256_unpackhi_epi32(rg, ba);
+			_mm256_storeu_si256((__m256i*) ((uint8_t*) dst + 8 * i + 0),  _mm256_permute2x128_si256(lo, hi, 0x20));
+			_mm256_storeu_si256((__m256i*) ((uint8_t*) dst + 8 * i + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+		}
+	}
+}
+
+void resolve_pixels(const DisplaySettings *settings, const Vector3 *accum, const float *weights, int count, void *dst)
+{
+	int pixel_size = display_pixel_size(settings->format);
+
+	int head = 0;
+	if (use_avx2) {
+		head = count & ~7;
+		resolve_pixels_avx2(settings, accum, weights, head, dst);
+	}
+
+	int head4 = head + ((count - head) & ~3);
+	resolve_pixels_sse(settings, accum + head, weights + head, head4 - head, (uint8_t*) dst + head * pixel_size);
+
+	for (int i = head4; i < count; i++)
+		resolve_pixel(settings, accum[i], weights[i], (uint8_t*) dst + i * pixel_size);
+}
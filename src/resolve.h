@@ -0,0 +1,35 @@
+/*
+Copyright 2024 Francesco Cozzuto
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+associated documentation files (the “Software”), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial
+portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef RESOLVE_INCLUDED
+#define RESOLVE_INCLUDED
+
+#include "vector.h"
+#include "gpu_and_windowing.h"
+
+// Must be called once before resolving pixels
+void init_resolve(void);
+
+// Turns "count" consecutive pixels of the accumulation buffer into
+// displayable colors in the format specified by the settings. The
+// colors are averaged by dividing them by their weight (pixels with
+// no weight are black), then exposure, tonemapping and sRGB encoding
+// are applied unless the settings leave them to the GPU.
+void resolve_pixels(const DisplaySettings *settings, const Vector3 *accum, const float *weights, int count, void *dst);
+
+#endif
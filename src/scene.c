@@ -1,8 +1,11 @@
 #include <math.h>
 #include <float.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
+#include <x86intrin.h>
 
 #include "utils.h"
 #include "scene.h"
@@ -11,9 +14,25 @@ Vector3 origin_of(Object o)
 {
 	if (o.type == OBJECT_SPHERE)
 		return o.sphere.center;
+	if (o.type == OBJECT_MESH)
+		return combine(o.mesh.bounds.min, o.mesh.bounds.max, 0.5, 0.5);
 	return combine(o.cube.origin, o.cube.size, 1, 0.5);
 }
 
+AABB bounds_of(Object o)
+{
+	if (o.type == OBJECT_SPHERE) {
+		Vector3 r = vec_from_scalar(o.sphere.radius);
+		return (AABB) {
+			combine(o.sphere.center, r, 1, -1),
+			combine(o.sphere.center, r, 1, +1),
+		};
+	}
+	if (o.type == OBJECT_MESH)
+		return o.mesh.bounds;
+	return (AABB) { o.cube.origin, combine(o.cube.origin, o.cube.size, 1, 1) };
+}
+
 static bool intersect_cube(Ray r, Cube c, float *tnear, float *tfar, Vector3 *normal)
 {
 	float txmin, txmax;
@@ -133,7 +152,108 @@ static bool intersect_sphere(Ray r, Sphere s, float *t)
 	return false;
 }
 
-static bool intersect_object(Ray r, Object o, float *t, Vector3 *normal)
+static Vector3 inverse_of(Vector3 v)
+{
+	return (Vector3) { 1.0f / v.x, 1.0f / v.y, 1.0f / v.z };
+}
+
+// Node of a tree being traversed and its box. The boxes of compressed
+// trees are decoded from the box of the parent, so it's carried along
+// with the node on the stack.
+typedef struct {
+	int  node;
+	AABB box;
+} StackEntry;
+
+// Primitives or right child of a node, read from the compressed
+// copy of the tree if there is one
+static inline void node_range(const BVH *bvh, const CompressedBVH *compressed, int node, int *index, int *count)
+{
+	if (compressed->nodes) {
+		*index = compressed->nodes[node].index;
+		*count = compressed->nodes[node].count;
+	} else {
+		*index = bvh->nodes[node].index;
+		*count = bvh->nodes[node].count;
+	}
+}
+
+static inline AABB node_box(const BVH *bvh, const CompressedBVH *compressed, int node, AABB parent_box)
+{
+	if (compressed->nodes)
+		return decode_box(parent_box, &compressed->nodes[node]);
+	return bvh->nodes[node].box;
+}
+
+// Finds the nearest triangle of a mesh hit before "max_t"
+static bool intersect_mesh(Ray r, const Scene *scene, const Mesh *mesh, float max_t, float *t, Vector3 *normal)
+{
+	const BVH *bvh = &scene->mesh_bvh;
+	const CompressedBVH *compressed = &scene->compressed_mesh_bvh;
+	TriangleRay tr = prepare_triangle_ray(r.origin, r.direction);
+	Vector3 inv_dir = inverse_of(r.direction);
+
+	const TriangleBlock *hit_block = NULL;
+	int hit_lane = -1;
+
+	StackEntry stack[BVH_MAX_DEPTH];
+	int depth = 0;
+
+	if (intersect_aabb(r.origin, inv_dir, mesh->bounds, max_t, NULL))
+		stack[depth++] = (StackEntry) { mesh->root, mesh->bounds };
+
+	while (depth > 0) {
+
+		StackEntry entry = stack[--depth];
+		int index;
+		int count;
+		node_range(bvh, compressed, entry.node, &index, &count);
+
+		if (count == 0) {
+			StackEntry left  = { entry.node + 1, node_box(bvh, compressed, entry.node + 1, entry.box) };
+			StackEntry right = { index,          node_box(bvh, compressed, index,          entry.box) };
+			float left_t;
+			float right_t;
+			bool  hit_left  = intersect_aabb(r.origin, inv_dir, left.box,  max_t, &left_t);
+			bool  hit_right = intersect_aabb(r.origin, inv_dir, right.box, max_t, &right_t);
+
+			if (hit_left && hit_right) {
+				if (left_t < right_t) {
+					stack[depth++] = right;
+					stack[depth++] = left;
+				} else {
+					stack[depth++] = left;
+					stack[depth++] = right;
+				}
+			} else if (hit_left)
+				stack[depth++] = left;
+			else if (hit_right)
+				stack[depth++] = right;
+			continue;
+		}
+
+		const TriangleBlock *block = &scene->triangle_blocks[index];
+		for (int remaining = count; remaining > 0; remaining -= 4, block++) {
+			float block_t;
+			int lane = intersect_triangle_block(&tr, block, remaining < 4 ? remaining : 4, max_t, &block_t);
+			if (lane >= 0) {
+				max_t = block_t;
+				hit_block = block;
+				hit_lane = lane;
+			}
+		}
+	}
+
+	if (hit_block == NULL)
+		return false;
+	*t = max_t;
+	if (normal)
+		*normal = triangle_normal(hit_block, hit_lane, r.direction);
+	return true;
+}
+
+// Meshes only report hits closer than "max_t"
+static bool intersect_object(Ray r, const Scene *scene, Object o, float max_t, float *t, Vector3 *normal)
 {
 	switch (o.type) {
 
@@ -149,46 +269,335 @@ static bool intersect_object(Ray r, Object o, float *t, Vector3 *normal)
 			return true;
 		}
 		return false;
+
+		case OBJECT_MESH:
+		return intersect_mesh(r, scene, &scene->meshes[o.mesh.index], max_t, t, normal);
 	}
 	return false;
 }
 
-HitInfo trace_ray(Ray ray, Scene *scene)
+static HitInfo make_hit(Ray ray, float t, Vector3 normal, int object)
+{
+	HitInfo result;
+	if (object == -1) {
+		result.distance = -1;
+		result.normal   = (Vector3) {0, 0, 0};
+		result.point    = (Vector3) {0, 0, 0};
+		result.object   = -1;
+	} else {
+		result.distance = t;
+		result.normal   = normal;
+		result.point    = combine(ray.origin, ray.direction, 1, t);
+		result.object   = object;
+	}
+	return result;
+}
+
+// Hits at the same distance are resolved in favour of the
+// object that comes first in the scene, regardless of the
+// order in which the BVH visits them.
+static bool closer_hit(float t, int object, float nearest_t, int nearest_object)
+{
+	return t < nearest_t || (t == nearest_t && object < nearest_object);
+}
+
+static bool trace_instance(Ray ray, const Scene *scene, int index, float *nearest_t, int *nearest_object, Vector3 *nearest_normal);
+
+// Updates the nearest hit with the objects of the tree starting at node
+// "root" and returns whether it changed. The ray may be in the space of
+// a definition, where its direction isn't normalized so that distances
+// are the same as in world space, and the normal is left in that space.
+static bool trace_tree(Ray ray, const Scene *scene, const BVH *bvh, const CompressedBVH *compressed, int root, float *nearest_t_, int *nearest_object_, Vector3 *nearest_normal_)
+{
+	float   nearest_t = *nearest_t_;
+	int     nearest_object = *nearest_object_;
+	Vector3 nearest_normal = *nearest_normal_;
+	bool    found = false;
+
+	Vector3 inv_dir = inverse_of(ray.direction);
+
+	StackEntry stack[BVH_MAX_DEPTH];
+	int depth = 0;
+
+	AABB root_box = bvh->nodes[root].box;
+	if (intersect_aabb(ray.origin, inv_dir, root_box, nearest_t, NULL))
+		stack[depth++] = (StackEntry) { root, root_box };
+
+	while (depth > 0) {
+
+		StackEntry entry = stack[--depth];
+		int index;
+		int count;
+		node_range(bvh, compressed, entry.node, &index, &count);
+
+		if (count == 0) {
+
+			// Visit the nearest child first so that the other
+			// one can be skipped if a closer hit is found
+			StackEntry left  = { entry.node + 1, node_box(bvh, compressed, entry.node + 1, entry.box) };
+			StackEntry right = { index,          node_box(bvh, compressed, index,          entry.box) };
+			float left_t;
+			float right_t;
+			bool  hit_left  = intersect_aabb(ray.origin, inv_dir, left.box,  nearest_t, &left_t);
+			bool  hit_right = intersect_aabb(ray.origin, inv_dir, right.box, nearest_t, &right_t);
+
+			if (hit_left && hit_right) {
+				if (left_t < right_t) {
+					stack[depth++] = right;
+					stack[depth++] = left;
+				} else {
+					stack[depth++] = left;
+					stack[depth++] = right;
+				}
+			} else if (hit_left)
+				stack[depth++] = left;
+			else if (hit_right)
+				stack[depth++] = right;
+			continue;
+		}
+
+		for (int i = index; i < index + count; i++) {
+			int object = bvh->prims[i];
+			if (object >= scene->num_objects) {
+				if (trace_instance(ray, scene, object - scene->num_objects, &nearest_t, &nearest_object, &nearest_normal))
+					found = true;
+				continue;
+			}
+			float t;
+			Vector3 n;
+			if (!intersect_object(ray, scene, scene->objects[object], nearest_t, &t, &n))
+				continue;
+			if (t >= 0 && closer_hit(t, object, nearest_t, nearest_object)) {
+				nearest_t = t;
+				nearest_object = object;
+				nearest_normal = n;
+				found = true;
+			}
+		}
+	}
+
+	*nearest_t_ = nearest_t;
+	*nearest_object_ = nearest_object;
+	*nearest_normal_ = nearest_normal;
+	return found;
+}
+
+static Vector3 transform_point(const Matrix4 *m, Vector3 p)
+{
+	Vector4 r = rdotv(*m, (Vector4) { p.x, p.y, p.z, 1 });
+	return (Vector3) { r.x, r.y, r.z };
+}
+
+static Vector3 transform_direction(const Matrix4 *m, Vector3 d)
+{
+	Vector4 r = rdotv(*m, (Vector4) { d.x, d.y, d.z, 0 });
+	return (Vector3) { r.x, r.y, r.z };
+}
+
+// Updates the nearest hit with the objects of an instance
+static bool trace_instance(Ray ray, const Scene *scene, int index, float *nearest_t, int *nearest_object, Vector3 *nearest_normal)
+{
+	const Instance   *instance   = &scene->instances[index];
+	const Definition *definition = &scene->definitions[instance->definition];
+	if (definition->root < 0)
+		return false;
+
+	Ray local;
+	local.origin    = transform_point(&instance->to_local, ray.origin);
+	local.direction = transform_direction(&instance->to_local, ray.direction);
+
+	Vector3 normal = {0, 0, 0};
+	if (!trace_tree(local, scene, &scene->definition_bvh, &scene->compressed_definition_bvh, definition->root, nearest_t, nearest_object, &normal))
+		return false;
+
+	*nearest_normal = normalize(transform_direction(&instance->normal_to_world, normal));
+	return true;
+}
+
+// Distance between the origin of the ray and the hit, or INFINITY if
+// it missed. This is the unit of the depth buffers. It's measured on
+// the hit point so that it doesn't depend on the length of the
+// direction the ray was traced with.
+float hit_depth(Ray ray, HitInfo hit)
+{
+	if (hit.object == -1)
+		return INFINITY;
+	return norm_of(combine(hit.point, ray.origin, 1, -1));
+}
+
+HitInfo trace_ray(Ray ray, const Scene *scene)
 {
 	ray.direction = normalize(ray.direction);
 
 	float   nearest_t = FLT_MAX;
 	int     nearest_object = -1;
-	Vector3 nearest_normal;
-	for (int i = 0; i < scene->num_objects; i++) {
-		float t;
-		Vector3 n;
-		if (!intersect_object(ray, scene->objects[i], &t, &n))
-			continue;
-		if (t >= 0 && t < nearest_t) {
-			nearest_t = t;
-			nearest_object = i;
-			nearest_normal = n;
-		}
+	Vector3 nearest_normal = {0, 0, 0};
+
+	if (scene->bvh.num_nodes > 0)
+		trace_tree(ray, scene, &scene->bvh, &scene->compressed_bvh, 0, &nearest_t, &nearest_object, &nearest_normal);
+
+	return make_hit(ray, nearest_t, nearest_normal, nearest_object);
+}
+
+// Returns the index of the light source found when the scene was
+// parsed, or -1 if there is none. This is kind of lazy as we should
+// sample every light source in the scene.
+int find_light_source(const Scene *scene)
+{
+	return scene->light_index;
+}
+
+// Builds the planes of the frustum that contains all the rays of the
+// packet given the directions of the rays at its four corners, in order
+// around the tile. The normals of the planes point inside the frustum.
+void setup_packet_frustum(RayPacket *packet, Vector3 corners[4])
+{
+	Vector3 center = combine(combine(corners[0], corners[1], 1, 1), combine(corners[2], corners[3], 1, 1), 1, 1);
+	for (int i = 0; i < 4; i++) {
+		Vector3 n = cross(corners[i], corners[(i+1) % 4]);
+		if (dotv(n, center) < 0)
+			n = scalev(n, -1);
+		packet->planes[i] = n;
 	}
+}
 
-	if (nearest_object == -1) {
-		HitInfo result;
-		result.distance = -1;
-		result.normal   = (Vector3) {0, 0, 0};
-		result.point    = (Vector3) {0, 0, 0};
-		result.object   = -1;
-		return result;
-	} else {
-		HitInfo result;
-		result.distance = nearest_t;
-		result.normal   = nearest_normal;
-		result.point    = combine(ray.origin, ray.direction, 1, nearest_t);
-		result.object   = nearest_object;
-		return result;
+// Returns false if the box is entirely outside of the packet frustum
+static bool box_in_frustum(const RayPacket *packet, AABB box)
+{
+	for (int i = 0; i < 4; i++) {
+		Vector3 n = packet->planes[i];
+
+		// Corner of the box that is furthest along the normal
+		Vector3 c = {
+			n.x >= 0 ? box.max.x : box.min.x,
+			n.y >= 0 ? box.max.y : box.min.y,
+			n.z >= 0 ? box.max.z : box.min.z,
+		};
+		if (dotv(n, combine(c, packet->origin, 1, -1)) < 0)
+			return false;
 	}
+	return true;
+}
+
+// Squared distance from a point to the closest point of a box
+static float distance2_to_box(Vector3 p, AABB box)
+{
+	float dx = maxf(maxf(box.min.x - p.x, p.x - box.max.x), 0);
+	float dy = maxf(maxf(box.min.y - p.y, p.y - box.max.y), 0);
+	float dz = maxf(maxf(box.min.z - p.z, p.z - box.max.z), 0);
+	return dx * dx + dy * dy + dz * dz;
 }
 
+// Finds the first hit of every ray in the packet. The rays traverse
+// the BVH together: a node is skipped for all of them if it lies outside
+// the packet frustum or if it's further away than the current hit of
+// every ray. Results are the same as calling "trace_ray" for each ray.
+void trace_packet(const RayPacket *packet, const Scene *scene, HitInfo *hits)
+{
+	int count = packet->count;
+	assert(count > 0 && count <= MAX_PACKET_SIZE);
+
+	Ray     rays[MAX_PACKET_SIZE];
+	Vector3 inv_dirs[MAX_PACKET_SIZE];
+	float   nearest_t[MAX_PACKET_SIZE];
+	int     nearest_object[MAX_PACKET_SIZE];
+	Vector3 nearest_normal[MAX_PACKET_SIZE];
+
+	for (int r = 0; r < count; r++) {
+		rays[r].origin    = packet->origin;
+		rays[r].direction = normalize(packet->dirs[r]);
+		inv_dirs[r] = inverse_of(rays[r].direction);
+		nearest_t[r] = FLT_MAX;
+		nearest_object[r] = -1;
+	}
+
+	// Distance of the furthest hit of the packet. Boxes further
+	// than this from the origin can't improve any of the hits.
+	float max_t = FLT_MAX;
+
+	const BVH *bvh = &scene->bvh;
+	const CompressedBVH *compressed = &scene->compressed_bvh;
+
+	StackEntry stack[2 * BVH_MAX_DEPTH];
+	int depth = 0;
+
+	if (bvh->num_nodes > 0)
+		stack[depth++] = (StackEntry) { 0, bvh->nodes[0].box };
+
+	while (depth > 0) {
+
+		StackEntry entry = stack[--depth];
+
+		if (!box_in_frustum(packet, entry.box))
+			continue;
+
+		if (max_t < FLT_MAX && distance2_to_box(packet->origin, entry.box) > max_t * max_t)
+			continue;
+
+		int index;
+		int num_prims;
+		node_range(bvh, compressed, entry.node, &index, &num_prims);
+
+		if (num_prims == 0) {
+
+			// Visit the child closest to the origin first
+			StackEntry left  = { entry.node + 1, node_box(bvh, compressed, entry.node + 1, entry.box) };
+			StackEntry right = { index,          node_box(bvh, compressed, index,          entry.box) };
+			if (distance2_to_box(packet->origin, left.box) <= distance2_to_box(packet->origin, right.box)) {
+				stack[depth++] = right;
+				stack[depth++] = left;
+			} else {
+				stack[depth++] = left;
+				stack[depth++] = right;
+			}
+			continue;
+		}
+
+		// Only the rays that actually cross the leaf need to
+		// be tested against its primitives
+		int active[MAX_PACKET_SIZE];
+		int num_active = 0;
+		for (int r = 0; r < count; r++)
+			if (intersect_aabb(rays[r].origin, inv_dirs[r], entry.box, nearest_t[r], NULL))
+				active[num_active++] = r;
+
+		for (int i = index; i < index + num_prims; i++) {
+
+			int object = bvh->prims[i];
+
+			// Instances are traced one ray at a time
+			if (object >= scene->num_objects) {
+				for (int q = 0; q < num_active; q++) {
+					int r = active[q];
+					trace_instance(rays[r], scene, object - scene->num_objects, &nearest_t[r], &nearest_object[r], &nearest_normal[r]);
+				}
+				continue;
+			}
+
+			Object o = scene->objects[object];
+
+			for (int q = 0; q < num_active; q++) {
+				int r = active[q];
+				float t;
+				Vector3 n;
+				if (!intersect_object(rays[r], scene, o, nearest_t[r], &t, &n))
+					continue;
+				if (t >= 0 && closer_hit(t, object, nearest_t[r], nearest_object[r])) {
+					nearest_t[r] = t;
+					nearest_object[r] = object;
+					nearest_normal[r] = n;
+				}
+			}
+		}
+
+		max_t = 0;
+		for (int r = 0; r < count; r++)
+			max_t = maxf(max_t, nearest_t[r]);
+	}
+
+	for (int r = 0; r < count; r++)
+		hits[r] = make_hit(rays[r], nearest_t[r], nearest_normal[r], nearest_object[r]);
+}
 
 typedef enum {
 	PROP_ALBEDO,
@@ -201,424 +610,2261 @@ typedef enum {
 	PROP_CENTER,
 	PROP_ORIGIN,
 	PROP_SIZE,
+	PROP_POSITION,
+	PROP_ROTATION,
+	PROP_SCALE,
+	PROP_FILE,
 } Property;
 
-static bool parse_scene_string(char *src, size_t len, Scene *scene)
-{
-	scene->num_objects = 0;
-
-	int line = 1;
-	size_t i = 0;
-	for (;;) {
+typedef enum {
+	VALUE_FLOAT,
+	VALUE_VECTOR, // 3 floats between braces
+	VALUE_PATH,   // Word or text between double quotes
+} ValueType;
 
-		while (i < len && is_space(src[i])) {
-			if (src[i] == '\n') line++;
-			i++;
-		}
+typedef enum {
+	KEYWORD_OBJECT,
+	KEYWORD_PROPERTY,
+	KEYWORD_DEFINE,
+	KEYWORD_END,
+	KEYWORD_INSTANCE,
+	KEYWORD_TRANSFORM, // Property of instances
+} KeywordKind;
 
-		if (i == len)
-			break;
-		
-		Object object;
-
-		if (5 < len - i
-			&& src[i+0] == 's'
-			&& src[i+1] == 'p'
-			&& src[i+2] == 'h'
-			&& src[i+3] == 'e'
-			&& src[i+4] == 'r'
-			&& src[i+5] == 'e') {
-			object.type = OBJECT_SPHERE;
-			object.sphere.center = (Vector3) {0, 0, 0};
-			object.sphere.radius = 1;
-			object.material.albedo = (Vector3) {0.44, 0.68, 0.84};
-			object.material.roughness = 0;
-			object.material.reflectance = 0.2;
-			object.material.metallic = 0;
-			object.material.emission_power = 0;
-			object.material.emission_color = (Vector3) {1, 1, 1};
-			i += 6;
-		} else if (3 < len - i
-			&& src[i+0] == 'c'
-			&& src[i+1] == 'u'
-			&& src[i+2] == 'b'
-			&& src[i+3] == 'e') {
-			object.type = OBJECT_CUBE;
-			object.cube.origin = (Vector3) {0, 0, 0};
-			object.cube.size = (Vector3) {1, 1, 1};
-			object.material.albedo = (Vector3) {0.44, 0.68, 0.84};
-			object.material.roughness = 0;
-			object.material.reflectance = 0.2;
-			object.material.metallic = 0;
-			object.material.emission_power = 0;
-			object.material.emission_color = (Vector3) {1, 1, 1};
-			i += 4;
-		} else {
-			fprintf(stderr, "Error: Invalid character (line %d)\n", line);
-			return false;
-		}
+typedef enum {
+	MARKER_DEFINE,
+	MARKER_END,
+	MARKER_INSTANCE,
+	MARKER_MESH,
+} MarkerKind;
 
-		for (;;) {
-			// Skip spaces before property
-			while (i < len && is_space(src[i])) {
-				if (src[i] == '\n') line++;
-				i++;
-			}
-			
-			int valuetype; // 0 for float, 1 for color (3 floats)
-
-			Property prop;
-			if (6 < len - i
-				&& src[i+0] == 'a'
-				&& src[i+1] == 'l'
-				&& src[i+2] == 'b'
-				&& src[i+3] == 'e'
-				&& src[i+4] == 'd'
-				&& src[i+5] == 'o') {
-				valuetype = 1;
-				prop = PROP_ALBEDO;
-				i += 9;
-			} else if (8 < len - i
-				&& src[i+0] == 'r'
-				&& src[i+1] == 'o'
-				&& src[i+2] == 'u'
-				&& src[i+3] == 'g'
-				&& src[i+4] == 'h'
-				&& src[i+5] == 'n'
-				&& src[i+6] == 'e'
-				&& src[i+7] == 's'
-				&& src[i+8] == 's') {
-				valuetype = 0;
-				prop = PROP_ROUGHNESS;
-				i += 9;
-			} else if (10 < len - i
-				&& src[i+0] == 'r'
-				&& src[i+1] == 'e'
-				&& src[i+2] == 'f'
-				&& src[i+3] == 'l'
-				&& src[i+4] == 'e'
-				&& src[i+5] == 'c'
-				&& src[i+6] == 't'
-				&& src[i+7] == 'a'
-				&& src[i+8] == 'n'
-				&& src[i+9] == 'c'
-				&& src[i+10] == 'e') {
-				valuetype = 0;
-				prop = PROP_REFLECTANCE;
-				i += 11;
-			} else if (7 < len - i
-				&& src[i+0] == 'm'
-				&& src[i+1] == 'e'
-				&& src[i+2] == 't'
-				&& src[i+3] == 'a'
-				&& src[i+4] == 'l'
-				&& src[i+5] == 'l'
-				&& src[i+6] == 'i'
-				&& src[i+7] == 'c') {
-				valuetype = 0;
-				prop = PROP_METALLIC;
-				i += 11;
-			} else if (13 < len - i
-				&& src[i+0] == 'e'
-				&& src[i+1] == 'm'
-				&& src[i+2] == 'i'
-				&& src[i+3] == 's'
-				&& src[i+4] == 's'
-				&& src[i+5] == 'i'
-				&& src[i+6] == 'o'
-				&& src[i+7] == 'n'
-				&& src[i+8] == '_'
-				&& src[i+9] == 'p'
-				&& src[i+10] == 'o'
-				&& src[i+11] == 'w'
-				&& src[i+12] == 'e'
-				&& src[i+13] == 'r') {
-				valuetype = 0;
-				prop = PROP_EMISSION_POWER;
-				i += 14;
-			} else if (13 < len - i
-				&& src[i+0] == 'e'
-				&& src[i+1] == 'm'
-				&& src[i+2] == 'i'
-				&& src[i+3] == 's'
-				&& src[i+4] == 's'
-				&& src[i+5] == 'i'
-				&& src[i+6] == 'o'
-				&& src[i+7] == 'n'
-				&& src[i+8] == '_'
-				&& src[i+9] == 'c'
-				&& src[i+10] == 'o'
-				&& src[i+11] == 'l'
-				&& src[i+12] == 'o'
-				&& src[i+13] == 'r') {
-				valuetype = 1;
-				prop = PROP_EMISSION_COLOR;
-				i += 14;
-			} else if (5 < len - i
-				&& src[i+0] == 'r'
-				&& src[i+1] == 'a'
-				&& src[i+2] == 'd'
-				&& src[i+3] == 'i'
-				&& src[i+4] == 'u'
-				&& src[i+5] == 's') {
-				if (object.type != OBJECT_SPHERE) {
-					fprintf(stderr, "Poperty 'radius' only allowed on spheres (line %d)\n", line);
-					return false;
-				}
-				valuetype = 0;
-				prop = PROP_RADIUS;
-				i += 6;
-			} else if (5 < len - i
-				&& src[i+0] == 'c'
-				&& src[i+1] == 'e'
-				&& src[i+2] == 'n'
-				&& src[i+3] == 't'
-				&& src[i+4] == 'e'
-				&& src[i+5] == 'r') {
-				if (object.type != OBJECT_SPHERE) {
-					fprintf(stderr, "Poperty 'center' only allowed on spheres (line %d)\n", line);
-					return false;
-				}
-				valuetype = 1;
-				prop = PROP_CENTER;
-				i += 6;
-			} else if (5 < len - i
-				&& src[i+0] == 'o'
-				&& src[i+1] == 'r'
-				&& src[i+2] == 'i'
-				&& src[i+3] == 'g'
-				&& src[i+4] == 'i'
-				&& src[i+5] == 'n') {
-				if (object.type != OBJECT_CUBE) {
-					fprintf(stderr, "Poperty 'origin' only allowed on cubes (line %d)\n", line);
-					return false;
-				}
-				valuetype = 1;
-				prop = PROP_ORIGIN;
-				i += 6;
-			} else if (3 < len - i
-				&& src[i+0] == 's'
-				&& src[i+1] == 'i'
-				&& src[i+2] == 'z'
-				&& src[i+3] == 'e') {
-				if (object.type != OBJECT_CUBE) {
-					fprintf(stderr, "Poperty 'size' only allowed on cubes (line %d)\n", line);
-					return false;
-				}
-				valuetype = 1;
-				prop = PROP_SIZE;
-				i += 4;
-			} else
-				// Not a valid property name
-				break;
+typedef struct {
+	char        name[16]; // Padded with zeros so it can be compared 16 bytes at a time
+	size_t      len;
+	KeywordKind kind;
+	ObjectType  type;      // Object started by the keyword, or the only object allowed to have the property
+	bool        any_type;  // The property is allowed on all objects
+	Property    prop;
+	ValueType   valuetype;
+	MarkerKind  marker;    // Stored by "define", "end", "instance" and "file"
+} Keyword;
 
-			// Consume spaces before the value
-			while (i < len && is_space(src[i])) {
-				if (src[i] == '\n') line++;
-				i++;
-			}
-			if (i == len) {
-				fprintf(stderr, "Error: Property value is missing (line %d)\n", line);
-				return false;
-			}
+// Keywords are looked up with a perfect hash of the word length and of
+// its first and second-to-last characters. The position of every entry
+// is "keyword_hash" of its name, so they must be updated together.
+#define KEYWORD_TABLE_SIZE 32
 
-			float   value0;
-			Vector3 value1;
-			if (valuetype == 0) {
-				// Parse a single float
-				int sign = 1;
-				if (src[i] == '-') {
-					sign = -1;
-					i++;
-					if (i == len || !is_digit(src[i])) {
-						fprintf(stderr, "Error: Missing number after minus sign (line %d)\n", line);
-						return false;
-					}
-				} else if (!is_digit(src[i])) {
-					fprintf(stderr, "Error: Missing number after property name (line %d)\n", line);
-					return false;
-				}
-				value0 = 0;
-				do {
-					int d = src[i] - '0';
-					value0 = value0 * 10 + d;
-					i++;
-				} while (i < len && is_digit(src[i]));
-				if (i < len && src[i] == '.') {
-					i++; // Skip the dot
-					if (i == len || !is_digit(src[i])) {
-						fprintf(stderr, "Error: Missing decimal part after dot (line %d)\n", line);
-						return false;
-					}
-					float q = 1.0f / 10;
-					do {
-						int d = src[i] - '0';
-						value0 += q * d;
-						q /= 10;
-						i++;
-					} while (i < len && is_digit(src[i]));
-				}
-				value0 *= sign;
-			} else {
-				assert(valuetype == 1);
+#define KEYWORD_NAME(name) name, sizeof(name) - 1
 
-				if (src[i] != '{') {
-					fprintf(stderr, "Error: Missing '{' after property name (line %d)\n", line);
-					return false;
-				}
-				i++;
+static const Keyword keywords[KEYWORD_TABLE_SIZE] = {
+	[31] = { KEYWORD_NAME("sphere"),         KEYWORD_OBJECT,    OBJECT_SPHERE },
+	[27] = { KEYWORD_NAME("cube"),           KEYWORD_OBJECT,    OBJECT_CUBE },
+	[13] = { KEYWORD_NAME("mesh"),           KEYWORD_OBJECT,    OBJECT_MESH },
+	[29] = { KEYWORD_NAME("albedo"),         KEYWORD_PROPERTY,  0,             true,  PROP_ALBEDO,         VALUE_VECTOR },
+	[20] = { KEYWORD_NAME("roughness"),      KEYWORD_PROPERTY,  0,             true,  PROP_ROUGHNESS,      VALUE_FLOAT },
+	[ 8] = { KEYWORD_NAME("reflectance"),    KEYWORD_PROPERTY,  0,             true,  PROP_REFLECTANCE,    VALUE_FLOAT },
+	[ 5] = { KEYWORD_NAME("metallic"),       KEYWORD_PROPERTY,  0,             true,  PROP_METALLIC,       VALUE_FLOAT },
+	[25] = { KEYWORD_NAME("emission_power"), KEYWORD_PROPERTY,  0,             true,  PROP_EMISSION_POWER, VALUE_FLOAT },
+	[ 9] = { KEYWORD_NAME("emission_color"), KEYWORD_PROPERTY,  0,             true,  PROP_EMISSION_COLOR, VALUE_VECTOR },
+	[22] = { KEYWORD_NAME("radius"),         KEYWORD_PROPERTY,  OBJECT_SPHERE, false, PROP_RADIUS,         VALUE_FLOAT },
+	[ 7] = { KEYWORD_NAME("center"),         KEYWORD_PROPERTY,  OBJECT_SPHERE, false, PROP_CENTER,         VALUE_VECTOR },
+	[19] = { KEYWORD_NAME("origin"),         KEYWORD_PROPERTY,  OBJECT_CUBE,   false, PROP_ORIGIN,         VALUE_VECTOR },
+	[11] = { KEYWORD_NAME("size"),           KEYWORD_PROPERTY,  OBJECT_CUBE,   false, PROP_SIZE,           VALUE_VECTOR },
+	[14] = { KEYWORD_NAME("file"),           KEYWORD_PROPERTY,  OBJECT_MESH,   false, PROP_FILE,           VALUE_PATH, MARKER_MESH },
+	[16] = { KEYWORD_NAME("define"),         KEYWORD_DEFINE,    .marker = MARKER_DEFINE },
+	[ 3] = { KEYWORD_NAME("end"),            KEYWORD_END,       .marker = MARKER_END },
+	[17] = { KEYWORD_NAME("instance"),       KEYWORD_INSTANCE,  .marker = MARKER_INSTANCE },
+	[24] = { KEYWORD_NAME("position"),       KEYWORD_TRANSFORM, 0,             false, PROP_POSITION,       VALUE_VECTOR },
+	[26] = { KEYWORD_NAME("rotation"),       KEYWORD_TRANSFORM, 0,             false, PROP_ROTATION,       VALUE_VECTOR },
+	[21] = { KEYWORD_NAME("scale"),          KEYWORD_TRANSFORM, 0,             false, PROP_SCALE,          VALUE_VECTOR },
+};
 
-				float temp[3];
-				for (int j = 0; j < 3; j++) {
+static unsigned int keyword_hash(const char *word, size_t len)
+{
+	return (len * 26 + (unsigned char) word[0] + (unsigned char) word[len-2] * 8) % KEYWORD_TABLE_SIZE;
+}
 
-					while (i < len && is_space(src[i])) {
-						if (src[i] == '\n') line++;
-						i++;
-					}
+static const Keyword *lookup_keyword(const char *word, size_t len, const char *end)
+{
+	if (len < 2 || len >= sizeof(keywords[0].name))
+		return NULL;
+	const Keyword *keyword = &keywords[keyword_hash(word, len)];
+	if (keyword->len != len)
+		return NULL;
 
-					int sign = 1;
-					if (src[i] == '-') {
-						sign = -1;
-						i++;
-						if (i == len || !is_digit(src[i])) {
-							fprintf(stderr, "Error: Missing number after minus sign (line %d)\n", line);
-							return false;
-						}
-					} else if (!is_digit(src[i])) {
-						fprintf(stderr, "Error: Missing number %d in vector value (line %d)\n", j, line);
-						return false;
-					}
-					temp[j] = 0;
-					do {
-						int d = src[i] - '0';
-						temp[j] = temp[j] * 10 + d;
-						i++;
-					} while (i < len && is_digit(src[i]));
-					if (i < len && src[i] == '.') {
-						i++; // Skip the dot
-						if (i == len || !is_digit(src[i])) {
-							fprintf(stderr, "Error: Missing decimal part after dot (line %d)\n", line);
-							return false;
-						}
-						float q = 1.0f / 10;
-						do {
-							int d = src[i] - '0';
-							temp[j] += q * d;
-							q /= 10;
-							i++;
-						} while (i < len && is_digit(src[i]));
-					}
-					temp[j] *= sign;
-				}
+	if (end - word >= 16) {
+		__m128i a = _mm_loadu_si128((const __m128i*) word);
+		__m128i b = _mm_loadu_si128((const __m128i*) keyword->name);
+		unsigned int equal = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+		unsigned int want = (1u << len) - 1;
+		return (equal & want) == want ? keyword : NULL;
+	}
+	return memcmp(keyword->name, word, len) ? NULL : keyword;
+}
 
-				while (i < len && is_space(src[i])) {
-					if (src[i] == '\n') line++;
-					i++;
-				}
+// Number of objects stored together by the parser
+#define OBJECT_CHUNK_SIZE 4096
 
-				if (i == len || src[i] != '}') {
-					fprintf(stderr, "Error: Missing '}' after property value (line %d)\n", line);
-					return false;
-				}
-				i++;
+typedef struct ObjectChunk ObjectChunk;
+struct ObjectChunk {
+	ObjectChunk *next;
+	int          count;
+	Object       objects[OBJECT_CHUNK_SIZE];
+};
 
-				value1.x = temp[0];
-				value1.y = temp[1];
-				value1.z = temp[2];
-			}
+// Objects read by the parser. They are stored in chunks allocated
+// from a scratch arena so that the list can grow without copying.
+typedef struct {
+	Arena       *arena;
+	ObjectChunk *head;
+	ObjectChunk *tail;
+	int          count;
+} ObjectList;
 
-			switch (prop) {
+// Returns the slot of a new object at the end of the list
+static Object *push_object(ObjectList *list)
+{
+	if (list->tail == NULL || list->tail->count == OBJECT_CHUNK_SIZE) {
+		ObjectChunk *chunk = arena_alloc_array(list->arena, ObjectChunk, 1);
+		chunk->next  = NULL;
+		chunk->count = 0;
+		if (list->tail)
+			list->tail->next = chunk;
+		else
+			list->head = chunk;
+		list->tail = chunk;
+	}
+	list->count++;
+	return &list->tail->objects[list->tail->count++];
+}
 
-				case PROP_ALBEDO:
-				if (value1.x < 0 || value1.x > 1 ||
-					value1.y < 0 || value1.y > 1 ||
-					value1.z < 0 || value1.z > 1) {
-					fprintf(stderr, "Error: albedo values must be between 0 and 1 (line %d)\n", line);
-					return false;
-				}
-				object.material.albedo = value1;
-				break;
+// Start or end of a definition, an instance or the file of a mesh read
+// by the parser. A definition can span many chunks of a scene parsed in
+// parallel, so they're only matched once all the chunks were parsed,
+// and mesh files are only loaded once even if many objects use them.
+// The name of mesh markers is the path of the file and the mesh is the
+// last object read before the marker.
+typedef struct {
+	MarkerKind  kind;
+	int         object; // Objects read before the marker
+	int         line;   // Relative to the start of the chunk
+	const char *name;
+	int         name_len;
+	Vector3     position;
+	Vector3     rotation; // Degrees around the x, y and z axes, applied in this order
+	Vector3     scale;
+} Marker;
 
-				case PROP_ROUGHNESS:
-				if (value0 < 0 || value0 > 1) {
-					fprintf(stderr, "Error: Roughness must be between 0 and 1 (line %d)\n", line);
-					return false;
-				}
-				object.material.roughness = value0;
-				break;
+typedef struct {
+	Arena  *arena;
+	Marker *items;
+	int     count;
+	int     capacity;
+} MarkerList;
 
-				case PROP_REFLECTANCE:
-				if (value0 < 0 || value0 > 1) {
-					fprintf(stderr, "Error: Reflectance must be between 0 and 1 (line %d)\n", line);
-					return false;
-				}
-				object.material.reflectance = value0;
-				break;
+static Marker *push_marker(MarkerList *list)
+{
+	// The old array is left in the arena, which at
+	// most doubles the memory used by the markers
+	if (list->count == list->capacity) {
+		int capacity = list->capacity ? 2 * list->capacity : 64;
+		Marker *items = arena_alloc_array(list->arena, Marker, capacity);
+		if (list->count > 0)
+			memcpy(items, list->items, sizeof(Marker) * list->count);
+		list->items = items;
+		list->capacity = capacity;
+	}
+	return &list->items[list->count++];
+}
 
-				case PROP_METALLIC:
-				if (value0 < 0 || value0 > 1) {
-					fprintf(stderr, "Error: Metallic must be between 0 and 1 (line %d)\n", line);
-					return false;
-				}
-				object.material.metallic = value0;
-				break;
+// First error found by the parser. The message doesn't include the
+// line because chunks parsed in parallel only know their line
+// relative to the start of the chunk.
+typedef struct {
+	int  line;
+	char message[128];
+} ParseError;
 
-				case PROP_EMISSION_POWER:
-				object.material.emission_power = value0;
-				break;
+static const char *parse_error(ParseError *error, int line, const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(error->message, sizeof(error->message), fmt, args);
+	va_end(args);
+	error->line = line;
+	return NULL;
+}
 
-				case PROP_EMISSION_COLOR:
-				if (value1.x < 0 || value1.x > 1 ||
-					value1.y < 0 || value1.y > 1 ||
-					value1.z < 0 || value1.z > 1) {
-					fprintf(stderr, "Error: Emission color values must be between 0 and 1 (line %d)\n", line);
-					return false;
-				}
-				object.material.emission_color = value1;
-				break;
+// The scanning functions take the current position and return the one
+// after what they read, or NULL after storing an error. Keeping the
+// position in locals lets the compiler hold it in a register, which
+// it can't do for a struct field that any character read may alias.
+//
+// Branching on every character is what makes a parser slow, since
+// mispredictions dominate. Where at least 16 bytes are left, runs of
+// spaces, letters and digits are measured 16 bytes at a time with SSE2
+// and short runs of digits are converted without a loop.
 
-				case PROP_RADIUS:
-				object.sphere.radius = value0;
-				break;
+static unsigned int space_mask(__m128i c)
+{
+	__m128i s = _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8(' ')),  _mm_cmpeq_epi8(c, _mm_set1_epi8('\t')));
+	__m128i n = _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(c, _mm_set1_epi8('\r')));
+	return _mm_movemask_epi8(_mm_or_si128(s, n));
+}
 
-				case PROP_CENTER:
-				object.sphere.center = value1;
-				break;
+// Bytes between "lo" and "hi" (included)
+static unsigned int range_mask(__m128i c, char lo, char hi)
+{
+	__m128i x = _mm_sub_epi8(c, _mm_set1_epi8(lo));
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8(hi - lo)), x));
+}
 
-				case PROP_ORIGIN:
-				object.cube.origin = value1;
-				break;
+// Length of the run of bytes with bits set in "mask"
+static int run_length(unsigned int mask)
+{
+	return __builtin_ctz(~mask | 0x10000);
+}
 
-				case PROP_SIZE:
-				if (value1.x < 0 || value1.y < 0 || value1.z < 0) {
-					fprintf(stderr, "Error: Size values must be positive (line %d)\n", line);
-					return false;
-				}
-				object.cube.size = value1;
-				break;
-			}
+static const char *skip_spaces(const char *p, const char *end, int *line)
+{
+	int newlines = 0;
+	while (end - p >= 16) {
+		__m128i c = _mm_loadu_si128((const __m128i*) p);
+		unsigned int spaces = space_mask(c);
+		unsigned int breaks = _mm_movemask_epi8(_mm_cmpeq_epi8(c, _mm_set1_epi8('\n')));
+		int n = run_length(spaces);
+		newlines += __builtin_popcount(breaks & ((1u << n) - 1));
+		p += n;
+		if (n < 16) {
+			*line += newlines;
+			return p;
 		}
+	}
+	while (p < end && is_space(*p)) {
+		newlines += *p == '\n';
+		p++;
+	}
+	*line += newlines;
+	return p;
+}
 
-		if (scene->num_objects == MAX_OBJECTS)
-			fprintf(stderr, "Warning: Ignoring object because the scene is too big (line %d)\n", line);
-		else
-			scene->objects[scene->num_objects++] = object;
+static bool is_word_char(char c)
+{
+	return (unsigned char) (c - 'a') < 26 || c == '_';
+}
+
+// Reads the longest sequence of lowercase letters and underscores
+static const char *scan_word(const char *p, const char *end)
+{
+	if (end - p >= 16) {
+		__m128i c = _mm_loadu_si128((const __m128i*) p);
+		unsigned int letters = range_mask(c, 'a', 'z') | _mm_movemask_epi8(_mm_cmpeq_epi8(c, _mm_set1_epi8('_')));
+		int n = run_length(letters);
+		if (n < 16)
+			return p + n;
 	}
+	while (p < end && is_word_char(*p))
+		p++;
+	return p;
+}
 
-	return true;
+// Names of definitions can also have digits and capital letters
+static const char *scan_name(const char *p, const char *end)
+{
+	while (p < end && (is_word_char(*p) || is_digit(*p) || (unsigned char) (*p - 'A') < 26))
+		p++;
+	return p;
 }
 
-bool parse_scene_file(char *file, Scene *scene)
+// Converts the first "n" (at most 8) of 8 digits read as
+// a little endian integer, using 3 multiplications
+static uint64_t convert_digits(uint64_t chars, int n)
 {
-	size_t len;
-	char  *src = load_file(file, &len);
-	if (src == NULL) {
-		fprintf(stderr, "Error: Couldn't open scene file\n");
-		return false;
+	// Subtracting first means borrows only reach the unused
+	// bytes, which are shifted out while making room for
+	// leading zeros
+	uint64_t val = chars - 0x3030303030303030;
+	val = n ? val << (8 * (8 - n)) : 0;
+	val = val * 10 + (val >> 8);
+	val = (((val & 0x000000FF000000FF) * (100 + (1000000ULL << 32))) +
+		(((val >> 16) & 0x000000FF000000FF) * (1 + (10000ULL << 32)))) >> 32;
+	return val;
+}
+
+static const uint64_t powers_of_ten[] = {
+	1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000,
+};
+
+// Accumulates a run of digits in "digits" and returns the position
+// after them. "count" is set to the number of digits read.
+static const char *scan_digits(const char *p, const char *end, uint64_t *digits, int *count)
+{
+	if (end - p >= 16) {
+		__m128i c = _mm_loadu_si128((const __m128i*) p);
+		int n = run_length(range_mask(c, '0', '9'));
+		if (n <= 8) {
+			uint64_t chars;
+			memcpy(&chars, p, sizeof(chars));
+			*digits = *digits * powers_of_ten[n] + convert_digits(chars, n);
+			*count = n;
+			return p + n;
+		}
 	}
+	const char *start = p;
+	uint64_t value = *digits;
+	while (p < end && is_digit(*p))
+		value = value * 10 + (*p++ - '0');
+	*digits = value;
+	*count = p - start;
+	return p;
+}
 
-	bool ok = parse_scene_string(src, len, scene);
+// Numbers with more digits than this don't fit in the 64 bit
+// accumulator and are converted by the C library
+#define MAX_EXACT_DIGITS 19
 
-	free(src);
+static float parse_long_float(const char *src, size_t len)
+{
+	char  buffer[128];
+	char *copy = buffer;
+	if (len >= sizeof(buffer)) {
+		copy = malloc(len + 1);
+		if (copy == NULL) {
+			printf("OUT OF MEMORY\n");
+			abort();
+		}
+	}
+	memcpy(copy, src, len);
+	copy[len] = '\0';
+
+	float value = strtof(copy, NULL);
+
+	if (copy != buffer)
+		free(copy);
+	return value;
+}
+
+// Reads a number with the form [-]digits[.digits][(e|E)[+|-]digits]
+static const char *scan_float(const char *p, const char *end, int line, float *value, ParseError *error)
+{
+	const char *start = p;
+
+	bool negative = false;
+	if (p < end && *p == '-') {
+		negative = true;
+		p++;
+	}
+
+	// The digits before and after the dot are accumulated
+	// in the same integer and the exponent scales it back
+	uint64_t digits = 0;
+	int num_digits;
+	p = scan_digits(p, end, &digits, &num_digits);
+	if (num_digits == 0) {
+		if (negative)
+			return parse_error(error, line, "Missing number after minus sign");
+		return parse_error(error, line, "Missing number");
+	}
+
+	int exponent = 0;
+	if (p < end && *p == '.') {
+		p++; // Skip the dot
+		int num_decimals;
+		p = scan_digits(p, end, &digits, &num_decimals);
+		if (num_decimals == 0)
+			return parse_error(error, line, "Missing decimal part after dot");
+		exponent -= num_decimals;
+		num_digits += num_decimals;
+	}
+
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		p++;
+		bool negative_exponent = false;
+		if (p < end && (*p == '-' || *p == '+')) {
+			negative_exponent = *p == '-';
+			p++;
+		}
+		if (p == end || !is_digit(*p))
+			return parse_error(error, line, "Missing exponent after 'e'");
+		int e = 0;
+		do {
+			// Saturate, anything this big is zero or infinite anyway
+			if (e < 100000)
+				e = e * 10 + (*p - '0');
+			p++;
+		} while (p < end && is_digit(*p));
+		exponent += negative_exponent ? -e : e;
+	}
+
+	if (num_digits <= MAX_EXACT_DIGITS)
+		*value = decimal_to_float(digits, exponent, negative);
+	else
+		*value = parse_long_float(start, p - start);
+	return p;
+}
+
+static const char *scan_vector(const char *p, const char *end, int *line, Vector3 *value, ParseError *error)
+{
+	if (p == end || *p != '{')
+		return parse_error(error, *line, "Missing '{' after property name");
+	p++;
+
+	float temp[3];
+	for (int j = 0; j < 3; j++) {
+		p = skip_spaces(p, end, line);
+		p = scan_float(p, end, *line, &temp[j], error);
+		if (p == NULL)
+			return NULL;
+	}
+	p = skip_spaces(p, end, line);
+
+	if (p == end || *p != '}')
+		return parse_error(error, *line, "Missing '}' after property value");
+	p++;
+
+	value->x = temp[0];
+	value->y = temp[1];
+	value->z = temp[2];
+	return p;
+}
+
+// Paths are a run of characters other than spaces, or any
+// text between double quotes on the same line
+static const char *scan_path(const char *p, const char *end, int line, const char **path, int *path_len, ParseError *error)
+{
+	if (*p != '"') {
+		const char *start = p;
+		while (p < end && !is_space(*p))
+			p++;
+		*path = start;
+		*path_len = p - start;
+		return p;
+	}
+
+	const char *start = ++p;
+	while (p < end && *p != '"' && *p != '\n')
+		p++;
+	if (p == end || *p != '"')
+		return parse_error(error, line, "Missing '\"' after path");
+	if (p == start)
+		return parse_error(error, line, "Empty path");
+	*path = start;
+	*path_len = p - start;
+	return p + 1;
+}
+
+static void init_object(Object *object, ObjectType type)
+{
+	object->type = type;
+	if (type == OBJECT_SPHERE) {
+		object->sphere.center = (Vector3) {0, 0, 0};
+		object->sphere.radius = 1;
+	} else if (type == OBJECT_MESH) {
+		object->mesh.bounds = empty_aabb();
+		object->mesh.index = -1; // No file yet
+	} else {
+		object->cube.origin = (Vector3) {0, 0, 0};
+		object->cube.size = (Vector3) {1, 1, 1};
+	}
+	object->material.albedo = (Vector3) {0.44, 0.68, 0.84};
+	object->material.roughness = 0;
+	object->material.reflectance = 0.2;
+	object->material.metallic = 0;
+	object->material.emission_power = 0;
+	object->material.emission_color = (Vector3) {1, 1, 1};
+}
+
+static bool set_property(Object *object, Property prop, float value0, Vector3 value1, int line, ParseError *error)
+{
+	switch (prop) {
+
+		case PROP_ALBEDO:
+		if (value1.x < 0 || value1.x > 1 ||
+			value1.y < 0 || value1.y > 1 ||
+			value1.z < 0 || value1.z > 1) {
+			parse_error(error, line, "albedo values must be between 0 and 1");
+			return false;
+		}
+		object->material.albedo = value1;
+		break;
+
+		case PROP_ROUGHNESS:
+		if (value0 < 0 || value0 > 1) {
+			parse_error(error, line, "Roughness must be between 0 and 1");
+			return false;
+		}
+		object->material.roughness = value0;
+		break;
+
+		case PROP_REFLECTANCE:
+		if (value0 < 0 || value0 > 1) {
+			parse_error(error, line, "Reflectance must be between 0 and 1");
+			return false;
+		}
+		object->material.reflectance = value0;
+		break;
+
+		case PROP_METALLIC:
+		if (value0 < 0 || value0 > 1) {
+			parse_error(error, line, "Metallic must be between 0 and 1");
+			return false;
+		}
+		object->material.metallic = value0;
+		break;
+
+		case PROP_EMISSION_POWER:
+		object->material.emission_power = value0;
+		break;
+
+		case PROP_EMISSION_COLOR:
+		if (value1.x < 0 || value1.x > 1 ||
+			value1.y < 0 || value1.y > 1 ||
+			value1.z < 0 || value1.z > 1) {
+			parse_error(error, line, "Emission color values must be between 0 and 1");
+			return false;
+		}
+		object->material.emission_color = value1;
+		break;
+
+		case PROP_RADIUS:
+		object->sphere.radius = value0;
+		break;
+
+		case PROP_CENTER:
+		object->sphere.center = value1;
+		break;
+
+		case PROP_ORIGIN:
+		object->cube.origin = value1;
+		break;
+
+		case PROP_SIZE:
+		if (value1.x < 0 || value1.y < 0 || value1.z < 0) {
+			parse_error(error, line, "Size values must be positive");
+			return false;
+		}
+		object->cube.size = value1;
+		break;
+
+		default:
+		break;
+	}
+	return true;
+}
+
+static bool set_transform(Marker *instance, Property prop, Vector3 value, int line, ParseError *error)
+{
+	switch (prop) {
+
+		case PROP_POSITION:
+		instance->position = value;
+		break;
+
+		case PROP_ROTATION:
+		instance->rotation = value;
+		break;
+
+		case PROP_SCALE:
+		if (value.x <= 0 || value.y <= 0 || value.z <= 0) {
+			parse_error(error, line, "Scale values must be greater than 0");
+			return false;
+		}
+		instance->scale = value;
+		break;
+
+		default:
+		break;
+	}
+	return true;
+}
+
+// Fails if the object that was just completed is a mesh without a file
+static bool check_object(const Object *object, int line, ParseError *error)
+{
+	if (object && object->type == OBJECT_MESH && object->mesh.index < 0) {
+		parse_error(error, line, "Mesh without a file");
+		return false;
+	}
+	return true;
+}
+
+// The scene is a sequence of words, numbers and vectors separated by
+// spaces. Every object starts with its type followed by any number of
+// properties, each with its value. Objects between "define <name>" and
+// "end" form a definition, which "instance <name>" places in the world
+// with its own position, rotation and scale. "line" is advanced past
+// the lines that were read.
+static bool parse_objects(const char *src, size_t len, ObjectList *list, MarkerList *markers, int *line_, ParseError *error)
+{
+	const char *p = src;
+	const char *end = src + len;
+	int line = *line_;
+
+	// Object or instance the properties are applied to
+	Object *object = NULL;
+	int     object_line = line;
+	int     instance = -1;
+	for (;;) {
+
+		p = skip_spaces(p, end, &line);
+		if (p == end)
+			break;
+
+		const char *word = p;
+		p = scan_word(p, end);
+		size_t word_len = p - word;
+		if (word_len == 0) {
+			parse_error(error, line, "Invalid character");
+			return false;
+		}
+
+		const Keyword *keyword = lookup_keyword(word, word_len, end);
+		if (keyword == NULL) {
+			parse_error(error, line, "Unknown keyword '%.*s'", (int) word_len, word);
+			return false;
+		}
+
+		switch (keyword->kind) {
+
+			case KEYWORD_OBJECT:
+			if (!check_object(object, object_line, error))
+				return false;
+			object = push_object(list);
+			object_line = line;
+			init_object(object, keyword->type);
+			instance = -1;
+			continue;
+
+			case KEYWORD_DEFINE:
+			case KEYWORD_INSTANCE:
+			case KEYWORD_END: {
+				if (!check_object(object, object_line, error))
+					return false;
+				int marker_line = line;
+				const char *name = NULL;
+				size_t name_len = 0;
+				if (keyword->kind != KEYWORD_END) {
+					p = skip_spaces(p, end, &line);
+					name = p;
+					p = scan_name(p, end);
+					name_len = p - name;
+					if (name_len == 0) {
+						parse_error(error, line, "Missing name after '%s'", keyword->name);
+						return false;
+					}
+				}
+
+				Marker *marker = push_marker(markers);
+				marker->kind     = keyword->marker;
+				marker->object   = list->count;
+				marker->line     = marker_line;
+				marker->name     = name;
+				marker->name_len = name_len;
+				marker->position = (Vector3) {0, 0, 0};
+				marker->rotation = (Vector3) {0, 0, 0};
+				marker->scale    = (Vector3) {1, 1, 1};
+
+				object = NULL;
+				instance = keyword->kind == KEYWORD_INSTANCE ? markers->count - 1 : -1;
+				continue;
+			}
+
+			case KEYWORD_TRANSFORM:
+			if (instance < 0) {
+				parse_error(error, line, "Property '%s' only allowed on instances", keyword->name);
+				return false;
+			}
+			break;
+
+			case KEYWORD_PROPERTY:
+			if (object == NULL) {
+				parse_error(error, line, "Property '%s' doesn't belong to an object", keyword->name);
+				return false;
+			}
+			if (!keyword->any_type && keyword->type != object->type) {
+				static const char *plurals[] = {
+					[OBJECT_CUBE]   = "cubes",
+					[OBJECT_SPHERE] = "spheres",
+					[OBJECT_MESH]   = "meshes",
+				};
+				parse_error(error, line, "Property '%s' only allowed on %s", keyword->name, plurals[keyword->type]);
+				return false;
+			}
+			break;
+		}
+
+		// Consume spaces before the value
+		p = skip_spaces(p, end, &line);
+		if (p == end) {
+			parse_error(error, line, "Property value is missing");
+			return false;
+		}
+
+		float       value0 = 0;
+		Vector3     value1 = {0, 0, 0};
+		const char *path = NULL;
+		int         path_len = 0;
+		if (keyword->valuetype == VALUE_FLOAT)
+			p = scan_float(p, end, line, &value0, error);
+		else if (keyword->valuetype == VALUE_VECTOR)
+			p = scan_vector(p, end, &line, &value1, error);
+		else
+			p = scan_path(p, end, line, &path, &path_len, error);
+		if (p == NULL)
+			return false;
+
+		if (keyword->kind == KEYWORD_TRANSFORM) {
+			if (!set_transform(&markers->items[instance], keyword->prop, value1, line, error))
+				return false;
+		} else if (keyword->valuetype == VALUE_PATH) {
+			Marker *marker = push_marker(markers);
+			marker->kind     = keyword->marker;
+			marker->object   = list->count;
+			marker->line     = line;
+			marker->name     = path;
+			marker->name_len = path_len;
+			object->mesh.index = 0; // Set when the file is loaded
+		} else {
+			if (!set_property(object, keyword->prop, value0, value1, line, error))
+				return false;
+		}
+	}
+
+	if (!check_object(object, object_line, error))
+		return false;
+
+	*line_ = line;
+	return true;
+}
+
+// Large scenes are split in chunks that are parsed in parallel, each
+// in its own arena. There are a few chunks per thread so that threads
+// finishing early can pick up more work.
+#define MIN_PARSE_CHUNK_SIZE (1 << 20)
+#define PARSE_CHUNKS_PER_THREAD 4
+#define MAX_PARSE_CHUNKS 256
+
+typedef struct {
+	const char *src;
+	size_t      len;
+	Arena       arena;
+	ObjectList  list;
+	MarkerList  markers;
+	int         num_lines;    // Lines ended in the chunk
+	int         first_line;   // Line of the scene where the chunk starts
+	int         first_object; // Index in the scene of the first object of the chunk
+	bool        ok;
+	ParseError  error;
+} ParseChunk;
+
+// Keywords that start something other than a property
+static bool starts_item(const Keyword *keyword)
+{
+	return keyword && keyword->kind != KEYWORD_PROPERTY && keyword->kind != KEYWORD_TRANSFORM;
+}
+
+// Returns the position of the first line after "pos" that starts with
+// an object, a definition or an instance, or "len" if there is none.
+// Chunks are only split there, so that every chunk is a sequence of
+// whole items.
+static size_t find_object_start(const char *src, size_t len, size_t pos)
+{
+	const char *end = src + len;
+	while (pos < len) {
+		const char *newline = memchr(src + pos, '\n', len - pos);
+		if (newline == NULL)
+			break;
+		pos = newline - src + 1;
+
+		const char *word = src + pos;
+		const char *word_end = scan_word(word, end);
+		if (starts_item(lookup_keyword(word, word_end - word, end)))
+			return pos;
+	}
+	return len;
+}
+
+// Splits the source in at most "max_chunks" chunks of about the same size
+static int split_source(const char *src, size_t len, int max_chunks, ParseChunk *chunks)
+{
+	int count = 0;
+	size_t begin = 0;
+	while (begin < len || count == 0) {
+		size_t end = len;
+		if (count < max_chunks - 1) {
+			size_t target = len / max_chunks * (count + 1);
+			end = find_object_start(src, len, target > begin ? target : begin);
+		}
+		chunks[count].src = src + begin;
+		chunks[count].len = end - begin;
+		count++;
+		begin = end;
+	}
+	return count;
+}
+
+static void parse_chunks(void *data, int begin, int end)
+{
+	ParseChunk *chunks = data;
+	for (int i = begin; i < end; i++) {
+		ParseChunk *chunk = &chunks[i];
+		init_arena(&chunk->arena);
+		chunk->list = (ObjectList) { .arena = &chunk->arena };
+		chunk->markers = (MarkerList) { .arena = &chunk->arena };
+
+		int line = 1;
+		chunk->ok = parse_objects(chunk->src, chunk->len, &chunk->list, &chunk->markers, &line, &chunk->error);
+		chunk->num_lines = line - 1;
+	}
+}
+
+typedef struct {
+	ParseChunk *chunks;
+	Object     *objects;
+	AABB       *boxes;
+} CompileJob;
+
+static void copy_chunks(void *data, int begin, int end)
+{
+	CompileJob *job = data;
+	for (int i = begin; i < end; i++) {
+		int k = job->chunks[i].first_object;
+		for (ObjectChunk *chunk = job->chunks[i].list.head; chunk; chunk = chunk->next) {
+			memcpy(&job->objects[k], chunk->objects, sizeof(Object) * chunk->count);
+			for (int j = 0; j < chunk->count; j++)
+				job->boxes[k + j] = bounds_of(chunk->objects[j]);
+			k += chunk->count;
+		}
+	}
+}
+
+// Runs "func" over the chunks on the pool if there is one
+static void for_each_chunk(Pool *pool, int num_chunks, ParallelForFunc func, void *data)
+{
+	if (pool)
+		parallel_for(pool, num_chunks, 1, func, data);
+	else
+		func(data, 0, num_chunks);
+}
+
+// Only objects of the world emit light, not those of definitions
+static int find_first_light(const Scene *scene)
+{
+	int d = 0;
+	for (int i = 0; i < scene->num_objects; i++) {
+		while (d < scene->num_definitions && scene->definitions[d].first_object + scene->definitions[d].num_objects <= i)
+			d++;
+		if (d < scene->num_definitions && i >= scene->definitions[d].first_object)
+			continue;
+		if (scene->objects[i].material.emission_power > 0)
+			return i;
+	}
+	return -1;
+}
+
+// Moves a tree in the arena of a scene so that it's freed with the rest
+static void move_bvh_to_arena(BVH *dst, BVH *src, Arena *arena)
+{
+	dst->num_nodes = src->num_nodes;
+	dst->num_prims = src->num_prims;
+	dst->nodes = arena_alloc_array(arena, BVHNode, src->num_nodes + 1);
+	dst->prims = arena_alloc_array(arena, int,     src->num_prims + 1);
+	memcpy(dst->nodes, src->nodes, sizeof(BVHNode) * src->num_nodes);
+	memcpy(dst->prims, src->prims, sizeof(int)     * src->num_prims);
+	free_bvh(src);
+}
+
+// Parts of a scene only needed while it's compiled
+typedef struct {
+	Object     *objects;     // Same array as the one of the scene
+	AABB       *boxes;       // Bounds of the objects followed by those of the instances
+	Definition *definitions; // Same array as the one of the scene
+	Matrix4    *to_world;    // Transform of every instance
+} SceneBuild;
+
+// Creates a scene with the parsed objects, concatenating the chunks
+// in order. Its arrays are sized exactly and allocated from the arena
+// of the scene. The trees are left empty and the bounding boxes of the
+// objects are stored in "build".
+static Scene *gather_objects(ParseChunk *chunks, int num_chunks, Pool *pool, Arena *scratch, SceneBuild *build)
+{
+	Arena arena;
+	init_arena(&arena);
+
+	Scene *scene = arena_alloc_array(&arena, Scene, 1);
+	memset(scene, 0, sizeof(Scene));
+
+	int num_objects = 0;
+	int num_markers = 0;
+	for (int i = 0; i < num_chunks; i++) {
+		num_objects += chunks[i].list.count;
+		num_markers += chunks[i].markers.count;
+	}
+
+	// There's room for the bounds of the instances too
+	Object *objects = arena_alloc_array(&arena, Object, num_objects + 1);
+	build->boxes = arena_alloc_array(scratch, AABB, num_objects + num_markers + 1);
+	CompileJob job = { chunks, objects, build->boxes };
+	for_each_chunk(pool, num_chunks, copy_chunks, &job);
+	build->objects = objects;
+
+	scene->objects = objects;
+	scene->num_objects = num_objects;
+	scene->arena = arena;
+	return scene;
+}
+
+static Matrix4 instance_transform(const Marker *marker)
+{
+	Vector3 r = marker->rotation;
+	Matrix4 m = scale_matrix(marker->scale);
+	m = dotm(rotate_matrix_x(deg2rad(r.x)), m);
+	m = dotm(rotate_matrix_y(deg2rad(r.y)), m);
+	m = dotm(rotate_matrix_z(deg2rad(r.z)), m);
+	return dotm(translate_matrix(marker->position, 1), m);
+}
+
+// Mesh file loaded and turned in a tree by one of the threads
+typedef struct {
+	const char    *path;
+	BVH            bvh;
+	TriangleBlock *blocks;
+	int            num_blocks;
+	bool           ok;
+} MeshJob;
+
+static void load_mesh_jobs(void *data, int begin, int end)
+{
+	MeshJob *jobs = data;
+	for (int i = begin; i < end; i++) {
+		MeshJob *job = &jobs[i];
+		MeshData mesh;
+		job->ok = load_mesh(job->path, &mesh);
+		if (!job->ok)
+			continue;
+		job->ok = build_mesh_bvh(&mesh, &job->bvh, &job->blocks, &job->num_blocks);
+		if (!job->ok)
+			fprintf(stderr, "Error: Couldn't build the acceleration structure of %s (out of memory)\n", job->path);
+		free_mesh_data(&mesh);
+	}
+}
+
+// Paths of meshes are relative to the directory of the scene
+// file, or to the working directory if there isn't one
+static char *mesh_path(const Marker *marker, const char *scene_file, Arena *scratch)
+{
+	const char *name = marker->name;
+	bool absolute = name[0] == '/' || name[0] == '\\' || (marker->name_len > 1 && name[1] == ':');
+
+	int dir_len = 0;
+	if (scene_file && !absolute)
+		for (int i = 0; scene_file[i]; i++)
+			if (scene_file[i] == '/' || scene_file[i] == '\\')
+				dir_len = i + 1;
+
+	char *path = arena_alloc_array(scratch, char, dir_len + marker->name_len + 1);
+	if (dir_len > 0)
+		memcpy(path, scene_file, dir_len);
+	memcpy(path + dir_len, name, marker->name_len);
+	path[dir_len + marker->name_len] = '\0';
+	return path;
+}
+
+// Loads the files of the mesh objects, each one only once, and stores
+// their trees one after the other in "mesh_bvh" of the scene
+static bool load_meshes(Scene *scene, Marker **files, int num_files, const char *scene_file, Pool *pool, Arena *scratch, SceneBuild *build)
+{
+	if (num_files == 0)
+		return true;
+
+	MeshJob *jobs    = arena_alloc_array(scratch, MeshJob, num_files);
+	int     *mesh_of = arena_alloc_array(scratch, int,     num_files);
+	int      num_jobs = 0;
+
+	// Same kind of table as the one of the definition names
+	int table_size = 16;
+	while (table_size < 2 * num_files)
+		table_size *= 2;
+	int *table = arena_alloc_array(scratch, int, table_size);
+	memset(table, 0, sizeof(int) * table_size);
+
+	for (int i = 0; i < num_files; i++) {
+		char *path = mesh_path(files[i], scene_file, scratch);
+		size_t len = strlen(path);
+		int k = hash_bytes(path, len) & (table_size - 1);
+		while (table[k] && strcmp(jobs[table[k] - 1].path, path))
+			k = (k + 1) & (table_size - 1);
+		if (table[k] == 0) {
+			memset(&jobs[num_jobs], 0, sizeof(MeshJob));
+			jobs[num_jobs].path = path;
+			table[k] = ++num_jobs;
+		}
+		mesh_of[i] = table[k] - 1;
+	}
+
+	for_each_chunk(pool, num_jobs, load_mesh_jobs, jobs);
+
+	bool ok = true;
+	int num_nodes  = 0;
+	int num_blocks = 0;
+	int files_size = 0;
+	for (int i = 0; i < num_jobs; i++) {
+		if (!jobs[i].ok) {
+			ok = false;
+			continue;
+		}
+		num_nodes  += jobs[i].bvh.num_nodes;
+		num_blocks += jobs[i].num_blocks;
+		files_size += strlen(jobs[i].path) + 1;
+	}
+	if (!ok) {
+		for (int i = 0; i < num_jobs; i++)
+			if (jobs[i].ok) {
+				free_bvh(&jobs[i].bvh);
+				free(jobs[i].blocks);
+			}
+		return false;
+	}
+
+	Mesh          *meshes = arena_alloc_array(&scene->arena, Mesh,          num_jobs);
+	TriangleBlock *blocks = arena_alloc_array(&scene->arena, TriangleBlock, num_blocks);
+	char          *names  = arena_alloc_array(&scene->arena, char,          files_size);
+	BVH *bvh = &scene->mesh_bvh;
+	bvh->nodes = arena_alloc_array(&scene->arena, BVHNode, num_nodes);
+	bvh->num_nodes = num_nodes;
+	bvh->prims = NULL;
+	bvh->num_prims = 0;
+
+	// Leaves are moved to where their blocks end up
+	num_nodes  = 0;
+	num_blocks = 0;
+	files_size = 0;
+	for (int i = 0; i < num_jobs; i++) {
+		MeshJob *job = &jobs[i];
+		for (int j = 0; j < job->bvh.num_nodes; j++) {
+			BVHNode node = job->bvh.nodes[j];
+			node.index += node.count > 0 ? num_blocks : num_nodes;
+			bvh->nodes[num_nodes + j] = node;
+		}
+		memcpy(blocks + num_blocks, job->blocks, sizeof(TriangleBlock) * job->num_blocks);
+
+		int num_triangles = 0;
+		for (int j = 0; j < job->bvh.num_nodes; j++)
+			num_triangles += job->bvh.nodes[j].count;
+		meshes[i].root   = num_nodes;
+		meshes[i].bounds = job->bvh.nodes[0].box;
+		meshes[i].num_triangles = num_triangles;
+
+		size_t len = strlen(job->path) + 1;
+		memcpy(names + files_size, job->path, len);
+		files_size += len;
+
+		num_nodes  += job->bvh.num_nodes;
+		num_blocks += job->num_blocks;
+		free_bvh(&job->bvh);
+		free(job->blocks);
+	}
+
+	scene->meshes = meshes;
+	scene->num_meshes = num_jobs;
+	scene->triangle_blocks = blocks;
+	scene->num_triangle_blocks = num_blocks;
+	scene->mesh_files = names;
+	scene->mesh_files_size = files_size;
+
+	// A mesh object is the last one read before its marker
+	for (int i = 0; i < num_files; i++) {
+		int o = files[i]->object - 1;
+		build->objects[o].mesh.index  = mesh_of[i];
+		build->objects[o].mesh.bounds = meshes[mesh_of[i]].bounds;
+		build->boxes[o] = meshes[mesh_of[i]].bounds;
+	}
+	return true;
+}
+
+// Matches the definitions and instances read by the parser, loads the
+// files of the meshes and stores them in the scene. Returns false after
+// printing the first error.
+static bool resolve_markers(Scene *scene, ParseChunk *chunks, int num_chunks, const char *file, Pool *pool, Arena *scratch, SceneBuild *build)
+{
+	int num_definitions = 0;
+	int num_instances = 0;
+	int num_files = 0;
+	for (int i = 0; i < num_chunks; i++)
+		for (int j = 0; j < chunks[i].markers.count; j++) {
+			MarkerKind kind = chunks[i].markers.items[j].kind;
+			if (kind == MARKER_DEFINE)
+				num_definitions++;
+			else if (kind == MARKER_INSTANCE)
+				num_instances++;
+			else if (kind == MARKER_MESH)
+				num_files++;
+		}
+
+	Definition *definitions = arena_alloc_array(&scene->arena, Definition, num_definitions + 1);
+	Instance   *instances   = arena_alloc_array(&scene->arena, Instance,   num_instances + 1);
+	Marker    **names       = arena_alloc_array(scratch, Marker*, num_definitions + 1);
+	Marker    **placements  = arena_alloc_array(scratch, Marker*, num_instances + 1);
+	Marker    **files       = arena_alloc_array(scratch, Marker*, num_files + 1);
+	build->definitions = definitions;
+	build->to_world    = arena_alloc_array(scratch, Matrix4, num_instances + 1);
+	scene->definitions = definitions;
+	scene->instances   = instances;
+
+	// The markers are made absolute so that they can be
+	// reported after the chunks are walked
+	int open = -1;
+	num_definitions = 0;
+	num_instances = 0;
+	num_files = 0;
+	for (int i = 0; i < num_chunks; i++)
+		for (int j = 0; j < chunks[i].markers.count; j++) {
+			Marker *marker = &chunks[i].markers.items[j];
+			marker->object += chunks[i].first_object;
+			marker->line   += chunks[i].first_line - 1;
+
+			switch (marker->kind) {
+
+				case MARKER_DEFINE:
+				if (open >= 0) {
+					fprintf(stderr, "Error: Definitions can't be nested (line %d)\n", marker->line);
+					return false;
+				}
+				open = num_definitions++;
+				definitions[open].first_object = marker->object;
+				definitions[open].num_objects  = 0;
+				definitions[open].root         = -1;
+				names[open] = marker;
+				break;
+
+				case MARKER_END:
+				if (open < 0) {
+					fprintf(stderr, "Error: 'end' without 'define' (line %d)\n", marker->line);
+					return false;
+				}
+				definitions[open].num_objects = marker->object - definitions[open].first_object;
+				open = -1;
+				break;
+
+				case MARKER_INSTANCE:
+				if (open >= 0) {
+					fprintf(stderr, "Error: Instances can't be placed inside definitions (line %d)\n", marker->line);
+					return false;
+				}
+				placements[num_instances++] = marker;
+				break;
+
+				case MARKER_MESH:
+				files[num_files++] = marker;
+				break;
+			}
+		}
+	if (open >= 0) {
+		fprintf(stderr, "Error: Definition '%.*s' is missing 'end' (line %d)\n", names[open]->name_len, names[open]->name, names[open]->line);
+		return false;
+	}
+	scene->num_definitions = num_definitions;
+	scene->num_instances   = num_instances;
+
+	// Names are looked up in an open addressing hash table
+	// storing the index of the definition plus one
+	int table_size = 16;
+	while (table_size < 2 * num_definitions)
+		table_size *= 2;
+	int *table = arena_alloc_array(scratch, int, table_size);
+	memset(table, 0, sizeof(int) * table_size);
+
+	for (int i = 0; i < num_definitions; i++) {
+		Marker *name = names[i];
+		int k = hash_bytes(name->name, name->name_len) & (table_size - 1);
+		while (table[k]) {
+			Marker *other = names[table[k] - 1];
+			if (other->name_len == name->name_len && !memcmp(other->name, name->name, name->name_len)) {
+				fprintf(stderr, "Error: Definition '%.*s' already exists (line %d)\n", name->name_len, name->name, name->line);
+				return false;
+			}
+			k = (k + 1) & (table_size - 1);
+		}
+		table[k] = i + 1;
+	}
+
+	for (int i = 0; i < num_instances; i++) {
+		Marker *marker = placements[i];
+		int k = hash_bytes(marker->name, marker->name_len) & (table_size - 1);
+		for (;;) {
+			if (table[k] == 0) {
+				fprintf(stderr, "Error: Unknown definition '%.*s' (line %d)\n", marker->name_len, marker->name, marker->line);
+				return false;
+			}
+			Marker *name = names[table[k] - 1];
+			if (name->name_len == marker->name_len && !memcmp(name->name, marker->name, name->name_len))
+				break;
+			k = (k + 1) & (table_size - 1);
+		}
+
+		Instance *instance = &instances[i];
+		instance->definition = table[k] - 1;
+		build->to_world[i] = instance_transform(marker);
+		if (!invert(build->to_world[i], &instance->to_local)) {
+			fprintf(stderr, "Error: Instance scale is too small (line %d)\n", marker->line);
+			return false;
+		}
+		instance->normal_to_world = transpose(instance->to_local);
+	}
+
+	if (!load_meshes(scene, files, num_files, file, pool, scratch, build))
+		return false;
+
+	scene->light_index = find_first_light(scene);
+	return true;
+}
+
+// Definitions with at least this many objects are built one at a time
+// with the help of the pool, the others are built by the threads at once
+#define MIN_SHARED_BUILD_SIZE (1 << 16)
+
+// Tree of a definition built by one of the threads
+typedef struct {
+	const AABB    *boxes;
+	int            count;
+	BVHBuildMethod method;
+	bool           shared; // Built with the pool before the others
+	BVH            bvh;
+	bool           ok;
+} DefinitionJob;
+
+static void build_definition_jobs(void *data, int begin, int end)
+{
+	DefinitionJob *jobs = data;
+	for (int i = begin; i < end; i++)
+		if (!jobs[i].shared)
+			jobs[i].ok = build_bvh(&jobs[i].bvh, jobs[i].boxes, jobs[i].count, jobs[i].method, NULL);
+}
+
+// Builds the trees of the definitions one after the other
+// in "definition_bvh" of the scene
+static bool build_definition_bvhs(Scene *scene, SceneBuild *build, Pool *pool, BVHBuildMethod method, Arena *scratch)
+{
+	int num_definitions = scene->num_definitions;
+	DefinitionJob *jobs = arena_alloc_array(scratch, DefinitionJob, num_definitions + 1);
+	for (int i = 0; i < num_definitions; i++) {
+		Definition *definition = &build->definitions[i];
+		DefinitionJob *job = &jobs[i];
+		job->boxes  = build->boxes + definition->first_object;
+		job->count  = definition->num_objects;
+		job->method = method;
+		job->shared = pool && job->count >= MIN_SHARED_BUILD_SIZE;
+		if (job->shared)
+			job->ok = build_bvh(&job->bvh, job->boxes, job->count, method, pool);
+	}
+	for_each_chunk(pool, num_definitions, build_definition_jobs, jobs);
+
+	bool ok = true;
+	for (int i = 0; i < num_definitions; i++)
+		ok = ok && jobs[i].ok;
+	if (!ok) {
+		for (int i = 0; i < num_definitions; i++)
+			if (jobs[i].ok)
+				free_bvh(&jobs[i].bvh);
+		return false;
+	}
+
+	int num_nodes = 0;
+	int num_prims = 0;
+	for (int i = 0; i < num_definitions; i++) {
+		num_nodes += jobs[i].bvh.num_nodes;
+		num_prims += jobs[i].bvh.num_prims;
+	}
+
+	BVH *bvh = &scene->definition_bvh;
+	bvh->num_nodes = num_nodes;
+	bvh->num_prims = num_prims;
+	bvh->nodes = arena_alloc_array(&scene->arena, BVHNode, num_nodes + 1);
+	bvh->prims = arena_alloc_array(&scene->arena, int,     num_prims + 1);
+
+	// Indices are moved to where the trees end up
+	// in the arrays shared by all the definitions
+	num_nodes = 0;
+	num_prims = 0;
+	for (int i = 0; i < num_definitions; i++) {
+		Definition *definition = &build->definitions[i];
+		BVH *part = &jobs[i].bvh;
+		for (int j = 0; j < part->num_nodes; j++) {
+			BVHNode node = part->nodes[j];
+			node.index += node.count > 0 ? num_prims : num_nodes;
+			bvh->nodes[num_nodes + j] = node;
+		}
+		for (int j = 0; j < part->num_prims; j++)
+			bvh->prims[num_prims + j] = part->prims[j] + definition->first_object;
+
+		definition->root = part->num_nodes > 0 ? num_nodes : -1;
+		num_nodes += part->num_nodes;
+		num_prims += part->num_prims;
+		free_bvh(part);
+	}
+	return true;
+}
+
+// Stores the bounds of the instances after those of the objects
+static void bound_instances(const Scene *scene, SceneBuild *build)
+{
+	for (int i = 0; i < scene->num_instances; i++) {
+		const Definition *definition = &scene->definitions[scene->instances[i].definition];
+		AABB box = empty_aabb();
+		if (definition->root >= 0) {
+			AABB local = scene->definition_bvh.nodes[definition->root].box;
+			for (int j = 0; j < 8; j++) {
+				Vector3 corner = {
+					j & 1 ? local.max.x : local.min.x,
+					j & 2 ? local.max.y : local.min.y,
+					j & 4 ? local.max.z : local.min.z,
+				};
+				box = grow_aabb(box, transform_point(&build->to_world[i], corner));
+			}
+		}
+		build->boxes[scene->num_objects + i] = box;
+	}
+}
+
+// Builds the top of the hierarchy over the objects that aren't part of
+// a definition and over the instances
+static bool build_scene_bvh(Scene *scene, const SceneBuild *build, Pool *pool, BVHBuildMethod method, Arena *scratch)
+{
+	// Primitives of the tree and their bounds
+	int  *prims = arena_alloc_array(scratch, int,  scene->num_objects + scene->num_instances + 1);
+	AABB *boxes = arena_alloc_array(scratch, AABB, scene->num_objects + scene->num_instances + 1);
+	int   count = 0;
+
+	int d = 0;
+	for (int i = 0; i < scene->num_objects; i++) {
+		if (d < scene->num_definitions && i == scene->definitions[d].first_object) {
+			i += scene->definitions[d++].num_objects - 1;
+			continue;
+		}
+		prims[count] = i;
+		boxes[count] = build->boxes[i];
+		count++;
+	}
+	for (int i = 0; i < scene->num_instances; i++) {
+		prims[count] = scene->num_objects + i;
+		boxes[count] = build->boxes[scene->num_objects + i];
+		count++;
+	}
+
+	BVH bvh;
+	if (!build_bvh(&bvh, boxes, count, method, pool)) {
+		fprintf(stderr, "Error: Couldn't build the acceleration structure (out of memory)\n");
+		return false;
+	}
+	for (int i = 0; i < bvh.num_prims; i++)
+		bvh.prims[i] = prims[bvh.prims[i]];
+	move_bvh_to_arena(&scene->bvh, &bvh, &scene->arena);
+	scene->bvh_build_cost = bvh_cost(&scene->bvh);
+	return true;
+}
+
+// Turns the parsed chunks in a scene. "file" is the scene file the
+// paths of the meshes are relative to, or NULL. Returns NULL after
+// printing an error if it's invalid.
+static Scene *compile_scene(ParseChunk *chunks, int num_chunks, const char *file, Pool *pool, Arena *scratch)
+{
+	SceneBuild build;
+	Scene *scene = gather_objects(chunks, num_chunks, pool, scratch, &build);
+	if (!resolve_markers(scene, chunks, num_chunks, file, pool, scratch, &build)) {
+		free_scene(scene);
+		return NULL;
+	}
+	if (!build_definition_bvhs(scene, &build, pool, BVH_BUILD_SAH, scratch)) {
+		fprintf(stderr, "Error: Couldn't build the acceleration structure (out of memory)\n");
+		free_scene(scene);
+		return NULL;
+	}
+	bound_instances(scene, &build);
+	if (!build_scene_bvh(scene, &build, pool, BVH_BUILD_SAH, scratch)) {
+		free_scene(scene);
+		return NULL;
+	}
+	return scene;
+}
+
+// Splits the source in chunks and parses them. Returns false after
+// printing the first error if the scene is invalid. The arenas of the
+// chunks must be freed with "free_chunks" either way.
+static bool parse_source(const char *src, size_t len, Pool *pool, Arena *scratch, ParseChunk **chunks_, int *num_chunks_)
+{
+	int max_chunks = 1;
+	if (pool) {
+		max_chunks = count_pool_threads(pool) * PARSE_CHUNKS_PER_THREAD;
+		if ((size_t) max_chunks > len / MIN_PARSE_CHUNK_SIZE)
+			max_chunks = len / MIN_PARSE_CHUNK_SIZE;
+		if (max_chunks > MAX_PARSE_CHUNKS)
+			max_chunks = MAX_PARSE_CHUNKS;
+		if (max_chunks < 1)
+			max_chunks = 1;
+	}
+	ParseChunk *chunks = arena_alloc_array(scratch, ParseChunk, max_chunks);
+	int num_chunks = split_source(src, len, max_chunks, chunks);
+
+	for_each_chunk(pool, num_chunks, parse_chunks, chunks);
+	*chunks_ = chunks;
+	*num_chunks_ = num_chunks;
+
+	// Only the first error is reported. The chunks before it were
+	// parsed completely, so their line counts are exact.
+	int line = 1;
+	int object = 0;
+	for (int i = 0; i < num_chunks; i++) {
+		if (!chunks[i].ok) {
+			fprintf(stderr, "Error: %s (line %d)\n", chunks[i].error.message, line + chunks[i].error.line - 1);
+			return false;
+		}
+		chunks[i].first_line   = line;
+		chunks[i].first_object = object;
+		line   += chunks[i].num_lines;
+		object += chunks[i].list.count;
+	}
+	return true;
+}
+
+static void free_chunks(ParseChunk *chunks, int num_chunks)
+{
+	for (int i = 0; i < num_chunks; i++)
+		free_arena(&chunks[i].arena);
+}
+
+static Scene *parse_scene_source(const char *src, size_t len, const char *file, Pool *pool, SceneLoadStats *stats)
+{
+	// Memory only needed while loading
+	Arena scratch;
+	init_arena(&scratch);
+
+	uint64_t start = get_relative_time_ns();
+
+	ParseChunk *chunks;
+	int num_chunks;
+	bool ok = parse_source(src, len, pool, &scratch, &chunks, &num_chunks);
+
+	uint64_t parsed = get_relative_time_ns();
+
+	Scene *scene = NULL;
+	if (ok)
+		scene = compile_scene(chunks, num_chunks, file, pool, &scratch);
+
+	if (stats) {
+		stats->parse_ns = parsed - start;
+		stats->build_ns = get_relative_time_ns() - parsed;
+	}
+
+	free_chunks(chunks, num_chunks);
+	free_arena(&scratch);
+	return scene;
+}
+
+Scene *parse_scene_string(const char *src, size_t len, Pool *pool, SceneLoadStats *stats)
+{
+	return parse_scene_source(src, len, NULL, pool, stats);
+}
+
+// Trees that can't be compressed are left as they are
+static size_t compress_tree(const BVH *bvh, CompressedBVH *compressed, Arena *arena)
+{
+	compressed->nodes = NULL;
+	compressed->num_nodes = 0;
+	if (bvh->num_nodes == 0)
+		return 0;
+
+	CompressedNode *nodes = arena_alloc_array(arena, CompressedNode, bvh->num_nodes);
+	if (!compress_bvh(bvh, nodes))
+		return 0;
+	compressed->nodes = nodes;
+	compressed->num_nodes = bvh->num_nodes;
+	return sizeof(CompressedNode) * bvh->num_nodes;
+}
+
+size_t compress_scene_bvhs(Scene *scene)
+{
+	return compress_tree(&scene->bvh,            &scene->compressed_bvh,            &scene->arena)
+	     + compress_tree(&scene->definition_bvh, &scene->compressed_definition_bvh, &scene->arena)
+	     + compress_tree(&scene->mesh_bvh,       &scene->compressed_mesh_bvh,       &scene->arena);
+}
+
+// Text of a scene file. It's mapped when possible so that
+// the parser threads can start without reading it first.
+typedef struct {
+	const char *data;
+	size_t      size;
+	char       *copy; // Used when the file isn't mapped
+	os_file_map map;
+} SceneSource;
+
+// Files that may be modified while they are parsed are read in a
+// private copy instead ("map" is false), since accessing a mapping
+// past the end of a file that shrank crashes the process.
+static bool open_scene_source(SceneSource *source, const char *file, bool map)
+{
+	source->copy = NULL;
+	if (map && os_file_map_open(&source->map, file)) {
+		source->data = source->map.data;
+		source->size = source->map.size;
+		return true;
+	}
+
+	// Empty files can't be mapped either
+	source->copy = load_file(file, &source->size);
+	source->data = source->copy;
+	if (source->copy == NULL) {
+		fprintf(stderr, "Error: Couldn't open scene file\n");
+		return false;
+	}
+	return true;
+}
+
+static void close_scene_source(SceneSource *source)
+{
+	if (source->copy)
+		free(source->copy);
+	else
+		os_file_map_close(&source->map);
+}
+
+Scene *parse_scene_file(char *file, Pool *pool)
+{
+	SceneSource source;
+	if (!open_scene_source(&source, file, true))
+		return NULL;
+
+	Scene *scene = parse_scene_source(source.data, source.size, file, pool, NULL);
+	close_scene_source(&source);
+	return scene;
+}
+
+// A refitted tree is rebuilt when it costs this much more than it
+// did the last time it was built from scratch
+#define REFIT_MAX_COST_GROWTH 1.5f
+
+static bool same_geometry(const Object *a, const Object *b)
+{
+	if (a->type != b->type)
+		return false;
+	if (a->type == OBJECT_SPHERE)
+		return !memcmp(&a->sphere, &b->sphere, sizeof(Sphere));
+	if (a->type == OBJECT_MESH)
+		return !memcmp(&a->mesh, &b->mesh, sizeof(MeshObject));
+	return !memcmp(&a->cube, &b->cube, sizeof(Cube));
+}
+
+// Gives the scene the tree of "old", refitted if the objects moved.
+// Returns false if the tree needs to be rebuilt instead.
+static bool reuse_bvh(Scene *scene, const Scene *old, const AABB *boxes, bool refit, Arena *scratch)
+{
+	BVHNode *nodes = old->bvh.nodes;
+	int num_nodes = old->bvh.num_nodes;
+
+	// The refitted nodes are only kept if the tree is still good
+	if (refit) {
+		BVH bvh = old->bvh;
+		bvh.nodes = arena_alloc_array(scratch, BVHNode, num_nodes + 1);
+		memcpy(bvh.nodes, nodes, sizeof(BVHNode) * num_nodes);
+		refit_bvh(&bvh, boxes);
+		if (bvh_cost(&bvh) > REFIT_MAX_COST_GROWTH * old->bvh_build_cost)
+			return false;
+		nodes = bvh.nodes;
+	}
+	scene->bvh_build_cost = old->bvh_build_cost;
+
+	BVH *bvh = &scene->bvh;
+	bvh->num_nodes = num_nodes;
+	bvh->num_prims = old->bvh.num_prims;
+	bvh->nodes = arena_alloc_array(&scene->arena, BVHNode, bvh->num_nodes + 1);
+	bvh->prims = arena_alloc_array(&scene->arena, int,     bvh->num_prims + 1);
+	memcpy(bvh->nodes, nodes,           sizeof(BVHNode) * bvh->num_nodes);
+	memcpy(bvh->prims, old->bvh.prims, sizeof(int)     * bvh->num_prims);
+	return true;
+}
+
+// Definitions and instances are at the same places in both scenes,
+// so the primitives of their top level trees are the same
+static bool same_layout(const Scene *scene, const Scene *old)
+{
+	if (scene->num_objects != old->num_objects
+		|| scene->num_definitions != old->num_definitions
+		|| scene->num_instances != old->num_instances)
+		return false;
+	for (int i = 0; i < scene->num_definitions; i++)
+		if (scene->definitions[i].first_object != old->definitions[i].first_object
+			|| scene->definitions[i].num_objects != old->definitions[i].num_objects)
+			return false;
+	return true;
+}
+
+// Gives the scene the trees of the definitions of "old"
+static void reuse_definition_bvhs(Scene *scene, const Scene *old, SceneBuild *build)
+{
+	BVH *bvh = &scene->definition_bvh;
+	bvh->num_nodes = old->definition_bvh.num_nodes;
+	bvh->num_prims = old->definition_bvh.num_prims;
+	bvh->nodes = arena_alloc_array(&scene->arena, BVHNode, bvh->num_nodes + 1);
+	bvh->prims = arena_alloc_array(&scene->arena, int,     bvh->num_prims + 1);
+	memcpy(bvh->nodes, old->definition_bvh.nodes, sizeof(BVHNode) * bvh->num_nodes);
+	memcpy(bvh->prims, old->definition_bvh.prims, sizeof(int)     * bvh->num_prims);
+	for (int i = 0; i < scene->num_definitions; i++)
+		build->definitions[i].root = old->definitions[i].root;
+}
+
+Scene *reload_scene_file(const Scene *old, char *file, Pool *pool, BVHBuildMethod method, SceneChange *change)
+{
+	// The file is reloaded because it's being edited
+	SceneSource source;
+	if (!open_scene_source(&source, file, false))
+		return NULL;
+
+	Arena scratch;
+	init_arena(&scratch);
+
+	ParseChunk *chunks;
+	int num_chunks;
+	Scene *scene = NULL;
+	SceneBuild build;
+	if (parse_source(source.data, source.size, pool, &scratch, &chunks, &num_chunks)) {
+		scene = gather_objects(chunks, num_chunks, pool, &scratch, &build);
+		if (!resolve_markers(scene, chunks, num_chunks, file, pool, &scratch, &build)) {
+			free_scene(scene);
+			scene = NULL;
+		}
+	}
+
+	bool layout_changed      = false;
+	bool geometry_changed    = false;
+	bool material_changed    = false;
+	bool definitions_changed = false;
+	if (scene) {
+		layout_changed = !same_layout(scene, old);
+		if (!layout_changed) {
+			int d = 0;
+			for (int i = 0; i < scene->num_objects; i++) {
+				if (!same_geometry(&scene->objects[i], &old->objects[i])) {
+					// Objects of definitions move all of their instances
+					while (d < scene->num_definitions && scene->definitions[d].first_object + scene->definitions[d].num_objects <= i)
+						d++;
+					if (d < scene->num_definitions && i >= scene->definitions[d].first_object)
+						definitions_changed = true;
+					geometry_changed = true;
+				}
+				if (memcmp(&scene->objects[i].material, &old->objects[i].material, sizeof(Material)))
+					material_changed = true;
+			}
+			for (int i = 0; i < scene->num_instances; i++)
+				if (scene->instances[i].definition != old->instances[i].definition
+					|| memcmp(&scene->instances[i].to_local, &old->instances[i].to_local, sizeof(Matrix4)))
+					geometry_changed = true;
+		}
+
+		if (!layout_changed && !definitions_changed)
+			reuse_definition_bvhs(scene, old, &build);
+		else if (!build_definition_bvhs(scene, &build, pool, method, &scratch)) {
+			fprintf(stderr, "Error: Couldn't build the acceleration structure (out of memory)\n");
+			free_scene(scene);
+			scene = NULL;
+		}
+	}
+
+	if (scene) {
+		bound_instances(scene, &build);
+
+		if (layout_changed)
+			*change = SCENE_REBUILT;
+		else if (!geometry_changed && !material_changed)
+			*change = SCENE_UNCHANGED;
+		else if (reuse_bvh(scene, old, build.boxes, geometry_changed, &scratch))
+			*change = geometry_changed ? SCENE_REFITTED : SCENE_MATERIALS_CHANGED;
+		else
+			*change = SCENE_REBUILT;
+
+		if (*change == SCENE_UNCHANGED) {
+			free_scene(scene);
+			scene = NULL;
+		} else if (*change == SCENE_REBUILT && !build_scene_bvh(scene, &build, pool, method, &scratch)) {
+			free_scene(scene);
+			scene = NULL;
+		}
+	}
+
+	free_chunks(chunks, num_chunks);
+	free_arena(&scratch);
+	close_scene_source(&source);
+	return scene;
+}
+
+// Amount of text read from a stream at a time
+#define STREAM_READ_SIZE (1 << 20)
+
+// Segments are merged while the last one has at least this fraction
+// of the objects of the one before it. Segment sizes then decrease
+// geometrically and every object is part of a logarithmic number of
+// rebuilds.
+#define SEGMENT_MERGE_RATIO 4
+
+// Returns the position of the last line of the text that starts with
+// a complete object keyword, or 0 if there is none. Everything before
+// it is a sequence of whole objects.
+static size_t find_last_object_start(const char *src, size_t len)
+{
+	const char *end = src + len;
+	for (size_t pos = len; pos > 0; pos--) {
+		if (src[pos-1] != '\n')
+			continue;
+
+		// The keyword may continue in the text that wasn't read yet
+		const char *word = src + pos;
+		const char *word_end = scan_word(word, end);
+		if (word_end == end)
+			continue;
+
+		const Keyword *keyword = lookup_keyword(word, word_end - word, end);
+		if (keyword && keyword->kind == KEYWORD_OBJECT)
+			return pos;
+	}
+	return 0;
+}
+
+bool open_scene_stream(SceneStream *stream, const char *file)
+{
+	memset(stream, 0, sizeof(SceneStream));
+	if (!os_stream_open(&stream->stream, file)) {
+		fprintf(stderr, "Error: Couldn't open scene stream\n");
+		return false;
+	}
+	stream->line = 1;
+	return true;
+}
+
+void close_scene_stream(SceneStream *stream)
+{
+	os_stream_close(&stream->stream);
+	for (int i = 0; i < stream->num_segments; i++)
+		free_bvh(&stream->segments[i].bvh);
+	free(stream->text);
+	free(stream->objects);
+}
+
+// Parses the first "len" bytes of the text and appends the objects
+static bool parse_stream_text(SceneStream *stream, size_t len)
+{
+	Arena scratch;
+	init_arena(&scratch);
+
+	ObjectList list = { .arena = &scratch };
+	MarkerList markers = { .arena = &scratch };
+	ParseError error;
+	if (!parse_objects(stream->text, len, &list, &markers, &stream->line, &error)) {
+		fprintf(stderr, "Error: %s (line %d)\n", error.message, error.line);
+		free_arena(&scratch);
+		return false;
+	}
+	if (markers.count > 0) {
+		fprintf(stderr, "Error: Definitions, instances and meshes can't be streamed (line %d)\n", markers.items[0].line);
+		free_arena(&scratch);
+		return false;
+	}
+
+	if (stream->num_objects + list.count > stream->max_objects) {
+		int max_objects = 2 * stream->max_objects;
+		if (max_objects < stream->num_objects + list.count)
+			max_objects = stream->num_objects + list.count;
+		Object *objects = realloc(stream->objects, sizeof(Object) * max_objects);
+		if (objects == NULL) {
+			printf("OUT OF MEMORY\n");
+			abort();
+		}
+		stream->objects = objects;
+		stream->max_objects = max_objects;
+	}
+	for (ObjectChunk *chunk = list.head; chunk; chunk = chunk->next) {
+		memcpy(&stream->objects[stream->num_objects], chunk->objects, sizeof(Object) * chunk->count);
+		stream->num_objects += chunk->count;
+	}
+
+	free_arena(&scratch);
+	return true;
+}
+
+bool read_scene_stream(SceneStream *stream)
+{
+	if (stream->done)
+		return false;
+
+	if (stream->text_len + STREAM_READ_SIZE > stream->text_cap) {
+		size_t text_cap = stream->text_len + STREAM_READ_SIZE;
+		char *text = realloc(stream->text, text_cap);
+		if (text == NULL) {
+			printf("OUT OF MEMORY\n");
+			abort();
+		}
+		stream->text = text;
+		stream->text_cap = text_cap;
+	}
+
+	long num = os_stream_read(&stream->stream, stream->text + stream->text_len, STREAM_READ_SIZE);
+	if (num < 0) {
+		fprintf(stderr, "Error: Couldn't read scene stream\n");
+		stream->done = true;
+		stream->failed = true;
+		return false;
+	}
+	stream->text_len += num;
+
+	// Only whole objects are parsed, the last one may be incomplete
+	// until the end of the stream
+	size_t len = stream->text_len;
+	if (num > 0)
+		len = find_last_object_start(stream->text, stream->text_len);
+
+	if (len > 0) {
+		if (!parse_stream_text(stream, len)) {
+			stream->done = true;
+			stream->failed = true;
+			return false;
+		}
+		memmove(stream->text, stream->text + len, stream->text_len - len);
+		stream->text_len -= len;
+	}
+
+	if (num == 0) {
+		stream->done = true;
+		return false;
+	}
+	return true;
+}
+
+// Builds the tree of a segment. The primitive indices are relative
+// to the first object of the segment.
+static bool build_segment(SceneStream *stream, SceneSegment *segment)
+{
+	AABB *boxes = malloc(sizeof(AABB) * (segment->count + 1));
+	if (boxes == NULL)
+		return false;
+	for (int i = 0; i < segment->count; i++)
+		boxes[i] = bounds_of(stream->objects[segment->first + i]);
+	// Streams are read by their own thread, while the
+	// pool is used by the main one
+	bool ok = build_bvh(&segment->bvh, boxes, segment->count, BVH_BUILD_SAH, NULL);
+	free(boxes);
 	return ok;
 }
+
+// Puts the objects that aren't part of a segment yet in a new one
+static bool update_segments(SceneStream *stream)
+{
+	if (stream->num_segmented == stream->num_objects)
+		return true;
+
+	SceneSegment *segments = stream->segments;
+	SceneSegment *segment = &segments[stream->num_segments++];
+	segment->first = stream->num_segmented;
+	segment->count = stream->num_objects - stream->num_segmented;
+	if (!build_segment(stream, segment)) {
+		stream->num_segments--;
+		return false;
+	}
+	stream->num_segmented = stream->num_objects;
+
+	for (;;) {
+		int n = stream->num_segments;
+		if (n < 2)
+			break;
+		if (n <= BVH_MAX_MERGE && segments[n-1].count * SEGMENT_MERGE_RATIO < segments[n-2].count)
+			break;
+
+		// Objects of adjacent segments are contiguous, so
+		// merging them just means building a bigger tree
+		SceneSegment merged;
+		merged.first = segments[n-2].first;
+		merged.count = segments[n-2].count + segments[n-1].count;
+		if (!build_segment(stream, &merged))
+			return false;
+		free_bvh(&segments[n-2].bvh);
+		free_bvh(&segments[n-1].bvh);
+		segments[n-2] = merged;
+		stream->num_segments--;
+	}
+	return true;
+}
+
+Scene *snapshot_scene_stream(SceneStream *stream)
+{
+	if (!update_segments(stream)) {
+		fprintf(stderr, "Error: Couldn't build the acceleration structure (out of memory)\n");
+		return NULL;
+	}
+
+	Arena arena;
+	init_arena(&arena);
+
+	Scene *scene = arena_alloc_array(&arena, Scene, 1);
+	memset(scene, 0, sizeof(Scene));
+
+	Object *objects = arena_alloc_array(&arena, Object, stream->num_objects + 1);
+	memcpy(objects, stream->objects, sizeof(Object) * stream->num_objects);
+	scene->objects = objects;
+	scene->num_objects = stream->num_objects;
+	scene->light_index = find_first_light(scene);
+
+	BVH parts[BVH_MAX_MERGE];
+	int first[BVH_MAX_MERGE];
+	for (int i = 0; i < stream->num_segments; i++) {
+		parts[i] = stream->segments[i].bvh;
+		first[i] = stream->segments[i].first;
+	}
+
+	BVH bvh;
+	if (!merge_bvhs(&bvh, parts, first, stream->num_segments)) {
+		fprintf(stderr, "Error: Couldn't build the acceleration structure (out of memory)\n");
+		free_arena(&arena);
+		return NULL;
+	}
+	move_bvh_to_arena(&scene->bvh, &bvh, &arena);
+
+	scene->arena = arena;
+	return scene;
+}
+
+// The cache file is a header followed by the arrays of the compiled
+// scene exactly as they are laid out in memory, so that they can be
+// used from the mapped file without any conversion. It's only valid
+// for builds with the same struct layouts, which is why the sizes
+// are part of the header. Bump the version when the meaning of the
+// arrays changes.
+#define SCENE_CACHE_MAGIC   "RTSCENE"
+#define SCENE_CACHE_VERSION 3
+#define SCENE_CACHE_ALIGN   64
+
+typedef struct {
+	char     magic[8];
+	uint32_t version;
+	uint32_t endianness;
+	uint32_t object_size;
+	uint32_t node_size;
+	uint32_t definition_size;
+	uint32_t instance_size;
+	uint32_t mesh_size;
+	uint32_t block_size;
+
+	// Key of the cache. The size is stored too to
+	// make collisions even less likely.
+	uint64_t source_hash;
+	uint64_t source_size;
+
+	// The mesh files are read again to check that they didn't change
+	uint64_t meshes_hash;
+
+	int32_t  num_objects;
+	int32_t  num_definitions;
+	int32_t  num_instances;
+	int32_t  light_index;
+	int32_t  num_nodes;
+	int32_t  num_prims;
+	int32_t  num_definition_nodes;
+	int32_t  num_definition_prims;
+	int32_t  num_meshes;
+	int32_t  num_mesh_nodes;
+	int32_t  num_triangle_blocks;
+	int32_t  mesh_files_size;
+
+	uint64_t objects_offset;
+	uint64_t definitions_offset;
+	uint64_t instances_offset;
+	uint64_t nodes_offset;
+	uint64_t prims_offset;
+	uint64_t definition_nodes_offset;
+	uint64_t definition_prims_offset;
+	uint64_t meshes_offset;
+	uint64_t mesh_nodes_offset;
+	uint64_t triangle_blocks_offset;
+	uint64_t mesh_files_offset;
+	uint64_t file_size;
+} SceneCacheHeader;
+
+static uint64_t align_offset(uint64_t offset)
+{
+	return (offset + SCENE_CACHE_ALIGN - 1) & ~(uint64_t) (SCENE_CACHE_ALIGN - 1);
+}
+
+static SceneCacheHeader cache_header(const Scene *scene, uint64_t source_hash, uint64_t source_size)
+{
+	SceneCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SCENE_CACHE_MAGIC, sizeof(header.magic));
+	header.version     = SCENE_CACHE_VERSION;
+	header.endianness  = 0x01020304;
+	header.object_size = sizeof(Object);
+	header.node_size   = sizeof(BVHNode);
+	header.definition_size = sizeof(Definition);
+	header.instance_size   = sizeof(Instance);
+	header.mesh_size       = sizeof(Mesh);
+	header.block_size      = sizeof(TriangleBlock);
+	header.source_hash = source_hash;
+	header.source_size = source_size;
+	if (scene) {
+		header.num_objects     = scene->num_objects;
+		header.num_definitions = scene->num_definitions;
+		header.num_instances   = scene->num_instances;
+		header.light_index     = scene->light_index;
+		header.num_nodes       = scene->bvh.num_nodes;
+		header.num_prims       = scene->bvh.num_prims;
+		header.num_definition_nodes = scene->definition_bvh.num_nodes;
+		header.num_definition_prims = scene->definition_bvh.num_prims;
+		header.num_meshes          = scene->num_meshes;
+		header.num_mesh_nodes      = scene->mesh_bvh.num_nodes;
+		header.num_triangle_blocks = scene->num_triangle_blocks;
+		header.mesh_files_size     = scene->mesh_files_size;
+	}
+	return header;
+}
+
+static bool write_padding(FILE *stream, uint64_t *offset)
+{
+	static const char zeros[SCENE_CACHE_ALIGN];
+	uint64_t aligned = align_offset(*offset);
+	if (fwrite(zeros, 1, aligned - *offset, stream) != aligned - *offset)
+		return false;
+	*offset = aligned;
+	return true;
+}
+
+static bool write_array(FILE *stream, uint64_t *offset, const void *data, size_t size)
+{
+	if (!write_padding(stream, offset))
+		return false;
+	if (fwrite(data, 1, size, stream) != size)
+		return false;
+	*offset += size;
+	return true;
+}
+
+// Hashes the contents of the mesh files listed in "files". Returns
+// false if one of them can't be read.
+static bool hash_mesh_files(const char *files, int size, uint64_t *hash)
+{
+	uint64_t h = 0;
+	for (int i = 0; i < size; i += strlen(files + i) + 1) {
+		os_file_map map;
+		if (!os_file_map_open(&map, files + i))
+			return false;
+		h = h * 31 + hash_bytes(map.data, map.size) + map.size;
+		os_file_map_close(&map);
+	}
+	*hash = h;
+	return true;
+}
+
+static void write_scene_cache(const Scene *scene, const char *cache_file, uint64_t source_hash, uint64_t source_size)
+{
+	SceneCacheHeader header = cache_header(scene, source_hash, source_size);
+	if (!hash_mesh_files(scene->mesh_files, scene->mesh_files_size, &header.meshes_hash))
+		return;
+
+	uint64_t offset = align_offset(sizeof(header));
+	header.objects_offset = offset;
+	offset = align_offset(offset + sizeof(Object) * header.num_objects);
+	header.definitions_offset = offset;
+	offset = align_offset(offset + sizeof(Definition) * header.num_definitions);
+	header.instances_offset = offset;
+	offset = align_offset(offset + sizeof(Instance) * header.num_instances);
+	header.nodes_offset = offset;
+	offset = align_offset(offset + sizeof(BVHNode) * header.num_nodes);
+	header.prims_offset = offset;
+	offset = align_offset(offset + sizeof(int) * header.num_prims);
+	header.definition_nodes_offset = offset;
+	offset = align_offset(offset + sizeof(BVHNode) * header.num_definition_nodes);
+	header.definition_prims_offset = offset;
+	offset = align_offset(offset + sizeof(int) * header.num_definition_prims);
+	header.meshes_offset = offset;
+	offset = align_offset(offset + sizeof(Mesh) * header.num_meshes);
+	header.mesh_nodes_offset = offset;
+	offset = align_offset(offset + sizeof(BVHNode) * header.num_mesh_nodes);
+	header.triangle_blocks_offset = offset;
+	offset = align_offset(offset + sizeof(TriangleBlock) * header.num_triangle_blocks);
+	header.mesh_files_offset = offset;
+	offset += header.mesh_files_size;
+	header.file_size = offset;
+
+	// Write to a temporary file and rename it when complete so that
+	// other processes never map a partially written cache
+	char temp_file[1024];
+	int k = snprintf(temp_file, sizeof(temp_file), "%s.tmp", cache_file);
+	if (k < 0 || k >= (int) sizeof(temp_file))
+		return;
+
+	FILE *stream = fopen(temp_file, "wb");
+	if (stream == NULL) {
+		fprintf(stderr, "Warning: Couldn't write scene cache %s\n", cache_file);
+		return;
+	}
+
+	offset = 0;
+	bool ok = write_array(stream, &offset, &header, sizeof(header))
+	       && write_array(stream, &offset, scene->objects,              sizeof(Object)     * header.num_objects)
+	       && write_array(stream, &offset, scene->definitions,          sizeof(Definition) * header.num_definitions)
+	       && write_array(stream, &offset, scene->instances,            sizeof(Instance)   * header.num_instances)
+	       && write_array(stream, &offset, scene->bvh.nodes,            sizeof(BVHNode)    * header.num_nodes)
+	       && write_array(stream, &offset, scene->bvh.prims,            sizeof(int)        * header.num_prims)
+	       && write_array(stream, &offset, scene->definition_bvh.nodes, sizeof(BVHNode)    * header.num_definition_nodes)
+	       && write_array(stream, &offset, scene->definition_bvh.prims, sizeof(int)        * header.num_definition_prims)
+	       && write_array(stream, &offset, scene->meshes,               sizeof(Mesh)       * header.num_meshes)
+	       && write_array(stream, &offset, scene->mesh_bvh.nodes,       sizeof(BVHNode)    * header.num_mesh_nodes)
+	       && write_array(stream, &offset, scene->triangle_blocks,      sizeof(TriangleBlock) * header.num_triangle_blocks)
+	       && write_array(stream, &offset, scene->mesh_files,           header.mesh_files_size);
+	if (fclose(stream))
+		ok = false;
+
+	if (ok) {
+#ifdef _WIN32
+		remove(cache_file);
+#endif
+		ok = !rename(temp_file, cache_file);
+	}
+	if (!ok) {
+		fprintf(stderr, "Warning: Couldn't write scene cache %s\n", cache_file);
+		remove(temp_file);
+	}
+}
+
+static bool valid_array(const SceneCacheHeader *header, uint64_t offset, int32_t count, size_t elem_size)
+{
+	return count >= 0
+	    && offset % SCENE_CACHE_ALIGN == 0
+	    && offset <= header->file_size
+	    && (uint64_t) count <= (header->file_size - offset) / elem_size;
+}
+
+static Scene *map_scene_cache(const char *cache_file, uint64_t source_hash, uint64_t source_size)
+{
+	os_file_map map;
+	if (!os_file_map_open(&map, cache_file))
+		return NULL;
+
+	// Anything unexpected means the cache is stale or
+	// was written by a different build and is ignored
+	SceneCacheHeader header;
+	SceneCacheHeader expect = cache_header(NULL, source_hash, source_size);
+	if (map.size < sizeof(header)) {
+		os_file_map_close(&map);
+		return NULL;
+	}
+	memcpy(&header, map.data, sizeof(header));
+	if (memcmp(header.magic, expect.magic, sizeof(header.magic))
+		|| header.version     != expect.version
+		|| header.endianness  != expect.endianness
+		|| header.object_size != expect.object_size
+		|| header.node_size   != expect.node_size
+		|| header.definition_size != expect.definition_size
+		|| header.instance_size   != expect.instance_size
+		|| header.mesh_size       != expect.mesh_size
+		|| header.block_size      != expect.block_size
+		|| header.source_hash != expect.source_hash
+		|| header.source_size != expect.source_size
+		|| header.file_size   != map.size
+		|| header.light_index < -1 || header.light_index >= header.num_objects
+		|| !valid_array(&header, header.objects_offset,          header.num_objects,          sizeof(Object))
+		|| !valid_array(&header, header.definitions_offset,      header.num_definitions,      sizeof(Definition))
+		|| !valid_array(&header, header.instances_offset,        header.num_instances,        sizeof(Instance))
+		|| !valid_array(&header, header.nodes_offset,            header.num_nodes,            sizeof(BVHNode))
+		|| !valid_array(&header, header.prims_offset,            header.num_prims,            sizeof(int))
+		|| !valid_array(&header, header.definition_nodes_offset, header.num_definition_nodes, sizeof(BVHNode))
+		|| !valid_array(&header, header.definition_prims_offset, header.num_definition_prims, sizeof(int))
+		|| !valid_array(&header, header.meshes_offset,           header.num_meshes,           sizeof(Mesh))
+		|| !valid_array(&header, header.mesh_nodes_offset,       header.num_mesh_nodes,       sizeof(BVHNode))
+		|| !valid_array(&header, header.triangle_blocks_offset,  header.num_triangle_blocks,  sizeof(TriangleBlock))
+		|| !valid_array(&header, header.mesh_files_offset,       header.mesh_files_size,      1)
+		|| (header.mesh_files_size > 0 && ((const char*) map.data)[header.mesh_files_offset + header.mesh_files_size - 1] != '\0')) {
+		os_file_map_close(&map);
+		return NULL;
+	}
+
+	uint64_t meshes_hash;
+	if (!hash_mesh_files((const char*) map.data + header.mesh_files_offset, header.mesh_files_size, &meshes_hash)
+		|| meshes_hash != header.meshes_hash) {
+		os_file_map_close(&map);
+		return NULL;
+	}
+
+	Arena arena;
+	init_arena(&arena);
+
+	const char *base = map.data;
+	Scene *scene = arena_alloc_array(&arena, Scene, 1);
+	memset(scene, 0, sizeof(Scene));
+	scene->objects     = (const Object*) (base + header.objects_offset);
+	scene->num_objects = header.num_objects;
+	scene->definitions     = (const Definition*) (base + header.definitions_offset);
+	scene->num_definitions = header.num_definitions;
+	scene->instances       = (const Instance*) (base + header.instances_offset);
+	scene->num_instances   = header.num_instances;
+	scene->light_index = header.light_index;
+
+	// The trees are never written through these pointers
+	scene->bvh.nodes     = (BVHNode*) (base + header.nodes_offset);
+	scene->bvh.num_nodes = header.num_nodes;
+	scene->bvh.prims     = (int*) (base + header.prims_offset);
+	scene->bvh.num_prims = header.num_prims;
+	scene->bvh_build_cost = bvh_cost(&scene->bvh); // Cached trees are never refitted
+	scene->definition_bvh.nodes     = (BVHNode*) (base + header.definition_nodes_offset);
+	scene->definition_bvh.num_nodes = header.num_definition_nodes;
+	scene->definition_bvh.prims     = (int*) (base + header.definition_prims_offset);
+	scene->definition_bvh.num_prims = header.num_definition_prims;
+	scene->meshes     = (const Mesh*) (base + header.meshes_offset);
+	scene->num_meshes = header.num_meshes;
+	scene->mesh_bvh.nodes     = (BVHNode*) (base + header.mesh_nodes_offset);
+	scene->mesh_bvh.num_nodes = header.num_mesh_nodes;
+	scene->triangle_blocks     = (const TriangleBlock*) (base + header.triangle_blocks_offset);
+	scene->num_triangle_blocks = header.num_triangle_blocks;
+	scene->mesh_files      = base + header.mesh_files_offset;
+	scene->mesh_files_size = header.mesh_files_size;
+
+	scene->arena = arena;
+	scene->map   = map;
+	return scene;
+}
+
+Scene *load_scene_file(char *file, bool use_cache, Pool *pool)
+{
+	if (!use_cache)
+		return parse_scene_file(file, pool);
+
+	SceneSource source;
+	if (!open_scene_source(&source, file, true))
+		return NULL;
+
+	const char *src = source.data;
+	size_t      len = source.size;
+
+	char cache_file[1024];
+	int k = snprintf(cache_file, sizeof(cache_file), "%s.rtscene", file);
+	if (k < 0 || k >= (int) sizeof(cache_file)) {
+		Scene *scene = parse_scene_source(src, len, file, pool, NULL);
+		close_scene_source(&source);
+		return scene;
+	}
+
+	uint64_t hash = hash_bytes(src, len);
+	Scene *scene = map_scene_cache(cache_file, hash, len);
+	if (scene == NULL) {
+		scene = parse_scene_source(src, len, file, pool, NULL);
+		if (scene)
+			write_scene_cache(scene, cache_file, hash, len);
+	}
+
+	close_scene_source(&source);
+	return scene;
+}
+
+void free_scene(const Scene *scene)
+{
+	// The scene is stored in its own arena, so
+	// the arena and the mapping need to be copied
+	// out first
+	Arena arena = scene->arena;
+	os_file_map map = scene->map;
+	free_arena(&arena);
+	os_file_map_close(&map);
+}
@@ -1,6 +1,12 @@
-#include "vector.h"
+#ifndef SCENE_INCLUDED
+#define SCENE_INCLUDED
 
-#define MAX_OBJECTS 1024
+#include "vector.h"
+#include "bvh.h"
+#include "arena.h"
+#include "os.h"
+#include "pool.h"
+#include "mesh.h"
 
 typedef struct {
 	Vector3 albedo;
@@ -19,20 +25,107 @@ typedef struct {
 typedef enum {
 	OBJECT_CUBE,
 	OBJECT_SPHERE,
+	OBJECT_MESH,
 } ObjectType;
 
+// Triangles of a mesh file. Meshes are placed in the world with
+// instances, their vertices aren't moved.
+typedef struct {
+	AABB bounds;
+	int  index; // In the "meshes" array of the scene
+} MeshObject;
+
 typedef struct {
 	ObjectType type;
 	union {
 		Sphere sphere;
 		Cube cube;
+		MeshObject mesh;
 	};
 	Material material;
 } Object;
 
+// Group of objects described once and placed in the world any number
+// of times by instances. Its objects are a range of the "objects" array
+// of the scene and aren't part of the world by themselves.
+typedef struct {
+	int first_object;
+	int num_objects;
+	int root; // Root of its tree in "definition_bvh", -1 if it's empty
+} Definition;
+
+// Copy of a definition placed in the world. Rays are moved to the
+// space of the definition instead of moving its objects, so copies
+// share the objects and the tree of the definition.
+typedef struct {
+	Matrix4 to_local;        // From world space to the space of the definition
+	Matrix4 normal_to_world; // Transpose of "to_local"
+	int     definition;
+} Instance;
+
+// Mesh file loaded for the scene. Objects using the same file share it.
 typedef struct {
-	Object objects[MAX_OBJECTS];
+	int  root; // Root of its tree in "mesh_bvh"
+	int  num_triangles;
+	AABB bounds;
+} Mesh;
+
+// Scene ready to be rendered. It's built once by the parser and isn't
+// modified after that, so it can be shared by the workers through a
+// const pointer. The struct itself and everything it references live
+// in its arena and are released together by "free_scene". Scenes
+// loaded from a cache file reference the mapped file instead.
+typedef struct {
+	const Object *objects;
 	int num_objects;
+
+	const Definition *definitions;
+	int num_definitions;
+
+	const Instance *instances;
+	int num_instances;
+
+	// Index of the first object of the world emitting light or -1
+	int light_index;
+
+	// Acceleration structure over the objects that aren't part of a
+	// definition and over the instances. Primitive indices below
+	// "num_objects" refer to the "objects" array, the others are
+	// instance "num_objects + i".
+	BVH bvh;
+
+	// Cost of "bvh" (see "bvh_cost") the last time it was built from
+	// scratch. A reload that refits the tree keeps the cost of the
+	// build it came from, so refits can't drift away from it.
+	float bvh_build_cost;
+
+	// Trees of all the definitions, one after the other. Their
+	// node and primitive indices refer to the whole arrays and
+	// their primitives to the "objects" array.
+	BVH definition_bvh;
+
+	const Mesh *meshes;
+	int num_meshes;
+
+	// Trees of all the meshes, one after the other. Leaves refer
+	// to the "triangle_blocks" array (see "build_mesh_bvh").
+	BVH mesh_bvh;
+	const TriangleBlock *triangle_blocks;
+	int num_triangle_blocks;
+
+	// Paths of the mesh files, each followed by a zero
+	const char *mesh_files;
+	int mesh_files_size;
+
+	// Compressed copies of "bvh", "definition_bvh" and "mesh_bvh"
+	// used by the traversal instead of them when they are set
+	// (see "compress_scene_bvhs")
+	CompressedBVH compressed_bvh;
+	CompressedBVH compressed_definition_bvh;
+	CompressedBVH compressed_mesh_bvh;
+
+	Arena arena;
+	os_file_map map;
 } Scene;
 
 typedef struct {
@@ -42,6 +135,123 @@ typedef struct {
 	int     object;
 } HitInfo;
 
+// Width of the screen tiles traced together as ray packets
+#define PACKET_W 8
+#define MAX_PACKET_SIZE (PACKET_W * PACKET_W)
+
+// Group of rays leaving from the same point with coherent directions
+// (the primary rays of a screen tile). The directions are contained in
+// the frustum delimited by "planes", which lets the traversal discard
+// subtrees for all the rays at once.
+typedef struct {
+	int     count;
+	Vector3 origin;
+	Vector3 dirs[MAX_PACKET_SIZE];
+	Vector3 planes[4];
+} RayPacket;
+
 Vector3 origin_of(Object o);
-HitInfo trace_ray(Ray ray, Scene *scene);
-bool    parse_scene_file(char *file, Scene *scene);
\ No newline at end of file
+AABB    bounds_of(Object o);
+HitInfo trace_ray(Ray ray, const Scene *scene);
+int     find_light_source(const Scene *scene);
+void    setup_packet_frustum(RayPacket *packet, Vector3 corners[4]);
+void    trace_packet(const RayPacket *packet, const Scene *scene, HitInfo *hits);
+float   hit_depth(Ray ray, HitInfo hit);
+
+// Time spent in the two phases of loading a scene
+typedef struct {
+	uint64_t parse_ns; // Reading the objects from the text
+	uint64_t build_ns; // Building the acceleration structure
+} SceneLoadStats;
+
+// Parses a scene from memory. Large scenes are split at object
+// boundaries and parsed by the threads of "pool", which can be NULL
+// to parse on the calling thread only. "stats" can be NULL. Returns
+// NULL if the scene is invalid. Mesh files are looked up relative to
+// the working directory.
+Scene  *parse_scene_string(const char *src, size_t len, Pool *pool, SceneLoadStats *stats);
+
+// Returns NULL if the file couldn't be read or is invalid. Mesh files
+// are looked up relative to the directory of the scene file.
+Scene  *parse_scene_file(char *file, Pool *pool);
+
+// Same as "parse_scene_file" but the compiled scene is saved next
+// to the source file (with the ".rtscene" extension added) and on
+// later runs it's mapped from there if the source didn't change.
+Scene  *load_scene_file(char *file, bool use_cache, Pool *pool);
+void    free_scene(const Scene *scene);
+
+// How a scene file changed since it was last loaded
+typedef enum {
+	SCENE_UNCHANGED,
+	SCENE_MATERIALS_CHANGED, // The tree was reused as it was
+	SCENE_REFITTED,          // Objects or instances moved and the tree was refitted
+	SCENE_REBUILT,           // The tree was built again
+} SceneChange;
+
+// Adds compressed copies of the trees of the scene, which rays traverse
+// instead of the full ones. Nodes take 12 bytes instead of 32, so more
+// of a large tree fits in the caches, but their boxes are decoded at
+// every visit and are a bit larger. The full trees are kept for
+// reloading and caching. It must be called before the scene is shared
+// with other threads. Returns the memory used by the compressed nodes.
+size_t  compress_scene_bvhs(Scene *scene);
+
+// Parses the file again after it was modified and compares it with
+// "old". The tree of "old" is reused whenever the objects are the same,
+// even if they moved a bit, and the trees of the definitions are kept
+// as long as their objects didn't change, so moving instances around
+// only refits the top of the hierarchy. Trees that have to be built again
+// are built with "method", which can trade their quality for a faster
+// reload. Returns NULL if the file is invalid or if nothing changed,
+// otherwise "change" tells what happened.
+Scene  *reload_scene_file(const Scene *old, char *file, Pool *pool, BVHBuildMethod method, SceneChange *change);
+
+// Objects of a stream with the tree built over them
+typedef struct {
+	int first;
+	int count;
+	BVH bvh;
+} SceneSegment;
+
+// Scene read from a stream (standard input or a pipe) while it's being
+// produced. Definitions, instances and meshes aren't supported. Objects
+// are parsed as soon as they are complete and each batch gets its own
+// tree. Recent segments are merged when they grow
+// close to the size of the ones before them, so there are only a few
+// of them, and snapshots of the scene only build the nodes above them.
+typedef struct {
+	os_stream stream;
+
+	// Text that wasn't parsed yet. It always starts at an object.
+	char  *text;
+	size_t text_len;
+	size_t text_cap;
+	int    line; // Line of the start of "text"
+
+	bool done;
+	bool failed;
+
+	Object *objects;
+	int     num_objects;
+	int     max_objects;
+
+	// Segments cover the objects from the first one to "num_segmented"
+	SceneSegment segments[BVH_MAX_MERGE + 1];
+	int          num_segments;
+	int          num_segmented;
+} SceneStream;
+
+bool   open_scene_stream(SceneStream *stream, const char *file);
+void   close_scene_stream(SceneStream *stream);
+
+// Waits for more of the stream and parses the objects that were
+// completed. Returns false at the end of the stream or if an error
+// occurred, in which case "failed" is set.
+bool   read_scene_stream(SceneStream *stream);
+
+// Returns a scene with all the objects read so far, or NULL if
+// there's no memory to build it
+Scene *snapshot_scene_stream(SceneStream *stream);
+
+#endif
@@ -0,0 +1,278 @@
+/*
+Copyright 2024 Francesco Cozzuto
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+associated documentation files (the “Software”), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial
+portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "scheduler.h"
+
+// Distance from the focus point, in fractions of half the frame
+// diagonal, at which the importance of a tile is halved
+#define FOVEA_RADIUS 0.25f
+
+// Tiles are refined at least once every this many sweeps
+#define MAX_FOVEA_PERIOD 8
+
+static void order_rows(int tiles_x, int tiles_y, int focus_x, int focus_y, int *order)
+{
+	(void) focus_x;
+	(void) focus_y;
+	for (int i = 0; i < tiles_x * tiles_y; i++)
+		order[i] = i;
+}
+
+// Walks a square spiral around the focus tile, skipping the
+// positions that fall outside of the frame
+static void order_spiral(int tiles_x, int tiles_y, int focus_x, int focus_y, int *order)
+{
+	static const int steps[4][2] = {{1, 0}, {0, 1}, {-1, 0}, {0, -1}};
+
+	int num_tiles = tiles_x * tiles_y;
+	int count = 0;
+	int x = focus_x;
+	int y = focus_y;
+	int direction = 0;
+	int run = 1;
+	while (count < num_tiles) {
+		// Runs grow by one every two turns
+		for (int turn = 0; turn < 2; turn++) {
+			for (int i = 0; i < run; i++) {
+				if (x >= 0 && x < tiles_x && y >= 0 && y < tiles_y)
+					order[count++] = y * tiles_x + x;
+				x += steps[direction][0];
+				y += steps[direction][1];
+			}
+			direction = (direction + 1) % 4;
+		}
+		run++;
+	}
+}
+
+// Converts a distance along the Hilbert curve filling an n by n
+// square (n is a power of two) into a position
+static void hilbert_position(int n, int d, int *x, int *y)
+{
+	*x = 0;
+	*y = 0;
+	for (int s = 1; s < n; s *= 2) {
+		int rx = 1 & (d / 2);
+		int ry = 1 & (d ^ rx);
+		if (ry == 0) {
+			if (rx == 1) {
+				*x = s - 1 - *x;
+				*y = s - 1 - *y;
+			}
+			int t = *x;
+			*x = *y;
+			*y = t;
+		}
+		*x += s * rx;
+		*y += s * ry;
+		d /= 4;
+	}
+}
+
+static void order_hilbert(int tiles_x, int tiles_y, int focus_x, int focus_y, int *order)
+{
+	(void) focus_x;
+	(void) focus_y;
+
+	int n = 1;
+	while (n < tiles_x || n < tiles_y)
+		n *= 2;
+
+	int count = 0;
+	for (int d = 0; d < n * n; d++) {
+		int x, y;
+		hilbert_position(n, d, &x, &y);
+		if (x < tiles_x && y < tiles_y)
+			order[count++] = y * tiles_x + x;
+	}
+}
+
+static const TileOrderFunc tile_orders[] = {
+	[TILE_ORDER_ROWS]    = order_rows,
+	[TILE_ORDER_SPIRAL]  = order_spiral,
+	[TILE_ORDER_HILBERT] = order_hilbert,
+};
+
+// Orders the tiles following the policy and, with foveation, assigns
+// them a refinement period based on their importance. Without it all
+// tiles are refined every sweep.
+static void plan_tiles(TileScheduler *scheduler)
+{
+	int num_tiles = scheduler->num_tiles;
+	if (num_tiles == 0)
+		return;
+
+	float focus_x = scheduler->focus_x * scheduler->frame_w;
+	float focus_y = scheduler->focus_y * scheduler->frame_h;
+
+	int focus_tile_x = focus_x / RENDER_TILE_SIZE;
+	int focus_tile_y = focus_y / RENDER_TILE_SIZE;
+	if (focus_tile_x >= scheduler->tiles_x) focus_tile_x = scheduler->tiles_x - 1;
+	if (focus_tile_y >= scheduler->tiles_y) focus_tile_y = scheduler->tiles_y - 1;
+	scheduler->order_func(scheduler->tiles_x, scheduler->tiles_y, focus_tile_x, focus_tile_y, scheduler->order);
+
+	if (!scheduler->foveate) {
+		for (int i = 0; i < num_tiles; i++)
+			scheduler->periods[i] = 1;
+		return;
+	}
+
+	float half_diagonal = 0.5f * sqrtf((float) scheduler->frame_w * scheduler->frame_w
+		+ (float) scheduler->frame_h * scheduler->frame_h);
+
+	float *distances = malloc(sizeof(float) * num_tiles);
+	if (!distances) abort();
+
+	float closest = INFINITY;
+	for (int j = 0; j < scheduler->tiles_y; j++)
+		for (int i = 0; i < scheduler->tiles_x; i++) {
+			float dx = (i + 0.5f) * RENDER_TILE_SIZE - focus_x;
+			float dy = (j + 0.5f) * RENDER_TILE_SIZE - focus_y;
+			float distance = sqrtf(dx * dx + dy * dy) / half_diagonal;
+			distances[j * scheduler->tiles_x + i] = distance;
+			if (distance < closest)
+				closest = distance;
+		}
+
+	// Importance falls off with the square of the distance. It's
+	// relative to the closest tile so that at least one tile is
+	// refined every sweep, even if the focus is outside the frame.
+	for (int i = 0; i < num_tiles; i++) {
+		float r = (distances[i] - closest) / FOVEA_RADIUS;
+		float importance = 1 / (1 + r * r);
+		int period = 1;
+		while (period < MAX_FOVEA_PERIOD && period * importance < 1)
+			period *= 2;
+		scheduler->periods[i] = period;
+	}
+
+	free(distances);
+}
+
+void init_scheduler(TileScheduler *scheduler, TileOrder order, bool foveate, float focus_x, float focus_y)
+{
+	memset(scheduler, 0, sizeof(TileScheduler));
+	scheduler->order_func = tile_orders[order];
+	scheduler->foveate = foveate;
+	scheduler->focus_x = focus_x;
+	scheduler->focus_y = focus_y;
+	os_mutex_create(&scheduler->mutex);
+}
+
+void free_scheduler(TileScheduler *scheduler)
+{
+	free(scheduler->order);
+	free(scheduler->periods);
+	free(scheduler->passes);
+	free(scheduler->scales);
+	os_mutex_delete(&scheduler->mutex);
+}
+
+void reset_scheduler(TileScheduler *scheduler, int frame_w, int frame_h, uint32_t generation)
+{
+	os_mutex_lock(&scheduler->mutex);
+
+	if (scheduler->order == NULL || scheduler->frame_w != frame_w || scheduler->frame_h != frame_h) {
+
+		scheduler->frame_w = frame_w;
+		scheduler->frame_h = frame_h;
+		scheduler->tiles_x = (frame_w + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+		scheduler->tiles_y = (frame_h + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+		scheduler->num_tiles = scheduler->tiles_x * scheduler->tiles_y;
+
+		free(scheduler->order);
+		free(scheduler->periods);
+		free(scheduler->passes);
+		free(scheduler->scales);
+		// One extra element so that empty frames don't allocate zero bytes
+		scheduler->order   = malloc(sizeof(int) * (scheduler->num_tiles + 1));
+		scheduler->periods = malloc(sizeof(int) * (scheduler->num_tiles + 1));
+		scheduler->passes  = malloc(sizeof(int) * (scheduler->num_tiles + 1));
+		scheduler->scales  = malloc(sizeof(int) * (scheduler->num_tiles + 1));
+		if (!scheduler->order || !scheduler->periods || !scheduler->passes || !scheduler->scales) {
+			printf("OUT OF MEMORY\n");
+			abort();
+		}
+
+		plan_tiles(scheduler);
+	}
+
+	memset(scheduler->passes, 0, sizeof(int) * scheduler->num_tiles);
+	scheduler->generation = generation;
+	scheduler->cursor = 0;
+	scheduler->sweep  = 0;
+
+	os_mutex_unlock(&scheduler->mutex);
+}
+
+bool next_tile(TileScheduler *scheduler, int start_scale, int fitting_scale, TileJob *job)
+{
+	os_mutex_lock(&scheduler->mutex);
+
+	if (scheduler->num_tiles == 0) {
+		os_mutex_unlock(&scheduler->mutex);
+		return false;
+	}
+
+	// The closest tile to the focus has a period of 1, so
+	// this finds a tile within a sweep.
+	int index;
+	for (;;) {
+		if (scheduler->cursor == scheduler->num_tiles) {
+			scheduler->cursor = 0;
+			scheduler->sweep++;
+		}
+		index = scheduler->order[scheduler->cursor++];
+		if (scheduler->passes[index] == 0 || scheduler->sweep % scheduler->periods[index] == 0)
+			break;
+	}
+
+	int scale;
+	if (scheduler->passes[index] == 0)
+		scale = start_scale;
+	else {
+		scale = scheduler->scales[index] / 2;
+		if (scale > fitting_scale)
+			scale = fitting_scale;
+		if (scale < 1)
+			scale = 1;
+	}
+
+	int tile_x = index % scheduler->tiles_x;
+	int tile_y = index / scheduler->tiles_x;
+	job->tile.x = tile_x * RENDER_TILE_SIZE;
+	job->tile.y = tile_y * RENDER_TILE_SIZE;
+	job->tile.w = RENDER_TILE_SIZE;
+	job->tile.h = RENDER_TILE_SIZE;
+	if (job->tile.w > scheduler->frame_w - job->tile.x) job->tile.w = scheduler->frame_w - job->tile.x;
+	if (job->tile.h > scheduler->frame_h - job->tile.y) job->tile.h = scheduler->frame_h - job->tile.y;
+	job->generation = scheduler->generation;
+	job->pass  = scheduler->passes[index];
+	job->scale = scale;
+
+	scheduler->passes[index]++;
+	scheduler->scales[index] = scale;
+
+	os_mutex_unlock(&scheduler->mutex);
+	return true;
+}
@@ -0,0 +1,107 @@
+/*
+Copyright 2024 Francesco Cozzuto
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+associated documentation files (the “Software”), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial
+portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef SCHEDULER_INCLUDED
+#define SCHEDULER_INCLUDED
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "os.h"
+
+// Size of the tiles the frame is split into. Workers
+// evaluate one tile at a time.
+#define RENDER_TILE_SIZE 64
+
+typedef struct {
+	int x, y;
+	int w, h;
+} Tile;
+
+// Order in which the tiles of a sweep are handed out
+typedef enum {
+	TILE_ORDER_ROWS,    // Left to right, top to bottom
+	TILE_ORDER_SPIRAL,  // Outwards from the focus point
+	TILE_ORDER_HILBERT, // Along a Hilbert curve, so consecutive tiles are close
+} TileOrder;
+
+// Writes the indices of the tiles_x by tiles_y tiles in the order they
+// should be handed out. The focus is the index of a tile along each axis.
+typedef void (*TileOrderFunc)(int tiles_x, int tiles_y, int focus_x, int focus_y, int *order);
+
+// Work handed out to a worker
+typedef struct {
+	Tile     tile;
+	uint32_t generation; // Frame the tile belongs to
+	int      pass;       // Passes over the tile handed out before this one
+	int      scale;      // Resolution the tile must be evaluated at
+} TileJob;
+
+// Hands out the tiles of the frame to the workers. Tiles are issued in
+// sweeps over the frame, following the order policy. With foveation,
+// the importance of a tile drops with its distance from the focus
+// point and tiles far from it are only refined every few sweeps.
+typedef struct {
+
+	// Guards everything below
+	os_mutex_t mutex;
+
+	TileOrderFunc order_func;
+	bool  foveate;
+	float focus_x; // Fractions of the frame size
+	float focus_y;
+
+	uint32_t generation;
+	int frame_w;
+	int frame_h;
+	int tiles_x;
+	int tiles_y;
+	int num_tiles;
+
+	// Tile indices in the order they are handed out
+	int *order;
+
+	// Tiles are only refined during sweeps that are a multiple
+	// of their period. The first pass is never skipped.
+	int *periods;
+
+	// Number of passes handed out since the frame was reset
+	// and the scale of the latest one
+	int *passes;
+	int *scales;
+
+	// Position of the next tile in "order" and number
+	// of sweeps completed over it
+	int cursor;
+	int sweep;
+
+} TileScheduler;
+
+void init_scheduler(TileScheduler *scheduler, TileOrder order, bool foveate, float focus_x, float focus_y);
+void free_scheduler(TileScheduler *scheduler);
+
+// Starts handing out the tiles of a new frame. Must be called when
+// the frame is reset or resized.
+void reset_scheduler(TileScheduler *scheduler, int frame_w, int frame_h, uint32_t generation);
+
+// Picks the next tile to evaluate. The first pass over a tile is
+// evaluated at "start_scale". Following passes double the resolution,
+// or increase it up to "fitting_scale" if that's faster. Returns false
+// if the frame is empty.
+bool next_tile(TileScheduler *scheduler, int start_scale, int fitting_scale, TileJob *job);
+
+#endif
@@ -25,12 +25,40 @@ OTHER DEALINGS IN THE SOFTWARE.
 For more information, please refer to <http://unlicense.org/>
 */
 #include <stddef.h>
+#include <stdint.h>
 #include <stdbool.h>
 
 #define COUNTOF(X) (int) (sizeof(X) / sizeof((X)[0]))
 
 char *load_file(const char *file, size_t *size);
 
+// Non-cryptographic 64 bit hash. It reads 8 bytes at a time so
+// that hashing large files isn't much slower than reading them.
+uint64_t hash_bytes(const void *data, size_t size);
+
+// Returns the float closest to digits * 10^exponent, rounding ties
+// to even. This is the expensive part of converting decimal numbers
+// and uses the Eisel-Lemire algorithm instead of repeated divisions.
+float eisel_lemire(uint64_t digits, int exponent, bool negative);
+
+// Same as "eisel_lemire", with a fast path for the common case
+// of short numbers that is inlined in the parsers.
+static inline float decimal_to_float(uint64_t digits, int exponent, bool negative)
+{
+	// When both the digits and the power of ten are exact floats
+	// a single operation rounds correctly
+	static const float exact_powers[] = { 1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f };
+	if (exponent >= -10 && exponent <= 10 && digits <= (1 << 24)) {
+		float value = (float) digits;
+		if (exponent < 0)
+			value /= exact_powers[-exponent];
+		else
+			value *= exact_powers[exponent];
+		return negative ? -value : value;
+	}
+	return eisel_lemire(digits, exponent, negative);
+}
+
 inline bool is_space(char c) { return c == ' ' || c == '\r' || c == '\t' || c == '\n'; }
 inline bool is_digit(char c) { return c >= '0' && c <= '9'; }
 
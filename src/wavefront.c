@@ -0,0 +1,432 @@
+/*
+Copyright 2024 Francesco Cozzuto
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+associated documentation files (the “Software”), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial
+portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "utils.h"
+#include "integrator.h"
+#include "wavefront.h"
+
+static void *grow_array(void *p, int count, size_t size)
+{
+	p = realloc(p, count * size);
+	if (p == NULL) abort();
+	return p;
+}
+
+static void grow_path_queue(PathQueue *q, int capacity)
+{
+	q->ox = grow_array(q->ox, capacity, sizeof(float));
+	q->oy = grow_array(q->oy, capacity, sizeof(float));
+	q->oz = grow_array(q->oz, capacity, sizeof(float));
+	q->dx = grow_array(q->dx, capacity, sizeof(float));
+	q->dy = grow_array(q->dy, capacity, sizeof(float));
+	q->dz = grow_array(q->dz, capacity, sizeof(float));
+	q->cr = grow_array(q->cr, capacity, sizeof(float));
+	q->cg = grow_array(q->cg, capacity, sizeof(float));
+	q->cb = grow_array(q->cb, capacity, sizeof(float));
+	q->lr = grow_array(q->lr, capacity, sizeof(float));
+	q->lg = grow_array(q->lg, capacity, sizeof(float));
+	q->lb = grow_array(q->lb, capacity, sizeof(float));
+	q->object = grow_array(q->object, capacity, sizeof(int));
+	q->px = grow_array(q->px, capacity, sizeof(float));
+	q->py = grow_array(q->py, capacity, sizeof(float));
+	q->pz = grow_array(q->pz, capacity, sizeof(float));
+	q->nx = grow_array(q->nx, capacity, sizeof(float));
+	q->ny = grow_array(q->ny, capacity, sizeof(float));
+	q->nz = grow_array(q->nz, capacity, sizeof(float));
+	q->sr = grow_array(q->sr, capacity, sizeof(float));
+	q->sg = grow_array(q->sg, capacity, sizeof(float));
+	q->sb = grow_array(q->sb, capacity, sizeof(float));
+	q->num_samples = grow_array(q->num_samples, capacity, sizeof(int));
+	q->slot = grow_array(q->slot, capacity, sizeof(int));
+}
+
+static void free_path_queue(PathQueue *q)
+{
+	free(q->ox); free(q->oy); free(q->oz);
+	free(q->dx); free(q->dy); free(q->dz);
+	free(q->cr); free(q->cg); free(q->cb);
+	free(q->lr); free(q->lg); free(q->lb);
+	free(q->object);
+	free(q->px); free(q->py); free(q->pz);
+	free(q->nx); free(q->ny); free(q->nz);
+	free(q->sr); free(q->sg); free(q->sb);
+	free(q->num_samples);
+	free(q->slot);
+}
+
+static void grow_shadow_queue(ShadowQueue *q, int capacity)
+{
+	q->ox = grow_array(q->ox, capacity, sizeof(float));
+	q->oy = grow_array(q->oy, capacity, sizeof(float));
+	q->oz = grow_array(q->oz, capacity, sizeof(float));
+	q->dx = grow_array(q->dx, capacity, sizeof(float));
+	q->dy = grow_array(q->dy, capacity, sizeof(float));
+	q->dz = grow_array(q->dz, capacity, sizeof(float));
+	q->path = grow_array(q->path, capacity, sizeof(int));
+}
+
+static void free_shadow_queue(ShadowQueue *q)
+{
+	free(q->ox); free(q->oy); free(q->oz);
+	free(q->dx); free(q->dy); free(q->dz);
+	free(q->path);
+}
+
+void init_wavefront(Wavefront *w)
+{
+	memset(w, 0, sizeof(Wavefront));
+}
+
+void free_wavefront(Wavefront *w)
+{
+	free_path_queue(&w->paths);
+	free_path_queue(&w->spare);
+	free_shadow_queue(&w->shadows);
+	free(w->keys);
+	free(w->keys_tmp);
+	free(w->order);
+	free(w->order_tmp);
+	free(w->results);
+	free(w->tags);
+}
+
+void wavefront_push(Wavefront *w, Ray ray, HitInfo hit, int tag)
+{
+	if (w->num_paths == w->capacity) {
+		int capacity = w->capacity ? 2 * w->capacity : 1024;
+		grow_path_queue(&w->paths, capacity);
+		grow_path_queue(&w->spare, capacity);
+		grow_shadow_queue(&w->shadows, capacity * LIGHT_SAMPLES);
+		w->keys      = grow_array(w->keys,      capacity, sizeof(uint32_t));
+		w->keys_tmp  = grow_array(w->keys_tmp,  capacity, sizeof(uint32_t));
+		w->order     = grow_array(w->order,     capacity, sizeof(int));
+		w->order_tmp = grow_array(w->order_tmp, capacity, sizeof(int));
+		w->results   = grow_array(w->results,   capacity, sizeof(Vector3));
+		w->tags      = grow_array(w->tags,      capacity, sizeof(int));
+		w->capacity = capacity;
+	}
+
+	PathQueue *q = &w->paths;
+	int i = w->num_paths++;
+	q->ox[i] = ray.origin.x;
+	q->oy[i] = ray.origin.y;
+	q->oz[i] = ray.origin.z;
+	q->dx[i] = ray.direction.x;
+	q->dy[i] = ray.direction.y;
+	q->dz[i] = ray.direction.z;
+	q->cr[i] = 1;
+	q->cg[i] = 1;
+	q->cb[i] = 1;
+	q->lr[i] = 0;
+	q->lg[i] = 0;
+	q->lb[i] = 0;
+	q->object[i] = hit.object;
+	q->px[i] = hit.point.x;
+	q->py[i] = hit.point.y;
+	q->pz[i] = hit.point.z;
+	q->nx[i] = hit.normal.x;
+	q->ny[i] = hit.normal.y;
+	q->nz[i] = hit.normal.z;
+	q->slot[i] = i;
+	w->tags[i] = tag;
+}
+
+static void finish_path(Wavefront *w, int i)
+{
+	PathQueue *q = &w->paths;
+	w->results[q->slot[i]] = (Vector3) { q->lr[i], q->lg[i], q->lb[i] };
+}
+
+static void intersect_stage(Wavefront *w, const Scene *scene)
+{
+	PathQueue *q = &w->paths;
+	for (int i = 0; i < w->num_paths; i++) {
+		Ray ray = {
+			{ q->ox[i], q->oy[i], q->oz[i] },
+			{ q->dx[i], q->dy[i], q->dz[i] },
+		};
+		HitInfo hit = trace_ray(ray, scene);
+		q->object[i] = hit.object;
+		q->px[i] = hit.point.x;
+		q->py[i] = hit.point.y;
+		q->pz[i] = hit.point.z;
+		q->nx[i] = hit.normal.x;
+		q->ny[i] = hit.normal.y;
+		q->nz[i] = hit.normal.z;
+	}
+}
+
+// Paths that flew out of the scene sample the sky and end here
+static void miss_stage(Wavefront *w, Cubemap *skybox)
+{
+	PathQueue *q = &w->paths;
+	for (int i = 0; i < w->num_paths; i++) {
+		if (q->object[i] != -1)
+			continue;
+		Vector3 dir = normalize((Vector3) { q->dx[i], q->dy[i], q->dz[i] });
+		Vector3 sky_color = sample_cubemap(skybox, dir);
+		q->lr[i] += sky_color.x * q->cr[i];
+		q->lg[i] += sky_color.y * q->cg[i];
+		q->lb[i] += sky_color.z * q->cb[i];
+		finish_path(w, i);
+	}
+}
+
+static void copy_path(PathQueue *dst, int j, PathQueue *src, int i)
+{
+	dst->ox[j] = src->ox[i]; dst->oy[j] = src->oy[i]; dst->oz[j] = src->oz[i];
+	dst->dx[j] = src->dx[i]; dst->dy[j] = src->dy[i]; dst->dz[j] = src->dz[i];
+	dst->cr[j] = src->cr[i]; dst->cg[j] = src->cg[i]; dst->cb[j] = src->cb[i];
+	dst->lr[j] = src->lr[i]; dst->lg[j] = src->lg[i]; dst->lb[j] = src->lb[i];
+	dst->object[j] = src->object[i];
+	dst->px[j] = src->px[i]; dst->py[j] = src->py[i]; dst->pz[j] = src->pz[i];
+	dst->nx[j] = src->nx[i]; dst->ny[j] = src->ny[i]; dst->nz[j] = src->nz[i];
+	dst->slot[j] = src->slot[i];
+}
+
+// Removes the paths that missed and sorts the others by the material
+// they hit and the octant of their direction, so that the shade stage
+// evaluates the same material many times in a row and the rays it
+// produces leave from nearby points.
+static void sort_stage(Wavefront *w)
+{
+	PathQueue *q = &w->paths;
+
+	// Objects have their own material, so the object index is
+	// used as material identifier.
+	int count = 0;
+	uint32_t max_key = 0;
+	for (int i = 0; i < w->num_paths; i++) {
+		if (q->object[i] == -1)
+			continue;
+		uint32_t octant = (q->dx[i] < 0) | (q->dy[i] < 0) << 1 | (q->dz[i] < 0) << 2;
+		uint32_t key = (uint32_t) q->object[i] << 3 | octant;
+		if (max_key < key) max_key = key;
+		w->keys[count] = key;
+		w->order[count] = i;
+		count++;
+	}
+
+	// LSD radix sort on 8 bit digits. Digits above the
+	// highest bit of the largest key are skipped.
+	for (int shift = 0; shift < 32 && (max_key >> shift) > 0; shift += 8) {
+
+		int offsets[256] = {0};
+		for (int i = 0; i < count; i++)
+			offsets[(w->keys[i] >> shift) & 0xFF]++;
+
+		int total = 0;
+		for (int d = 0; d < 256; d++) {
+			int n = offsets[d];
+			offsets[d] = total;
+			total += n;
+		}
+
+		for (int i = 0; i < count; i++) {
+			int p = offsets[(w->keys[i] >> shift) & 0xFF]++;
+			w->keys_tmp[p]  = w->keys[i];
+			w->order_tmp[p] = w->order[i];
+		}
+
+		uint32_t *tmp_keys = w->keys;
+		w->keys = w->keys_tmp;
+		w->keys_tmp = tmp_keys;
+
+		int *tmp_order = w->order;
+		w->order = w->order_tmp;
+		w->order_tmp = tmp_order;
+	}
+
+	for (int i = 0; i < count; i++)
+		copy_path(&w->spare, i, q, w->order[i]);
+
+	PathQueue tmp = w->paths;
+	w->paths = w->spare;
+	w->spare = tmp;
+	w->num_paths = count;
+}
+
+// Evaluates the material at the hit point of each path. This
+// adds the emitted light, queues the light samples and replaces
+// the ray of the path with the next bounce.
+static void shade_stage(Wavefront *w, const Scene *scene, int light_index)
+{
+	PathQueue   *q = &w->paths;
+	ShadowQueue *s = &w->shadows;
+
+	Vector3 light_origin = {0, 0, 0};
+	if (light_index != -1)
+		light_origin = origin_of(scene->objects[light_index]);
+
+	w->num_shadows = 0;
+	for (int i = 0; i < w->num_paths; i++) {
+
+		Vector3 point  = { q->px[i], q->py[i], q->pz[i] };
+		Vector3 normal = { q->nx[i], q->ny[i], q->nz[i] };
+		Vector3 in_dir = { q->dx[i], q->dy[i], q->dz[i] };
+		Vector3 contrib = { q->cr[i], q->cg[i], q->cb[i] };
+
+		q->sr[i] = 0;
+		q->sg[i] = 0;
+		q->sb[i] = 0;
+		q->num_samples[i] = 0;
+		if (light_index != -1) {
+			Vector3 dir_to_light_source = combine(light_origin, point, 1, -1);
+			for (int k = 0; k < LIGHT_SAMPLES; k++) {
+
+				Vector3 rand_dir = random_direction();
+				if (dotv(rand_dir, normal) <= 0)
+					continue;
+
+				Vector3 sample_dir = normalize(combine(rand_dir, dir_to_light_source, LIGHT_SAMPLE_SPREAD, 1));
+				Vector3 sample_origin = combine(point, sample_dir, 1, RAY_OFFSET);
+
+				int j = w->num_shadows++;
+				s->ox[j] = sample_origin.x;
+				s->oy[j] = sample_origin.y;
+				s->oz[j] = sample_origin.z;
+				s->dx[j] = sample_dir.x;
+				s->dy[j] = sample_dir.y;
+				s->dz[j] = sample_dir.z;
+				s->path[j] = i;
+				q->num_samples[i]++;
+			}
+		}
+
+		Material material = scene->objects[q->object[i]].material;
+
+		Vector3 v = scalev(in_dir, -1);
+		float NoV = clamp(dotv(normal, v), 0, 1);
+
+		// Approximation of the Fresnel term
+		Vector3 f0_d = vec_from_scalar(0.16 * material.reflectance * material.reflectance);
+		Vector3 f0_m = material.albedo;
+		Vector3 f0 = combine(f0_d, f0_m, (1 - material.metallic), material.metallic);
+		Vector3 F = fresnel_schlick(NoV, f0);
+
+		Vector3 rand_dir = random_direction();
+		if (dotv(rand_dir, normal) < 0)
+			rand_dir = scalev(rand_dir, -1);
+
+		Vector3 emitted = mulv(scalev(material.emission_color, material.emission_power), contrib);
+		q->lr[i] += emitted.x;
+		q->lg[i] += emitted.y;
+		q->lb[i] += emitted.z;
+
+		// Specular or diffuse bounce, chosen with probability F
+		// like in the per-pixel integrator.
+		Vector3 out_dir;
+		if (material.metallic > 0.001 || random_float() <= avgv(F)) {
+			Vector3 reflect_dir = reflect(in_dir, scalev(normal, -1));
+			out_dir = normalize(combine(rand_dir, reflect_dir, material.roughness, 1));
+		} else {
+			out_dir = rand_dir;
+			contrib = mulv(contrib, scalev(material.albedo, (1 - material.metallic)));
+		}
+		Vector3 out_origin = combine(point, out_dir, 1, RAY_OFFSET);
+
+		q->ox[i] = out_origin.x;
+		q->oy[i] = out_origin.y;
+		q->oz[i] = out_origin.z;
+		q->dx[i] = out_dir.x;
+		q->dy[i] = out_dir.y;
+		q->dz[i] = out_dir.z;
+		q->cr[i] = contrib.x;
+		q->cg[i] = contrib.y;
+		q->cb[i] = contrib.z;
+	}
+}
+
+static void shadow_stage(Wavefront *w, const Scene *scene)
+{
+	PathQueue   *q = &w->paths;
+	ShadowQueue *s = &w->shadows;
+	for (int j = 0; j < w->num_shadows; j++) {
+		Ray ray = {
+			{ s->ox[j], s->oy[j], s->oz[j] },
+			{ s->dx[j], s->dy[j], s->dz[j] },
+		};
+		HitInfo hit = trace_ray(ray, scene);
+		if (hit.object != -1) {
+			Material material = scene->objects[hit.object].material;
+			int i = s->path[j];
+			q->sr[i] += material.emission_color.x * material.emission_power;
+			q->sg[i] += material.emission_color.y * material.emission_power;
+			q->sb[i] += material.emission_color.z * material.emission_power;
+		}
+	}
+}
+
+// Adds the light samples to the result of each path and
+// reduces the contribution of the path accordingly.
+static void light_stage(Wavefront *w)
+{
+	PathQueue *q = &w->paths;
+	for (int i = 0; i < w->num_paths; i++) {
+
+		if (q->num_samples[i] == 0)
+			continue;
+
+		Vector3 sampled_light_color = scalev((Vector3) { q->sr[i], q->sg[i], q->sb[i] }, 1.0f / q->num_samples[i]);
+		if (iszerov(sampled_light_color))
+			continue;
+
+		q->lr[i] += sampled_light_color.x * q->cr[i] * LIGHT_SAMPLE_WEIGHT;
+		q->lg[i] += sampled_light_color.y * q->cg[i] * LIGHT_SAMPLE_WEIGHT;
+		q->lb[i] += sampled_light_color.z * q->cb[i] * LIGHT_SAMPLE_WEIGHT;
+		q->cr[i] *= 1 - LIGHT_SAMPLE_WEIGHT;
+		q->cg[i] *= 1 - LIGHT_SAMPLE_WEIGHT;
+		q->cb[i] *= 1 - LIGHT_SAMPLE_WEIGHT;
+	}
+}
+
+void wavefront_run(Wavefront *w, const Scene *scene, Cubemap *skybox)
+{
+	w->num_results = w->num_paths;
+
+	int light_index = find_light_source(scene);
+
+	for (int i = 0; i < MAX_BOUNCES && w->num_paths > 0; i++) {
+
+		// The first hit of each path was given when it was pushed
+		if (i > 0)
+			intersect_stage(w, scene);
+
+		miss_stage(w, skybox);
+		sort_stage(w);
+		shade_stage(w, scene, light_index);
+		shadow_stage(w, scene);
+		light_stage(w);
+	}
+
+	// Paths still alive after the last bounce
+	for (int i = 0; i < w->num_paths; i++)
+		finish_path(w, i);
+	w->num_paths = 0;
+}
+
+void wavefront_discard(Wavefront *w)
+{
+	w->num_paths = 0;
+}
@@ -0,0 +1,118 @@
+/*
+Copyright 2024 Francesco Cozzuto
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+associated documentation files (the “Software”), to deal in the Software without restriction,
+including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial
+portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#ifndef WAVEFRONT_INCLUDED
+#define WAVEFRONT_INCLUDED
+
+#include <stdint.h>
+#include "scene.h"
+#include "gpu_and_windowing.h"
+
+// Wavefront path tracer
+//
+// Instead of following one path at a time through all of its
+// bounces, a batch of paths is advanced one bounce at a time by
+// a sequence of stages (intersect, sort, shade, trace shadow rays,
+// gather light samples) that each loop over the whole batch. The
+// state of the paths is stored as a structure of arrays, and between
+// the intersect and the shade stages paths are sorted by the
+// material they hit and the direction they travel in, so each stage
+// works on coherent data.
+//
+// It evaluates the same estimator as "pixel" in main.c.
+
+// Per-path state. Every field is an array with one
+// element per path.
+typedef struct {
+
+	// Ray being traced
+	float *ox, *oy, *oz;
+	float *dx, *dy, *dz;
+
+	// How much of the light carried by the ray reaches the camera
+	float *cr, *cg, *cb;
+
+	// Light gathered by the path so far
+	float *lr, *lg, *lb;
+
+	// First hit of the ray (object is -1 if it missed)
+	int   *object;
+	float *px, *py, *pz;
+	float *nx, *ny, *nz;
+
+	// Sum of the light samples taken at the current hit
+	// and the number of samples
+	float *sr, *sg, *sb;
+	int   *num_samples;
+
+	// Index of the result of the path
+	int *slot;
+
+} PathQueue;
+
+// Rays traced towards the light source
+typedef struct {
+	float *ox, *oy, *oz;
+	float *dx, *dy, *dz;
+
+	// Path the sample belongs to
+	int *path;
+} ShadowQueue;
+
+typedef struct {
+
+	// Paths of the batch. The spare queue is only used
+	// as destination when sorting.
+	PathQueue paths;
+	PathQueue spare;
+	int num_paths;
+	int capacity;
+
+	ShadowQueue shadows;
+	int num_shadows;
+
+	// Sort keys and permutation (plus the scratch
+	// space of the radix sort)
+	uint32_t *keys;
+	uint32_t *keys_tmp;
+	int      *order;
+	int      *order_tmp;
+
+	// Results of the paths of the batch, in the order
+	// they were pushed, and the tags given to them
+	Vector3 *results;
+	int     *tags;
+	int      num_results;
+
+} Wavefront;
+
+void init_wavefront(Wavefront *w);
+void free_wavefront(Wavefront *w);
+
+// Adds a path to the batch given its primary ray and the first hit.
+// The tag is returned with the result.
+void wavefront_push(Wavefront *w, Ray ray, HitInfo hit, int tag);
+
+// Evaluates all paths pushed since the last call. Their colors are
+// stored in "results" and the batch is emptied.
+void wavefront_run(Wavefront *w, const Scene *scene, Cubemap *skybox);
+
+// Drops the paths pushed since the last call to "wavefront_run"
+void wavefront_discard(Wavefront *w);
+
+#endif